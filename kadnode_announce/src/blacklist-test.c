@@ -0,0 +1,240 @@
+/*
+* Check of the blacklist (blacklist.c) against a simple reference
+* model, driven by random operations on a few hundred addresses:
+* scores and their decay, blacklisting after BLACKLIST_SCORE, the
+* time doubled with every strike, expiry and entries without a port
+* that cover all ports of an address. At the end, a flood of new
+* addresses must not replace any blacklisted entry.
+* Build with "make blacklist-test", run ./build/blacklist-test [<operations> [<seed>]]
+* Exits with 1 at the first difference.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "main.h"
+#include "blacklist.h"
+
+/* Addresses the operations pick from, four per host; the first has port 0 */
+#define TEST_ADDRS 400
+
+struct test_entry {
+	int used;
+	int score;
+	int strikes;
+	time_t time;
+	time_t until;
+};
+
+static struct test_entry g_model[TEST_ADDRS];
+static time_t g_now = 1000000;
+static int g_failed = 0;
+
+#define test_assert(cond, ...) \
+	if( !(cond) ) { fprintf( stderr, __VA_ARGS__ ); fprintf( stderr, "\n" ); g_failed = 1; return -1; }
+
+/* Replaces utils.c, so that the time can be moved */
+time_t time_now_sec( void ) {
+	return g_now;
+}
+
+static void test_addr( struct sockaddr_storage *ss, int a ) {
+	struct sockaddr_in6 *sin6;
+	struct sockaddr_in *sin;
+	int host, port;
+
+	host = a / 4;
+	port = (a % 4) ? (6880 + a % 4) : 0;
+
+	memset( ss, 0, sizeof(*ss) );
+	if( host % 2 ) {
+		sin = (struct sockaddr_in *) ss;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl( 0x0A000000 | host );
+		sin->sin_port = htons( port );
+	} else {
+		sin6 = (struct sockaddr_in6 *) ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr.s6_addr[0] = 0x20;
+		sin6->sin6_addr.s6_addr[1] = 0x01;
+		sin6->sin6_addr.s6_addr[2] = 0x0d;
+		sin6->sin6_addr.s6_addr[3] = 0xb8;
+		sin6->sin6_addr.s6_addr[14] = host >> 8;
+		sin6->sin6_addr.s6_addr[15] = host;
+		sin6->sin6_port = htons( port );
+	}
+}
+
+/* Reference blacklist_score */
+static int test_model_score( struct test_entry *e, int score ) {
+	time_t halvings;
+	int strikes;
+
+	if( !e->used ) {
+		memset( e, 0, sizeof(*e) );
+		e->used = 1;
+		e->time = g_now;
+	}
+
+	if( e->until > g_now ) {
+		return 0;
+	}
+
+	halvings = (g_now - e->time) / BLACKLIST_DECAY;
+	e->score = ((halvings >= 31) ? 0 : (e->score >> halvings)) + score;
+	e->time = g_now;
+
+	if( e->score < BLACKLIST_SCORE ) {
+		return 0;
+	}
+
+	strikes = (e->strikes < BLACKLIST_MAX_STRIKES) ? e->strikes : BLACKLIST_MAX_STRIKES;
+	e->until = g_now + ((time_t) BLACKLIST_TIME << strikes);
+	e->score = 0;
+	if( e->strikes < 255 ) {
+		e->strikes++;
+	}
+
+	return 1;
+}
+
+/* Reference blacklist_contains, the entry without a port covers the host */
+static int test_model_contains( int a ) {
+	return g_model[a].until > g_now || g_model[a - a % 4].until > g_now;
+}
+
+static int test_model_count( void ) {
+	int count;
+	int a;
+
+	count = 0;
+	for( a = 0; a < TEST_ADDRS; a++ ) {
+		count += (g_model[a].until > g_now);
+	}
+
+	return count;
+}
+
+static int test_check( int a ) {
+	struct sockaddr_storage ss;
+
+	test_addr( &ss, a );
+	test_assert( blacklist_contains( (struct sockaddr *) &ss ) == test_model_contains( a ),
+		"blacklist: address %d is %sblacklisted", a, test_model_contains( a ) ? "not " : "" );
+
+	return 0;
+}
+
+static int test_blacklist( long operations ) {
+	static const int scores[] = { BLACKLIST_TRUNCATED_TID, BLACKLIST_BAD_NODES, BLACKLIST_TIMEOUT };
+	struct sockaddr_storage ss;
+	long op;
+	int score;
+	int a, r, rc;
+
+	for( op = 0; op < operations; op++ ) {
+		a = random() % TEST_ADDRS;
+		r = random() % 100;
+
+		if( r < 55 ) {
+			test_addr( &ss, a );
+			score = scores[random() % 3];
+			rc = blacklist_score( (struct sockaddr *) &ss, score );
+			test_assert( rc == test_model_score( &g_model[a], score ),
+				"blacklist: score of address %d differs at operation %ld", a, op );
+		} else if( r < 60 ) {
+			test_addr( &ss, a );
+			blacklist_add( (struct sockaddr *) &ss );
+			test_model_score( &g_model[a], BLACKLIST_SCORE );
+		} else if( r < 75 ) {
+			/* Seconds, some decays and now and then the end of a strike */
+			g_now += (r == 74) ? random() % (BLACKLIST_TIME << BLACKLIST_MAX_STRIKES) : random() % 120;
+		} else if( test_check( a ) < 0 ) {
+			fprintf( stderr, "blacklist: failed at operation %ld\n", op );
+			return -1;
+		}
+
+		if( (op % 1024) == 0 ) {
+			test_assert( blacklist_count() == test_model_count(), "blacklist: %d blacklisted, expected %d at operation %ld",
+				blacklist_count(), test_model_count(), op );
+		}
+	}
+
+	return 0;
+}
+
+/* New addresses with a low score replace anything but blacklisted entries */
+static int test_flood( void ) {
+	struct sockaddr_in sin;
+	int count;
+	int a, i;
+
+	count = test_model_count();
+
+	memset( &sin, 0, sizeof(sin) );
+	sin.sin_family = AF_INET;
+	for( i = 0; i < 4 * BLACKLIST_SIZE; i++ ) {
+		sin.sin_addr.s_addr = htonl( 0xAC100000 | i );
+		sin.sin_port = htons( 6881 );
+		blacklist_score( (struct sockaddr *) &sin, BLACKLIST_TIMEOUT );
+	}
+
+	for( a = 0; a < TEST_ADDRS; a++ ) {
+		if( test_model_contains( a ) && test_check( a ) < 0 ) {
+			fprintf( stderr, "blacklist: replaced by the flood\n" );
+			return -1;
+		}
+	}
+
+	test_assert( blacklist_count() == count, "blacklist: %d blacklisted after the flood, expected %d",
+		blacklist_count(), count );
+
+	return count;
+}
+
+int main( int argc, char **argv ) {
+	long operations;
+	long seed;
+	int strikes;
+	int count;
+	int a;
+
+	operations = (argc > 1) ? strtol( argv[1], NULL, 10 ) : 1000000;
+	seed = (argc > 2) ? strtol( argv[2], NULL, 10 ) : time( NULL );
+	if( operations <= 0 ) {
+		fprintf( stderr, "Usage: %s [<operations> [<seed>]]\n", argv[0] );
+		return 1;
+	}
+
+	/* Results and failures in order */
+	setvbuf( stdout, NULL, _IOLBF, 0 );
+	printf( "seed %ld\n", seed );
+	srandom( seed );
+
+	if( test_blacklist( operations ) < 0 ) {
+		return 1;
+	}
+
+	count = test_flood();
+	if( count < 0 ) {
+		return 1;
+	}
+
+	strikes = 0;
+	for( a = 0; a < TEST_ADDRS; a++ ) {
+		if( g_model[a].strikes > strikes ) {
+			strikes = g_model[a].strikes;
+		}
+	}
+
+	printf( "blacklist: %ld operations, %d blacklisted, up to %d strikes\n", operations, count, strikes );
+
+	return g_failed;
+}
@@ -0,0 +1,233 @@
+#define _WITH_DPRINTF
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "main.h"
+#include "utils.h"
+#include "blacklist.h"
+
+#define BLACKLIST_KEY_LEN 18
+
+struct blacklist_entry_t {
+	UCHAR key[BLACKLIST_KEY_LEN]; /* Address and port */
+	UCHAR af; /* 0 if unused */
+	UCHAR strikes; /* Times blacklisted */
+	int score;
+	time_t time; /* Last change of the score */
+	time_t until; /* Blacklisted until this time */
+};
+
+static struct blacklist_entry_t g_entries[BLACKLIST_SETS][BLACKLIST_WAYS];
+static uint32_t g_seed = 0;
+
+static int blacklist_key( const struct sockaddr *sa, UCHAR key[] ) {
+	memset( key, 0, BLACKLIST_KEY_LEN );
+	if( sa->sa_family == AF_INET ) {
+		memcpy( key, &((const IP4 *) sa)->sin_addr, 4 );
+		memcpy( key + 4, &((const IP4 *) sa)->sin_port, 2 );
+		return AF_INET;
+	} else if( sa->sa_family == AF_INET6 ) {
+		memcpy( key, &((const IP6 *) sa)->sin6_addr, 16 );
+		memcpy( key + 16, &((const IP6 *) sa)->sin6_port, 2 );
+		return AF_INET6;
+	} else {
+		return 0;
+	}
+}
+
+/* Seeded FNV-1a over the compact address */
+static struct blacklist_entry_t *blacklist_set( const UCHAR key[], int af ) {
+	uint32_t h;
+	int i;
+
+	while( g_seed == 0 ) {
+		g_seed = random();
+	}
+
+	h = (2166136261U ^ g_seed) + af;
+	for( i = 0; i < BLACKLIST_KEY_LEN; i++ ) {
+		h = (h ^ key[i]) * 16777619U;
+	}
+
+	return g_entries[h % BLACKLIST_SETS];
+}
+
+static struct blacklist_entry_t *blacklist_find( const struct sockaddr *sa, UCHAR key[], int *af ) {
+	struct blacklist_entry_t *set;
+	int i;
+
+	*af = blacklist_key( sa, key );
+	if( *af == 0 ) {
+		return NULL;
+	}
+
+	set = blacklist_set( key, *af );
+	for( i = 0; i < BLACKLIST_WAYS; i++ ) {
+		if( set[i].af == *af && memcmp( set[i].key, key, BLACKLIST_KEY_LEN ) == 0 ) {
+			return &set[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Score after the decay since the last change */
+static int blacklist_decayed( const struct blacklist_entry_t *e, time_t now ) {
+	time_t halvings;
+
+	halvings = (now - e->time) / BLACKLIST_DECAY;
+	return (halvings >= 31) ? 0 : (e->score >> halvings);
+}
+
+/* Lower is replaced first: unused, then by score, then blacklisted by end time */
+static long blacklist_priority( const struct blacklist_entry_t *e, time_t now ) {
+	if( e->af == 0 ) {
+		return -1;
+	} else if( e->until > now ) {
+		return BLACKLIST_SCORE + (long) (e->until - now);
+	} else {
+		return blacklist_decayed( e, now ) + e->strikes;
+	}
+}
+
+int blacklist_score( const struct sockaddr *sa, int score ) {
+	UCHAR key[BLACKLIST_KEY_LEN];
+	struct blacklist_entry_t *set;
+	struct blacklist_entry_t *e;
+	time_t now;
+	int strikes;
+	int af;
+	int i;
+
+	now = time_now_sec();
+	e = blacklist_find( sa, key, &af );
+
+	if( e == NULL ) {
+		if( af == 0 ) {
+			return 0;
+		}
+
+		set = blacklist_set( key, af );
+		e = &set[0];
+		for( i = 1; i < BLACKLIST_WAYS; i++ ) {
+			if( blacklist_priority( &set[i], now ) < blacklist_priority( e, now ) ) {
+				e = &set[i];
+			}
+		}
+
+		memset( e, 0, sizeof(struct blacklist_entry_t) );
+		memcpy( e->key, key, BLACKLIST_KEY_LEN );
+		e->af = af;
+		e->time = now;
+	}
+
+	if( e->until > now ) {
+		return 0;
+	}
+
+	e->score = blacklist_decayed( e, now ) + score;
+	e->time = now;
+
+	if( e->score < BLACKLIST_SCORE ) {
+		return 0;
+	}
+
+	strikes = (e->strikes < BLACKLIST_MAX_STRIKES) ? e->strikes : BLACKLIST_MAX_STRIKES;
+	e->until = now + ((time_t) BLACKLIST_TIME << strikes);
+	e->score = 0;
+	if( e->strikes < 255 ) {
+		e->strikes++;
+	}
+
+	return 1;
+}
+
+void blacklist_add( const struct sockaddr *sa ) {
+	blacklist_score( sa, BLACKLIST_SCORE );
+}
+
+int blacklist_contains( const struct sockaddr *sa ) {
+	UCHAR key[BLACKLIST_KEY_LEN];
+	struct sockaddr_storage any;
+	struct blacklist_entry_t *e;
+	time_t now;
+	int af;
+
+	now = time_now_sec();
+	e = blacklist_find( sa, key, &af );
+	if( e && e->until > now ) {
+		return 1;
+	}
+
+	/* Addresses blacklisted without a port (port 0) cover all ports */
+	if( af == AF_INET ) {
+		memcpy( &any, sa, sizeof(IP4) );
+		((IP4 *) &any)->sin_port = 0;
+	} else if( af == AF_INET6 ) {
+		memcpy( &any, sa, sizeof(IP6) );
+		((IP6 *) &any)->sin6_port = 0;
+	} else {
+		return 0;
+	}
+
+	e = blacklist_find( (struct sockaddr *) &any, key, &af );
+	return e && e->until > now;
+}
+
+int blacklist_count( void ) {
+	time_t now;
+	int count;
+	int i, j;
+
+	now = time_now_sec();
+	count = 0;
+	for( i = 0; i < BLACKLIST_SETS; i++ ) {
+		for( j = 0; j < BLACKLIST_WAYS; j++ ) {
+			if( g_entries[i][j].af && g_entries[i][j].until > now ) {
+				count++;
+			}
+		}
+	}
+
+	return count;
+}
+
+void blacklist_debug( int fd ) {
+	char addrbuf[INET6_ADDRSTRLEN+1];
+	const struct blacklist_entry_t *e;
+	unsigned short port;
+	time_t now;
+	int blacklisted;
+	int scored;
+	int i, j;
+
+	now = time_now_sec();
+	blacklisted = 0;
+	scored = 0;
+	for( i = 0; i < BLACKLIST_SETS; i++ ) {
+		for( j = 0; j < BLACKLIST_WAYS; j++ ) {
+			e = &g_entries[i][j];
+			if( e->af == 0 ) {
+				continue;
+			}
+
+			if( e->until <= now ) {
+				scored += (blacklist_decayed( e, now ) > 0);
+				continue;
+			}
+
+			inet_ntop( e->af, e->key, addrbuf, sizeof(addrbuf) );
+			memcpy( &port, e->key + ((e->af == AF_INET) ? 4 : 16), 2 );
+			dprintf( fd, (e->af == AF_INET) ? " %s:%hu" : " [%s]:%hu", addrbuf, ntohs( port ) );
+			dprintf( fd, " (%ld seconds left, %d strikes)\n", (long) (e->until - now), e->strikes );
+			blacklisted++;
+		}
+	}
+
+	dprintf( fd, " Found %d blacklisted addresses, %d with a score (max %d).\n",
+		blacklisted, scored, BLACKLIST_SIZE );
+}
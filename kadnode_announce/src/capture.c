@@ -0,0 +1,250 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+#include "net.h"
+#include "kad.h"
+#include "logq.h"
+#include "portmap.h"
+#include "pcapfile.h"
+#include "utpsyn.h"
+#include "capture.h"
+
+/* Ring of CAPTURE_BLOCKS * CAPTURE_BLOCK_SIZE bytes */
+#define CAPTURE_BLOCK_SIZE (64 * 1024)
+#define CAPTURE_BLOCKS 64
+#define CAPTURE_FRAME_SIZE 256
+#define CAPTURE_FRAMES (CAPTURE_BLOCKS * (CAPTURE_BLOCK_SIZE / CAPTURE_FRAME_SIZE))
+
+/* Bytes of a packet passed by the filter: IPv4 with options, UDP and the uTP header */
+#define CAPTURE_SNAPLEN (60 + 8 + UTPSYN_HEADER_LEN)
+
+static int g_sock = -1;
+static uint8_t *g_ring = NULL;
+static unsigned g_frame = 0;
+
+static unsigned long g_packets = 0;
+static unsigned long g_records = 0;
+static unsigned long g_unmapped = 0;
+static unsigned long g_dropped = 0;
+
+/*
+* Filter on the network header (SOCK_DGRAM):
+* IPv4, UDP, not a later fragment, destination port in
+* MIN_PORT..MAX_PORT, at most UTPSYN_MAX_LEN bytes of payload
+* and UTPSYN_TYPE as the first byte.
+*/
+static struct sock_filter g_filter[] = {
+	BPF_STMT( BPF_LD | BPF_B | BPF_ABS, 9 ),
+	BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 10 ),
+	BPF_STMT( BPF_LD | BPF_H | BPF_ABS, 6 ),
+	BPF_JUMP( BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 8, 0 ),
+	BPF_STMT( BPF_LDX | BPF_B | BPF_MSH, 0 ),
+	BPF_STMT( BPF_LD | BPF_H | BPF_IND, 2 ),
+	BPF_JUMP( BPF_JMP | BPF_JGE | BPF_K, MIN_PORT, 0, 5 ),
+	BPF_JUMP( BPF_JMP | BPF_JGT | BPF_K, MAX_PORT, 4, 0 ),
+	BPF_STMT( BPF_LD | BPF_H | BPF_IND, 4 ),
+	BPF_JUMP( BPF_JMP | BPF_JGT | BPF_K, UTPSYN_MAX_LEN + 8, 2, 0 ),
+	BPF_STMT( BPF_LD | BPF_B | BPF_IND, 8 ),
+	BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, UTPSYN_TYPE, 1, 0 ),
+	BPF_STMT( BPF_RET | BPF_K, 0 ),
+	BPF_STMT( BPF_RET | BPF_K, CAPTURE_SNAPLEN ),
+};
+
+/* Map the port to its infohash and queue the record */
+static void capture_packet( time_t time, const struct utpsyn_t *syn ) {
+	char hexbuf[SHA1_HEX_LENGTH+1];
+	char line[LOGQ_LINE_MAX];
+	const char *payload;
+	const char *date;
+	const UCHAR *id;
+
+	if( portmap_find( syn->dport, &id, &payload, &date ) < 0 ) {
+		g_unmapped++;
+		return;
+	}
+
+	utpsyn_format( line, sizeof(line), time, syn, str_id( id, hexbuf ), payload, date );
+	logq_printf( LOGQ_LEECHERS, time, "%s", line );
+	g_records++;
+}
+
+static void capture_replay( const char path[] ) {
+	struct pcapfile_t pf;
+	struct utpsyn_t syn;
+	const uint8_t *data;
+	unsigned long records;
+	size_t len;
+	time_t time;
+
+	if( pcapfile_open( &pf, path ) < 0 ) {
+		log_warn( "CAP: Failed to read pcap file %s.", path );
+		return;
+	}
+
+	records = g_records;
+	while( pcapfile_next( &pf, &time, &data, &len ) ) {
+		g_packets++;
+		if( utpsyn_parse_frame( &syn, pf.linktype, data, len ) == 0 ) {
+			capture_packet( time, &syn );
+		}
+	}
+
+	pcapfile_close( &pf );
+
+	log_info( "CAP: Replayed %s: %lu leecher records.", path, g_records - records );
+}
+
+/* Process all frames the kernel has filled */
+static void capture_handle( int rc, int sock ) {
+	struct tpacket2_hdr *hdr;
+	struct sockaddr_ll *sll;
+	struct utpsyn_t syn;
+
+	for( ;; ) {
+		hdr = (struct tpacket2_hdr *) (g_ring + (size_t) g_frame * CAPTURE_FRAME_SIZE);
+		if( !(__atomic_load_n( &hdr->tp_status, __ATOMIC_ACQUIRE ) & TP_STATUS_USER) ) {
+			break;
+		}
+
+		sll = (struct sockaddr_ll *) ((uint8_t *) hdr + TPACKET_ALIGN( sizeof(struct tpacket2_hdr) ));
+
+		/* Leechers only send SYNs to us */
+		if( sll->sll_pkttype != PACKET_OUTGOING ) {
+			g_packets++;
+			if( utpsyn_parse_ip( &syn, (uint8_t *) hdr + hdr->tp_net, hdr->tp_snaplen ) == 0 ) {
+				capture_packet( hdr->tp_sec, &syn );
+			}
+		}
+
+		__atomic_store_n( &hdr->tp_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE );
+		g_frame = (g_frame + 1) % CAPTURE_FRAMES;
+	}
+}
+
+static int capture_open( const char ifname[] ) {
+	struct sock_fprog fprog;
+	struct tpacket_req req;
+	struct sockaddr_ll sll;
+	int version;
+	int sock;
+
+	sock = socket( AF_PACKET, SOCK_DGRAM, htons( ETH_P_IP ) );
+	if( sock < 0 ) {
+		log_warn( "CAP: Failed to create packet socket: %s", strerror( errno ) );
+		return -1;
+	}
+
+	fprog.len = sizeof(g_filter) / sizeof(g_filter[0]);
+	fprog.filter = g_filter;
+	if( setsockopt( sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog) ) < 0 ) {
+		log_warn( "CAP: Failed to attach filter: %s", strerror( errno ) );
+		goto fail;
+	}
+
+	version = TPACKET_V2;
+	if( setsockopt( sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version) ) < 0 ) {
+		log_warn( "CAP: Failed to set TPACKET_V2: %s", strerror( errno ) );
+		goto fail;
+	}
+
+	memset( &req, 0, sizeof(req) );
+	req.tp_block_size = CAPTURE_BLOCK_SIZE;
+	req.tp_block_nr = CAPTURE_BLOCKS;
+	req.tp_frame_size = CAPTURE_FRAME_SIZE;
+	req.tp_frame_nr = CAPTURE_FRAMES;
+	if( setsockopt( sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req) ) < 0 ) {
+		log_warn( "CAP: Failed to create ring: %s", strerror( errno ) );
+		goto fail;
+	}
+
+	g_ring = mmap( NULL, CAPTURE_BLOCKS * CAPTURE_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0 );
+	if( g_ring == MAP_FAILED ) {
+		log_warn( "CAP: Failed to map ring: %s", strerror( errno ) );
+		g_ring = NULL;
+		goto fail;
+	}
+
+	/* "any" captures on all interfaces */
+	memset( &sll, 0, sizeof(sll) );
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons( ETH_P_IP );
+	if( strcmp( ifname, "any" ) != 0 ) {
+		sll.sll_ifindex = if_nametoindex( ifname );
+		if( sll.sll_ifindex == 0 ) {
+			log_warn( "CAP: Unknown interface %s.", ifname );
+			goto fail;
+		}
+	}
+
+	if( bind( sock, (struct sockaddr *) &sll, sizeof(sll) ) < 0 ) {
+		log_warn( "CAP: Failed to bind to %s: %s", ifname, strerror( errno ) );
+		goto fail;
+	}
+
+	return sock;
+
+fail:
+	if( g_ring ) {
+		munmap( g_ring, CAPTURE_BLOCKS * CAPTURE_BLOCK_SIZE );
+		g_ring = NULL;
+	}
+	close( sock );
+	return -1;
+}
+
+int capture_status( char *buf, int size ) {
+	struct tpacket_stats stats;
+	socklen_t len;
+
+	if( g_sock < 0 && g_packets == 0 ) {
+		return 0;
+	}
+
+	/* The kernel resets its counters on every read */
+	len = sizeof(stats);
+	if( g_sock >= 0 && getsockopt( g_sock, SOL_PACKET, PACKET_STATISTICS, &stats, &len ) == 0 ) {
+		g_dropped += stats.tp_drops;
+	}
+
+	return snprintf( buf, size, "Capture: %lu packets, %lu leecher records, %lu unmapped ports, %lu dropped\n",
+		g_packets, g_records, g_unmapped, g_dropped );
+}
+
+void capture_setup( void ) {
+	if( gconf->capture_file ) {
+		capture_replay( gconf->capture_file );
+	}
+
+	if( gconf->capture_ifname ) {
+		g_sock = capture_open( gconf->capture_ifname );
+		if( g_sock >= 0 ) {
+			net_add_handler( g_sock, &capture_handle );
+			log_info( "CAP: Capturing uTP SYNs on %s.", gconf->capture_ifname );
+		}
+	}
+}
+
+void capture_free( void ) {
+	/* The socket is closed by net_loop */
+	if( g_ring ) {
+		munmap( g_ring, CAPTURE_BLOCKS * CAPTURE_BLOCK_SIZE );
+		g_ring = NULL;
+	}
+	g_sock = -1;
+}
@@ -0,0 +1,27 @@
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+/*
+* Capture the uTP SYNs that leechers send to the announced
+* port range and write them to the leecher log (LOGQ_LEECHERS)
+* as they arrive, instead of going through tcpdump files and
+* pcap_to_log_tuples.py.
+*
+* Packets are received on an AF_PACKET socket of the interface
+* given with --capture-ifname. A BPF filter passes only IPv4/UDP
+* packets to MIN_PORT..MAX_PORT that look like a uTP SYN, and the
+* kernel hands them over in a memory-mapped ring (PACKET_MMAP).
+* The destination port is mapped to its infohash by portmap.c.
+*
+* With --capture-file, a pcap file is replayed through the same
+* code at startup to test the capture offline.
+*/
+
+void capture_setup( void );
+void capture_free( void );
+
+/* Print capture statistics */
+int capture_status( char *buf, int size );
+
+#endif /* _CAPTURE_H_ */
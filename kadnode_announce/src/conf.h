@@ -4,6 +4,7 @@
 
 #include <sys/time.h>
 #include "main.h"
+#include "kad.h" /* LOOKUPS or ANNOUNCEMENTS, for the fields below */
 
 extern const char *kadnode_version_str;
 
@@ -69,6 +70,37 @@ struct gconf_t {
 	/* KadNode startup time */
 	time_t startup_time;
 
+	/* Seconds between fsync of the measurement logs (0 to disable) */
+	int log_fsync;
+
+	/* Write seeder and result node logs as text or binary */
+	int log_format;
+
+	/* Hajime config file with the module names */
+	char *modules_file;
+
+	/* Days before and after today to compute infohashes for */
+	int infohash_window;
+
+	/* Seconds a seeder may be absent before its session is closed (0 to log all seeders) */
+	int session_timeout;
+
+#ifdef ANNOUNCEMENTS
+	/* Closest nodes each announcement is stored on */
+	int announce_replicas;
+
+	/* Capture uTP SYNs on this interface */
+	char *capture_ifname;
+
+	/* Replay this pcap file through the capture at startup */
+	char *capture_file;
+#endif
+
+#ifdef ZLIB
+	/* Compress seeder and result node logs */
+	int log_compress;
+#endif
+
 #ifdef __CYGWIN__
 	/* Start as windows service */
 	int service_start;
@@ -0,0 +1,426 @@
+/*
+* Checks of the data structures of dht.c against simple reference
+* models, driven by random operations:
+*  storage: the peer index and expiry list of each infohash, against
+*  a plain array of peers
+*  nodes: the nodes of find_node/get_peers replies, taken from the
+*  compact node blocks of the buckets, against buffer_closest_nodes
+*  that encodes them from the nodes every time (IPv4 only)
+* Build with "make dht-test", run ./build/dht-test [<operations> [<seed>]]
+* Exits with 1 at the first difference.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "log.h"
+#include "sha1.h"
+#include "sha1mb.h"
+#include "main.h"
+#include "utils.h"
+#include "conf.h"
+#include "results.h"
+#include "net.h"
+#include "values.h"
+#include "logq.h"
+#include "infohashes.h"
+#include "observe.h"
+#include "ratelimit.h"
+#include "blacklist.h"
+#include "metrics.h"
+#include "latency.h"
+#include "kad.h"
+
+static ssize_t test_sendto( int fd, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen );
+
+#define sendto test_sendto
+#include "dht.c"
+#undef sendto
+
+/* Nothing is sent */
+static ssize_t test_sendto( int fd, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen ) {
+	return len;
+}
+
+static int g_failed = 0;
+
+#define test_assert(cond, ...) \
+	if( !(cond) ) { fprintf( stderr, __VA_ARGS__ ); fprintf( stderr, "\n" ); g_failed = 1; return -1; }
+
+/*
+* Storage
+*/
+
+/* Infohashes and addresses the operations pick from */
+#define TEST_STORAGE_IDS 4
+#define TEST_STORAGE_ADDRS 6000
+
+struct test_peer {
+	UCHAR ip[16];
+	int len;
+	unsigned short port;
+	time_t time;
+};
+
+struct test_storage {
+	UCHAR id[SHA1_BIN_LENGTH];
+	struct test_peer *peers;
+	int num;
+};
+
+static void test_storage_addr( struct sockaddr_storage *ss, int a ) {
+	struct sockaddr_in6 *sin6;
+	struct sockaddr_in *sin;
+
+	memset( ss, 0, sizeof(*ss) );
+
+	/* Some addresses differ only in the port */
+	if( a % 3 ) {
+		sin = (struct sockaddr_in *) ss;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl( 0xC6120000 | (a / 4) );
+		sin->sin_port = htons( 6881 + (a % 4) );
+	} else {
+		sin6 = (struct sockaddr_in6 *) ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr.s6_addr[0] = 0x20;
+		sin6->sin6_addr.s6_addr[1] = 0x01;
+		sin6->sin6_addr.s6_addr[2] = 0x0d;
+		sin6->sin6_addr.s6_addr[3] = 0xb8;
+		memcpy( &sin6->sin6_addr.s6_addr[12], &a, sizeof(a) );
+		sin6->sin6_port = htons( 6881 );
+	}
+}
+
+static void test_storage_peer( struct test_peer *p, const struct sockaddr_storage *ss, unsigned short port ) {
+	memset( p, 0, sizeof(*p) );
+	if( ss->ss_family == AF_INET ) {
+		memcpy( p->ip, &((const struct sockaddr_in *) ss)->sin_addr, 4 );
+		p->len = 4;
+	} else {
+		memcpy( p->ip, &((const struct sockaddr_in6 *) ss)->sin6_addr, 16 );
+		p->len = 16;
+	}
+	p->port = port;
+}
+
+static int test_peer_equal( const struct test_peer *a, const struct test_peer *b ) {
+	return a->len == b->len && a->port == b->port && memcmp( a->ip, b->ip, a->len ) == 0;
+}
+
+/* Reference storage_store */
+static void test_model_store( struct test_storage *ts, const struct test_peer *peer ) {
+	int i;
+
+	for( i = 0; i < ts->num; i++ ) {
+		if( test_peer_equal( &ts->peers[i], peer ) ) {
+			ts->peers[i].time = now.tv_sec;
+			return;
+		}
+	}
+
+	if( ts->num < DHT_MAX_PEERS ) {
+		ts->peers[ts->num] = *peer;
+		ts->peers[ts->num].time = now.tv_sec;
+		ts->num++;
+	}
+}
+
+/* Reference expire_storage */
+static void test_model_expire( struct test_storage *ts ) {
+	int i;
+
+	i = 0;
+	while( i < ts->num ) {
+		if( ts->peers[i].time < now.tv_sec - 32 * 60 ) {
+			ts->peers[i] = ts->peers[--ts->num];
+		} else {
+			i++;
+		}
+	}
+}
+
+static int test_storage_check( const struct test_storage *ts ) {
+	const struct storage *st;
+	const struct peer *p;
+	int indexed;
+	int i, s, n;
+
+	st = find_storage( ts->id );
+	if( ts->num == 0 ) {
+		test_assert( st == NULL, "storage: empty storage was not removed" );
+		return 0;
+	}
+
+	test_assert( st != NULL, "storage: storage with %d peers not found", ts->num );
+	test_assert( st->numpeers == ts->num, "storage: %d peers, expected %d", st->numpeers, ts->num );
+	test_assert( st->numpeers <= st->maxpeers && 2 * st->maxpeers == st->indexsize,
+		"storage: %d peers, %d max, index size %d", st->numpeers, st->maxpeers, st->indexsize );
+
+	/* Every peer of the model is found with its time */
+	for( i = 0; i < ts->num; i++ ) {
+		s = storage_slot( st, ts->peers[i].ip, ts->peers[i].len, ts->peers[i].port );
+		test_assert( st->index[s] != 0, "storage: peer %d not found", i );
+		p = &st->peers[st->index[s] - 1];
+		test_assert( p->time == ts->peers[i].time, "storage: peer %d has time %ld, expected %ld",
+			i, (long) p->time, (long) ts->peers[i].time );
+	}
+
+	/* Every peer is indexed once, where a lookup finds it */
+	indexed = 0;
+	for( s = 0; s < st->indexsize; s++ ) {
+		if( st->index[s] == 0 ) {
+			continue;
+		}
+		test_assert( st->index[s] <= st->numpeers, "storage: slot %d points to peer %d", s, st->index[s] );
+		p = &st->peers[st->index[s] - 1];
+		test_assert( storage_slot( st, p->ip, p->len, p->port ) == s, "storage: slot %d is not found by a lookup", s );
+		indexed++;
+	}
+	test_assert( indexed == st->numpeers, "storage: %d slots used for %d peers", indexed, st->numpeers );
+
+	/* The expiry list holds all peers, oldest first */
+	n = 0;
+	for( i = st->oldest; i >= 0; i = st->peers[i].newer ) {
+		test_assert( n < st->numpeers, "storage: expiry list has a cycle" );
+		if( st->peers[i].older >= 0 ) {
+			test_assert( st->peers[st->peers[i].older].newer == i, "storage: broken link at peer %d", i );
+			test_assert( st->peers[st->peers[i].older].time <= st->peers[i].time, "storage: expiry list out of order" );
+		} else {
+			test_assert( i == st->oldest, "storage: peer %d has no older peer", i );
+		}
+		if( st->peers[i].newer < 0 ) {
+			test_assert( i == st->newest, "storage: peer %d is not the newest", i );
+		}
+		n++;
+	}
+	test_assert( n == st->numpeers, "storage: expiry list has %d of %d peers", n, st->numpeers );
+
+	return 0;
+}
+
+static int test_storage( long operations ) {
+	struct test_storage models[TEST_STORAGE_IDS];
+	struct sockaddr_storage ss;
+	struct test_peer peer;
+	struct test_storage *ts;
+	long op;
+	int i, a, r;
+
+	for( i = 0; i < TEST_STORAGE_IDS; i++ ) {
+		dht_random_bytes( models[i].id, SHA1_BIN_LENGTH );
+		models[i].peers = calloc( DHT_MAX_PEERS, sizeof(struct test_peer) );
+		models[i].num = 0;
+	}
+
+	for( op = 0; op < operations; op++ ) {
+		/* Most peers go to the first infohash, so that it fills up to DHT_MAX_PEERS */
+		i = random() % (TEST_STORAGE_IDS + 4);
+		ts = &models[(i < 5) ? 0 : (i - 4)];
+		r = random() % 20000;
+
+		if( r < 19000 ) {
+			a = random() % ((ts == &models[0]) ? TEST_STORAGE_ADDRS : 200);
+			test_storage_addr( &ss, a );
+			test_storage_peer( &peer, &ss, 1000 + (a % 7) );
+			storage_store( ts->id, (struct sockaddr *) &ss, peer.port );
+			test_model_store( ts, &peer );
+		} else if( r < 19999 ) {
+			now.tv_sec += random() % 2;
+		} else {
+			now.tv_sec += random() % (40 * 60);
+			expire_storage();
+			for( i = 0; i < TEST_STORAGE_IDS; i++ ) {
+				test_model_expire( &models[i] );
+			}
+		}
+
+		/* All of a storage is compared now and then */
+		if( r == 19999 || (op % 1024) == 0 ) {
+			for( i = 0; i < TEST_STORAGE_IDS; i++ ) {
+				if( test_storage_check( &models[i] ) < 0 ) {
+					fprintf( stderr, "storage: failed at operation %ld\n", op );
+					return -1;
+				}
+			}
+		}
+	}
+
+	printf( "storage: %ld operations, %d/%d/%d/%d peers\n", operations,
+		models[0].num, models[1].num, models[2].num, models[3].num );
+
+	for( i = 0; i < TEST_STORAGE_IDS; i++ ) {
+		free( models[i].peers );
+	}
+
+	return 0;
+}
+
+/*
+* Nodes
+*/
+
+/* Ids and addresses the operations pick from */
+#define TEST_NODES_IDS 4000
+
+static UCHAR g_node_ids[TEST_NODES_IDS][SHA1_BIN_LENGTH];
+
+/* An id that shares the first bits bits with our own, so that the buckets around us get split */
+static void test_nodes_id( UCHAR id[], int bits ) {
+	int i;
+
+	dht_random_bytes( id, SHA1_BIN_LENGTH );
+	for( i = 0; i < bits; i++ ) {
+		id[i / 8] &= ~(0x80 >> (i % 8));
+		id[i / 8] |= myid[i / 8] & (0x80 >> (i % 8));
+	}
+	id[bits / 8] ^= (~(id[bits / 8] ^ myid[bits / 8])) & (0x80 >> (bits % 8));
+}
+
+static void test_nodes_addr( struct sockaddr_in *sin, int i, int port ) {
+	memset( sin, 0, sizeof(struct sockaddr_in) );
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl( 0xC6120000 | (i + 1) );
+	sin->sin_port = htons( 6881 + port );
+}
+
+static int test_nodes_check( const UCHAR target[] ) {
+	UCHAR nodes[8 * 26];
+	UCHAR expected[8 * 26];
+	struct bucket *b;
+	int numnodes;
+	int num;
+
+	numnodes = closest_nodes( nodes, target, AF_INET );
+
+	/* Same buckets as closest_nodes */
+	num = 0;
+	b = find_bucket( target, AF_INET );
+	num = buffer_closest_nodes( expected, num, target, b );
+	if( b->next ) {
+		num = buffer_closest_nodes( expected, num, target, b->next );
+	}
+	b = previous_bucket( b );
+	if( b ) {
+		num = buffer_closest_nodes( expected, num, target, b );
+	}
+
+	test_assert( numnodes == num, "nodes: %d nodes, expected %d", numnodes, num );
+	test_assert( memcmp( nodes, expected, 26 * num ) == 0, "nodes: nodes differ" );
+
+	return num;
+}
+
+static int test_nodes( long operations ) {
+	struct sockaddr_in sin;
+	UCHAR target[SHA1_BIN_LENGTH];
+	struct bucket *b;
+	struct node *n;
+	long checks, found;
+	long op;
+	int numbuckets;
+	int i, r, rc;
+
+	for( i = 0; i < TEST_NODES_IDS; i++ ) {
+		test_nodes_id( g_node_ids[i], i % 24 );
+	}
+
+	checks = 0;
+	found = 0;
+	for( op = 0; op < operations; op++ ) {
+		i = random() % TEST_NODES_IDS;
+		r = random() % 100;
+
+		if( r < 50 ) {
+			/* A node sent a message or a reply, now and then from another port */
+			test_nodes_addr( &sin, i, (r < 2) ? (1 + random() % 2) : 0 );
+			new_node( g_node_ids[i], (struct sockaddr *) &sin, sizeof(sin), random() % 3 );
+		} else if( r < 60 ) {
+			/* A request was sent to a node */
+			n = find_node( g_node_ids[i], AF_INET );
+			if( n ) {
+				pinged( n, NULL );
+			}
+		} else if( r < 70 ) {
+			now.tv_sec += (r == 69 && (random() % 16) == 0) ? random() % 3600 : random() % 10;
+		} else {
+			/* Targets far away, in our own buckets and on known nodes */
+			if( r < 80 ) {
+				dht_random_bytes( target, SHA1_BIN_LENGTH );
+			} else if( r < 90 ) {
+				test_nodes_id( target, random() % 24 );
+			} else {
+				memcpy( target, g_node_ids[i], SHA1_BIN_LENGTH );
+			}
+
+			rc = test_nodes_check( target );
+			if( rc < 0 ) {
+				fprintf( stderr, "nodes: failed at operation %ld\n", op );
+				return -1;
+			}
+			checks++;
+			found += rc;
+		}
+	}
+
+	numbuckets = 0;
+	for( b = buckets; b; b = b->next ) {
+		numbuckets++;
+	}
+
+	printf( "nodes: %ld operations, %d buckets, %ld replies with %.1f nodes on average\n",
+		operations, numbuckets, checks, checks ? (double) found / checks : 0.0 );
+
+	return 0;
+}
+
+int main( int argc, char **argv ) {
+	UCHAR myid[SHA1_BIN_LENGTH];
+	long operations;
+	long seed;
+	int s;
+
+	operations = (argc > 1) ? strtol( argv[1], NULL, 10 ) : 200000;
+	seed = (argc > 2) ? strtol( argv[2], NULL, 10 ) : time( NULL );
+	if( operations <= 0 ) {
+		fprintf( stderr, "Usage: %s [<operations> [<seed>]]\n", argv[0] );
+		return 1;
+	}
+
+	/* Results and failures in order */
+	setvbuf( stdout, NULL, _IOLBF, 0 );
+	printf( "seed %ld\n", seed );
+	srandom( seed );
+
+	/* Nothing is sent on the socket */
+	s = socket( AF_INET, SOCK_DGRAM, 0 );
+	if( s < 0 ) {
+		fprintf( stderr, "Failed to create socket.\n" );
+		return 1;
+	}
+
+	dht_random_bytes( myid, sizeof(myid) );
+	if( dht_init( s, -1, myid, (UCHAR *) "KN\0\0" ) < 0 ) {
+		fprintf( stderr, "dht_init failed.\n" );
+		return 1;
+	}
+
+	if( test_storage( operations ) == 0 ) {
+		test_nodes( operations );
+	}
+
+	dht_uninit();
+	close( s );
+
+	return g_failed;
+}
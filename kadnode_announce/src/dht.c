@@ -58,6 +58,7 @@ THE SOFTWARE.
 
 #include "dht.h"
 #include "kad.h"
+#include "idmap.h"
 
 #ifndef HAVE_MEMMEM
 #ifdef __GLIBC__
@@ -156,10 +157,19 @@ set_nonblocking(int fd, int nonblocking)
 #endif
 
 
+/* Hajime
+ * index is an open addressing table (linear probing) over the address
+ * and port of the peers. A slot is the position in peers + 1, or 0 if
+ * empty; indexsize is 2 * maxpeers. The peers are also linked from
+ * oldest to newest refresh, so that expiry only looks at the peers
+ * that actually expire.
+ */
 struct storage {
     unsigned char id[20];
     int numpeers, maxpeers;
     struct peer *peers;
+    int *index, indexsize;
+    int oldest, newest;
     struct storage *next;
 };
 
@@ -242,6 +252,10 @@ static int have_v = 0;
 static unsigned char my_v[9];
 static unsigned char secret[8];
 static unsigned char oldsecret[8];
+/* Hajime
+ * Incremented by rotate_secrets (served tokens)
+ */
+static unsigned int secret_epoch;
 
 static struct bucket *buckets = NULL;
 static struct bucket *buckets6 = NULL;
@@ -250,24 +264,23 @@ static int numstorage;
 
 static struct search *searches = NULL;
 static int numsearches;
+
+/* Hajime
+ * Searches, storage and results are indexed by id in idmap.c
+ * instead of walking the lists.
+ */
+#define SEARCH_SLOT(af) ((af) == AF_INET6 ? IDMAP_SEARCH6 : IDMAP_SEARCH)
 static unsigned short search_id;
 
-/* The maximum number of nodes that we snub.  There is probably little
-   reason to increase this value. */
-#ifndef DHT_MAX_BLACKLISTED
-#define DHT_MAX_BLACKLISTED 10
-#endif
-static struct sockaddr_storage blacklist[DHT_MAX_BLACKLISTED];
-int next_blacklisted;
+/* Hajime
+ * Number of closest nodes each announcement is stored on
+ */
+static int announce_replicas = REPLICATE_NUM;
 
 static struct timeval now;
 static time_t mybucket_grow_time, mybucket6_grow_time;
 static time_t expire_stuff_time;
 
-#define MAX_TOKEN_BUCKET_TOKENS 1600
-static time_t token_bucket_time;
-static int token_bucket_tokens;
-
 FILE *dht_debug = NULL;
 
 #ifdef __GNUC__
@@ -524,6 +537,16 @@ bucket_random(struct bucket *b, unsigned char *id_return)
     return 1;
 }
 
+/* Hajime
+ * Drop the compact node blocks of a bucket
+ */
+static void
+bucket_changed(struct bucket *b)
+{
+    if(b)
+        b->compact_expires = 0;
+}
+
 /* Insert a new node into a bucket. */
 static struct node *
 insert_node(struct node *node)
@@ -536,6 +559,7 @@ insert_node(struct node *node)
     node->next = b->nodes;
     b->nodes = node;
     b->count++;
+    bucket_changed(b);
     return node;
 }
 
@@ -573,6 +597,62 @@ tid_match(const unsigned char *tid, const char *prefix,
         return 0;
 }
 
+/* Hajime
+ * announce_peer tids carry the index of the announced port in the
+ * second byte, so that acks can be tracked per (node, port).  The
+ * index has the high bit set and cannot clash with the ASCII prefixes.
+ */
+static void
+make_ap_tid(unsigned char *tid_return, int index, unsigned short seqno)
+{
+    tid_return[0] = 'a';
+    tid_return[1] = 0x80 | index;
+    memcpy(tid_return + 2, &seqno, 2);
+}
+
+static int
+ap_tid_match(const unsigned char *tid, int *index_return,
+             unsigned short *seqno_return)
+{
+    if(tid[0] == 'a' && (tid[1] & 0x80) && (tid[1] & 0x7F) < SEARCH_PORTS) {
+        *index_return = tid[1] & 0x7F;
+        memcpy(seqno_return, tid + 2, 2);
+        return 1;
+    } else
+        return 0;
+}
+
+/* Bitmask of all ports of a search */
+static unsigned int
+search_ports_mask(const struct search *sr)
+{
+    if(sr->numports >= 32)
+        return ~0U;
+    return (1U << sr->numports) - 1;
+}
+
+/* Remember when the closest live nodes have acked all ports */
+static void
+search_check_replicated(struct search *sr)
+{
+    unsigned int all_ports = search_ports_mask(sr);
+    int i, j = 0, count = 0;
+
+    if(sr->replicated_time)
+        return;
+
+    for(i = 0; i < sr->numnodes && j < announce_replicas; i++) {
+        if(sr->nodes[i].pinged >= 3 && sr->nodes[i].acked != all_ports)
+            continue;
+        if(sr->nodes[i].acked == all_ports)
+            count++;
+        j++;
+    }
+
+    if(count >= announce_replicas)
+        sr->replicated_time = now.tv_sec;
+}
+
 /* Every bucket caches the address of a likely node.  Ping it. */
 static int
 send_cached_ping(struct bucket *b)
@@ -598,12 +678,26 @@ pinged(struct node *n, struct bucket *b)
 {
     n->pinged++;
     n->pinged_time = now.tv_sec;
-    if(n->pinged >= 3)
-        send_cached_ping(b ? b : find_bucket(n->id, n->ss.ss_family));
+    /* Hajime
+     * Nodes that time out repeatedly end up in the blacklist
+     */
+    if(n->pinged == 3)
+        blacklist_score((struct sockaddr*)&n->ss, BLACKLIST_TIMEOUT);
+    if(n->pinged >= 3) {
+        if(b == NULL)
+            b = find_bucket(n->id, n->ss.ss_family);
+        /* Hajime
+         * The node is not good anymore
+         */
+        bucket_changed(b);
+        send_cached_ping(b);
+    }
 }
 
-/* The internal blacklist is an LRU cache of nodes that have sent
-   incorrect messages. */
+/* The internal blacklist holds nodes that have sent incorrect messages. */
+/* Hajime
+ * Hashed and scored, with expiry (blacklist.c)
+ */
 static void
 blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
 {
@@ -630,27 +724,31 @@ blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
         }
     }
     /* And make sure we don't hear from it again. */
-    memcpy(&blacklist[next_blacklisted], sa, salen);
-    next_blacklisted = (next_blacklisted + 1) % DHT_MAX_BLACKLISTED;
+    blacklist_add(sa);
+}
+
+/* Hajime
+ * Add to the misbehaviour score of a node and drop it if that
+ * gets it blacklisted.
+ */
+static void
+penalize_node(const unsigned char *id, const struct sockaddr *sa, int salen,
+              int score)
+{
+    if(blacklist_score(sa, score))
+        blacklist_node(id, sa, salen);
 }
 
 static int
 node_blacklisted(const struct sockaddr *sa, int salen)
 {
-    int i;
-
     if((unsigned)salen > sizeof(struct sockaddr_storage))
         abort();
 
     if(dht_blacklisted(sa, salen))
         return 1;
 
-    for(i = 0; i < DHT_MAX_BLACKLISTED; i++) {
-        if(memcmp(&blacklist[i], sa, salen) == 0)
-            return 1;
-    }
-
-    return 0;
+    return blacklist_contains(sa);
 }
 
 /* Split a bucket into two equal parts. */
@@ -680,6 +778,7 @@ split_bucket(struct bucket *b)
     nodes = b->nodes;
     b->nodes = NULL;
     b->count = 0;
+    bucket_changed(b);
     new->next = b->next;
     b->next = new;
     while(nodes) {
@@ -720,6 +819,11 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
         if(id_cmp(n->id, id) == 0) {
             if(confirm || n->time < now.tv_sec - 15 * 60) {
                 /* Known node.  Update stuff. */
+                /* Hajime
+                 * A good node at the same address keeps its compact block
+                 */
+                if(!node_good(n) || memcmp(&n->ss, sa, salen) != 0)
+                    bucket_changed(b);
                 memcpy((struct sockaddr*)&n->ss, sa, salen);
                 if(confirm)
                     n->time = now.tv_sec;
@@ -753,6 +857,7 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
             n->reply_time = confirm >= 2 ? now.tv_sec : 0;
             n->pinged_time = 0;
             n->pinged = 0;
+            bucket_changed(b);
             return n;
         }
         n = n->next;
@@ -822,6 +927,7 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
     n->next = b->nodes;
     b->nodes = n;
     b->count++;
+    bucket_changed(b);
     return n;
 }
 
@@ -884,8 +990,10 @@ expire_buckets(struct bucket *b)
             p = p->next;
         }
 
-        if(changed)
+        if(changed) {
+            bucket_changed(b);
             send_cached_ping(b);
+        }
 
         b = b->next;
     }
@@ -910,6 +1018,180 @@ find_search(unsigned short tid, int af)
     return NULL;
 }
 
+/* Hajime
+ * Token cache: the tokens of get_peers replies are kept per infohash
+ * and node, so that an announcement can be sent to the nodes of the
+ * previous announcement without walking the DHT again.  Nodes accept
+ * a token for at least ten minutes (BEP 5), less than the re-announce
+ * interval of values.c.  So values.c asks the cached nodes for new
+ * tokens shortly before each re-announce (dht_refresh_tokens), and
+ * the nodes are kept for TOKEN_CACHE_EXPIRE_TIME to be asked.
+ */
+#define TOKEN_CACHE_TIME (10 * 60)
+#define TOKEN_CACHE_EXPIRE_TIME (60 * 60)
+#define TOKEN_SLOT(af) ((af) == AF_INET6 ? IDMAP_TOKENS6 : IDMAP_TOKENS)
+
+struct token_node {
+    unsigned char id[20];
+    struct sockaddr_storage ss;
+    int sslen;
+    unsigned char token[40];
+    int token_len;
+    time_t time;                /* when the token was received */
+};
+
+struct token_cache {
+    unsigned char id[20];
+    int af;
+    unsigned short tid;         /* of the token refresh requests */
+    int numnodes;               /* sorted by distance to id */
+    struct token_node nodes[SEARCH_NODES];
+    struct token_cache *next;
+};
+
+static struct token_cache *token_caches = NULL;
+static int numtokencaches;
+static unsigned short token_cache_id;
+static int token_cache_hits, token_cache_misses;
+
+static void
+token_cache_add(const unsigned char *info_hash, int af,
+                const unsigned char *id,
+                const struct sockaddr *sa, int salen,
+                const unsigned char *token, int token_len)
+{
+    struct token_cache *tc;
+    struct token_node *tn;
+    int i, j;
+
+    if(token_len <= 0 || token_len > 40 || salen > (int) sizeof(tn->ss))
+        return;
+
+    tc = idmap_lookup(info_hash, TOKEN_SLOT(af));
+    if(tc == NULL) {
+        tc = calloc(1, sizeof(struct token_cache));
+        if(tc == NULL)
+            return;
+        memcpy(tc->id, info_hash, 20);
+        tc->af = af;
+        tc->tid = token_cache_id++;
+        if(idmap_set(info_hash, TOKEN_SLOT(af), tc) < 0) {
+            free(tc);
+            return;
+        }
+        tc->next = token_caches;
+        token_caches = tc;
+        numtokencaches++;
+    }
+
+    for(i = 0; i < tc->numnodes; i++) {
+        if(id_cmp(id, tc->nodes[i].id) == 0) {
+            tn = &tc->nodes[i];
+            goto found;
+        }
+        if(xorcmp(id, tc->nodes[i].id, info_hash) < 0)
+            break;
+    }
+
+    if(i == SEARCH_NODES)
+        return;
+
+    if(tc->numnodes < SEARCH_NODES)
+        tc->numnodes++;
+
+    for(j = tc->numnodes - 1; j > i; j--)
+        tc->nodes[j] = tc->nodes[j - 1];
+
+    tn = &tc->nodes[i];
+    memcpy(tn->id, id, 20);
+
+found:
+    memcpy(&tn->ss, sa, salen);
+    tn->sslen = salen;
+    memcpy(tn->token, token, token_len);
+    tn->token_len = token_len;
+    tn->time = now.tv_sec;
+}
+
+static struct token_cache *
+find_token_cache(unsigned short tid, int af)
+{
+    struct token_cache *tc = token_caches;
+    while(tc) {
+        if(tc->tid == tid && tc->af == af)
+            return tc;
+        tc = tc->next;
+    }
+    return NULL;
+}
+
+static int
+token_node_valid(const struct token_node *tn)
+{
+    return tn->time >= now.tv_sec - TOKEN_CACHE_TIME &&
+        !node_blacklisted((const struct sockaddr*)&tn->ss, tn->sslen);
+}
+
+/* Whether the announce_replicas closest nodes all have a valid token */
+static int
+token_cache_valid(const struct token_cache *tc)
+{
+    int i;
+
+    if(tc->numnodes < announce_replicas)
+        return 0;
+
+    for(i = 0; i < announce_replicas; i++)
+        if(!token_node_valid(&tc->nodes[i]))
+            return 0;
+
+    return 1;
+}
+
+/* Drop the nodes with a token older than age and blacklisted nodes */
+static void
+token_cache_drop(struct token_cache *tc, time_t age)
+{
+    int i = 0;
+
+    while(i < tc->numnodes) {
+        struct token_node *tn = &tc->nodes[i];
+        if(tn->time < now.tv_sec - age ||
+           node_blacklisted((struct sockaddr*)&tn->ss, tn->sslen)) {
+            memmove(tn, tn + 1,
+                    (tc->numnodes - i - 1) * sizeof(struct token_node));
+            tc->numnodes--;
+        } else {
+            i++;
+        }
+    }
+}
+
+static void
+expire_token_caches(void)
+{
+    struct token_cache *tc = token_caches, *previous = NULL;
+
+    while(tc) {
+        struct token_cache *next = tc->next;
+
+        token_cache_drop(tc, TOKEN_CACHE_EXPIRE_TIME);
+
+        if(tc->numnodes == 0) {
+            if(previous)
+                previous->next = next;
+            else
+                token_caches = next;
+            idmap_set(tc->id, TOKEN_SLOT(tc->af), NULL);
+            free(tc);
+            numtokencaches--;
+        } else {
+            previous = tc;
+        }
+        tc = next;
+    }
+}
+
 /* A search contains a list of nodes, sorted by decreasing distance to the
    target.  We just got a new candidate, insert it at the right spot or
    discard it. */
@@ -928,6 +1210,12 @@ insert_search_node(unsigned char *id,
         return 0;
     }
 
+    /* Hajime
+     * Keep blacklisted nodes out of searches
+     */
+    if(node_blacklisted(sa, salen))
+        return 0;
+
     for(i = 0; i < sr->numnodes; i++) {
         if(id_cmp(id, sr->nodes[i].id) == 0) {
             n = &sr->nodes[i];
@@ -968,6 +1256,7 @@ found:
         } else {
             memcpy(n->token, token, token_len);
             n->token_len = token_len;
+            token_cache_add(sr->id, sr->af, id, sa, salen, token, token_len);
         }
     }
 
@@ -1008,6 +1297,7 @@ expire_searches(void)
                 results_done(results, 0);
                 result_nodes_done(sr, 0);
             }
+            idmap_set(sr->id, SEARCH_SLOT(sr->af), NULL);
             free(sr);
             numsearches--;
         } else {
@@ -1086,7 +1376,7 @@ result_node_send_get_peers(struct search *sr, struct result_node *rn)
 /* When a search is in progress, we periodically call search_step to send
    further requests. */
 static void
-search_step(struct search *sr, dht_callback *callback, void *closure)
+do_search_step(struct search *sr, dht_callback *callback, void *closure)
 {
     int i, j;
     int all_done = 1;
@@ -1167,21 +1457,31 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
     // Search is done
     if(all_done) {
         //lookup search - nothing else needed, we're done
-        if(sr->port == 0) {
+        if(sr->numports == 0) {
             goto done;
         } 
         // announce search - need to send announce_peer message to found
-        // nodes
+        // nodes, one per port
         else {
+            unsigned int all_ports = search_ports_mask(sr);
             ap_debug_print("%ld search for announcement %s done\n", 
                             time_now_sec(), str_id(sr->id, buf));
             int all_acked = 1;
+            if(sr->announce_time == 0)
+                sr->announce_time = now.tv_sec;
+            sr->retry_time = 0;
+            /* Hajime
+             * Announce to the announce_replicas closest live nodes at
+             * once.  Each node has its own retry timer; a node that
+             * did not ack after 3 tries is replaced by the next one.
+             */
             j = 0;
-            for(i = 0; i < sr->numnodes && j < REPLICATE_NUM; i++) {
+            for(i = 0; i < sr->numnodes && j < announce_replicas; i++) {
                 struct search_node *n = &sr->nodes[i];
                 struct node *node;
                 unsigned char tid[4];
-                if(n->pinged >= 3){
+                int k;
+                if(n->pinged >= 3 && n->acked != all_ports){
                     ap_debug_print("%s(%s) pinged >=3. Skipping \n", 
                             str_id(n->id, buf), str_addr(&n->ss, buf1));
                     continue;
@@ -1191,29 +1491,41 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
                    I don't think this makes a lot of sense -- just sending
                    a positive reply is just as good --, let's deal with it. */
                 if(n->token_len == 0)
-                    n->acked = 1;
-                if(!n->acked) {
+                    n->acked = n->sent = all_ports;
+                if(n->acked != all_ports) {
                     all_acked = 0;
-                    ap_debug_print("Sending announce_peer to %s(%s)\n", 
-                            str_id(n->id, buf), str_addr(&n->ss, buf1));
-                    make_tid(tid, "ap", sr->tid);
-                    send_announce_peer((struct sockaddr*)&n->ss,
-                                       sizeof(struct sockaddr_storage),
-                                       tid, 4, sr->id, sr->port,
-                                       n->token, n->token_len,
-                                       n->reply_time >= now.tv_sec - 15);
-                    n->pinged++;
-                    n->request_time = now.tv_sec;
-                    node = find_node(n->id, n->ss.ss_family);
-                    if(node) pinged(node, NULL);
+                    if(n->request_time + ANNOUNCE_RETRY_TIME <= now.tv_sec) {
+                        ap_debug_print("Sending announce_peer to %s(%s)\n", 
+                                str_id(n->id, buf), str_addr(&n->ss, buf1));
+                        /* Only the ports that were not acked yet */
+                        for(k = 0; k < sr->numports; k++) {
+                            if(n->acked & (1U << k))
+                                continue;
+                            make_ap_tid(tid, k, sr->tid);
+                            send_announce_peer((struct sockaddr*)&n->ss,
+                                               sizeof(struct sockaddr_storage),
+                                               tid, 4, sr->id, sr->ports[k],
+                                               n->token, n->token_len,
+                                               n->reply_time >= now.tv_sec - 15);
+                        }
+                        n->sent = all_ports;
+                        n->pinged++;
+                        n->request_time = now.tv_sec;
+                        node = find_node(n->id, n->ss.ss_family);
+                        if(node) pinged(node, NULL);
+                    }
+                    if(sr->retry_time == 0 ||
+                       sr->retry_time > n->request_time + ANNOUNCE_RETRY_TIME)
+                        sr->retry_time = n->request_time + ANNOUNCE_RETRY_TIME;
                 }
-                if(n->acked){
+                if(n->acked == all_ports){
                     ap_debug_print("%s(%s) acked announce peer\n", 
                             str_id(n->id, buf), str_addr(&n->ss, buf1));
                 }
 
                 j++;
             }
+            search_check_replicated(sr);
             if(all_acked)
                 goto done;
         }
@@ -1249,6 +1561,18 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
     sr->step_time = now.tv_sec;
 }
 
+/* Hajime
+ * Time the search steps (latency.c)
+ */
+static void
+search_step(struct search *sr, dht_callback *callback, void *closure)
+{
+    uint64_t start = latency_now();
+
+    do_search_step(sr, callback, closure);
+    latency_add(LATENCY_SEARCH_STEP, start);
+}
+
 static struct search *
 new_search(void)
 {
@@ -1297,11 +1621,33 @@ insert_search_bucket(struct bucket *b, struct search *sr)
     }
 }
 
+void
+dht_set_replicas(int replicas)
+{
+    if(replicas > 0 && replicas <= SEARCH_NODES)
+        announce_replicas = replicas;
+}
+
 /* Start a search.  If port is non-zero, perform an announce when the
    search is complete. */
 int
 dht_search(const unsigned char *id, int port, int af,
            dht_callback *callback, void *closure)
+{
+    unsigned short p = port;
+
+    return dht_search_ports(id, &p, port ? 1 : 0, af, callback, closure);
+}
+
+/* Hajime
+ * Start a search and announce all numports ports when it is complete.
+ * Announcing the ports of an id with separate searches would keep
+ * restarting the one search that exists per id.
+ */
+int
+dht_search_ports(const unsigned char *id,
+                 const unsigned short *ports, int numports, int af,
+                 dht_callback *callback, void *closure)
 {
     struct search *sr;
     //struct storage *st;
@@ -1313,6 +1659,11 @@ dht_search(const unsigned char *id, int port, int af,
         return -1;
     }
 
+    if(numports < 0 || numports > SEARCH_PORTS) {
+        errno = EINVAL;
+        return -1;
+    }
+
     /* Hajime
      * don't bother looking locally - the callback function was modified to
      * require a search struct
@@ -1349,12 +1700,7 @@ dht_search(const unsigned char *id, int port, int af,
     }
     */
 
-    sr = searches;
-    while(sr) {
-        if(sr->af == af && id_cmp(sr->id, id) == 0)
-            break;
-        sr = sr->next;
-    }
+    sr = idmap_lookup(id, SEARCH_SLOT(af));
     if(sr) {
         /* We're reusing data from an old search.  Reusing the same tid
            means that we can merge replies for both searches. */
@@ -1373,6 +1719,7 @@ dht_search(const unsigned char *id, int port, int af,
             n->token_len = 0;
             n->replied = 0;
             n->acked = 0;
+            n->sent = 0;
         }
         /* Hajime
          * Last search for infohash did not complete. Log partial results
@@ -1389,6 +1736,15 @@ dht_search(const unsigned char *id, int port, int af,
             errno = ENOSPC;
             return -1;
         }
+        /* Drop the index entry of a reused slot */
+        if(idmap_lookup(sr->id, SEARCH_SLOT(sr->af)) == sr)
+            idmap_set(sr->id, SEARCH_SLOT(sr->af), NULL);
+        if(idmap_set(id, SEARCH_SLOT(af), sr) < 0) {
+            /* Leave the slot to be reused */
+            sr->done = 1;
+            errno = ENOMEM;
+            return -1;
+        }
         sr->af = af;
         sr->tid = search_id++;
         sr->step_time = 0;
@@ -1397,7 +1753,50 @@ dht_search(const unsigned char *id, int port, int af,
         sr->numnodes = 0;
     }
 
-    sr->port = port;
+    if(numports > 0)
+        memcpy(sr->ports, ports, numports * sizeof(unsigned short));
+    sr->numports = numports;
+    sr->announce_time = 0;
+    sr->replicated_time = 0;
+    sr->retry_time = 0;
+
+    /* Hajime
+     * Announce straight to the nodes of the token cache if there are
+     * enough valid tokens.  Both lists are sorted by distance.  The
+     * nodes are marked as replied, so that search_step sends the
+     * announce_peer messages right away.
+     */
+    if(numports > 0) {
+        struct token_cache *tc = idmap_lookup(id, TOKEN_SLOT(af));
+        if(tc && token_cache_valid(tc)) {
+            int i;
+            sr->numnodes = 0;
+            for(i = 0; i < tc->numnodes; i++) {
+                struct token_node *tn = &tc->nodes[i];
+                if(!token_node_valid(tn))
+                    continue;
+                struct search_node *n = &sr->nodes[sr->numnodes++];
+                memset(n, 0, sizeof(struct search_node));
+                memcpy(n->id, tn->id, 20);
+                memcpy(&n->ss, &tn->ss, tn->sslen);
+                n->sslen = tn->sslen;
+                memcpy(n->token, tn->token, tn->token_len);
+                n->token_len = tn->token_len;
+                n->replied = 1;
+                n->reply_time = tn->time;
+            }
+            token_cache_hits++;
+            ap_debug_print("Announcing %s from the token cache\n",
+                           str_id(id, buf));
+            search_step(sr, callback, closure);
+            search_time = now.tv_sec;
+            return 1;
+        }
+        /* The search refills the cache with the nodes that answer */
+        if(tc)
+            token_cache_drop(tc, TOKEN_CACHE_TIME);
+        token_cache_misses++;
+    }
 
     insert_search_bucket(b, sr);
 
@@ -1416,27 +1815,202 @@ dht_search(const unsigned char *id, int port, int af,
     return 1;
 }
 
+/* Hajime
+ * Ask the nodes of the token cache of id for new tokens, so that the
+ * next announcement of id can be sent from the cache.  The replies
+ * are stored by token_cache_add.  Returns the number of requests sent.
+ */
+int
+dht_refresh_tokens(const unsigned char *id, int af)
+{
+    struct token_cache *tc = idmap_lookup(id, TOKEN_SLOT(af));
+    unsigned char tid[4];
+    int i, sent = 0;
+
+    if(tc == NULL)
+        return 0;
+
+    make_tid(tid, "tr", tc->tid);
+    for(i = 0; i < tc->numnodes; i++) {
+        struct token_node *tn = &tc->nodes[i];
+        if(send_get_peers((struct sockaddr*)&tn->ss, tn->sslen,
+                          tid, 4, tc->id, -1, 0) >= 0)
+            sent++;
+    }
+
+    return sent;
+}
+
 /* A struct storage stores all the stored peer addresses for a given info
    hash. */
 
 static struct storage *
 find_storage(const unsigned char *id)
 {
-    struct storage *st = storage;
+    return idmap_lookup(id, IDMAP_STORAGE);
+}
 
-    while(st) {
-        if(id_cmp(id, st->id) == 0)
+/* Hajime
+ * FNV-1a over the compact address and port of a peer
+ */
+static unsigned int
+peer_hash(const unsigned char *ip, int len, unsigned short port)
+{
+    unsigned int h = 2166136261U;
+    int i;
+
+    for(i = 0; i < len; i++)
+        h = (h ^ ip[i]) * 16777619U;
+    h = (h ^ (port >> 8)) * 16777619U;
+    h = (h ^ (port & 0xFF)) * 16777619U;
+    return h;
+}
+
+/* Hajime
+ * Slot of a peer in the index of a storage, or the empty slot
+ * where it would be inserted.
+ */
+static int
+storage_slot(const struct storage *st,
+             const unsigned char *ip, int len, unsigned short port)
+{
+    int mask = st->indexsize - 1;
+    int s = peer_hash(ip, len, port) & mask;
+
+    while(st->index[s]) {
+        const struct peer *p = &st->peers[st->index[s] - 1];
+        if(p->port == port && p->len == len && memcmp(p->ip, ip, len) == 0)
             break;
-        st = st->next;
+        s = (s + 1) & mask;
     }
-    return st;
+    return s;
+}
+
+/* Hajime
+ * Empty a slot of the index. Following entries are shifted back
+ * so that lookups do not need tombstones.
+ */
+static void
+storage_unindex(struct storage *st, int s)
+{
+    int mask = st->indexsize - 1;
+    int i = s, j = s, k;
+
+    st->index[i] = 0;
+    while(1) {
+        const struct peer *p;
+        j = (j + 1) & mask;
+        if(st->index[j] == 0)
+            break;
+        p = &st->peers[st->index[j] - 1];
+        k = peer_hash(p->ip, p->len, p->port) & mask;
+        /* The entry can move to i if its home slot is not in (i, j] */
+        if(i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            st->index[i] = st->index[j];
+            st->index[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/* Hajime
+ * Grow the peer array and rebuild the index for the new size
+ */
+static int
+storage_grow(struct storage *st)
+{
+    struct peer *new_peers;
+    int *new_index;
+    int i, n;
+
+    n = st->maxpeers == 0 ? 2 : 2 * st->maxpeers;
+    n = MIN(n, DHT_MAX_PEERS);
+    new_peers = realloc(st->peers, n * sizeof(struct peer));
+    if(new_peers == NULL)
+        return -1;
+    st->peers = new_peers;
+    new_index = calloc(2 * n, sizeof(int));
+    if(new_index == NULL)
+        return -1;
+    free(st->index);
+    st->index = new_index;
+    st->indexsize = 2 * n;
+    st->maxpeers = n;
+
+    for(i = 0; i < st->numpeers; i++) {
+        struct peer *p = &st->peers[i];
+        st->index[storage_slot(st, p->ip, p->len, p->port)] = i + 1;
+    }
+    return 0;
+}
+
+/* Hajime
+ * Append a peer to the newest end of the expiry list
+ */
+static void
+storage_link(struct storage *st, int i)
+{
+    st->peers[i].older = st->newest;
+    st->peers[i].newer = -1;
+    if(st->newest >= 0)
+        st->peers[st->newest].newer = i;
+    else
+        st->oldest = i;
+    st->newest = i;
+}
+
+static void
+storage_unlink(struct storage *st, int i)
+{
+    struct peer *p = &st->peers[i];
+
+    if(p->older >= 0)
+        st->peers[p->older].newer = p->newer;
+    else
+        st->oldest = p->newer;
+    if(p->newer >= 0)
+        st->peers[p->newer].older = p->older;
+    else
+        st->newest = p->older;
+}
+
+/* Hajime
+ * Remove a peer. The last peer of the array takes its place.
+ */
+static void
+storage_remove(struct storage *st, int i)
+{
+    int last = st->numpeers - 1;
+    struct peer *p;
+    int s;
+
+    storage_unlink(st, i);
+    p = &st->peers[i];
+    storage_unindex(st, storage_slot(st, p->ip, p->len, p->port));
+
+    if(i != last) {
+        p = &st->peers[last];
+        s = storage_slot(st, p->ip, p->len, p->port);
+        st->peers[i] = *p;
+        st->index[s] = i + 1;
+        p = &st->peers[i];
+        if(p->older >= 0)
+            st->peers[p->older].newer = i;
+        else
+            st->oldest = i;
+        if(p->newer >= 0)
+            st->peers[p->newer].older = i;
+        else
+            st->newest = i;
+    }
+    st->numpeers--;
 }
 
 static int
 storage_store(const unsigned char *id,
               const struct sockaddr *sa, unsigned short port)
 {
-    int i, len;
+    int i, s, len;
     struct storage *st;
     unsigned char *ip;
 
@@ -1460,68 +2034,69 @@ storage_store(const unsigned char *id,
         st = calloc(1, sizeof(struct storage));
         if(st == NULL) return -1;
         memcpy(st->id, id, 20);
+        st->oldest = st->newest = -1;
+        if(storage_grow(st) < 0 || idmap_set(id, IDMAP_STORAGE, st) < 0) {
+            free(st->peers);
+            free(st->index);
+            free(st);
+            return -1;
+        }
         st->next = storage;
         storage = st;
         numstorage++;
     }
 
-    for(i = 0; i < st->numpeers; i++) {
-        if(st->peers[i].port == port && st->peers[i].len == len &&
-           memcmp(st->peers[i].ip, ip, len) == 0)
-            break;
-    }
+    s = storage_slot(st, ip, len, port);
 
-    if(i < st->numpeers) {
+    if(st->index[s]) {
         /* Already there, only need to refresh */
+        i = st->index[s] - 1;
         st->peers[i].time = now.tv_sec;
+        storage_unlink(st, i);
+        storage_link(st, i);
         return 0;
     } else {
         struct peer *p;
-        if(i >= st->maxpeers) {
+        if(st->numpeers >= st->maxpeers) {
             /* Need to expand the array. */
-            struct peer *new_peers;
-            int n;
             if(st->maxpeers >= DHT_MAX_PEERS)
                 return 0;
-            n = st->maxpeers == 0 ? 2 : 2 * st->maxpeers;
-            n = MIN(n, DHT_MAX_PEERS);
-            new_peers = realloc(st->peers, n * sizeof(struct peer));
-            if(new_peers == NULL)
+            if(storage_grow(st) < 0)
                 return -1;
-            st->peers = new_peers;
-            st->maxpeers = n;
+            s = storage_slot(st, ip, len, port);
         }
-        p = &st->peers[st->numpeers++];
+        i = st->numpeers++;
+        p = &st->peers[i];
         p->time = now.tv_sec;
         p->len = len;
         memcpy(p->ip, ip, len);
         p->port = port;
+        st->index[s] = i + 1;
+        storage_link(st, i);
         return 1;
     }
 }
 
+/* Hajime
+ * Only the expired peers at the oldest end of each list are visited
+ */
 static int
 expire_storage(void)
 {
     struct storage *st = storage, *previous = NULL;
     while(st) {
-        int i = 0;
-        while(i < st->numpeers) {
-            if(st->peers[i].time < now.tv_sec - 32 * 60) {
-                if(i != st->numpeers - 1)
-                    st->peers[i] = st->peers[st->numpeers - 1];
-                st->numpeers--;
-            } else {
-                i++;
-            }
-        }
+        while(st->oldest >= 0 &&
+              st->peers[st->oldest].time < now.tv_sec - 32 * 60)
+            storage_remove(st, st->oldest);
 
         if(st->numpeers == 0) {
             free(st->peers);
+            free(st->index);
             if(previous)
                 previous->next = st->next;
             else
                 storage = st->next;
+            idmap_set(st->id, IDMAP_STORAGE, NULL);
             free(st);
             if(previous)
                 st = previous->next;
@@ -1551,6 +2126,7 @@ rotate_secrets(void)
 
     memcpy(oldsecret, secret, sizeof(secret));
     rc = dht_random_bytes(secret, sizeof(secret));
+    secret_epoch++;
 
     if(rc < 0)
         return -1;
@@ -1562,8 +2138,15 @@ rotate_secrets(void)
 #define TOKEN_SIZE 8
 #endif
 
-static void
-make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
+/* Secret and IPv6 address and port */
+#define TOKEN_INPUT_SIZE (sizeof(secret) + 16 + 2)
+
+/* Hajime
+ * Token input: secret, address and port. The token is the start of
+ * the SHA-1 digest of the input, as computed by dht_hash.
+ */
+static size_t
+token_input(const struct sockaddr *sa, int old, unsigned char *buf)
 {
     void *ip;
     int iplen;
@@ -1583,51 +2166,163 @@ make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
         abort();
     }
 
-    dht_hash(token_return, TOKEN_SIZE,
-             old ? oldsecret : secret, sizeof(secret),
-             ip, iplen, (unsigned char*)&port, 2);
+    memcpy(buf, old ? oldsecret : secret, sizeof(secret));
+    memcpy(buf + sizeof(secret), ip, iplen);
+    memcpy(buf + sizeof(secret) + iplen, &port, 2);
+    return sizeof(secret) + iplen + 2;
+}
+
+/* Hajime
+ * Cache of the tokens handed out to and checked for each source
+ * address and port, so that a flood of get_peers and announce_peer
+ * does not compute a SHA-1 for every request. An entry holds the
+ * tokens of the current and the old secret of its epoch. After
+ * rotate_secrets the current token of the last epoch becomes the
+ * old one; older entries are refilled. The table is set associative,
+ * a new address replaces the least recently used entry of its set.
+ */
+#ifndef DHT_SERVED_TOKENS
+#define DHT_SERVED_TOKENS 8192
+#endif
+#define DHT_SERVED_TOKEN_WAYS 4
+
+struct served_token {
+    unsigned char key[18];      /* address and port */
+    unsigned char af;
+    unsigned char valid;        /* bit 0: token[0], bit 1: token[1] */
+    unsigned int epoch;
+    unsigned int used;
+    unsigned char token[2][TOKEN_SIZE]; /* current, old secret */
+};
+
+static struct served_token served_tokens[DHT_SERVED_TOKENS];
+static unsigned int served_token_clock;
+static unsigned long served_token_hits, served_token_misses;
+
+static struct served_token *
+find_served_token(const struct sockaddr *sa)
+{
+    struct served_token *set, *st;
+    unsigned char key[18];
+    unsigned int h = 2166136261U;
+    int i;
+
+    memset(key, 0, sizeof(key));
+    if(sa->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)sa;
+        memcpy(key, &sin->sin_addr, 4);
+        memcpy(key + 4, &sin->sin_port, 2);
+    } else if(sa->sa_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
+        memcpy(key, &sin6->sin6_addr, 16);
+        memcpy(key + 16, &sin6->sin6_port, 2);
+    } else {
+        abort();
+    }
+
+    for(i = 0; i < 18; i++)
+        h = (h ^ key[i]) * 16777619U;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    set = &served_tokens[(h % (DHT_SERVED_TOKENS / DHT_SERVED_TOKEN_WAYS))
+                         * DHT_SERVED_TOKEN_WAYS];
+    st = set;
+    for(i = 0; i < DHT_SERVED_TOKEN_WAYS; i++) {
+        if(set[i].af == sa->sa_family && memcmp(set[i].key, key, 18) == 0) {
+            st = &set[i];
+            break;
+        }
+        if(set[i].used < st->used)
+            st = &set[i];
+    }
+
+    if(i == DHT_SERVED_TOKEN_WAYS) {
+        memcpy(st->key, key, 18);
+        st->af = sa->sa_family;
+        st->valid = 0;
+        st->epoch = secret_epoch;
+    } else if(st->epoch != secret_epoch) {
+        if(st->epoch + 1 == secret_epoch && (st->valid & 1)) {
+            memcpy(st->token[1], st->token[0], TOKEN_SIZE);
+            st->valid = 2;
+        } else {
+            st->valid = 0;
+        }
+        st->epoch = secret_epoch;
+    }
+    st->used = ++served_token_clock;
+    return st;
+}
+
+/* Hajime
+ * Token of an entry, computed if it is not cached yet
+ */
+static const unsigned char *
+served_token(struct served_token *st, const struct sockaddr *sa, int old)
+{
+    unsigned char buf[TOKEN_INPUT_SIZE];
+    size_t len;
+
+    if(st->valid & (1 << old)) {
+        served_token_hits++;
+    } else {
+        len = token_input(sa, old, buf);
+        dht_hash(st->token[old], TOKEN_SIZE, buf, len, NULL, 0, NULL, 0);
+        st->valid |= 1 << old;
+        served_token_misses++;
+    }
+    return st->token[old];
+}
+
+static void
+make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
+{
+    memcpy(token_return, served_token(find_served_token(sa), sa, old ? 1 : 0),
+           TOKEN_SIZE);
 }
+
 static int
 token_match(const unsigned char *token, int token_len,
             const struct sockaddr *sa)
 {
     char buf[257], buf1[257], buf2[257];
     char debug = 0;
-    unsigned char t[TOKEN_SIZE];
+    struct served_token *st;
+    int old;
     if(token_len != TOKEN_SIZE){
         if(debug){
             dprintf(1, "token_len !=token_size.\n"
-                    "token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
+                    "token: %s token_len: %d TOKEN_SIZE: %d, sa: %s\n", 
                     str_id(token, buf), token_len, TOKEN_SIZE,
-                    str_id(t, buf1), str_addr((const IP *)sa, buf2));
+                    str_addr((const IP *)sa, buf2));
         }
         
         return 0;
     }
-    make_token(sa, 0, t);
-    if(memcmp(t, token, TOKEN_SIZE) == 0){
-        if(debug){
-            dprintf(1, "t=token with old=0.\n"
-                    "token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
-                    str_id(token, buf), token_len, TOKEN_SIZE,
-                    str_id(t, buf1), str_addr((const IP *)sa, buf2));
-        }
-        return 1;
-    }
-    make_token(sa, 1, t);
-    if(memcmp(t, token, TOKEN_SIZE) == 0){
-        if(debug){
-            dprintf(1, "t=token with old=1.\n"
-                    "token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
-                    str_id(token, buf), token_len, TOKEN_SIZE,
-                    str_id(t, buf1), str_addr((const IP *)sa, buf2));
+    /* Hajime
+     * Most announces carry the current token, the old one is only
+     * computed if that does not match
+     */
+    st = find_served_token(sa);
+    for(old = 0; old < 2; old++){
+        if(memcmp(served_token(st, sa, old), token, TOKEN_SIZE) == 0){
+            if(debug){
+                dprintf(1, "t=token with old=%d.\n"
+                        "token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
+                        old, str_id(token, buf), token_len, TOKEN_SIZE,
+                        str_id(st->token[old], buf1), str_addr((const IP *)sa, buf2));
+            }
+            return 1;
         }
-        return 1;
     }
     if(debug){
         dprintf(1, "t!=token. token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
                 str_id(token, buf), token_len, TOKEN_SIZE,
-                str_id(t, buf1), str_addr((const IP *)sa, buf2));
+                str_id(st->token[0], buf1), str_addr((const IP *)sa, buf2));
     }
     return 0;
 }
@@ -1844,11 +2539,6 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     search_id = random() & 0xFFFF;
     search_time = 0;
 
-    next_blacklisted = 0;
-
-    token_bucket_time = now.tv_sec;
-    token_bucket_tokens = MAX_TOKEN_BUCKET_TOKENS;
-
     memset(secret, 0, sizeof(secret));
     rc = rotate_secrets();
     if(rc < 0)
@@ -1904,34 +2594,27 @@ dht_uninit()
     while(storage) {
         struct storage *st = storage;
         storage = storage->next;
+        idmap_set(st->id, IDMAP_STORAGE, NULL);
         free(st->peers);
+        free(st->index);
         free(st);
     }
 
     while(searches) {
         struct search *sr = searches;
         searches = searches->next;
+        idmap_set(sr->id, SEARCH_SLOT(sr->af), NULL);
         free(sr);
     }
 
-    return 1;
-}
-
-/* Rate control for requests we receive. */
-
-static int
-token_bucket(void)
-{
-    if(token_bucket_tokens == 0) {
-        token_bucket_tokens = MIN(MAX_TOKEN_BUCKET_TOKENS,
-                                  400 * (now.tv_sec - token_bucket_time));
-        token_bucket_time = now.tv_sec;
+    while(token_caches) {
+        struct token_cache *tc = token_caches;
+        token_caches = token_caches->next;
+        idmap_set(tc->id, TOKEN_SLOT(tc->af), NULL);
+        free(tc);
     }
+    numtokencaches = 0;
 
-    if(token_bucket_tokens == 0)
-        return 0;
-
-    token_bucket_tokens--;
     return 1;
 }
 
@@ -2058,7 +2741,11 @@ dht_periodic(const void *buf, size_t buflen,
              time_t *tosleep,
              dht_callback *callback, void *closure)
 {
+    uint64_t start;
+    int timers = 0;
+
     gettimeofday(&now, NULL);
+    start = latency_now();
 
     if(buflen > 0) {
         int message;
@@ -2071,8 +2758,8 @@ dht_periodic(const void *buf, size_t buflen,
         int values_len = 2048, values6_len = 2048;
         int want;
         unsigned short ttid;
+        int index;
         struct node *from_node = NULL;
-        char buf1[257];
 
         if(is_martian(from))
             goto dontread;
@@ -2094,6 +2781,14 @@ dht_periodic(const void *buf, size_t buflen,
                                 values, &values_len, values6, &values6_len,
                                 &want);
 
+        /* Hajime
+         * Packets in by KRPC type (metrics.c)
+         */
+        if(message < 0)
+            metrics_count(METRIC_PARSE_FAILURES);
+        else
+            metrics_count(METRIC_PACKETS_IN + message);
+
         if(message < 0 || message == ERROR || id_cmp(id, zeroes) == 0) {
             debugf("Unparseable message: ");
             debug_printable(buf, buflen);
@@ -2108,11 +2803,13 @@ dht_periodic(const void *buf, size_t buflen,
 
         if(message > REPLY) {
             /* Rate limit requests. */
-            if(!token_bucket()) {
-                dprintf(1, "Dropping request from %s due to rate limiting.\n",
-                        str_addr((const IP *)from, buf1));
+            /* Hajime
+             * Per source address instead of one bucket for all requests,
+             * so that a single scanner cannot starve the other nodes
+             * (ratelimit.c). Drops are logged there.
+             */
+            if(!ratelimit_allow(from))
                 goto dontread;
-            }
         }
 
         switch(message) {
@@ -2124,7 +2821,7 @@ dht_periodic(const void *buf, size_t buflen,
                 /* This is really annoying, as it means that we will
                    time-out all our searches that go through this node.
                    Kill it. */
-                blacklist_node(id, from, fromlen);
+                penalize_node(id, from, fromlen, BLACKLIST_TRUNCATED_TID);
                 goto dontread;
             }
             if(tid_match(tid, "pn", NULL)) {
@@ -2142,7 +2839,7 @@ dht_periodic(const void *buf, size_t buflen,
                        gp ? " for get_peers" : "");
                 if(nodes_len % 26 != 0 || nodes6_len % 38 != 0) {
                     debugf("Unexpected length for node info!\n");
-                    blacklist_node(id, from, fromlen);
+                    penalize_node(id, from, fromlen, BLACKLIST_BAD_NODES);
                 } else if(gp && sr == NULL) {
                     debugf("Unknown search!\n");
                     new_node(id, from, fromlen, 1);
@@ -2218,7 +2915,7 @@ dht_periodic(const void *buf, size_t buflen,
                         }
                     }
                 }
-            } else if(tid_match(tid, "ap", &ttid)) {
+            } else if(ap_tid_match(tid, &index, &ttid)) {
                 struct search *sr;
                 debugf("Got reply to announce_peer.\n");
                 sr = find_search(ttid, from->sa_family);
@@ -2232,13 +2929,30 @@ dht_periodic(const void *buf, size_t buflen,
                         if(id_cmp(sr->nodes[i].id, id) == 0) {
                             sr->nodes[i].request_time = 0;
                             sr->nodes[i].reply_time = now.tv_sec;
-                            sr->nodes[i].acked = 1;
+                            if(index < sr->numports)
+                                sr->nodes[i].acked |= 1U << index;
                             sr->nodes[i].pinged = 0;
+                            search_check_replicated(sr);
                             break;
                         }
                     /* See comment for gp above. */
                     search_send_get_peers(sr, NULL);
                 }
+            } else if(tid_match(tid, "tr", &ttid)) {
+                /* Hajime
+                 * New token for the token cache (dht_refresh_tokens)
+                 */
+                struct token_cache *tc;
+                tc = find_token_cache(ttid, from->sa_family);
+                if(!tc) {
+                    debugf("Unknown token cache!\n");
+                    new_node(id, from, fromlen, 1);
+                } else {
+                    new_node(id, from, fromlen, 2);
+                    if(token_len > 0)
+                        token_cache_add(tc->id, tc->af, id, from, fromlen,
+                                        token, token_len);
+                }
             } else {
                 debugf("Unexpected reply: ");
                 debug_printable(buf, buflen);
@@ -2270,6 +2984,10 @@ dht_periodic(const void *buf, size_t buflen,
             } else {
                 struct storage *st = find_storage(info_hash);
                 unsigned char token[TOKEN_SIZE];
+                /* Hajime
+                 * Log requests for Hajime infohashes
+                 */
+                observe_message(OBSERVE_GET_PEERS, info_hash, from, 0);
                 make_token(from, 0, token);
                 if(st && st->numpeers > 0) {
                      debugf("Sending found%s peers.\n",
@@ -2308,6 +3026,10 @@ dht_periodic(const void *buf, size_t buflen,
                            203, "Announce_peer with forbidden port number");
                 break;
             }
+            /* Hajime
+             * Log announcements of Hajime infohashes
+             */
+            observe_message(OBSERVE_ANNOUNCE_PEER, info_hash, from, port);
             storage_store(info_hash, from, port);
             /* Note that if storage_store failed, we lie to the requestor.
                This is to prevent them from backtracking, and hence
@@ -2318,21 +3040,33 @@ dht_periodic(const void *buf, size_t buflen,
     }
 
  dontread:
-    if(now.tv_sec >= rotate_secrets_time)
+    /* Hajime
+     * Time the packet and the timers that were due separately (latency.c)
+     */
+    if(buflen > 0)
+        start = latency_add(LATENCY_PACKET, start);
+
+    if(now.tv_sec >= rotate_secrets_time) {
         rotate_secrets();
+        timers = 1;
+    }
     
     if(now.tv_sec >= expire_stuff_time) {
+        timers = 1;
         expire_buckets(buckets);
         expire_buckets(buckets6);
         expire_storage();
         expire_searches();
+        expire_token_caches();
     }
 
     if(search_time > 0 && now.tv_sec >= search_time) {
         struct search *sr;
+        timers = 1;
         sr = searches;
         while(sr) {
-            if(!sr->done && sr->step_time + 5 <= now.tv_sec) {
+            if(!sr->done && (sr->step_time + 5 <= now.tv_sec ||
+                             (sr->retry_time && sr->retry_time <= now.tv_sec))) {
                 search_step(sr, callback, closure);
             }
             sr = sr->next;
@@ -2344,6 +3078,8 @@ dht_periodic(const void *buf, size_t buflen,
         while(sr) {
             if(!sr->done) {
                 time_t tm = sr->step_time + 15 + random() % 10;
+                if(sr->retry_time && sr->retry_time < tm)
+                    tm = sr->retry_time;
                 if(search_time == 0 || search_time > tm)
                     search_time = tm;
             }
@@ -2353,6 +3089,7 @@ dht_periodic(const void *buf, size_t buflen,
 
     if(now.tv_sec >= confirm_nodes_time) {
         int soon = 0;
+        timers = 1;
 
         soon |= bucket_maintenance(AF_INET);
         soon |= bucket_maintenance(AF_INET6);
@@ -2386,6 +3123,9 @@ dht_periodic(const void *buf, size_t buflen,
             *tosleep = search_time - now.tv_sec;
     }
 
+    if(timers)
+        latency_add(LATENCY_TIMERS, start);
+
     return 1;
 }
 
@@ -2514,15 +3254,16 @@ dht_ping_node(struct sockaddr *sa, int salen)
 
 static int
 dht_send(const void *buf, size_t len, int flags,
-         const struct sockaddr *sa, int salen)
+         const struct sockaddr *sa, int salen, int type)
 {
-    int s;
+    int s, rc;
 
     if(salen == 0)
         abort();
 
     if(node_blacklisted(sa, salen)) {
         debugf("Attempting to send to blacklisted node.\n");
+        metrics_count(METRIC_BLACKLISTED_SENDS);
         errno = EPERM;
         return -1;
     }
@@ -2539,7 +3280,13 @@ dht_send(const void *buf, size_t len, int flags,
         return -1;
     }
 
-    return sendto(s, buf, len, flags, sa, salen);
+    rc = sendto(s, buf, len, flags, sa, salen);
+    /* Hajime
+     * Packets out by KRPC type (metrics.c)
+     */
+    if(rc >= 0)
+        metrics_count(METRIC_PACKETS_OUT + type);
+    return rc;
 }
 
 int
@@ -2555,7 +3302,7 @@ send_ping(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_PING);
 
  fail:
     errno = ENOSPC;
@@ -2574,7 +3321,7 @@ send_pong(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_REPLY);
 
  fail:
     errno = ENOSPC;
@@ -2603,7 +3350,7 @@ send_find_node(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen, METRIC_KRPC_FIND_NODE);
 
  fail:
     errno = ENOSPC;
@@ -2670,7 +3417,7 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
     ADD_V(buf, i, 2048);
     rc = snprintf(buf + i, 2048 - i, "1:y1:re"); INC(i, rc, 2048);
 
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_REPLY);
 
  fail:
     errno = ENOSPC;
@@ -2737,6 +3484,144 @@ buffer_closest_nodes(unsigned char *nodes, int numnodes,
     return numnodes;
 }
 
+/* Hajime
+ * First 8 bytes of an id as a number, so that most distance
+ * comparisons are a single xor.
+ */
+static unsigned long long
+id_prefix(const unsigned char *id)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for(i = 0; i < 8; i++)
+        v = (v << 8) | id[i];
+    return v;
+}
+
+/* Hajime
+ * Encode the good nodes of a bucket unless the blocks are still valid.
+ * They stay valid until the first node can stop being good with time;
+ * all other changes go through bucket_changed. Returns the number of
+ * blocks, or -1 if the bucket has more good nodes than fit.
+ */
+static int
+bucket_compact(struct bucket *b)
+{
+    int size = b->af == AF_INET ? 26 : 38;
+    struct node *n;
+
+    if(now.tv_sec <= b->compact_expires)
+        return b->numcompact;
+
+    b->numcompact = 0;
+    b->compact_expires = now.tv_sec + 15 * 60;
+    for(n = b->nodes; n; n = n->next) {
+        unsigned char *c;
+        if(!node_good(n))
+            continue;
+        if(b->numcompact >= 8) {
+            b->compact_expires = 0;
+            return -1;
+        }
+        c = b->compact + size * b->numcompact;
+        memcpy(c, n->id, 20);
+        if(b->af == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in*)&n->ss;
+            memcpy(c + 20, &sin->sin_addr, 4);
+            memcpy(c + 24, &sin->sin_port, 2);
+        } else {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&n->ss;
+            memcpy(c + 20, &sin6->sin6_addr, 16);
+            memcpy(c + 36, &sin6->sin6_port, 2);
+        }
+        b->prefix[b->numcompact] = id_prefix(n->id);
+        b->numcompact++;
+        b->compact_expires = MIN(b->compact_expires,
+                                 MIN(n->reply_time + 7200, n->time + 900));
+    }
+    return b->numcompact;
+}
+
+/* Hajime
+ * Copy the (up to) 8 blocks closest to id out of the compact blocks
+ * of the given buckets.
+ */
+static int
+select_closest_nodes(unsigned char *nodes, const unsigned char *id,
+                     struct bucket **bs, int numbuckets)
+{
+    const unsigned char *best[8];
+    unsigned long long bestdist[8];
+    unsigned long long target = id_prefix(id);
+    int numbest = 0, size = 0;
+    int i, j, k;
+
+    for(k = 0; k < numbuckets; k++) {
+        struct bucket *b = bs[k];
+        size = b->af == AF_INET ? 26 : 38;
+        for(j = 0; j < b->numcompact; j++) {
+            const unsigned char *c = b->compact + size * j;
+            unsigned long long dist = b->prefix[j] ^ target;
+
+            for(i = numbest; i > 0; i--) {
+                if(bestdist[i - 1] < dist ||
+                   (bestdist[i - 1] == dist && xorcmp(best[i - 1], c, id) < 0))
+                    break;
+            }
+            if(i == 8)
+                continue;
+            if(numbest < 8)
+                numbest++;
+            memmove(best + i + 1, best + i,
+                    (numbest - i - 1) * sizeof(best[0]));
+            memmove(bestdist + i + 1, bestdist + i,
+                    (numbest - i - 1) * sizeof(bestdist[0]));
+            best[i] = c;
+            bestdist[i] = dist;
+        }
+    }
+
+    for(i = 0; i < numbest; i++)
+        memcpy(nodes + size * i, best[i], size);
+    return numbest;
+}
+
+/* Hajime
+ * Closest good nodes of the bucket of id and its two neighbours
+ */
+static int
+closest_nodes(unsigned char *nodes, const unsigned char *id, int af)
+{
+    struct bucket *bs[3];
+    struct bucket *b;
+    int numbuckets = 0, numnodes = 0, i;
+
+    b = find_bucket(id, af);
+    if(b == NULL)
+        return 0;
+    bs[numbuckets++] = b;
+    if(b->next)
+        bs[numbuckets++] = b->next;
+    b = previous_bucket(b);
+    if(b)
+        bs[numbuckets++] = b;
+
+    for(i = 0; i < numbuckets; i++) {
+        if(bucket_compact(bs[i]) < 0)
+            break;
+    }
+
+    if(i < numbuckets) {
+        /* Overfull bucket, encode the nodes as they are found */
+        for(i = 0; i < numbuckets; i++)
+            numnodes = buffer_closest_nodes(nodes, numnodes, id, bs[i]);
+        return numnodes;
+    }
+
+    return select_closest_nodes(nodes, id, bs, numbuckets);
+}
+
 int
 send_closest_nodes(const struct sockaddr *sa, int salen,
                    const unsigned char *tid, int tid_len,
@@ -2747,35 +3632,15 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
     unsigned char nodes[8 * 26];
     unsigned char nodes6[8 * 38];
     int numnodes = 0, numnodes6 = 0;
-    struct bucket *b;
 
     if(want < 0)
         want = sa->sa_family == AF_INET ? WANT4 : WANT6;
 
-    if((want & WANT4)) {
-        b = find_bucket(id, AF_INET);
-        if(b) {
-            numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
-            if(b->next)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b->next);
-            b = previous_bucket(b);
-            if(b)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
-        }
-    }
+    if((want & WANT4))
+        numnodes = closest_nodes(nodes, id, AF_INET);
 
-    if((want & WANT6)) {
-        b = find_bucket(id, AF_INET6);
-        if(b) {
-            numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
-            if(b->next)
-                numnodes6 =
-                    buffer_closest_nodes(nodes6, numnodes6, id, b->next);
-            b = previous_bucket(b);
-            if(b)
-                numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
-        }
-    }
+    if((want & WANT6))
+        numnodes6 = closest_nodes(nodes6, id, AF_INET6);
     debugf("  (%d+%d nodes.)\n", numnodes, numnodes6);
 
     return send_nodes_peers(sa, salen, tid, tid_len,
@@ -2807,7 +3672,7 @@ send_get_peers(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen, METRIC_KRPC_GET_PEERS);
 
  fail:
     errno = ENOSPC;
@@ -2837,7 +3702,7 @@ send_announce_peer(const struct sockaddr *sa, int salen,
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
 
-    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, sa, salen);
+    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, sa, salen, METRIC_KRPC_ANNOUNCE_PEER);
 
  fail:
     errno = ENOSPC;
@@ -2858,7 +3723,7 @@ send_peer_announced(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_REPLY);
 
  fail:
     errno = ENOSPC;
@@ -2881,7 +3746,7 @@ send_error(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:ee"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_ERROR);
 
  fail:
     errno = ENOSPC;
@@ -44,6 +44,15 @@ struct bucket {
     struct node *nodes;
     struct sockaddr_storage cached;  /* the address of a likely candidate */
     int cachedlen;
+    /* Hajime
+     * Compact node blocks (id, address, port) of the good nodes and the
+     * first 8 bytes of their ids, for send_closest_nodes. Valid until
+     * compact_expires; cleared when the nodes of the bucket change.
+     */
+    unsigned char compact[8 * 38];
+    unsigned long long prefix[8];
+    int numcompact;
+    time_t compact_expires;
     struct bucket *next;
 };
 
@@ -57,7 +66,8 @@ struct search_node {
     unsigned char token[40];
     int token_len;
     int replied;                /* whether we have received a reply */
-    int acked;                  /* whether they acked our announcement */
+    unsigned int acked;         /* bitmask of the ports they acked */
+    unsigned int sent;          /* bitmask of the ports announced to them */
 };
 
 /*Hajime
@@ -82,12 +92,21 @@ struct result_node{
    the target 8 turn out to be dead. */
 #define SEARCH_NODES 16
 
+/* An announce search announces up to SEARCH_PORTS ports to every node,
+   one announce_peer per port, while the nodes and tokens are looked up
+   only once. */
+#define SEARCH_PORTS 32
+
 struct search {
     unsigned short tid;
     int af;
     time_t step_time;           /* the time of the last search_step */
     unsigned char id[20];
-    unsigned short port;        /* 0 for pure searches */
+    unsigned short ports[SEARCH_PORTS];
+    int numports;               /* 0 for pure searches */
+    time_t announce_time;       /* the time of the first announce_peer */
+    time_t replicated_time;     /* when enough nodes acked all ports */
+    time_t retry_time;          /* the next announce_peer retransmission */
     int done;
     struct search_node nodes[SEARCH_NODES];
     int numnodes;
@@ -100,6 +119,10 @@ struct peer {
     unsigned char ip[16];
     unsigned short len;
     unsigned short port;
+    /* Hajime
+     * Neighbours in the expiry list of the storage (-1 for none)
+     */
+    int older, newer;
 };
 
 typedef void
@@ -110,6 +133,9 @@ dht_callback(void *closure, int event,
 
 #define REPLICATE_NUM 8
 
+/* Seconds before an announce_peer to a node is sent again */
+#define ANNOUNCE_RETRY_TIME 5
+
 #define DHT_EVENT_NONE 0
 #define DHT_EVENT_VALUES 1
 #define DHT_EVENT_VALUES6 2
@@ -126,6 +152,11 @@ int dht_periodic(const void *buf, size_t buflen,
                  time_t *tosleep, dht_callback *callback, void *closure);
 int dht_search(const unsigned char *id, int port, int af,
                dht_callback *callback, void *closure);
+int dht_search_ports(const unsigned char *id,
+                     const unsigned short *ports, int numports, int af,
+                     dht_callback *callback, void *closure);
+int dht_refresh_tokens(const unsigned char *id, int af);
+void dht_set_replicas(int replicas);
 int dht_nodes(int af,
               int *good_return, int *dubious_return, int *cached_return,
               int *incoming_return);
@@ -13,6 +13,9 @@
 
 #define MAX_ADDRS 32
 
+/* Size of the metrics reply */
+#define METRICS_SIZE (16 * 1024)
+
 
 /* handle 'GET /lookup?foo.p2p' */
 void handle_lookup( char *reply_buf, const char *params ) {
@@ -23,7 +26,7 @@ void handle_lookup( char *reply_buf, const char *params ) {
 
 	/* Lookup id - starts search when not already done */
 	num = N_ELEMS(addrs);
-	if( kad_lookup_value( params, addrs, &num ) >= 0 && num > 0 ) {
+	if( kad_lookup_value( params, addrs, &num, NULL, NULL ) >= 0 && num > 0 ) {
 		for( n = 0, i = 0; i < num; i++ ) {
 			n += sprintf( reply_buf + n, "%s\n", str_addr( &addrs[i], addrbuf ) );
 		}
@@ -52,6 +55,26 @@ void handle_blacklist( char *reply_buf, char *params ) {
 	}
 }
 
+/*
+* handle 'GET /metrics' - the only reply with a HTTP header,
+* as Prometheus expects one.
+*/
+void handle_metrics( int clientfd ) {
+	static char body[METRICS_SIZE];
+	char header[128];
+	int len;
+
+	len = kad_metrics( body, sizeof(body) );
+	snprintf( header, sizeof(header),
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %d\r\n\r\n", len );
+
+	/* The scraper may be gone already */
+	send( clientfd, header, strlen( header ), MSG_NOSIGNAL );
+	send( clientfd, body, len, MSG_NOSIGNAL );
+}
+
 void web_handler( int rc, int sock ) {
 	size_t clientfd;
 	IP clientaddr;
@@ -83,9 +106,10 @@ void web_handler( int rc, int sock ) {
 		*space = '\0';
 	}
 
+	/* Parameters are optional for 'GET /metrics' */
 	delim = strchr( cmd, '?' );
 	if( delim == NULL ) {
-		goto done;
+		params = cmd + strlen( cmd );
 	} else {
 		*delim = '\0';
 		params = delim + 1;
@@ -93,6 +117,11 @@ void web_handler( int rc, int sock ) {
 
 	log_debug( "WEB: cmd: '%s', params: '%s'\n", cmd, params);
 
+	if( match( cmd, "metrics" ) ) {
+		handle_metrics( clientfd );
+		goto done;
+	}
+
 	reply_buf[0] = '\n';
 	reply_buf[1] = '\0';
 
@@ -0,0 +1,191 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "hll.h"
+
+struct hll *hll_new( int p ) {
+	struct hll *hll;
+
+	if( p < HLL_MIN_P || p > HLL_MAX_P ) {
+		return NULL;
+	}
+
+	hll = (struct hll *) calloc( 1, sizeof(struct hll) + ((size_t) 1 << p) );
+	if( hll ) {
+		hll->p = p;
+	}
+
+	return hll;
+}
+
+void hll_free( struct hll *hll ) {
+	free( hll );
+}
+
+/* FNV-1a with a final mix, so that all bits depend on the input */
+uint64_t hll_hash( const void *data, size_t len ) {
+	const uint8_t *p;
+	uint64_t h;
+	size_t i;
+
+	p = (const uint8_t *) data;
+	h = 0xcbf29ce484222325ULL;
+	for( i = 0; i < len; i++ ) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+void hll_add( struct hll *hll, uint64_t hash ) {
+	uint64_t rest;
+	uint32_t idx;
+	uint8_t rank;
+
+	/* The first p bits select the register */
+	idx = hash >> (64 - hll->p);
+	rest = hash << hll->p;
+
+	/* Position of the first set bit in the remaining bits */
+	rank = rest ? (__builtin_clzll( rest ) + 1) : (64 - hll->p + 1);
+
+	if( rank > hll->reg[idx] ) {
+		hll->reg[idx] = rank;
+	}
+}
+
+int hll_merge( struct hll *dst, const struct hll *src ) {
+	size_t m, i;
+
+	if( dst->p != src->p ) {
+		return -1;
+	}
+
+	m = (size_t) 1 << dst->p;
+	for( i = 0; i < m; i++ ) {
+		if( src->reg[i] > dst->reg[i] ) {
+			dst->reg[i] = src->reg[i];
+		}
+	}
+
+	return 0;
+}
+
+double hll_estimate( const struct hll *hll ) {
+	double alpha;
+	double sum;
+	double est;
+	size_t zeros;
+	size_t m, i;
+
+	m = (size_t) 1 << hll->p;
+	switch( m ) {
+		case 16:
+			alpha = 0.673;
+			break;
+		case 32:
+			alpha = 0.697;
+			break;
+		case 64:
+			alpha = 0.709;
+			break;
+		default:
+			alpha = 0.7213 / (1.0 + 1.079 / m);
+	}
+
+	sum = 0.0;
+	zeros = 0;
+	for( i = 0; i < m; i++ ) {
+		sum += ldexp( 1.0, -hll->reg[i] );
+		if( hll->reg[i] == 0 ) {
+			zeros++;
+		}
+	}
+
+	est = alpha * m * m / sum;
+
+	/* Linear counting is more accurate for small sets */
+	if( est <= 2.5 * m && zeros > 0 ) {
+		est = m * log( (double) m / zeros );
+	}
+
+	return est;
+}
+
+static void hll_put16( uint8_t *p, uint16_t v ) {
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void hll_put32( uint8_t *p, uint32_t v ) {
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static uint16_t hll_get16( const uint8_t *p ) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t hll_get32( const uint8_t *p ) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+size_t hll_record_size( const struct hll *hll, size_t key_len ) {
+	return HLL_HEADER_SIZE + key_len + ((size_t) 1 << hll->p);
+}
+
+void hll_record_write( uint8_t *buf, int kind, uint32_t day,
+		const void *key, size_t key_len, const struct hll *hll ) {
+	hll_put32( buf, HLL_MAGIC );
+	buf[4] = kind;
+	buf[5] = hll->p;
+	hll_put16( buf + 6, key_len );
+	hll_put32( buf + 8, day );
+	memcpy( buf + HLL_HEADER_SIZE, key, key_len );
+	memcpy( buf + HLL_HEADER_SIZE + key_len, hll->reg, (size_t) 1 << hll->p );
+}
+
+long hll_record_read( const uint8_t *data, size_t len, struct hll_record *rec ) {
+	size_t key_len;
+	size_t m;
+	int p;
+
+	if( len < HLL_HEADER_SIZE || hll_get32( data ) != HLL_MAGIC ) {
+		return -1;
+	}
+
+	p = data[5];
+	key_len = hll_get16( data + 6 );
+	if( p < HLL_MIN_P || p > HLL_MAX_P || key_len > HLL_KEY_MAX ) {
+		return -1;
+	}
+
+	m = (size_t) 1 << p;
+	if( (len - HLL_HEADER_SIZE) < (key_len + m) ) {
+		return -1;
+	}
+
+	rec->hll = hll_new( p );
+	if( rec->hll == NULL ) {
+		return -1;
+	}
+
+	rec->kind = data[4];
+	rec->day = hll_get32( data + 8 );
+	rec->key = data + HLL_HEADER_SIZE;
+	rec->key_len = key_len;
+	memcpy( rec->hll->reg, data + HLL_HEADER_SIZE + key_len, m );
+
+	return HLL_HEADER_SIZE + key_len + m;
+}
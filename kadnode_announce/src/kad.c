@@ -6,6 +6,7 @@
 
 #include "log.h"
 #include "sha1.h"
+#include "sha1mb.h"
 #include "main.h"
 #include "utils.h"
 #include "conf.h"
@@ -13,6 +14,17 @@
 #include "results.h"
 #include "net.h"
 #include "values.h"
+#include "logq.h"
+#include "infohashes.h"
+#include "logsink.h"
+#include "sessions.h"
+#include "uniques.h"
+#include "observe.h"
+#include "ratelimit.h"
+#include "blacklist.h"
+#include "metrics.h"
+#include "latency.h"
+#include "capture.h"
 #ifdef AUTH
 #include "ext-auth.h"
 #endif
@@ -104,6 +116,21 @@ static struct result_node *result_node_add(struct search *sr,
     return new;
 }
 
+
+/* Pass the ack ratio and replication time of an announcement to its value */
+static void kad_announce_done( struct search *sr ) {
+	int acked, sent, i;
+
+	acked = 0;
+	sent = 0;
+	for( i = 0; i < sr->numnodes; i++ ) {
+		acked += __builtin_popcount( sr->nodes[i].acked );
+		sent += __builtin_popcount( sr->nodes[i].sent );
+	}
+
+	values_announced( sr->id, acked, sent,
+		sr->replicated_time ? (int) (sr->replicated_time - sr->announce_time) : -1 );
+}
     
 /* Hajime
  * Kadnode originally just added the address to the result list or called
@@ -112,7 +139,7 @@ static struct result_node *result_node_add(struct search *sr,
  * entire list.
  */
 /* This callback is called when a search result arrives or a search completes */
-void dht_callback_func( void *closure, int event, struct search *sr, 
+static void dht_callback_results( void *closure, int event, struct search *sr, 
         const void *data, size_t data_len, struct node *from_node) {
 	struct results_t *results;
 	IP addr;
@@ -121,12 +148,17 @@ void dht_callback_func( void *closure, int event, struct search *sr,
     char buf0[257], buf1[257];
     UCHAR *info_hash = sr->id;
     struct result_node *rn;
+    struct hll *payload_hll, *node_hll;
 	
     results = results_find( info_hash );
 	
     //if no reults struct found, this is an announce search
     if( results == NULL ) {
         values_debug_print("No results for %s. Announce search\n", str_id(sr->id, buf0));
+        if( sr->numports > 0 && (event == DHT_EVENT_SEARCH_DONE ||
+                event == DHT_EVENT_SEARCH_DONE6) ) {
+            kad_announce_done( sr );
+        }
 		return;
 	}
 
@@ -151,6 +183,10 @@ void dht_callback_func( void *closure, int event, struct search *sr,
     // or add a new one
     rn = result_node_add(sr, from_node);
 
+    // Sketches of distinct seeders for the payload and the result node
+    payload_hll = uniques_payload(results->filename);
+    node_hll = uniques_node(from_node->id);
+
     // Add results to result set of the result node and the 
     // overall infohash search
 	switch( event ) {
@@ -160,6 +196,7 @@ void dht_callback_func( void *closure, int event, struct search *sr,
                 num_returned_results = (data_len / sizeof(dht_addr4_t));
 				for( i = 0; i < num_returned_results; i++ ) {
 					to_addr( &addr, &data4[i].addr, 4, data4[i].port );
+					uniques_add( payload_hll, node_hll, &addr );
 					new_results += results_add_addr( results, &addr );
 					new_node_results += results_add_addr( rn->results, &addr );
 				}
@@ -171,12 +208,16 @@ void dht_callback_func( void *closure, int event, struct search *sr,
                 num_returned_results = (data_len / sizeof(dht_addr6_t));
 				for( i = 0; i < num_returned_results; i++ ) {
 					to_addr( &addr, &data6[i].addr, 16, data6[i].port );
+					uniques_add( payload_hll, node_hll, &addr );
 					new_results += results_add_addr( results, &addr );
 					new_node_results += results_add_addr( rn->results, &addr );
 				}
 			}
 			break;
 	}
+
+	metrics_add( METRIC_RESULTS, num_returned_results );
+	metrics_add( METRIC_RESULTS_NEW, new_results );
     
     // Update info for result node
     struct timeval now;
@@ -217,6 +258,16 @@ void dht_callback_func( void *closure, int event, struct search *sr,
     }
 }
 
+/* Time the handling of search events (latency.c) */
+void dht_callback_func( void *closure, int event, struct search *sr,
+		const void *data, size_t data_len, struct node *from_node ) {
+	uint64_t start;
+
+	start = latency_now();
+	dht_callback_results( closure, event, sr, data, data_len, from_node );
+	latency_add( LATENCY_CALLBACK, start );
+}
+
 /*
 * Lookup in values we announce ourselves.
 * Useful for networks of only one node, also faster.
@@ -324,6 +375,7 @@ void dht_hash( void *hash_return, int hash_size,
 		const void *v1, int len1,
 		const void *v2, int len2,
 		const void *v3, int len3 ) {
+	UCHAR digest[SHA1_BIN_LENGTH];
 	SHA1_CTX ctx;
 
 	SHA1_Init( &ctx );
@@ -331,7 +383,9 @@ void dht_hash( void *hash_return, int hash_size,
 	if(v2) SHA1_Update( &ctx, v2, len2 );
 	if(v3) SHA1_Update( &ctx, v3, len3 );
 
-	SHA1_Final( &ctx, hash_return );
+	/* Tokens are shorter than a digest */
+	SHA1_Final( &ctx, digest );
+	memcpy( hash_return, digest, (hash_size < SHA1_BIN_LENGTH) ? hash_size : SHA1_BIN_LENGTH );
 }
 
 int dht_random_bytes( void *buf, size_t size ) {
@@ -366,6 +420,8 @@ void kad_setup( void ) {
 	if( dht_init( s4, s6, node_id, (UCHAR*) "KN\0\0") < 0 ) {
 		log_err( "KAD: Failed to initialize the DHT." );
 	}
+
+	dht_set_replicas( gconf->announce_replicas );
 }
 
 void kad_free( void ) {
@@ -396,6 +452,44 @@ int kad_count_nodes( int good ) {
 
 #define bprintf(...) (written += snprintf( buf+written, size-written, __VA_ARGS__))
 
+/* Set the gauges of the DHT and print all metrics */
+int kad_metrics( char *buf, int size ) {
+	struct search *srch;
+	struct result_node *rn;
+	struct storage *strg;
+	uint64_t bytes, records;
+	int numsearches_active = 0;
+	int numresult_nodes = 0;
+	int numstorage_peers = 0;
+
+	for( srch = searches; srch != NULL; srch = srch->next ) {
+		if( srch->done ) {
+			continue;
+		}
+		numsearches_active++;
+		for( rn = srch->result_nodes; rn != NULL; rn = rn->next ) {
+			numresult_nodes++;
+		}
+	}
+
+	for( strg = storage; strg != NULL; strg = strg->next ) {
+		numstorage_peers += strg->numpeers;
+	}
+
+	logq_depth( &bytes, &records );
+
+	metrics_set( METRIC_NODES, kad_count_nodes( 0 ) );
+	metrics_set( METRIC_NODES_GOOD, kad_count_nodes( 1 ) );
+	metrics_set( METRIC_SEARCHES, numsearches_active );
+	metrics_set( METRIC_RESULT_NODES, numresult_nodes );
+	metrics_set( METRIC_STORAGE_PEERS, numstorage_peers );
+	metrics_set( METRIC_BLACKLISTED, blacklist_count() );
+	metrics_set( METRIC_LOGQ_BYTES, bytes );
+	metrics_set( METRIC_LOGQ_RECORDS, records );
+
+	return metrics_print( buf, size );
+}
+
 int kad_status( char *buf, int size ) {
 	char hexbuf[SHA1_HEX_LENGTH+1];
 	struct storage *strg = storage;
@@ -441,8 +535,22 @@ int kad_status( char *buf, int size ) {
 	bprintf( "DHT Searches: %d active, %d completed (max %d)\n",
 		numsearches_active, numsearches_done, DHT_MAX_SEARCHES );
 	bprintf( "DHT Blacklist: %d (max %d)\n",
-		(next_blacklisted % DHT_MAX_BLACKLISTED), DHT_MAX_BLACKLISTED );
+		blacklist_count(), BLACKLIST_SIZE );
+	bprintf( "DHT Served tokens: %lu hits, %lu misses\n",
+		served_token_hits, served_token_misses );
 	bprintf( "DHT Values to announce: %d\n", numvalues );
+	bprintf( "DHT Token cache: %d infohashes, %d hits, %d misses\n",
+		numtokencaches, token_cache_hits, token_cache_misses );
+	bprintf( "Infohash SHA-1: %s\n", sha1mb_impl() );
+	if( gconf->session_timeout > 0 ) {
+		bprintf( "Seeder sessions: %d open\n", sessions_count() );
+	}
+	written += logq_status( buf + written, size - written );
+	written += logsink_status( buf + written, size - written );
+	written += uniques_status( buf + written, size - written );
+	written += observe_status( buf + written, size - written );
+	written += ratelimit_status( buf + written, size - written );
+	written += capture_status( buf + written, size - written );
 
 	return written;
 }
@@ -462,18 +570,42 @@ int kad_ping( const IP* addr ) {
 * that this node can satisfy the given id on the given port.
 */
 int kad_announce_once( const UCHAR id[], int port ) {
+	return kad_announce_ports( id, port, 1 );
+}
 
-	if( port < 1 || port > 65535 ) {
+/*
+* Announce the ports port..port+count-1 for the given id.
+* The closest nodes are searched only once for all ports.
+*/
+int kad_announce_ports( const UCHAR id[], int port, int count ) {
+	unsigned short ports[SEARCH_PORTS];
+	int i;
+
+	if( port < 1 || count < 1 || count > SEARCH_PORTS || port + count - 1 > 65535 ) {
 		return -1;
 	}
 
+	for( i = 0; i < count; i++ ) {
+		ports[i] = port + i;
+	}
+
 	dht_lock();
-	dht_search( id, port, gconf->af, dht_callback_func, NULL );
+	dht_search_ports( id, ports, count, gconf->af, dht_callback_func, NULL );
 	dht_unlock();
 
 	return 0;
 }
 
+int kad_refresh_tokens( const UCHAR id[] ) {
+	int rc;
+
+	dht_lock();
+	rc = dht_refresh_tokens( id, gconf->af );
+	dht_unlock();
+
+	return rc;
+}
+
 /*
 * Add a new value to the announcement list or refresh an announcement.
 */
@@ -579,23 +711,17 @@ int kad_lookup_node( const char query[], IP *addr_return ) {
 	dht_lock();
 
 	rc = 1;
-	sr = searches;
-	while( sr ) {
-		if( sr->af == gconf->af && id_equal( sr->id, id ) ) {
-			for( i = 0; i < sr->numnodes; ++i ) {
-				if( id_equal( sr->nodes[i].id, id ) ) {
-					memcpy( addr_return, &sr->nodes[i].ss, sizeof(IP) );
-					rc = 0;
-					goto done;
-				}
+	sr = idmap_lookup( id, SEARCH_SLOT( gconf->af ) );
+	if( sr ) {
+		for( i = 0; i < sr->numnodes; ++i ) {
+			if( id_equal( sr->nodes[i].id, id ) ) {
+				memcpy( addr_return, &sr->nodes[i].ss, sizeof(IP) );
+				rc = 0;
+				break;
 			}
-			break;
 		}
-		sr = sr->next;
 	}
 
-	done:;
-
 	dht_unlock();
 
 	return rc;
@@ -693,7 +819,10 @@ void kad_debug_searches( int fd ) {
 	for( j = 0; s != NULL; ++j ) {
 		dprintf( fd, " Search: %s\n", str_id( s->id, hexbuf ) );
 		dprintf( fd, "  af: %s\n", (s->af == AF_INET) ? "AF_INET" : "AF_INET6" );
-		dprintf( fd, "  port: %hu\n", s->port );
+		dprintf( fd, "  ports: %d\n", s->numports );
+		if( s->numports > 0 ) {
+			dprintf( fd, "  first port: %hu\n", s->ports[0] );
+		}
 		dprintf( fd, "  done: %d\n", s->done );
 		for(i = 0; i < s->numnodes; ++i) {
 			struct search_node *sn = &s->nodes[i];
@@ -701,7 +830,8 @@ void kad_debug_searches( int fd ) {
 			dprintf( fd, "    addr: %s\n", str_addr( &sn->ss, addrbuf ) );
 			dprintf( fd, "    pinged: %d\n", sn->pinged );
 			dprintf( fd, "    replied: %d\n", sn->replied );
-			dprintf( fd, "    acked: %d\n", sn->acked );
+			dprintf( fd, "    acked: 0x%x\n", sn->acked );
+			dprintf( fd, "    sent: 0x%x\n", sn->sent );
 		}
 		dprintf( fd, "  Found %d nodes.\n", i );
 		s = s->next;
@@ -739,17 +869,8 @@ void kad_debug_storage( int fd ) {
 }
 
 void kad_debug_blacklist( int fd ) {
-	char addrbuf[FULL_ADDSTRLEN+1];
-	int i;
-
 	dht_lock();
-
-	for( i = 0; i < (next_blacklisted % DHT_MAX_BLACKLISTED); i++ ) {
-		dprintf( fd, " %s\n", str_addr( &blacklist[i], addrbuf ) );
-	}
-
-	dprintf( fd, " Found %d blacklisted addresses.\n", i );
-
+	blacklist_debug( fd );
 	dht_unlock();
 }
 
@@ -764,35 +885,28 @@ void kad_debug_constants( int fd ) {
 	dprintf( fd, "DHT_MAX_PEERS: %d\n", DHT_MAX_PEERS );
 
 	/* maximum number of blacklisted nodes */
-	dprintf( fd, "DHT_MAX_BLACKLISTED: %d\n", DHT_MAX_BLACKLISTED );
+	dprintf( fd, "BLACKLIST_SIZE: %d\n", BLACKLIST_SIZE );
 }
 
 /* Hajime
  * Log info to a file. Start a new logfile each day, and append
  * the date to the filename. What is logged is determined by 
- * DEBUG macros defined in kad.h.
+ * DEBUG macros defined in kad.h. The file is written by the
+ * log writer thread (logq.c).
  */
 void log_print(const char *str, ...){
-    char time_str[26];
-
-    // Get the current time in utc for timestamp
+    char line[LOGQ_LINE_MAX];
     time_t now;
-    struct tm *utc_time;
-    time(&now);
-    utc_time = gmtime(&now);
-    strftime(time_str, 26, "%F", utc_time); 
-    
-    //open logfile for result infohash
-    char filename[257];
-    errno = 0;
-    snprintf(filename, sizeof(filename), "lookup_log_%s.log", time_str);
-    FILE *log = fopen(filename, "a");
+    int len;
 
-    fprintf(log, "%ld: ", time_now_sec());
+    now = time_now_sec();
+    len = snprintf(line, sizeof(line), "%ld: ", now);
 
     va_list arglist;
     va_start(arglist,str);
-    vfprintf(log,str,arglist);
+    vsnprintf(line + len, sizeof(line) - len, str, arglist);
     va_end(arglist);
-    fclose(log);
+
+    // Written by the log writer thread
+    logq_printf(LOGQ_DEBUG, now, "%s", line);
 }
@@ -2,24 +2,42 @@
 #ifndef _KAD_H_
 #define _KAD_H_
 
-/* File with Hajime payload data. Expects each line to be of the form
- *      <infohash> <payload_name> <date_used_to_construct_infohash>
- * This is generated by running update_infohashes.sh
+/* Hajime config file. The infohashes to announce are computed from the
+ * module names in its [modules] section (infohashes.c).
+ * Can be changed with --modules-file.
  */
-#define HASH_FILENAME "/home/ubuntu/hajime_dht_measurement/config/infohashes.txt"
+#define MODULES_FILENAME "/home/ubuntu/hajime_dht_measurement/config/config.file"
 #define LOOKUP_DATA_DIR "/home/ubuntu/hajime_dht_measurement/data/lookup"
 #define RESULT_NODE_DATA_DIR "/home/ubuntu/hajime_dht_measurement/data/result_nodes"
 
+/* Directory where the leechers of the capture (capture.c) are written to
+ */
+#define ANNOUNCE_DATA_DIR "/home/ubuntu/hajime_dht_measurement/data/announce"
+
+/* Directory where the get_peers / announce_peer requests for Hajime
+ * infohashes that reach this node (observe.c) are written to
+ */
+#define OBSERVED_DATA_DIR ANNOUNCE_DATA_DIR
+
 /* File keeping the infohash to port mapping to enable the uTP server to 
  * translate a port from a connection back to a Hajime payload infohash
  */
 #define PORT_MAP_FILENAME "/home/ubuntu/hajime_dht_measurement/config/port_map.txt"
 #define PORT_TMP_FILENAME "/home/ubuntu/hajime_dht_measurement/config/port_map_tmp.txt"
 
+/* Memory-mapped copy of the port map for capture processes (portshm.h)
+ */
+#define PORTMAP_SHM_FILENAME "/dev/shm/kadnode_port_map"
+
 /* Number of ports each infohash will be announced on
  */
 #define PORTS_PER_ANNOUNCE 10
 
+/* Distance between the first ports of two infohashes. The scripts
+ * map a port back to its range with port / 50 * 50.
+ */
+#define PORT_INCREMENT 50
+
 /* Max and min port numbers that can be used for the announcements
  */
 #define MIN_PORT 20000
@@ -89,6 +107,9 @@ int kad_export_nodes( IP addr_array[], size_t *addr_num );
 /* Print status information */
 int kad_status( char *buf, int len );
 
+/* Print the metrics in the Prometheus text format (metrics.c) */
+int kad_metrics( char *buf, int len );
+
 /* Count good or all known peers */
 int kad_count_nodes( int good );
 
@@ -98,6 +119,12 @@ int kad_count_nodes( int good );
 */
 int kad_announce_once( const UCHAR id[], int port );
 
+/* Announce count consecutive ports from a single search */
+int kad_announce_ports( const UCHAR id[], int port, int count );
+
+/* Ask the nodes that got the last announcement of id for new tokens */
+int kad_refresh_tokens( const UCHAR id[] );
+
 /* Announce query until lifetime expires. */
 int kad_announce( const char query[], int port, time_t lifetime );
 
@@ -0,0 +1,430 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "klog.h"
+
+/* Size of the dictionary hash tables (power of two) */
+#define KLOG_TABLE_SIZE 65536
+
+/* Columns of a block */
+enum {
+	KLOG_COL_TIME,
+	KLOG_COL_REF,
+	KLOG_COL_NODE,
+	KLOG_COL_COUNT,
+	KLOG_COL_NEW,
+	KLOG_COL_NO_NEW,
+	KLOG_COL_SEQUENTIAL,
+	KLOG_COL_SET_SIZE,
+	KLOG_COL_IP,
+	KLOG_COL_PORT,
+	KLOG_COLS
+};
+
+struct klog_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+struct klog_block {
+	int kind;
+	uint32_t flags;
+	uint32_t rows;
+	uint32_t addrs;
+	uint32_t time_first;
+	uint32_t time_last;
+	/* Infohashes (with payload and date for seeders) */
+	struct klog_buf dict;
+	uint32_t dict_num;
+	uint32_t dict_table[KLOG_TABLE_SIZE];
+	/* Nodes that sent results */
+	struct klog_buf nodes;
+	uint32_t nodes_num;
+	uint32_t nodes_table[KLOG_TABLE_SIZE];
+	struct klog_buf cols[KLOG_COLS];
+	/* Encoded block */
+	struct klog_buf out;
+};
+
+static char *klog_hex( const uint8_t id[], char buf[] ) {
+	static const char hexchars[] = "0123456789abcdef";
+	int i;
+
+	for( i = 0; i < KLOG_ID_LEN; i++ ) {
+		buf[2 * i] = hexchars[id[i] >> 4];
+		buf[2 * i + 1] = hexchars[id[i] & 0xf];
+	}
+	buf[2 * KLOG_ID_LEN] = '\0';
+
+	return buf;
+}
+
+/* Same format as str_addr() */
+static char *klog_node_addr( const struct klog_node *node, char buf[] ) {
+	char ipbuf[INET6_ADDRSTRLEN+1];
+
+	switch( node->family ) {
+		case 4:
+			inet_ntop( AF_INET, node->ip, ipbuf, sizeof(ipbuf) );
+			sprintf( buf, "%s:%hu", ipbuf, node->port );
+			break;
+		case 6:
+			inet_ntop( AF_INET6, node->ip, ipbuf, sizeof(ipbuf) );
+			sprintf( buf, "[%s]:%hu", ipbuf, node->port );
+			break;
+		default:
+			sprintf( buf, "<invalid address>" );
+	}
+
+	return buf;
+}
+
+void klog_print_seeder( FILE *fp, time_t time, const struct klog_seeders *rec, const struct klog_addr4 *addr ) {
+	char hexbuf[2 * KLOG_ID_LEN + 1];
+	char ipbuf[INET_ADDRSTRLEN+1];
+
+	inet_ntop( AF_INET, addr->ip, ipbuf, sizeof(ipbuf) );
+
+	// timestamp payload_filename payload_hash_date infohash [seeder|leecher] ip port
+	fprintf( fp, "%ld %s %s %s seeder %s %hu\n",
+		(long) time, rec->payload, rec->date, klog_hex( rec->id, hexbuf ), ipbuf, addr->port );
+}
+
+void klog_print_result( FILE *fp, time_t time, const uint8_t id[], const struct klog_node *node, const struct klog_addr4 *addr ) {
+	char hexbuf0[2 * KLOG_ID_LEN + 1];
+	char hexbuf1[2 * KLOG_ID_LEN + 1];
+	char addrbuf[INET6_ADDRSTRLEN + 16];
+	char ipbuf[INET_ADDRSTRLEN+1];
+
+	inet_ntop( AF_INET, addr->ip, ipbuf, sizeof(ipbuf) );
+
+	fprintf( fp, "%ld %s %s %s %s %hu\n",
+		(long) time, klog_hex( id, hexbuf0 ), klog_node_addr( node, addrbuf ),
+		klog_hex( node->id, hexbuf1 ), ipbuf, addr->port );
+}
+
+void klog_print_summary( FILE *fp, time_t time, const struct klog_result_node *rec ) {
+	char hexbuf0[2 * KLOG_ID_LEN + 1];
+	char hexbuf1[2 * KLOG_ID_LEN + 1];
+	char addrbuf[INET6_ADDRSTRLEN + 16];
+
+	fprintf( fp, "#%ld %s %s %s Total seeders: %u new_results_responses: %d "
+		"no_new_results_responses: %d (%d sequential)",
+		(long) time, klog_hex( rec->id, hexbuf0 ), klog_hex( rec->node.id, hexbuf1 ),
+		klog_node_addr( &rec->node, addrbuf ),
+		rec->count, rec->new_responses, rec->no_new_responses, rec->sequential );
+
+	if( rec->flags & KLOG_F_SET_SIZE ) {
+		fprintf( fp, " result_set_size: %d\n", rec->set_size );
+	} else {
+		fprintf( fp, "\n" );
+	}
+}
+
+void klog_print_record( FILE *fp, int kind, time_t time, const void *data ) {
+	const struct klog_result_node *rn;
+	const struct klog_seeders *sd;
+	const struct klog_addr4 *addr;
+	uint32_t i;
+
+	if( kind == KLOG_SEEDERS ) {
+		sd = (const struct klog_seeders *) data;
+		addr = (const struct klog_addr4 *) (sd + 1);
+		for( i = 0; i < sd->count; i++ ) {
+			klog_print_seeder( fp, time, sd, &addr[i] );
+		}
+	} else if( kind == KLOG_RESULT_NODES ) {
+		rn = (const struct klog_result_node *) data;
+		addr = (const struct klog_addr4 *) (rn + 1);
+		for( i = 0; i < rn->count; i++ ) {
+			klog_print_result( fp, time, rn->id, &rn->node, &addr[i] );
+		}
+		klog_print_summary( fp, time, rn );
+	}
+}
+
+uint16_t klog_get16( const uint8_t *p ) {
+	return p[0] | (p[1] << 8);
+}
+
+uint32_t klog_get32( const uint8_t *p ) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+uint64_t klog_get64( const uint8_t *p ) {
+	return klog_get32( p ) | ((uint64_t) klog_get32( p + 4 ) << 32);
+}
+
+static void klog_put( struct klog_buf *buf, const void *data, size_t len ) {
+	size_t size;
+
+	if( buf->len + len > buf->size ) {
+		size = buf->size ? buf->size : 4096;
+		while( size < buf->len + len ) {
+			size *= 2;
+		}
+		buf->data = realloc( buf->data, size );
+		buf->size = size;
+	}
+
+	memcpy( buf->data + buf->len, data, len );
+	buf->len += len;
+}
+
+static void klog_put16( struct klog_buf *buf, uint16_t v ) {
+	uint8_t b[2] = { v & 0xff, v >> 8 };
+	klog_put( buf, b, 2 );
+}
+
+static void klog_put32( struct klog_buf *buf, uint32_t v ) {
+	uint8_t b[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24 };
+	klog_put( buf, b, 4 );
+}
+
+static void klog_put64( struct klog_buf *buf, uint64_t v ) {
+	klog_put32( buf, v & 0xffffffff );
+	klog_put32( buf, v >> 32 );
+}
+
+/*
+* Find or insert an entry of a dictionary. Ids are random,
+* so the first bytes serve as hash. Returns the entry index.
+*/
+static uint32_t klog_dict_ref( struct klog_buf *buf, uint32_t *num, uint32_t table[],
+		const void *entry, size_t entry_size ) {
+	const uint8_t *cur;
+	uint32_t h;
+
+	h = klog_get32( entry ) & (KLOG_TABLE_SIZE - 1);
+	while( table[h] ) {
+		cur = buf->data + (table[h] - 1) * entry_size;
+		if( memcmp( cur, entry, entry_size ) == 0 ) {
+			return table[h] - 1;
+		}
+		h = (h + 1) & (KLOG_TABLE_SIZE - 1);
+	}
+
+	klog_put( buf, entry, entry_size );
+	table[h] = ++(*num);
+
+	return *num - 1;
+}
+
+struct klog_block *klog_block_new( int kind ) {
+	struct klog_block *block;
+
+	block = (struct klog_block *) calloc( 1, sizeof(struct klog_block) );
+	block->kind = kind;
+
+	return block;
+}
+
+int klog_block_rows( const struct klog_block *block ) {
+	return block->rows;
+}
+
+static void klog_block_time( struct klog_block *block, time_t time ) {
+	if( block->rows == 0 ) {
+		block->time_first = time;
+	}
+	block->time_last = time;
+}
+
+static void klog_block_addrs( struct klog_block *block, const struct klog_addr4 *addr, uint32_t count ) {
+	uint32_t i;
+
+	for( i = 0; i < count; i++ ) {
+		klog_put( &block->cols[KLOG_COL_IP], addr[i].ip, 4 );
+		klog_put16( &block->cols[KLOG_COL_PORT], addr[i].port );
+	}
+	block->addrs += count;
+}
+
+void klog_block_add( struct klog_block *block, time_t time, const void *data ) {
+	const struct klog_result_node *rn;
+	const struct klog_seeders *sd;
+	struct klog_seeders entry;
+	struct klog_node node;
+	uint32_t ref;
+	uint32_t i;
+
+	if( block->kind == KLOG_SEEDERS ) {
+		sd = (const struct klog_seeders *) data;
+		if( sd->count == 0 ) {
+			return;
+		}
+
+		/* Dictionary entries are compared as a whole */
+		memset( &entry, 0, sizeof(entry) );
+		memcpy( entry.id, sd->id, KLOG_ID_LEN );
+		snprintf( entry.date, sizeof(entry.date), "%s", sd->date );
+		snprintf( entry.payload, sizeof(entry.payload), "%s", sd->payload );
+		ref = klog_dict_ref( &block->dict, &block->dict_num, block->dict_table, &entry, sizeof(entry) );
+
+		klog_block_time( block, time );
+		for( i = 0; i < sd->count; i++ ) {
+			klog_put32( &block->cols[KLOG_COL_TIME], time );
+			klog_put16( &block->cols[KLOG_COL_REF], ref );
+		}
+		klog_block_addrs( block, (const struct klog_addr4 *) (sd + 1), sd->count );
+		block->rows += sd->count;
+	} else {
+		rn = (const struct klog_result_node *) data;
+
+		memset( &node, 0, sizeof(node) );
+		memcpy( node.id, rn->node.id, KLOG_ID_LEN );
+		memcpy( node.ip, rn->node.ip, 16 );
+		node.port = rn->node.port;
+		node.family = rn->node.family;
+
+		klog_block_time( block, time );
+		if( block->rows == 0 ) {
+			block->flags = rn->flags;
+		}
+
+		ref = klog_dict_ref( &block->dict, &block->dict_num, block->dict_table, rn->id, KLOG_ID_LEN );
+		klog_put32( &block->cols[KLOG_COL_TIME], time );
+		klog_put16( &block->cols[KLOG_COL_REF], ref );
+		ref = klog_dict_ref( &block->nodes, &block->nodes_num, block->nodes_table, &node, sizeof(node) );
+		klog_put16( &block->cols[KLOG_COL_NODE], ref );
+		klog_put32( &block->cols[KLOG_COL_COUNT], rn->count );
+		klog_put32( &block->cols[KLOG_COL_NEW], rn->new_responses );
+		klog_put32( &block->cols[KLOG_COL_NO_NEW], rn->no_new_responses );
+		klog_put32( &block->cols[KLOG_COL_SEQUENTIAL], rn->sequential );
+		if( block->flags & KLOG_F_SET_SIZE ) {
+			klog_put32( &block->cols[KLOG_COL_SET_SIZE], rn->set_size );
+		}
+		klog_block_addrs( block, (const struct klog_addr4 *) (rn + 1), rn->count );
+		block->rows++;
+	}
+}
+
+static void klog_block_reset( struct klog_block *block ) {
+	int i;
+
+	if( block->dict_num ) {
+		memset( block->dict_table, 0, sizeof(block->dict_table) );
+	}
+	if( block->nodes_num ) {
+		memset( block->nodes_table, 0, sizeof(block->nodes_table) );
+	}
+
+	block->dict.len = 0;
+	block->dict_num = 0;
+	block->nodes.len = 0;
+	block->nodes_num = 0;
+	for( i = 0; i < KLOG_COLS; i++ ) {
+		block->cols[i].len = 0;
+	}
+	block->rows = 0;
+	block->addrs = 0;
+}
+
+/* Write the collected rows as one block and start a new one. Returns the bytes written. */
+int klog_block_write( struct klog_block *block, FILE *fp, struct klog_index *index ) {
+	const struct klog_seeders *sd;
+	const struct klog_node *node;
+	struct klog_buf *out;
+	uint32_t i;
+	uint8_t len;
+
+	if( block->rows == 0 ) {
+		return 0;
+	}
+
+	out = &block->out;
+	out->len = 0;
+
+	klog_put32( out, KLOG_BLOCK_MAGIC );
+	klog_put16( out, block->kind );
+	klog_put16( out, block->flags );
+	klog_put32( out, block->rows );
+	klog_put32( out, block->dict_num );
+	klog_put32( out, block->nodes_num );
+	klog_put32( out, block->addrs );
+	klog_put32( out, block->time_first );
+	klog_put32( out, block->time_last );
+
+	if( block->kind == KLOG_SEEDERS ) {
+		sd = (const struct klog_seeders *) block->dict.data;
+		for( i = 0; i < block->dict_num; i++ ) {
+			len = strlen( sd[i].payload );
+			klog_put( out, sd[i].id, KLOG_ID_LEN );
+			klog_put( out, sd[i].date, KLOG_DATE_LEN );
+			klog_put( out, &len, 1 );
+			klog_put( out, sd[i].payload, len );
+		}
+	} else {
+		klog_put( out, block->dict.data, block->dict.len );
+		node = (const struct klog_node *) block->nodes.data;
+		for( i = 0; i < block->nodes_num; i++ ) {
+			klog_put( out, node[i].id, KLOG_ID_LEN );
+			klog_put( out, &node[i].family, 1 );
+			klog_put( out, node[i].ip, 16 );
+			klog_put16( out, node[i].port );
+		}
+	}
+
+	for( i = 0; i < KLOG_COLS; i++ ) {
+		klog_put( out, block->cols[i].data, block->cols[i].len );
+	}
+
+	if( index ) {
+		index->offset = ftell( fp );
+		index->rows = block->rows;
+		index->time_first = block->time_first;
+		index->time_last = block->time_last;
+	}
+
+	klog_block_reset( block );
+
+	if( fwrite( out->data, 1, out->len, fp ) != out->len ) {
+		return -1;
+	}
+
+	return out->len;
+}
+
+int klog_footer_write( FILE *fp, const struct klog_index *index, uint32_t num ) {
+	struct klog_buf out;
+	uint32_t i;
+	int rc;
+
+	memset( &out, 0, sizeof(out) );
+	klog_put32( &out, KLOG_FOOTER_MAGIC );
+	klog_put32( &out, num );
+	for( i = 0; i < num; i++ ) {
+		klog_put64( &out, index[i].offset );
+		klog_put32( &out, index[i].rows );
+		klog_put32( &out, index[i].time_first );
+		klog_put32( &out, index[i].time_last );
+	}
+	klog_put32( &out, num );
+	klog_put32( &out, KLOG_END_MAGIC );
+
+	rc = (fwrite( out.data, 1, out.len, fp ) == out.len) ? out.len : -1;
+	free( out.data );
+
+	return rc;
+}
+
+void klog_block_free( struct klog_block *block ) {
+	int i;
+
+	if( block == NULL ) {
+		return;
+	}
+
+	free( block->dict.data );
+	free( block->nodes.data );
+	for( i = 0; i < KLOG_COLS; i++ ) {
+		free( block->cols[i].data );
+	}
+	free( block->out.data );
+	free( block );
+}
@@ -0,0 +1,125 @@
+
+#ifndef _KLOG_H_
+#define _KLOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+* Records of the seeder and result node logs and their
+* binary file format. Shared by the log writer thread
+* and kadnode-logcat, which converts binary files back
+* to the text format.
+*
+* A binary file is a sequence of blocks. When the writer
+* closes the file, it appends a footer with an index of the
+* blocks it has written since the file was opened. All
+* integers are little endian, IPv4 addresses are kept in
+* network byte order. In files written with --log-compress
+* the block offsets refer to the uncompressed data.
+*
+* Block header (32 bytes):
+*  u32 magic KLOG_BLOCK_MAGIC
+*  u16 kind (KLOG_SEEDERS / KLOG_RESULT_NODES)
+*  u16 flags (KLOG_F_*)
+*  u32 rows, u32 dict entries, u32 node entries, u32 addresses
+*  u32 time of the first row, u32 time of the last row
+* Block body (see klog_block_write):
+*  dictionary, node dictionary, one column after another
+*
+* Footer:
+*  u32 magic KLOG_FOOTER_MAGIC, u32 number of blocks
+*  per block: u64 offset, u32 rows, u32 first time, u32 last time
+*  u32 number of blocks, u32 magic KLOG_END_MAGIC
+*/
+
+#define KLOG_BLOCK_MAGIC 0x31424c4b /* "KLB1" */
+#define KLOG_FOOTER_MAGIC 0x31464c4b /* "KLF1" */
+#define KLOG_END_MAGIC 0x45464c4b /* "KLFE" */
+
+#define KLOG_HEADER_SIZE 32
+#define KLOG_INDEX_SIZE 20
+
+/* Block kinds */
+#define KLOG_SEEDERS 1
+#define KLOG_RESULT_NODES 2
+
+/* The result node summary includes result_set_size */
+#define KLOG_F_SET_SIZE 0x01
+
+/* A block is written when it holds this many rows */
+#define KLOG_BLOCK_ROWS 8192
+
+#define KLOG_ID_LEN 20
+#define KLOG_DATE_LEN 10
+/* Payload names are capped at NAME_MAX, the binary format stores the length in one byte */
+#define KLOG_PAYLOAD_LEN 255
+
+/* Address of a seeder */
+struct klog_addr4 {
+	uint8_t ip[4];
+	uint16_t port;
+};
+
+/* Node that sent results */
+struct klog_node {
+	uint8_t id[KLOG_ID_LEN];
+	uint8_t ip[16];
+	uint16_t port;
+	uint8_t family; /* 4 or 6 */
+};
+
+/* Seeders found by a lookup, followed by count struct klog_addr4 */
+struct klog_seeders {
+	uint8_t id[KLOG_ID_LEN];
+	char date[KLOG_DATE_LEN + 1];
+	char payload[KLOG_PAYLOAD_LEN + 1];
+	uint32_t count;
+};
+
+/* Results from one node of a search, followed by count struct klog_addr4 */
+struct klog_result_node {
+	uint8_t id[KLOG_ID_LEN];
+	struct klog_node node;
+	int32_t new_responses;
+	int32_t no_new_responses;
+	int32_t sequential;
+	int32_t set_size;
+	uint32_t flags;
+	uint32_t count;
+};
+
+/* Block index entry of the footer */
+struct klog_index {
+	uint64_t offset;
+	uint32_t rows;
+	uint32_t time_first;
+	uint32_t time_last;
+};
+
+/* Text output in the format of the daily log files */
+void klog_print_seeder( FILE *fp, time_t time, const struct klog_seeders *rec, const struct klog_addr4 *addr );
+void klog_print_result( FILE *fp, time_t time, const uint8_t id[], const struct klog_node *node, const struct klog_addr4 *addr );
+void klog_print_summary( FILE *fp, time_t time, const struct klog_result_node *rec );
+
+/* Print all lines of a record */
+void klog_print_record( FILE *fp, int kind, time_t time, const void *data );
+
+/* Collects records of one kind and writes them as a block */
+struct klog_block;
+
+struct klog_block *klog_block_new( int kind );
+void klog_block_add( struct klog_block *block, time_t time, const void *data );
+int klog_block_rows( const struct klog_block *block );
+int klog_block_write( struct klog_block *block, FILE *fp, struct klog_index *index );
+void klog_block_free( struct klog_block *block );
+
+int klog_footer_write( FILE *fp, const struct klog_index *index, uint32_t num );
+
+/* Little endian helpers */
+uint16_t klog_get16( const uint8_t *p );
+uint32_t klog_get32( const uint8_t *p );
+uint64_t klog_get64( const uint8_t *p );
+
+#endif /* _KLOG_H_ */
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "main.h"
+#include "latency.h"
+
+/* Values below LATENCY_SUB_BUCKETS get a bucket each, then LATENCY_SUB_BUCKETS per power of two */
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS * 63)
+
+struct latency_hist_t {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[LATENCY_BUCKETS];
+};
+
+static struct latency_hist_t g_hists[LATENCY_TYPES];
+
+static const char *g_type_names[LATENCY_TYPES] = {
+	"dht_periodic packet",
+	"dht_periodic timers",
+	"search_step",
+	"dht_callback_func",
+	"log_lookup_results",
+	"result_nodes_done",
+	"net_loop iteration"
+};
+
+static int latency_bucket( uint64_t ns ) {
+	int e;
+
+	if( ns < LATENCY_SUB_BUCKETS ) {
+		return ns;
+	}
+
+	/* Highest set bit and the two bits below it */
+	e = 63 - __builtin_clzll( ns );
+	return LATENCY_SUB_BUCKETS * (e - 1) + ((ns >> (e - 2)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* Largest value of a bucket */
+static uint64_t latency_bucket_max( int i ) {
+	int e;
+
+	if( i < LATENCY_SUB_BUCKETS ) {
+		return i;
+	}
+
+	e = i / LATENCY_SUB_BUCKETS + 1;
+	return ((uint64_t) (LATENCY_SUB_BUCKETS + i % LATENCY_SUB_BUCKETS + 1) << (e - 2)) - 1;
+}
+
+static uint64_t latency_percentile( const struct latency_hist_t *hist, int percent ) {
+	uint64_t rank;
+	uint64_t sum;
+	uint64_t value;
+	int i;
+
+	if( hist->count == 0 ) {
+		return 0;
+	}
+
+	rank = (hist->count * percent + 99) / 100;
+	sum = 0;
+	for( i = 0; i < LATENCY_BUCKETS; i++ ) {
+		sum += hist->buckets[i];
+		if( sum >= rank ) {
+			break;
+		}
+	}
+
+	value = latency_bucket_max( i );
+	return (value < hist->max) ? value : hist->max;
+}
+
+static const char *latency_str( uint64_t ns, char buf[] ) {
+	if( ns < 1000 ) {
+		sprintf( buf, "%lluns", (unsigned long long) ns );
+	} else if( ns < 1000000 ) {
+		sprintf( buf, "%.1fus", ns / 1e3 );
+	} else if( ns < 1000000000 ) {
+		sprintf( buf, "%.1fms", ns / 1e6 );
+	} else {
+		sprintf( buf, "%.2fs", ns / 1e9 );
+	}
+
+	return buf;
+}
+
+uint64_t latency_now( void ) {
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t latency_add( int type, uint64_t start ) {
+	struct latency_hist_t *hist;
+	uint64_t now;
+	uint64_t ns;
+
+	now = latency_now();
+	ns = now - start;
+
+	hist = &g_hists[type];
+	hist->buckets[latency_bucket( ns )]++;
+	hist->count++;
+	if( ns > hist->max ) {
+		hist->max = ns;
+	}
+
+	return now;
+}
+
+int latency_print( char *buf, int size ) {
+	char p50buf[16], p99buf[16], maxbuf[16];
+	const struct latency_hist_t *hist;
+	int written;
+	int i;
+
+	written = 0;
+
+#define lprintf(...) \
+	if( written < size ) { written += snprintf( buf + written, size - written, __VA_ARGS__ ); }
+
+	lprintf( "Latency (count, p50, p99, max):\n" );
+	for( i = 0; i < LATENCY_TYPES; i++ ) {
+		hist = &g_hists[i];
+		lprintf( " %s: %llu %s %s %s\n", g_type_names[i], (unsigned long long) hist->count,
+			latency_str( latency_percentile( hist, 50 ), p50buf ),
+			latency_str( latency_percentile( hist, 99 ), p99buf ),
+			latency_str( hist->max, maxbuf ) );
+	}
+
+#undef lprintf
+
+	return (written < size) ? written : (size - 1);
+}
+
+void latency_reset( void ) {
+	memset( g_hists, 0, sizeof(g_hists) );
+}
@@ -0,0 +1,39 @@
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+
+/*
+* Fixed bucket latency histograms of the event loop, to see
+* where the time goes when the lookup rounds fall behind.
+* Times are taken from CLOCK_MONOTONIC in nanoseconds. Each
+* power of two is split into LATENCY_SUB_BUCKETS buckets, so a
+* percentile is the upper end of its bucket, at most 19% above
+* the real value; the maximum is exact. The histograms are only
+* used by the DHT thread.
+*/
+
+#define LATENCY_PACKET 0 /* dht_periodic with a packet */
+#define LATENCY_TIMERS 1 /* Timer path of dht_periodic, if a timer was due */
+#define LATENCY_SEARCH_STEP 2 /* search_step */
+#define LATENCY_CALLBACK 3 /* dht_callback_func */
+#define LATENCY_LOG_RESULTS 4 /* log_lookup_results */
+#define LATENCY_RESULT_NODES 5 /* result_nodes_done */
+#define LATENCY_NET_LOOP 6 /* net_loop iteration, without the wait in select */
+#define LATENCY_TYPES 7
+
+#define LATENCY_SUB_BUCKETS 4
+
+/* Current time in nanoseconds */
+uint64_t latency_now( void );
+
+/* Add the time since start to a histogram. Returns the current time. */
+uint64_t latency_add( int type, uint64_t start );
+
+/* Print count, p50, p99 and max of each histogram */
+int latency_print( char *buf, int size );
+
+void latency_reset( void );
+
+#endif /* _LATENCY_H_ */
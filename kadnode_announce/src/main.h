@@ -22,6 +22,23 @@
 #define NSS_PORT "4053"
 #define WEB_PORT "8053"
 
+/* Seconds between fsync of the measurement logs */
+#define LOG_FSYNC_DEFAULT 60
+
+/* Format of the seeder and result node logs */
+#define LOG_FORMAT_TEXT 0
+#define LOG_FORMAT_BINARY 1
+
+/* Days before and after the current UTC day to compute infohashes for */
+#define INFOHASH_WINDOW_DEFAULT 2
+
+/* Minutes a seeder may be absent before its session is closed */
+#define SESSION_TIMEOUT_DEFAULT 0
+
+/* Closest nodes each announcement is stored on (at most SEARCH_NODES of dht.h) */
+#define ANNOUNCE_REPLICAS_DEFAULT 8
+#define ANNOUNCE_REPLICAS_MAX 16
+
 #define QUERY_TLD_DEFAULT ".p2p"
 #define QUERY_MAX_SIZE 512
 
@@ -20,6 +20,7 @@
 #include "utils.h"
 #include "net.h"
 #include "kad.h"
+#include "latency.h"
 
 #define RECV_BUF_SIZE 1048576
 
@@ -177,6 +178,7 @@ void net_loop( void ) {
 	fd_set fds_working;
 	fd_set fds;
 	int max_fd = -1;
+	uint64_t start;
 
 	struct timeval tv;
 
@@ -215,6 +217,9 @@ void net_loop( void ) {
 			}
 		}
 
+		/* Time the handlers, not the wait */
+		start = latency_now();
+
 		for( i = 0; i < numtasks; ++i ) {
 			struct task_t *task = &tasks[i];
 			if( task->fd >= 0 && FD_ISSET( task->fd, &fds_working ) ) {
@@ -223,6 +228,8 @@ void net_loop( void ) {
 				task->callback( 0, task->fd );
 			}
 		}
+
+		latency_add( LATENCY_NET_LOOP, start );
 	}
 
 	/* Close sockets and FDs */
@@ -0,0 +1,105 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "main.h"
+#include "utils.h"
+#include "logq.h"
+#include "infohashes.h"
+#include "observe.h"
+
+/* Length of the interval the rates are computed over */
+#define OBSERVE_INTERVAL 60
+
+struct observe_counter_t {
+	unsigned long total; /* All requests */
+	unsigned long matched; /* Requests for Hajime infohashes */
+	unsigned long interval_total;
+	unsigned long interval_matched;
+	unsigned long rate_total; /* Requests of the last full interval */
+	unsigned long rate_matched;
+};
+
+static struct observe_counter_t g_counters[OBSERVE_TYPES];
+
+/* Start of the current interval */
+static time_t g_interval = 0;
+
+static const char *g_type_names[OBSERVE_TYPES] = {
+	"get_peers",
+	"announce_peer"
+};
+
+/* Move the counts of the current interval to the rates */
+static void observe_interval( time_t now ) {
+	int last;
+	int i;
+
+	if( now < g_interval + OBSERVE_INTERVAL ) {
+		return;
+	}
+
+	/* The counts are only a rate if the interval just ended */
+	last = (g_interval && now < g_interval + 2 * OBSERVE_INTERVAL);
+
+	for( i = 0; i < OBSERVE_TYPES; i++ ) {
+		g_counters[i].rate_total = last ? g_counters[i].interval_total : 0;
+		g_counters[i].rate_matched = last ? g_counters[i].interval_matched : 0;
+		g_counters[i].interval_total = 0;
+		g_counters[i].interval_matched = 0;
+	}
+
+	g_interval = now - (now % OBSERVE_INTERVAL);
+}
+
+void observe_message( int type, const UCHAR info_hash[], const struct sockaddr *from, unsigned short port ) {
+	char ipbuf[INET6_ADDRSTRLEN+1];
+	const struct infohash_t *ih;
+	struct observe_counter_t *counter;
+	unsigned short source_port;
+	time_t now;
+
+	now = time_now_sec();
+	observe_interval( now );
+
+	counter = &g_counters[type];
+	counter->total++;
+	counter->interval_total++;
+
+	ih = infohashes_find( info_hash );
+	if( ih == NULL ) {
+		return;
+	}
+
+	counter->matched++;
+	counter->interval_matched++;
+
+	if( from->sa_family == AF_INET ) {
+		inet_ntop( AF_INET, &((const IP4 *) from)->sin_addr, ipbuf, sizeof(ipbuf) );
+		source_port = ntohs( ((const IP4 *) from)->sin_port );
+	} else {
+		inet_ntop( AF_INET6, &((const IP6 *) from)->sin6_addr, ipbuf, sizeof(ipbuf) );
+		source_port = ntohs( ((const IP6 *) from)->sin6_port );
+	}
+
+	logq_printf( LOGQ_OBSERVED, now, "%ld %s %s %s %s %s %hu\n",
+		(long) now, ih->payload, ih->date, ih->hex, g_type_names[type], ipbuf, port ? port : source_port );
+}
+
+int observe_status( char *buf, int size ) {
+	const struct observe_counter_t *gp;
+	const struct observe_counter_t *ap;
+
+	observe_interval( time_now_sec() );
+
+	gp = &g_counters[OBSERVE_GET_PEERS];
+	ap = &g_counters[OBSERVE_ANNOUNCE_PEER];
+
+	return snprintf( buf, size,
+		"Observed get_peers: %lu (%lu Hajime), %lu/min (%lu Hajime/min)\n"
+		"Observed announce_peer: %lu (%lu Hajime), %lu/min (%lu Hajime/min)\n",
+		gp->total, gp->matched, gp->rate_total, gp->rate_matched,
+		ap->total, ap->matched, ap->rate_total, ap->rate_matched );
+}
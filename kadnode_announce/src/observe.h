@@ -0,0 +1,31 @@
+
+#ifndef _OBSERVE_H_
+#define _OBSERVE_H_
+
+#include <sys/socket.h>
+
+#include "main.h"
+
+/*
+* Passive observation of the get_peers and announce_peer requests
+* other nodes send us. The info_hash of every request is looked up
+* in the infohash set of infohashes.c, and requests for Hajime
+* infohashes are logged to OBSERVED_DATA_DIR/observed_<date>.log:
+*   timestamp payload date infohash get_peers|announce_peer ip port
+* The port is the source port for get_peers and the announced
+* port for announce_peer.
+*/
+
+#define OBSERVE_GET_PEERS 0
+#define OBSERVE_ANNOUNCE_PEER 1
+#define OBSERVE_TYPES 2
+
+/*
+* Called by the DHT for every valid get_peers / announce_peer request.
+* port is the announced port, or 0 to log the source port.
+*/
+void observe_message( int type, const UCHAR info_hash[], const struct sockaddr *from, unsigned short port );
+
+int observe_status( char *buf, int size );
+
+#endif /* _OBSERVE_H_ */
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "main.h"
+#include "kad.h"
+#include "pcapfile.h"
+#include "utpsyn.h"
+
+const char *usage = MAIN_SRVNAME" pcap Converter - Write the uTP SYNs of leechers in pcap files as leecher logs.\n\n"
+"Usage: pcap2log [OPTIONS]* -f|-d <pcap file>|<pcap directory> [<output directory>]\n"
+"\n"
+" -f <file>	Convert a single capture file.\n"
+" -d <dir>	Convert all files of a directory, several at once.\n"
+" -m <file>	Port map file to map ports to infohashes.\n"
+"		Default: "PORT_MAP_FILENAME"\n"
+" -j <num>	Number of files to convert at once in directory mode.\n"
+"		Default: number of cores\n"
+" -h		Print this help.\n"
+"\n"
+"Lines are appended to <output directory>/<date>.log (default: the current\n"
+"directory), the same output as scripts/announce/pcap_to_log_tuples.py.\n"
+"\n";
+
+#define PORTMAP_SIZE ((MAX_PORT - MIN_PORT) / PORT_INCREMENT + 1)
+
+/* Field lengths of the port map file */
+#define PAYLOAD_LEN 256
+#define DATE_LEN 10
+
+/* Range of the port map file */
+struct range {
+	int used;
+	char id_hex[SHA1_HEX_LENGTH+1];
+	char payload[PAYLOAD_LEN+1];
+	char date[DATE_LEN+1];
+};
+
+static struct range g_ranges[PORTMAP_SIZE];
+
+/* Files of directory mode */
+struct job {
+	char *path;
+	char *buf; /* Output lines */
+	size_t len;
+	int status; /* Return value of convert_file */
+	int done;
+};
+
+static struct job *g_jobs = NULL;
+static size_t g_jobs_num = 0;
+static size_t g_jobs_next = 0;
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+
+static int load_port_map( const char path[] ) {
+	char id_hex[SHA1_HEX_LENGTH+1];
+	char payload[PAYLOAD_LEN+1];
+	char date[DATE_LEN+1];
+	char line[512];
+	struct range *range;
+	FILE *fp;
+	int port;
+
+	fp = fopen( path, "r" );
+	if( fp == NULL ) {
+		fprintf( stderr, "Failed to open %s: %s\n", path, strerror( errno ) );
+		return -1;
+	}
+
+	/* Later lines win for the same range */
+	while( fgets( line, sizeof(line), fp ) ) {
+		if( sscanf( line, "%d %40s %256s %10s", &port, id_hex, payload, date ) != 4
+				|| port < MIN_PORT || port > MAX_PORT ) {
+			fprintf( stderr, "Error parsing line %s", line );
+			continue;
+		}
+
+		range = &g_ranges[(port - MIN_PORT) / PORT_INCREMENT];
+		range->used = 1;
+		strcpy( range->id_hex, id_hex );
+		strcpy( range->payload, payload );
+		strcpy( range->date, date );
+	}
+
+	fclose( fp );
+
+	return 0;
+}
+
+/* Write the leecher lines of a capture file */
+static int convert_file( const char path[], FILE *out ) {
+	char line[512];
+	struct pcapfile_t pf;
+	struct utpsyn_t syn;
+	struct range *range;
+	const uint8_t *data;
+	size_t len;
+	time_t time;
+
+	if( pcapfile_open( &pf, path ) < 0 ) {
+		fprintf( stderr, "Failed to read pcap file %s.\n", path );
+		return 1;
+	}
+
+	while( pcapfile_next( &pf, &time, &data, &len ) ) {
+		if( utpsyn_parse_frame( &syn, pf.linktype, data, len ) < 0 ) {
+			continue;
+		}
+
+		range = &g_ranges[(syn.dport - MIN_PORT) / PORT_INCREMENT];
+		if( !range->used ) {
+			continue;
+		}
+
+		utpsyn_format( line, sizeof(line), time, &syn, range->id_hex, range->payload, range->date );
+		fputs( line, out );
+	}
+
+	pcapfile_close( &pf );
+
+	return 0;
+}
+
+static void *convert_worker( void *arg ) {
+	struct job *job;
+	FILE *out;
+	size_t i;
+
+	for( ;; ) {
+		i = __atomic_fetch_add( &g_jobs_next, 1, __ATOMIC_RELAXED );
+		if( i >= g_jobs_num ) {
+			break;
+		}
+
+		job = &g_jobs[i];
+		out = open_memstream( &job->buf, &job->len );
+		if( out ) {
+			job->status = convert_file( job->path, out );
+			fclose( out );
+		} else {
+			fprintf( stderr, "Failed to convert %s: %s\n", job->path, strerror( errno ) );
+			job->status = 1;
+		}
+
+		pthread_mutex_lock( &g_mutex );
+		job->done = 1;
+		pthread_cond_broadcast( &g_cond );
+		pthread_mutex_unlock( &g_mutex );
+	}
+
+	return NULL;
+}
+
+/* Convert the files of a directory in parallel and write the lines in directory order */
+static int convert_dir( const char path[], FILE *out, int threads_num ) {
+	struct dirent *entry;
+	pthread_t *threads;
+	struct job *jobs;
+	size_t size;
+	size_t i;
+	DIR *dir;
+	int created;
+	int rc;
+	int n;
+
+	dir = opendir( path );
+	if( dir == NULL ) {
+		fprintf( stderr, "Failed to open %s: %s\n", path, strerror( errno ) );
+		return 1;
+	}
+
+	size = 0;
+	while( (entry = readdir( dir )) != NULL ) {
+		if( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 ) {
+			continue;
+		}
+
+		if( g_jobs_num == size ) {
+			size = size ? (2 * size) : 64;
+			jobs = realloc( g_jobs, size * sizeof(struct job) );
+			if( jobs == NULL ) {
+				break;
+			}
+			g_jobs = jobs;
+		}
+
+		memset( &g_jobs[g_jobs_num], 0, sizeof(struct job) );
+		g_jobs[g_jobs_num].path = malloc( strlen( path ) + strlen( entry->d_name ) + 2 );
+		if( g_jobs[g_jobs_num].path == NULL ) {
+			break;
+		}
+		sprintf( g_jobs[g_jobs_num].path, "%s/%s", path, entry->d_name );
+		g_jobs_num++;
+	}
+	closedir( dir );
+
+	if( entry != NULL ) {
+		fprintf( stderr, "Out of memory while reading %s\n", path );
+		for( i = 0; i < g_jobs_num; i++ ) {
+			free( g_jobs[i].path );
+		}
+		free( g_jobs );
+		return 1;
+	}
+
+	if( g_jobs_num == 0 ) {
+		fprintf( stderr, "No files found in %s\n", path );
+		return 1;
+	}
+
+	/* Without any worker thread the files are converted here */
+	created = 0;
+	threads = calloc( threads_num, sizeof(pthread_t) );
+	for( n = 0; threads && n < threads_num; n++ ) {
+		rc = pthread_create( &threads[created], NULL, &convert_worker, NULL );
+		if( rc != 0 ) {
+			fprintf( stderr, "Failed to start thread: %s\n", strerror( rc ) );
+			break;
+		}
+		created++;
+	}
+
+	if( created == 0 ) {
+		convert_worker( NULL );
+	}
+
+	/* Write each file as soon as it and all files before it are done */
+	rc = 0;
+	for( i = 0; i < g_jobs_num; i++ ) {
+		pthread_mutex_lock( &g_mutex );
+		while( !g_jobs[i].done ) {
+			pthread_cond_wait( &g_cond, &g_mutex );
+		}
+		pthread_mutex_unlock( &g_mutex );
+
+		if( g_jobs[i].buf ) {
+			fwrite( g_jobs[i].buf, 1, g_jobs[i].len, out );
+		}
+		if( g_jobs[i].status != 0 ) {
+			rc = 1;
+		}
+		free( g_jobs[i].buf );
+		free( g_jobs[i].path );
+	}
+
+	for( n = 0; n < created; n++ ) {
+		pthread_join( threads[n], NULL );
+	}
+
+	free( threads );
+	free( g_jobs );
+
+	return rc;
+}
+
+int main( int argc, char **argv ) {
+	const char *port_map = PORT_MAP_FILENAME;
+	const char *file = NULL;
+	const char *dir = NULL;
+	const char *output_dir = NULL;
+	char output[1024];
+	char date[DATE_LEN+1];
+	struct tm utc;
+	time_t now;
+	FILE *out;
+	int threads_num;
+	int rc;
+	int i;
+
+	threads_num = sysconf( _SC_NPROCESSORS_ONLN );
+
+	for( i = 1; i < argc; i++ ) {
+		if( strcmp( argv[i], "-h" ) == 0 ) {
+			fprintf( stdout, "%s", usage );
+			return 0;
+		} else if( strcmp( argv[i], "-f" ) == 0 && i + 1 < argc ) {
+			file = argv[++i];
+		} else if( strcmp( argv[i], "-d" ) == 0 && i + 1 < argc ) {
+			dir = argv[++i];
+		} else if( strcmp( argv[i], "-m" ) == 0 && i + 1 < argc ) {
+			port_map = argv[++i];
+		} else if( strcmp( argv[i], "-j" ) == 0 && i + 1 < argc ) {
+			threads_num = atoi( argv[++i] );
+		} else if( output_dir == NULL && argv[i][0] != '-' ) {
+			output_dir = argv[i];
+		} else {
+			fprintf( stderr, "%s", usage );
+			return 1;
+		}
+	}
+
+	if( (file == NULL) == (dir == NULL) ) {
+		fprintf( stderr, "%s", usage );
+		return 1;
+	}
+
+	if( threads_num < 1 ) {
+		threads_num = 1;
+	}
+
+	if( load_port_map( port_map ) < 0 ) {
+		return 1;
+	}
+
+	/* Named after the day of the conversion */
+	now = time( NULL );
+	gmtime_r( &now, &utc );
+	strftime( date, sizeof(date), "%F", &utc );
+	if( output_dir ) {
+		snprintf( output, sizeof(output), "%s/%s.log", output_dir, date );
+	} else {
+		snprintf( output, sizeof(output), "%s.log", date );
+	}
+
+	out = fopen( output, "a" );
+	if( out == NULL ) {
+		fprintf( stderr, "Failed to open %s: %s\n", output, strerror( errno ) );
+		return 1;
+	}
+
+	if( file ) {
+		rc = convert_file( file, out );
+	} else {
+		rc = convert_dir( dir, out, threads_num );
+	}
+
+	fclose( out );
+
+	return rc;
+}
@@ -0,0 +1,102 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcapfile.h"
+
+#define PCAPFILE_MAGIC_US 0xa1b2c3d4
+#define PCAPFILE_MAGIC_NS 0xa1b23c4d
+
+#define PCAPFILE_HEADER_SIZE 24
+#define PCAPFILE_RECORD_SIZE 16
+
+static uint32_t pcapfile_get32( const struct pcapfile_t *pf, const uint8_t *p ) {
+	uint32_t v;
+
+	memcpy( &v, p, sizeof(v) );
+	return pf->swapped ? __builtin_bswap32( v ) : v;
+}
+
+int pcapfile_open( struct pcapfile_t *pf, const char path[] ) {
+	struct stat st;
+	void *data;
+	uint32_t magic;
+	int fd;
+
+	memset( pf, 0, sizeof(struct pcapfile_t) );
+
+	fd = open( path, O_RDONLY );
+	if( fd < 0 ) {
+		return -1;
+	}
+
+	if( fstat( fd, &st ) != 0 || st.st_size < PCAPFILE_HEADER_SIZE ) {
+		close( fd );
+		return -1;
+	}
+
+	data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+
+	if( data == MAP_FAILED ) {
+		return -1;
+	}
+
+	/* Records are read once from start to end */
+	madvise( data, st.st_size, MADV_SEQUENTIAL );
+
+	pf->data = data;
+	pf->size = st.st_size;
+
+	memcpy( &magic, pf->data, sizeof(magic) );
+	if( magic == __builtin_bswap32( PCAPFILE_MAGIC_US ) || magic == __builtin_bswap32( PCAPFILE_MAGIC_NS ) ) {
+		pf->swapped = 1;
+		magic = __builtin_bswap32( magic );
+	}
+
+	if( magic != PCAPFILE_MAGIC_US && magic != PCAPFILE_MAGIC_NS ) {
+		pcapfile_close( pf );
+		return -1;
+	}
+
+	pf->linktype = pcapfile_get32( pf, pf->data + 20 ) & 0xffff;
+	pf->offset = PCAPFILE_HEADER_SIZE;
+
+	return 0;
+}
+
+int pcapfile_next( struct pcapfile_t *pf, time_t *time, const uint8_t **data, size_t *len ) {
+	const uint8_t *rec;
+	uint32_t caplen;
+
+	if( pf->offset + PCAPFILE_RECORD_SIZE > pf->size ) {
+		return 0;
+	}
+
+	rec = pf->data + pf->offset;
+	caplen = pcapfile_get32( pf, rec + 8 );
+
+	if( caplen > pf->size - pf->offset - PCAPFILE_RECORD_SIZE ) {
+		return 0;
+	}
+
+	/* Only whole seconds are logged, the fraction is ignored */
+	*time = pcapfile_get32( pf, rec );
+	*data = rec + PCAPFILE_RECORD_SIZE;
+	*len = caplen;
+
+	pf->offset += PCAPFILE_RECORD_SIZE + caplen;
+
+	return 1;
+}
+
+void pcapfile_close( struct pcapfile_t *pf ) {
+	if( pf->data ) {
+		munmap( (void *) pf->data, pf->size );
+		pf->data = NULL;
+	}
+}
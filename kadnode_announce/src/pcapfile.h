@@ -0,0 +1,36 @@
+
+#ifndef _PCAPFILE_H_
+#define _PCAPFILE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+* Read classic pcap files (as written by tcpdump) through
+* a read-only memory map, one record at a time. Files in
+* either byte order and with micro- or nanosecond
+* timestamps are supported; pcapng is not.
+* Shared by the capture module and pcap2log.
+*/
+
+struct pcapfile_t {
+	const uint8_t *data;
+	size_t size;
+	size_t offset; /* Next record */
+	int swapped; /* Written on a host of the other byte order */
+	int linktype;
+};
+
+/* Map a file and read the header. Returns -1 on error. */
+int pcapfile_open( struct pcapfile_t *pf, const char path[] );
+
+/*
+* Get the next record. Returns 1 for a record, 0 at the end of the
+* file or at a record that was not completely written yet.
+*/
+int pcapfile_next( struct pcapfile_t *pf, time_t *time, const uint8_t **data, size_t *len );
+
+void pcapfile_close( struct pcapfile_t *pf );
+
+#endif /* _PCAPFILE_H_ */
@@ -0,0 +1,306 @@
+#define _WITH_DPRINTF
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "main.h"
+#include "log.h"
+#include "utils.h"
+#include "kad.h"
+#include "results.h"
+#include "values.h"
+#include "portmap.h"
+#include "portshm.h"
+
+#define PORTMAP_RANGES ((MAX_PORT - MIN_PORT) / PORT_INCREMENT)
+#define PORTMAP_WORDS ((PORTMAP_RANGES + 63) / 64)
+
+#define PORTMAP_DAY (24 * 60 * 60)
+
+struct portmap_range_t {
+	UCHAR id[SHA1_BIN_LENGTH];
+	char payload[MAX_FILENAME_LEN+1];
+	char date[DATE_LEN+1];
+	time_t expires; /* Free the range after this time */
+};
+
+/* Set bits are ranges in use */
+static uint64_t g_used[PORTMAP_WORDS];
+static struct portmap_range_t g_ranges[PORTMAP_RANGES];
+static int g_count = 0;
+
+/* Search for a free range starts after the last allocated one */
+static int g_next = 0;
+
+/* Ranges changed since the last snapshot */
+static int g_dirty = 0;
+
+static int portmap_used( int i ) {
+	return (g_used[i / 64] >> (i % 64)) & 1;
+}
+
+static int portmap_port( int i ) {
+	return MIN_PORT + i * PORT_INCREMENT;
+}
+
+/* Range of a port or -1 */
+static int portmap_index( int port ) {
+	if( port < MIN_PORT || port >= MAX_PORT || (port - MIN_PORT) % PORT_INCREMENT ) {
+		return -1;
+	}
+
+	return (port - MIN_PORT) / PORT_INCREMENT;
+}
+
+/* Start of the UTC day of a YYYY-MM-DD date */
+static time_t portmap_date_time( const char date[] ) {
+	struct tm tm;
+
+	memset( &tm, 0, sizeof(tm) );
+	if( sscanf( date, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday ) != 3 ) {
+		return 0;
+	}
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+
+	return timegm( &tm );
+}
+
+static void portmap_set( int i, const UCHAR id[], const char payload[], const char date[] ) {
+	struct portmap_range_t *range;
+
+	range = &g_ranges[i];
+	memcpy( range->id, id, SHA1_BIN_LENGTH );
+	snprintf( range->payload, sizeof(range->payload), "%s", payload );
+	snprintf( range->date, sizeof(range->date), "%s", date );
+	range->expires = portmap_date_time( date ) + PORTMAP_KEEP_DAYS * PORTMAP_DAY;
+	portshm_set( i, id, range->payload, range->date );
+
+	if( !portmap_used( i ) ) {
+		g_used[i / 64] |= (uint64_t) 1 << (i % 64);
+		g_count++;
+	}
+
+	g_dirty = 1;
+}
+
+static void portmap_clear( int i ) {
+	g_used[i / 64] &= ~((uint64_t) 1 << (i % 64));
+	portshm_clear( i );
+	g_count--;
+	g_dirty = 1;
+}
+
+/* First free range at or after start, wrapping around */
+static int portmap_find_free( int start ) {
+	uint64_t free_bits;
+	int n, w, i;
+
+	for( n = 0; n <= PORTMAP_WORDS; n++ ) {
+		w = (start / 64 + n) % PORTMAP_WORDS;
+		free_bits = ~g_used[w];
+
+		/* Skip ranges before start in the first word */
+		if( n == 0 ) {
+			free_bits &= ~(uint64_t) 0 << (start % 64);
+		}
+
+		if( free_bits ) {
+			i = w * 64 + __builtin_ctzll( free_bits );
+			if( i < PORTMAP_RANGES ) {
+				return i;
+			}
+		}
+	}
+
+	return -1;
+}
+
+int portmap_alloc( const UCHAR id[], const char payload[], const char date[] ) {
+	char hexbuf[SHA1_HEX_LENGTH+1];
+	char today[DATE_LEN+1];
+	struct tm utc;
+	time_t now;
+	int i;
+
+	/* Keep the range of the last run */
+	for( i = 0; i < PORTMAP_RANGES; i++ ) {
+		if( portmap_used( i ) && memcmp( g_ranges[i].id, id, SHA1_BIN_LENGTH ) == 0 ) {
+			return portmap_port( i );
+		}
+	}
+
+	/* Take back an expired range that was not given to another infohash */
+	for( i = 0; i < PORTMAP_RANGES; i++ ) {
+		if( !portmap_used( i ) && memcmp( g_ranges[i].id, id, SHA1_BIN_LENGTH ) == 0 ) {
+			break;
+		}
+	}
+
+	if( i == PORTMAP_RANGES ) {
+		i = portmap_find_free( g_next );
+	}
+	if( i < 0 ) {
+		log_warn( "PORT: No free port range for %s.", str_id( id, hexbuf ) );
+		return -1;
+	}
+
+	/* Values announced from the console have no payload and date */
+	if( date == NULL ) {
+		now = time_now_sec();
+		gmtime_r( &now, &utc );
+		strftime( today, sizeof(today), "%F", &utc );
+		date = today;
+	}
+
+	portmap_set( i, id, payload ? payload : "-", date );
+	g_next = (i + 1) % PORTMAP_RANGES;
+
+	return portmap_port( i );
+}
+
+int portmap_find( int port, const UCHAR **id, const char **payload, const char **date ) {
+	int i;
+
+	if( port < MIN_PORT || port >= MAX_PORT ) {
+		return -1;
+	}
+
+	i = (port - MIN_PORT) / PORT_INCREMENT;
+	if( !portmap_used( i ) ) {
+		return -1;
+	}
+
+	*id = g_ranges[i].id;
+	*payload = g_ranges[i].payload;
+	*date = g_ranges[i].date;
+
+	return 0;
+}
+
+void portmap_expire( void ) {
+	time_t now;
+	int i;
+
+	now = time_now_sec();
+	for( i = 0; i < PORTMAP_RANGES; i++ ) {
+		if( !portmap_used( i ) ) {
+			continue;
+		}
+
+		/* Still announced, keep the range for PORTMAP_KEEP_DAYS after the last check */
+		if( values_find( g_ranges[i].id ) ) {
+			if( g_ranges[i].expires < now + PORTMAP_KEEP_DAYS * PORTMAP_DAY ) {
+				g_ranges[i].expires = now + PORTMAP_KEEP_DAYS * PORTMAP_DAY;
+			}
+			continue;
+		}
+
+		if( g_ranges[i].expires <= now ) {
+			portmap_clear( i );
+		}
+	}
+}
+
+void portmap_save( void ) {
+	char hexbuf[SHA1_HEX_LENGTH+1];
+	FILE *fp;
+	int i;
+
+	if( !g_dirty ) {
+		return;
+	}
+
+	fp = fopen( PORT_TMP_FILENAME, "w" );
+	if( fp == NULL ) {
+		log_warn( "PORT: Failed to write %s: %s", PORT_TMP_FILENAME, strerror( errno ) );
+		return;
+	}
+
+	for( i = 0; i < PORTMAP_RANGES; i++ ) {
+		if( portmap_used( i ) ) {
+			fprintf( fp, "%d %s %s %s\n", portmap_port( i ),
+				str_id( g_ranges[i].id, hexbuf ), g_ranges[i].payload, g_ranges[i].date );
+		}
+	}
+
+	/* Readers see either the old or the new file */
+	if( fflush( fp ) != 0 || fsync( fileno( fp ) ) != 0 ) {
+		log_warn( "PORT: Failed to write %s: %s", PORT_TMP_FILENAME, strerror( errno ) );
+		fclose( fp );
+		return;
+	}
+	fclose( fp );
+
+	if( rename( PORT_TMP_FILENAME, PORT_MAP_FILENAME ) != 0 ) {
+		log_warn( "PORT: Failed to replace %s: %s", PORT_MAP_FILENAME, strerror( errno ) );
+		return;
+	}
+
+	g_dirty = 0;
+}
+
+int portmap_count( void ) {
+	return g_count;
+}
+
+void portmap_debug( int fd ) {
+	char hexbuf[SHA1_HEX_LENGTH+1];
+	int i;
+
+	for( i = 0; i < PORTMAP_RANGES; i++ ) {
+		if( portmap_used( i ) ) {
+			dprintf( fd, " %d-%d %s %s %s\n", portmap_port( i ), portmap_port( i ) + PORTS_PER_ANNOUNCE - 1,
+				str_id( g_ranges[i].id, hexbuf ), g_ranges[i].payload, g_ranges[i].date );
+		}
+	}
+
+	dprintf( fd, " Found %d port ranges in use (max %d).\n", g_count, PORTMAP_RANGES );
+}
+
+void portmap_setup( void ) {
+	char hex[SHA1_HEX_LENGTH+1];
+	char payload[MAX_FILENAME_LEN+1];
+	char date[DATE_LEN+1];
+	char line[512];
+	UCHAR id[SHA1_BIN_LENGTH];
+	FILE *fp;
+	int port;
+	int i;
+
+	portshm_setup();
+
+	fp = fopen( PORT_MAP_FILENAME, "r" );
+	if( fp == NULL ) {
+		return;
+	}
+
+	/* Later lines of older files win for the same range */
+	while( fgets( line, sizeof(line), fp ) ) {
+		if( sscanf( line, "%d %40s %256s %10s", &port, hex, payload, date ) != 4
+				|| !str_isHex( hex, SHA1_HEX_LENGTH ) || (i = portmap_index( port )) < 0 ) {
+			continue;
+		}
+
+		bytes_from_hex( id, hex, SHA1_HEX_LENGTH );
+		portmap_set( i, id, payload, date );
+		g_next = (i + 1) % PORTMAP_RANGES;
+	}
+
+	fclose( fp );
+
+	portmap_expire();
+	portmap_save();
+
+	log_info( "PORT: %d port ranges of the last run.", g_count );
+}
+
+void portmap_free( void ) {
+	portmap_save();
+	portshm_free();
+}
@@ -0,0 +1,46 @@
+
+#ifndef _PORTMAP_H_
+#define _PORTMAP_H_
+
+#include "main.h"
+
+/*
+* Port ranges of the announced infohashes. MIN_PORT..MAX_PORT
+* is divided into ranges of PORT_INCREMENT ports. Each announced
+* infohash gets a free range, which is kept while the infohash is
+* announced and until PORTMAP_KEEP_DAYS after its date and after
+* the announcements stopped, so that late connections can still
+* be mapped back to it.
+*
+* The ranges are persisted in PORT_MAP_FILENAME, one
+* "<first port> <infohash> <payload> <date>" line per range, which
+* the uTP server and the scripts read. The file is replaced
+* atomically and only written when a range changed. Capture
+* processes on the same host can also read the ranges from the
+* shared memory map of portshm.h.
+*/
+
+#define PORTMAP_KEEP_DAYS 3
+
+/* Get the range of an infohash or allocate a new one. Returns the first port or -1. */
+int portmap_alloc( const UCHAR id[], const char payload[], const char date[] );
+
+/* Get the range of any port of a PORT_INCREMENT block. Returns -1 if the port is not mapped. */
+int portmap_find( int port, const UCHAR **id, const char **payload, const char **date );
+
+/* Free the ranges that are no longer announced and past PORTMAP_KEEP_DAYS */
+void portmap_expire( void );
+
+/* Write the snapshot file if any range changed */
+void portmap_save( void );
+
+/* Number of ranges in use */
+int portmap_count( void );
+
+void portmap_debug( int fd );
+
+/* Read the ranges of the last run */
+void portmap_setup( void );
+void portmap_free( void );
+
+#endif /* _PORTMAP_H_ */
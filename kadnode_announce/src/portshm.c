@@ -0,0 +1,184 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "main.h"
+#include "log.h"
+#include "kad.h"
+#include "portshm.h"
+
+static struct portshm_t *g_shm = NULL;
+
+/* Mark the map as changing */
+static void portshm_write_begin( void ) {
+	__atomic_store_n( &g_shm->seq, g_shm->seq + 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+}
+
+static void portshm_write_end( void ) {
+	__atomic_store_n( &g_shm->seq, g_shm->seq + 1, __ATOMIC_RELEASE );
+}
+
+void portshm_set( int range, const uint8_t id[], const char payload[], const char date[] ) {
+	struct portshm_range_t *entry;
+	int i;
+
+	if( g_shm == NULL || range < 0 || range >= PORTSHM_RANGES ) {
+		return;
+	}
+
+	portshm_write_begin();
+
+	entry = &g_shm->ranges[range];
+	memcpy( entry->id, id, sizeof(entry->id) );
+	entry->port = MIN_PORT + range * PORT_INCREMENT;
+	snprintf( entry->date, sizeof(entry->date), "%s", date );
+	snprintf( entry->payload, sizeof(entry->payload), "%s", payload );
+
+	for( i = 0; i < PORT_INCREMENT; i++ ) {
+		g_shm->slots[range * PORT_INCREMENT + i] = range + 1;
+	}
+
+	portshm_write_end();
+}
+
+void portshm_clear( int range ) {
+	int i;
+
+	if( g_shm == NULL || range < 0 || range >= PORTSHM_RANGES ) {
+		return;
+	}
+
+	portshm_write_begin();
+
+	for( i = 0; i < PORT_INCREMENT; i++ ) {
+		g_shm->slots[range * PORT_INCREMENT + i] = 0;
+	}
+
+	portshm_write_end();
+}
+
+const struct portshm_t *portshm_open( const char path[] ) {
+	struct portshm_t *shm;
+	int fd;
+
+	fd = open( path, O_RDONLY );
+	if( fd < 0 ) {
+		return NULL;
+	}
+
+	shm = mmap( NULL, sizeof(struct portshm_t), PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+
+	if( shm == MAP_FAILED ) {
+		return NULL;
+	}
+
+	if( shm->magic != PORTSHM_MAGIC || shm->version != PORTSHM_VERSION
+			|| shm->slots_num != PORTSHM_SLOTS || shm->ranges_num != PORTSHM_RANGES ) {
+		munmap( shm, sizeof(struct portshm_t) );
+		return NULL;
+	}
+
+	return shm;
+}
+
+void portshm_close( const struct portshm_t *shm ) {
+	munmap( (void *) shm, sizeof(struct portshm_t) );
+}
+
+int portshm_lookup( const struct portshm_t *shm, int port, struct portshm_range_t *range ) {
+	uint32_t seq1, seq2;
+	uint16_t slot;
+
+	slot = 0;
+
+	if( port < shm->min_port || port >= shm->min_port + PORTSHM_SLOTS ) {
+		return -1;
+	}
+
+	do {
+		seq1 = __atomic_load_n( &shm->seq, __ATOMIC_ACQUIRE );
+		if( seq1 & 1 ) {
+			continue;
+		}
+
+		slot = shm->slots[port - shm->min_port];
+		if( slot ) {
+			memcpy( range, &shm->ranges[slot - 1], sizeof(struct portshm_range_t) );
+		}
+
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+		seq2 = __atomic_load_n( &shm->seq, __ATOMIC_RELAXED );
+	} while( (seq1 & 1) || seq1 != seq2 );
+
+	if( slot == 0 ) {
+		return -1;
+	}
+
+	/* The strings are not terminated if read during an update */
+	range->date[PORTSHM_DATE_LEN] = '\0';
+	range->payload[PORTSHM_PAYLOAD_LEN] = '\0';
+
+	return 0;
+}
+
+void portshm_setup( void ) {
+	struct portshm_t *shm;
+	int fd;
+
+	/*
+	* The file is reused and not truncated, since readers
+	* of the last run may still have it mapped.
+	*/
+	fd = open( PORTMAP_SHM_FILENAME, O_RDWR | O_CREAT, 0644 );
+	if( fd < 0 ) {
+		log_warn( "PORT: Failed to create %s: %s", PORTMAP_SHM_FILENAME, strerror( errno ) );
+		return;
+	}
+
+	if( ftruncate( fd, sizeof(struct portshm_t) ) != 0 ) {
+		log_warn( "PORT: Failed to create %s: %s", PORTMAP_SHM_FILENAME, strerror( errno ) );
+		close( fd );
+		return;
+	}
+
+	shm = mmap( NULL, sizeof(struct portshm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+
+	if( shm == MAP_FAILED ) {
+		log_warn( "PORT: Failed to map %s: %s", PORTMAP_SHM_FILENAME, strerror( errno ) );
+		return;
+	}
+
+	g_shm = shm;
+
+	/* An odd seq is left by a writer that did not finish */
+	if( shm->seq & 1 ) {
+		shm->seq++;
+	}
+
+	/* Start empty; portmap.c adds the ranges */
+	portshm_write_begin();
+	memset( shm->slots, 0, sizeof(shm->slots) );
+	memset( shm->ranges, 0, sizeof(shm->ranges) );
+	shm->version = PORTSHM_VERSION;
+	shm->min_port = MIN_PORT;
+	shm->slots_num = PORTSHM_SLOTS;
+	shm->ranges_num = PORTSHM_RANGES;
+	shm->magic = PORTSHM_MAGIC;
+	portshm_write_end();
+}
+
+void portshm_free( void ) {
+	/* The file stays for captures processed after shutdown */
+	if( g_shm ) {
+		munmap( g_shm, sizeof(struct portshm_t) );
+		g_shm = NULL;
+	}
+}
@@ -0,0 +1,69 @@
+
+#ifndef _PORTSHM_H_
+#define _PORTSHM_H_
+
+#include <stdint.h>
+
+#include "main.h"
+#include "kad.h"
+
+/*
+* The port ranges of portmap.c published in a memory-mapped file
+* (PORTMAP_SHM_FILENAME), so that a capture process on the same host
+* can map the destination port of a connection to its infohash
+* without reading the port map file.
+*
+* The file holds a header, a flat array with one slot per port of
+* MIN_PORT..MAX_PORT and a table of the ranges. A slot is the range
+* number + 1, or 0 if the port is not mapped. All ports of a
+* PORT_INCREMENT block map to the range starting at the block.
+*
+* The announce node is the only writer. Changes are made under a
+* sequence lock: seq is odd while a change is in progress, and readers
+* retry until they have read the same even seq before and after
+* copying an entry. All numbers are in host byte order.
+*/
+
+#define PORTSHM_MAGIC 0x4d50484b /* "KHPM" */
+#define PORTSHM_VERSION 1
+
+#define PORTSHM_SLOTS (MAX_PORT - MIN_PORT)
+#define PORTSHM_RANGES (PORTSHM_SLOTS / PORT_INCREMENT)
+
+#define PORTSHM_PAYLOAD_LEN 256
+#define PORTSHM_DATE_LEN 10
+
+struct portshm_range_t {
+	uint8_t id[20];
+	uint16_t port; /* First port of the range */
+	char date[PORTSHM_DATE_LEN+1]; /* YYYY-MM-DD */
+	char payload[PORTSHM_PAYLOAD_LEN+1];
+};
+
+struct portshm_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint16_t min_port;
+	uint16_t slots_num;
+	uint16_t ranges_num;
+	uint16_t reserved;
+	uint16_t slots[PORTSHM_SLOTS];
+	struct portshm_range_t ranges[PORTSHM_RANGES];
+};
+
+/* Writer - used by portmap.c */
+void portshm_set( int range, const uint8_t id[], const char payload[], const char date[] );
+void portshm_clear( int range );
+
+/* Reader - map the file read-only. Returns NULL on error. */
+const struct portshm_t *portshm_open( const char path[] );
+void portshm_close( const struct portshm_t *shm );
+
+/* Copy the range of a port. Returns 0 on success or -1 if the port is not mapped. */
+int portshm_lookup( const struct portshm_t *shm, int port, struct portshm_range_t *range );
+
+void portshm_setup( void );
+void portshm_free( void );
+
+#endif /* _PORTSHM_H_ */
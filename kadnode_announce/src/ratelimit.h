@@ -0,0 +1,35 @@
+
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <sys/socket.h>
+
+/*
+* Rate limit of incoming DHT requests per source address. Each source
+* (IPv4 address or IPv6 /64) gets a token bucket of RATELIMIT_BURST
+* requests that refills at RATELIMIT_RATE requests per second, so a
+* single scanner is throttled while all other nodes are still served.
+*
+* The buckets live in a fixed table of RATELIMIT_SLOTS entries. A source
+* can be in one of two slots; a new source takes the slot that was idle
+* the longest. Drops are written to the debug log at most once every
+* RATELIMIT_LOG_INTERVAL seconds.
+*/
+
+#define RATELIMIT_RATE 20
+#define RATELIMIT_BURST 100
+#define RATELIMIT_SLOTS 8192
+#define RATELIMIT_LOG_INTERVAL 10
+
+/* Number of sources printed by ratelimit_print */
+#define RATELIMIT_TOP 10
+
+/* Count a request. Returns 1 if it is to be served, 0 if it is to be dropped. */
+int ratelimit_allow( const struct sockaddr *from );
+
+int ratelimit_status( char *buf, int size );
+
+/* Print the sources with the most dropped requests */
+int ratelimit_print( char *buf, int size );
+
+#endif /* _RATELIMIT_H_ */
@@ -0,0 +1,308 @@
+
+#define _WITH_DPRINTF
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+#include "net.h"
+#include "logq.h"
+#include "sessions.h"
+
+/*
+* Sessions are kept in a chained hash table keyed on
+* the payload number, the IPv4 address and the port.
+* Payload names are few, they are stored once and
+* referred to by their position in g_payloads.
+*/
+
+#define SESSIONS_MIN_SIZE 4096
+#define SESSIONS_MAX_PAYLOADS 0xffff
+
+struct session_t {
+	struct session_t *next;
+	uint64_t key; /* payload << 48 | ip << 16 | port */
+	time_t first_seen;
+	time_t last_seen;
+	uint32_t sightings;
+};
+
+static struct session_t **g_sessions = NULL;
+static size_t g_sessions_size = 0;
+static size_t g_sessions_num = 0;
+
+static char **g_payloads = NULL;
+static size_t g_payloads_num = 0;
+
+static time_t g_sessions_expire = 0;
+
+/* Statistics */
+static uint64_t g_sessions_opened = 0;
+static uint64_t g_sessions_closed = 0;
+
+static size_t sessions_hash( uint64_t key, size_t size ) {
+	/* Addresses are not uniformly distributed */
+	return ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+/* Double the number of buckets and move all sessions over */
+static void sessions_grow( void ) {
+	struct session_t **table;
+	struct session_t *cur;
+	struct session_t *next;
+	size_t size;
+	size_t i, h;
+
+	size = g_sessions_size ? (2 * g_sessions_size) : SESSIONS_MIN_SIZE;
+	table = (struct session_t **) calloc( size, sizeof(struct session_t *) );
+	if( table == NULL ) {
+		return;
+	}
+
+	for( i = 0; i < g_sessions_size; i++ ) {
+		cur = g_sessions[i];
+		while( cur ) {
+			next = cur->next;
+			h = sessions_hash( cur->key, size );
+			cur->next = table[h];
+			table[h] = cur;
+			cur = next;
+		}
+	}
+
+	free( g_sessions );
+	g_sessions = table;
+	g_sessions_size = size;
+}
+
+/* Get the number of a payload name, add it if it is new */
+static int sessions_payload( const char payload[] ) {
+	char **payloads;
+	char *name;
+	size_t i;
+
+	for( i = 0; i < g_payloads_num; i++ ) {
+		if( strcmp( g_payloads[i], payload ) == 0 ) {
+			return i;
+		}
+	}
+
+	if( g_payloads_num >= SESSIONS_MAX_PAYLOADS ) {
+		return -1;
+	}
+
+	name = strdup( payload );
+	if( name == NULL ) {
+		return -1;
+	}
+
+	payloads = (char **) realloc( g_payloads, (g_payloads_num + 1) * sizeof(char *) );
+	if( payloads == NULL ) {
+		free( name );
+		return -1;
+	}
+
+	g_payloads = payloads;
+	g_payloads[g_payloads_num] = name;
+
+	return g_payloads_num++;
+}
+
+static void sessions_log( const struct session_t *session, time_t now, int closed ) {
+	char ipbuf[INET_ADDRSTRLEN+1];
+	UCHAR ip[4];
+	const char *payload;
+	uint16_t port;
+
+	payload = g_payloads[session->key >> 48];
+	ip[0] = (session->key >> 40) & 0xff;
+	ip[1] = (session->key >> 32) & 0xff;
+	ip[2] = (session->key >> 24) & 0xff;
+	ip[3] = (session->key >> 16) & 0xff;
+	port = session->key & 0xffff;
+
+	inet_ntop( AF_INET, ip, ipbuf, sizeof(ipbuf) );
+
+	if( closed ) {
+		logq_printf( LOGQ_SESSIONS, now, "%ld close %s %s %hu %ld %ld %u\n",
+			(long) now, payload, ipbuf, port,
+			(long) session->first_seen, (long) session->last_seen, session->sightings );
+	} else {
+		logq_printf( LOGQ_SESSIONS, now, "%ld open %s %s %hu\n",
+			(long) now, payload, ipbuf, port );
+	}
+}
+
+static void sessions_close( struct session_t *session, time_t now ) {
+	sessions_log( session, now, 1 );
+	g_sessions_closed++;
+	free( session );
+	g_sessions_num--;
+}
+
+static void sessions_open( uint64_t key, time_t now ) {
+	struct session_t *session;
+	size_t h;
+
+	if( g_sessions_num >= g_sessions_size ) {
+		sessions_grow();
+	}
+
+	if( g_sessions == NULL ) {
+		return;
+	}
+
+	session = (struct session_t *) calloc( 1, sizeof(struct session_t) );
+	if( session == NULL ) {
+		return;
+	}
+
+	session->key = key;
+	session->first_seen = now;
+	session->last_seen = now;
+	session->sightings = 1;
+
+	sessions_log( session, now, 0 );
+
+	h = sessions_hash( key, g_sessions_size );
+	session->next = g_sessions[h];
+	g_sessions[h] = session;
+	g_sessions_num++;
+	g_sessions_opened++;
+}
+
+void sessions_update( const char payload[], const struct klog_addr4 *addrs, size_t num, time_t now ) {
+	struct session_t **pre;
+	struct session_t *session;
+	uint64_t key;
+	size_t i;
+	int p;
+
+	p = sessions_payload( payload );
+	if( p < 0 ) {
+		return;
+	}
+
+	for( i = 0; i < num; i++ ) {
+		key = ((uint64_t) p << 48)
+			| ((uint64_t) addrs[i].ip[0] << 40) | ((uint64_t) addrs[i].ip[1] << 32)
+			| ((uint64_t) addrs[i].ip[2] << 24) | ((uint64_t) addrs[i].ip[3] << 16)
+			| addrs[i].port;
+
+		session = NULL;
+		if( g_sessions ) {
+			pre = &g_sessions[sessions_hash( key, g_sessions_size )];
+			while( *pre ) {
+				if( (*pre)->key == key ) {
+					session = *pre;
+					break;
+				}
+				pre = &(*pre)->next;
+			}
+		}
+
+		if( session && (now - session->last_seen) > gconf->session_timeout ) {
+			/* Absent for too long - the sweep has not run yet */
+			*pre = session->next;
+			sessions_close( session, now );
+			session = NULL;
+		}
+
+		if( session ) {
+			/* The same address might be reported twice by a lookup */
+			if( session->last_seen != now ) {
+				session->sightings++;
+				session->last_seen = now;
+			}
+		} else {
+			sessions_open( key, now );
+		}
+	}
+}
+
+/* Close sessions not seen within the timeout */
+static void sessions_expire( time_t now ) {
+	struct session_t **pre;
+	struct session_t *session;
+	size_t i;
+
+	for( i = 0; i < g_sessions_size; i++ ) {
+		pre = &g_sessions[i];
+		while( *pre ) {
+			session = *pre;
+			if( (now - session->last_seen) > gconf->session_timeout ) {
+				*pre = session->next;
+				sessions_close( session, now );
+			} else {
+				pre = &session->next;
+			}
+		}
+	}
+}
+
+int sessions_count( void ) {
+	return g_sessions_num;
+}
+
+void sessions_debug( int fd ) {
+	size_t i;
+
+	dprintf( fd, "Sessions:\n" );
+	dprintf( fd, " timeout: %d seconds\n", gconf->session_timeout );
+	dprintf( fd, " open: %zu (%zu buckets)\n", g_sessions_num, g_sessions_size );
+	dprintf( fd, " opened: %llu, closed: %llu\n",
+		(unsigned long long) g_sessions_opened, (unsigned long long) g_sessions_closed );
+	for( i = 0; i < g_payloads_num; i++ ) {
+		dprintf( fd, " payload: %s\n", g_payloads[i] );
+	}
+}
+
+void sessions_handle( int _rc, int _sock ) {
+	/* Close sessions of seeders that have not been seen */
+	if( g_sessions_expire <= time_now_sec() ) {
+		sessions_expire( time_now_sec() );
+
+		/* Try again in ~1 minute */
+		g_sessions_expire = time_add_min( 1 );
+	}
+}
+
+void sessions_setup( void ) {
+	if( gconf->session_timeout > 0 ) {
+		net_add_handler( -1, &sessions_handle );
+	}
+}
+
+void sessions_free( void ) {
+	struct session_t *cur;
+	struct session_t *next;
+	time_t now;
+	size_t i;
+
+	/* Sessions end with the measurement */
+	now = time_now_sec();
+	for( i = 0; i < g_sessions_size; i++ ) {
+		cur = g_sessions[i];
+		while( cur ) {
+			next = cur->next;
+			sessions_close( cur, now );
+			cur = next;
+		}
+	}
+
+	for( i = 0; i < g_payloads_num; i++ ) {
+		free( g_payloads[i] );
+	}
+
+	free( g_payloads );
+	free( g_sessions );
+	g_payloads = NULL;
+	g_payloads_num = 0;
+	g_sessions = NULL;
+	g_sessions_size = 0;
+}
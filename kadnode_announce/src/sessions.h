@@ -0,0 +1,32 @@
+
+#ifndef _SESSIONS_H_
+#define _SESSIONS_H_
+
+#include <time.h>
+
+#include "klog.h"
+
+/*
+* Seeder sessions. Instead of logging all seeders after every
+* lookup, each (payload, address) pair is tracked in memory and
+* a line is logged only when it is first seen and when it has
+* not been seen for --session-timeout seconds:
+*   timestamp open payload ip port
+*   timestamp close payload ip port first_seen last_seen sightings
+*/
+
+/* Record the seeders found by a lookup for a payload */
+void sessions_update( const char payload[], const struct klog_addr4 *addrs, size_t num, time_t now );
+
+/* Number of open sessions */
+int sessions_count( void );
+
+void sessions_debug( int fd );
+
+/* Register a handler to close timed out sessions */
+void sessions_setup( void );
+
+/* Close all sessions */
+void sessions_free( void );
+
+#endif /* _SESSIONS_H_ */
@@ -0,0 +1,109 @@
+
+/*
+* Benchmark of the SHA-1 implementations on the message
+* sizes KadNode hashes: tokens, infohash strings and module names.
+* Build with "make sha1-bench", run ./build/sha1-bench [<count>]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha1.h"
+#include "sha1mb.h"
+
+/* Messages per sha1mb_hash call */
+#define BENCH_BATCH 64
+
+struct bench_case_t {
+	const char *name;
+	size_t len;
+};
+
+static const struct bench_case_t g_cases[] = {
+	/* Secret, IPv4 address and port */
+	{ "token", 14 },
+	/* "D-M-Y-W-Z-" and a hex digest */
+	{ "infohash", 55 },
+	/* Two blocks */
+	{ "long", 100 }
+};
+
+static const char *g_impl_names[] = { "scalar", "sse2", "avx2" };
+
+static double bench_now( void ) {
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main( int argc, char **argv ) {
+	uint8_t (*digests)[SHA1_DIGEST_SIZE];
+	uint8_t (*expected)[SHA1_DIGEST_SIZE];
+	const uint8_t **data;
+	uint8_t *buf;
+	size_t *len;
+	size_t count;
+	size_t c, i, j;
+	double start, secs;
+	SHA1_CTX ctx;
+
+	count = (argc > 1) ? strtoul( argv[1], NULL, 10 ) : 1000000;
+	if( count == 0 ) {
+		fprintf( stderr, "Usage: %s [<count>]\n", argv[0] );
+		return 1;
+	}
+
+	buf = (uint8_t *) malloc( count * 128 );
+	data = (const uint8_t **) malloc( count * sizeof(uint8_t *) );
+	len = (size_t *) malloc( count * sizeof(size_t) );
+	digests = malloc( count * SHA1_DIGEST_SIZE );
+	expected = malloc( count * SHA1_DIGEST_SIZE );
+
+	srand( 1 );
+	for( i = 0; i < count * 128; i++ ) {
+		buf[i] = rand();
+	}
+
+	printf( "Default implementation: %s\n", sha1mb_impl() );
+
+	for( c = 0; c < sizeof(g_cases) / sizeof(g_cases[0]); c++ ) {
+		for( i = 0; i < count; i++ ) {
+			data[i] = buf + i * 128;
+			len[i] = g_cases[c].len;
+
+			SHA1_Init( &ctx );
+			SHA1_Update( &ctx, data[i], len[i] );
+			SHA1_Final( &ctx, expected[i] );
+		}
+
+		for( j = 0; j < sizeof(g_impl_names) / sizeof(g_impl_names[0]); j++ ) {
+			if( sha1mb_select( g_impl_names[j] ) < 0 ) {
+				continue;
+			}
+
+			memset( digests, 0, count * SHA1_DIGEST_SIZE );
+			start = bench_now();
+			for( i = 0; i < count; i += BENCH_BATCH ) {
+				sha1mb_hash( &digests[i], &data[i], &len[i],
+					(count - i < BENCH_BATCH) ? (count - i) : BENCH_BATCH );
+			}
+			secs = bench_now() - start;
+
+			printf( "%-8s %3zu bytes %-6s %8.2f Mhash/s %s\n",
+				g_cases[c].name, g_cases[c].len, g_impl_names[j],
+				count / secs / 1e6,
+				memcmp( digests, expected, count * SHA1_DIGEST_SIZE ) ? "MISMATCH" : "ok" );
+		}
+	}
+
+	free( buf );
+	free( data );
+	free( len );
+	free( digests );
+	free( expected );
+
+	return 0;
+}
@@ -0,0 +1,249 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sha1.h"
+#include "sha1mb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1MB_X86
+#endif
+
+typedef void sha1mb_func( uint8_t digests[][SHA1_DIGEST_SIZE],
+	const uint8_t *data[], const size_t len[], size_t num );
+
+/*
+* Padded block b of a message. Blocks within the message are
+* used in place, the last one or two are built in pad.
+*/
+static const uint8_t *sha1mb_block( const uint8_t *data, size_t len, size_t b, uint8_t pad[64] ) {
+	uint64_t bits;
+	size_t pos;
+	size_t end;
+	size_t i;
+
+	pos = b * 64;
+	if( pos + 64 <= len ) {
+		return data + pos;
+	}
+
+	memset( pad, 0, 64 );
+	if( pos < len ) {
+		memcpy( pad, data + pos, len - pos );
+	}
+	if( pos <= len ) {
+		pad[len - pos] = 0x80;
+	}
+
+	/* The bit length goes into the last 8 bytes of the last block */
+	end = ((len + 8) / 64 + 1) * 64;
+	if( pos + 64 == end ) {
+		bits = (uint64_t) len << 3;
+		for( i = 0; i < 8; i++ ) {
+			pad[63 - i] = bits >> (8 * i);
+		}
+	}
+
+	return pad;
+}
+
+static uint32_t sha1mb_load( const uint8_t *p ) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void sha1mb_put( uint8_t digest[], const uint32_t state[5] ) {
+	int i;
+
+	for( i = 0; i < 5; i++ ) {
+		digest[4 * i] = state[i] >> 24;
+		digest[4 * i + 1] = state[i] >> 16;
+		digest[4 * i + 2] = state[i] >> 8;
+		digest[4 * i + 3] = state[i];
+	}
+}
+
+static void sha1mb_scalar( uint8_t digests[][SHA1_DIGEST_SIZE],
+		const uint8_t *data[], const size_t len[], size_t num ) {
+	SHA1_CTX ctx;
+	size_t i;
+
+	for( i = 0; i < num; i++ ) {
+		SHA1_Init( &ctx );
+		SHA1_Update( &ctx, data[i], len[i] );
+		SHA1_Final( &ctx, digests[i] );
+	}
+}
+
+#ifdef SHA1MB_X86
+
+typedef uint32_t sha1mb_u32x4 __attribute__ ((vector_size (16)));
+typedef uint32_t sha1mb_u32x8 __attribute__ ((vector_size (32)));
+
+#define SHA1MB_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+* The same code for each lane width. The vector extensions are
+* compiled to SSE2 or AVX2 depending on the target of the function.
+* Lanes without a message or past their last block hash zeros,
+* the state of a lane is read out after its last block.
+*/
+#define SHA1MB_LANES_FUNC( NAME, VT, LANES ) \
+static void NAME( uint8_t digests[][SHA1_DIGEST_SIZE], \
+		const uint8_t *data[], const size_t len[], size_t num ) { \
+	const uint8_t *block[LANES]; \
+	uint8_t pad[LANES][64]; \
+	uint32_t words[LANES]; \
+	uint32_t state[5]; \
+	size_t blocks[LANES]; \
+	size_t max_blocks; \
+	size_t n, b, k; \
+	VT s[5], w[16]; \
+	VT a, bb, c, d, e, f, tmp; \
+	int i, t; \
+\
+	for( k = 0; k < num; k += n ) { \
+		n = (num - k < LANES) ? (num - k) : LANES; \
+\
+		max_blocks = 0; \
+		for( i = 0; i < LANES; i++ ) { \
+			blocks[i] = (i < (int) n) ? ((len[k + i] + 8) / 64 + 1) : 0; \
+			if( blocks[i] > max_blocks ) { \
+				max_blocks = blocks[i]; \
+			} \
+		} \
+\
+		memset( s, 0, sizeof(s) ); \
+		s[0] += 0x67452301; \
+		s[1] += 0xEFCDAB89; \
+		s[2] += 0x98BADCFE; \
+		s[3] += 0x10325476; \
+		s[4] += 0xC3D2E1F0; \
+\
+		for( b = 0; b < max_blocks; b++ ) { \
+			for( i = 0; i < LANES; i++ ) { \
+				if( b < blocks[i] ) { \
+					block[i] = sha1mb_block( data[k + i], len[k + i], b, pad[i] ); \
+				} else { \
+					memset( pad[i], 0, 64 ); \
+					block[i] = pad[i]; \
+				} \
+			} \
+			for( t = 0; t < 16; t++ ) { \
+				for( i = 0; i < LANES; i++ ) { \
+					words[i] = sha1mb_load( block[i] + 4 * t ); \
+				} \
+				memcpy( &w[t], words, sizeof(words) ); \
+			} \
+\
+			a = s[0]; bb = s[1]; c = s[2]; d = s[3]; e = s[4]; \
+			for( t = 0; t < 80; t++ ) { \
+				if( t >= 16 ) { \
+					tmp = w[(t + 13) & 15] ^ w[(t + 8) & 15] ^ w[(t + 2) & 15] ^ w[t & 15]; \
+					w[t & 15] = SHA1MB_ROL( tmp, 1 ); \
+				} \
+				if( t < 20 ) { \
+					f = ((bb & (c ^ d)) ^ d) + 0x5A827999; \
+				} else if( t < 40 ) { \
+					f = (bb ^ c ^ d) + 0x6ED9EBA1; \
+				} else if( t < 60 ) { \
+					f = (((bb | c) & d) | (bb & c)) + 0x8F1BBCDC; \
+				} else { \
+					f = (bb ^ c ^ d) + 0xCA62C1D6; \
+				} \
+				tmp = SHA1MB_ROL( a, 5 ) + f + e + w[t & 15]; \
+				e = d; d = c; c = SHA1MB_ROL( bb, 30 ); bb = a; a = tmp; \
+			} \
+			s[0] += a; s[1] += bb; s[2] += c; s[3] += d; s[4] += e; \
+\
+			for( i = 0; i < (int) n; i++ ) { \
+				if( blocks[i] == b + 1 ) { \
+					for( t = 0; t < 5; t++ ) { \
+						state[t] = s[t][i]; \
+					} \
+					sha1mb_put( digests[k + i], state ); \
+				} \
+			} \
+		} \
+	} \
+}
+
+SHA1MB_LANES_FUNC( sha1mb_sse2, sha1mb_u32x4, 4 )
+
+__attribute__ ((target ("avx2")))
+SHA1MB_LANES_FUNC( sha1mb_avx2, sha1mb_u32x8, 8 )
+
+#endif /* SHA1MB_X86 */
+
+struct sha1mb_impl_t {
+	const char *name;
+	sha1mb_func *func;
+};
+
+static const struct sha1mb_impl_t g_impls[] = {
+#ifdef SHA1MB_X86
+	{ "avx2", &sha1mb_avx2 },
+	{ "sse2", &sha1mb_sse2 },
+#endif
+	{ "scalar", &sha1mb_scalar }
+};
+
+#define SHA1MB_IMPLS (sizeof(g_impls) / sizeof(g_impls[0]))
+
+static const struct sha1mb_impl_t *g_impl = NULL;
+
+static int sha1mb_supported( const struct sha1mb_impl_t *impl ) {
+#ifdef SHA1MB_X86
+	__builtin_cpu_init();
+	if( impl->func == &sha1mb_avx2 ) {
+		return __builtin_cpu_supports( "avx2" );
+	}
+	if( impl->func == &sha1mb_sse2 ) {
+		return __builtin_cpu_supports( "sse2" );
+	}
+#endif
+	return 1;
+}
+
+/* Use the widest implementation the CPU supports */
+static const struct sha1mb_impl_t *sha1mb_get( void ) {
+	size_t i;
+
+	if( g_impl == NULL ) {
+		for( i = 0; i < SHA1MB_IMPLS; i++ ) {
+			if( sha1mb_supported( &g_impls[i] ) ) {
+				g_impl = &g_impls[i];
+				break;
+			}
+		}
+	}
+
+	return g_impl;
+}
+
+void sha1mb_hash( uint8_t digests[][SHA1_DIGEST_SIZE],
+		const uint8_t *data[], const size_t len[], size_t num ) {
+
+	/* A single message does not fill any lanes */
+	if( num == 1 ) {
+		sha1mb_scalar( digests, data, len, num );
+	} else {
+		sha1mb_get()->func( digests, data, len, num );
+	}
+}
+
+const char *sha1mb_impl( void ) {
+	return sha1mb_get()->name;
+}
+
+int sha1mb_select( const char name[] ) {
+	size_t i;
+
+	for( i = 0; i < SHA1MB_IMPLS; i++ ) {
+		if( strcmp( g_impls[i].name, name ) == 0 && sha1mb_supported( &g_impls[i] ) ) {
+			g_impl = &g_impls[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,28 @@
+
+#ifndef _SHA1MB_H_
+#define _SHA1MB_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sha1.h"
+
+/*
+* Multi-buffer SHA-1: hash many independent messages at once,
+* one message per SIMD lane (8 lanes with AVX2, 4 with SSE2).
+* The implementation is selected at runtime from the CPU
+* features; the scalar code of sha1.c is the fallback.
+* Shared by the daemon and sha1-bench.
+*/
+
+/* digests[i] = SHA-1 of data[i] of len[i] bytes */
+void sha1mb_hash( uint8_t digests[][SHA1_DIGEST_SIZE],
+	const uint8_t *data[], const size_t len[], size_t num );
+
+/* Name of the implementation in use ("avx2", "sse2" or "scalar") */
+const char *sha1mb_impl( void );
+
+/* Force an implementation by name. Returns -1 if not available. */
+int sha1mb_select( const char name[] );
+
+#endif /* _SHA1MB_H_ */
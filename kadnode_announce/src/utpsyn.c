@@ -0,0 +1,122 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "main.h"
+#include "kad.h"
+#include "utpsyn.h"
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+
+static uint16_t utpsyn_get16( const uint8_t *p ) {
+	return (p[0] << 8) | p[1];
+}
+
+int utpsyn_parse_ip( struct utpsyn_t *syn, const uint8_t *data, size_t len ) {
+	const uint8_t *udp;
+	size_t hlen;
+
+	if( len < 20 || (data[0] >> 4) != 4 || data[9] != IPPROTO_UDP ) {
+		return -1;
+	}
+
+	/* Only the first fragment has the UDP header */
+	if( utpsyn_get16( data + 6 ) & 0x1fff ) {
+		return -1;
+	}
+
+	hlen = (data[0] & 0x0f) * 4;
+	if( hlen < 20 || len < hlen + 8 ) {
+		return -1;
+	}
+
+	/* Do not look past the end of the IP packet */
+	if( utpsyn_get16( data + 2 ) >= hlen + 8 && utpsyn_get16( data + 2 ) < len ) {
+		len = utpsyn_get16( data + 2 );
+	}
+
+	udp = data + hlen;
+	syn->sport = utpsyn_get16( udp );
+	syn->dport = utpsyn_get16( udp + 2 );
+	syn->len = (int) utpsyn_get16( udp + 4 ) - 8;
+
+	if( syn->dport < MIN_PORT || syn->dport > MAX_PORT || syn->len > UTPSYN_MAX_LEN ) {
+		return -1;
+	}
+
+	len -= hlen + 8;
+	if( len == 0 || udp[8] != UTPSYN_TYPE ) {
+		return -1;
+	}
+
+	memcpy( syn->src, data + 12, 4 );
+	syn->header_len = (len < UTPSYN_HEADER_LEN) ? len : UTPSYN_HEADER_LEN;
+	memcpy( syn->header, udp + 8, syn->header_len );
+
+	return 0;
+}
+
+int utpsyn_parse_frame( struct utpsyn_t *syn, int linktype, const uint8_t *data, size_t len ) {
+	size_t offset;
+	uint16_t type;
+
+	switch( linktype ) {
+		case UTPSYN_LINK_ETHERNET:
+			if( len < 14 ) {
+				return -1;
+			}
+			offset = 14;
+			type = utpsyn_get16( data + 12 );
+			while( type == ETHERTYPE_VLAN && len >= offset + 4 ) {
+				type = utpsyn_get16( data + offset + 2 );
+				offset += 4;
+			}
+			break;
+		case UTPSYN_LINK_LINUX_SLL:
+			if( len < 16 ) {
+				return -1;
+			}
+			offset = 16;
+			type = utpsyn_get16( data + 14 );
+			break;
+		case UTPSYN_LINK_LINUX_SLL2:
+			if( len < 20 ) {
+				return -1;
+			}
+			offset = 20;
+			type = utpsyn_get16( data );
+			break;
+		case UTPSYN_LINK_RAW:
+			offset = 0;
+			type = ETHERTYPE_IPV4;
+			break;
+		default:
+			return -1;
+	}
+
+	if( type != ETHERTYPE_IPV4 ) {
+		return -1;
+	}
+
+	return utpsyn_parse_ip( syn, data + offset, len - offset );
+}
+
+int utpsyn_format( char buf[], size_t size, time_t time, const struct utpsyn_t *syn,
+		const char id_hex[], const char payload[], const char date[] ) {
+	char hexbuf[2 * UTPSYN_HEADER_LEN + 1];
+	char ipbuf[INET_ADDRSTRLEN];
+	int i;
+
+	for( i = 0; i < syn->header_len; i++ ) {
+		sprintf( hexbuf + 2 * i, "%02x", syn->header[i] );
+	}
+	hexbuf[2 * syn->header_len] = '\0';
+
+	inet_ntop( AF_INET, syn->src, ipbuf, sizeof(ipbuf) );
+
+	// timestamp payload_filename payload_hash_date infohash [seeder|leecher] ip port udp_len utp_header
+	return snprintf( buf, size, "%ld %s %s %s leecher %s %hu %d %s\n",
+		(long) time, payload, date, id_hex, ipbuf, syn->sport, syn->len, hexbuf );
+}
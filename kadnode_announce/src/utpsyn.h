@@ -0,0 +1,56 @@
+
+#ifndef _UTPSYN_H_
+#define _UTPSYN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+* Recognise the uTP SYN packets that leechers send to the
+* announced port range and format them as leecher records.
+* Applies the filters of scripts/announce/pcap_to_log_tuples.py:
+* IPv4/UDP to MIN_PORT..MAX_PORT, at most UTPSYN_MAX_LEN bytes
+* of UDP payload and a first byte of UTPSYN_TYPE.
+* Shared by the capture module and pcap2log.
+*/
+
+/* uTP version 1 with type ST_SYN */
+#define UTPSYN_TYPE 0x41
+
+/* Longer payloads are not uTP SYNs */
+#define UTPSYN_MAX_LEN 30
+
+/* Bytes of the uTP header written to the record */
+#define UTPSYN_HEADER_LEN 20
+
+/* Link types of pcap files */
+#define UTPSYN_LINK_ETHERNET 1
+#define UTPSYN_LINK_RAW 101
+#define UTPSYN_LINK_LINUX_SLL 113
+#define UTPSYN_LINK_LINUX_SLL2 276
+
+struct utpsyn_t {
+	uint8_t src[4]; /* Network byte order */
+	uint16_t sport;
+	uint16_t dport;
+	int len; /* UDP payload length of the UDP header */
+	int header_len; /* Captured bytes in header */
+	uint8_t header[UTPSYN_HEADER_LEN];
+};
+
+/* Parse an IPv4 packet. Returns 0 for a uTP SYN to the port range, -1 otherwise. */
+int utpsyn_parse_ip( struct utpsyn_t *syn, const uint8_t *data, size_t len );
+
+/* Parse a frame of a pcap link type */
+int utpsyn_parse_frame( struct utpsyn_t *syn, int linktype, const uint8_t *data, size_t len );
+
+/*
+* Format a leecher record:
+* "<time> <payload> <date> <infohash> leecher <ip> <port> <len> <header hex>\n"
+* Returns the length of the line.
+*/
+int utpsyn_format( char buf[], size_t size, time_t time, const struct utpsyn_t *syn,
+	const char id_hex[], const char payload[], const char date[] );
+
+#endif /* _UTPSYN_H_ */
@@ -18,12 +18,19 @@
 #include "ext-auth.h"
 #endif
 #include "values.h"
+#include "idmap.h"
+#include "infohashes.h"
+#include "portmap.h"
 
 /* Announce values every 20 minutes */
 #define ANNOUNCE_INTERVAL (20*60)
 #define ANNOUNCE_MAINTENANCE_TIME 5
-#define VALUE_LIFETIME (20 * 60)
-#define PORT_INCREMENT 50
+
+/*
+* Refresh the cached tokens of the closest nodes one maintenance
+* round before the value is announced again (see dht_refresh_tokens)
+*/
+#define TOKEN_REFRESH_TIME (ANNOUNCE_MAINTENANCE_TIME * 60)
 
 static time_t g_values_expire = 0;
 static time_t g_values_announce = 0;
@@ -34,16 +41,7 @@ struct value_t* values_get( void ) {
 }
 
 struct value_t* values_find( UCHAR id[] ) {
-	struct value_t *value;
-
-	value = g_values;
-	while( value ) {
-		if( id_equal( id, value->id ) ) {
-			return value;
-		}
-		value = value->next;
-	}
-	return NULL;
+	return (struct value_t *) idmap_lookup( id, IDMAP_VALUE );
 }
 
 int values_count( void ) {
@@ -65,9 +63,14 @@ void values_debug( int fd ) {
 	struct value_t *value;
 	time_t now;
 	int value_counter;
+	int acked, sent, replicated_num, replicated_sum;
 
 	now = time_now_sec();
 	value_counter = 0;
+	acked = 0;
+	sent = 0;
+	replicated_num = 0;
+	replicated_sum = 0;
 	value = g_values;
 	dprintf( fd, "Announced values:\n" );
 	while( value ) {
@@ -85,6 +88,22 @@ void values_debug( int fd ) {
 			dprintf( fd, "  lifetime: %ld min left\n", (value->lifetime -  now) / 60 );
 		}
 
+		if( value->announcements > 0 ) {
+			dprintf( fd, "  acked: %d/%d (%d%%)\n", value->acked, value->sent,
+				value->sent ? (100 * value->acked / value->sent) : 0 );
+			if( value->replicated >= 0 ) {
+				dprintf( fd, "  replicated: in %d sec\n", value->replicated );
+			} else {
+				dprintf( fd, "  replicated: no\n" );
+			}
+			acked += value->acked;
+			sent += value->sent;
+			if( value->replicated >= 0 ) {
+				replicated_num++;
+				replicated_sum += value->replicated;
+			}
+		}
+
 #ifdef AUTH
 		if( value->skey ) {
 			char sbuf[2*crypto_sign_SECRETKEYBYTES+1];
@@ -97,6 +116,28 @@ void values_debug( int fd ) {
 	}
 
 	dprintf( fd, " Found %d values.\n", value_counter );
+	if( sent > 0 ) {
+		dprintf( fd, " Acked %d/%d (%d%%) announcements, %d values replicated",
+			acked, sent, 100 * acked / sent, replicated_num );
+		if( replicated_num > 0 ) {
+			dprintf( fd, " in %d sec on average", replicated_sum / replicated_num );
+		}
+		dprintf( fd, ".\n" );
+	}
+}
+
+void values_announced( const UCHAR id[], int acked, int sent, int replicated ) {
+	struct value_t *value;
+
+	value = idmap_lookup( id, IDMAP_VALUE );
+	if( value == NULL ) {
+		return;
+	}
+
+	value->acked = acked;
+	value->sent = sent;
+	value->replicated = replicated;
+	value->announcements++;
 }
 
 int values_add( const char query[], int port, time_t lifetime,
@@ -132,54 +173,14 @@ int values_add( const char query[], int port, time_t lifetime,
 	}
 
     /*Hajime
-     * Assign infohash to announce a port. This pretty ugly and ad hoc - 
-     * designed to minimize interruptions to measurments already taking
-     * place. Each infohash is announced on a range of ports (with the goal
-     * of increasing the chances of bots connecting to us to download). Each
-     * new announcement is assigned a new port range by incrementing the 
-     * last used range, eventually wrapping around. Infohash to port mappings 
-     * are maintained in a file also read by the uTP server listening for
-     * connections, which maps a port for a received connection back to its
-     * announced infohash. The port mapping file is periodically rewritten to
-     * prevent conflicting infohash to port mappings when the port ranges wrap
-     * around. Infohashes to announce are read in from the infohash file. 
-     * Filenames and paths are configurable and defined in kad.h
+     * Each infohash is announced on a range of ports (with the goal of
+     * increasing the chances of bots connecting to us to download). The
+     * range is taken from the port map (portmap.c), which the uTP server
+     * reads to map a port of a received connection back to its infohash.
      */
-    char *line = NULL, *last_line = NULL;	
-    size_t len = 0;
-    ssize_t read;
-    char *last_port;
-    int next_port;
-    FILE *port_map_file = fopen(PORT_MAP_FILENAME, "r+");
-
-    // Log port mapping
-    if(!port_map_file){
-        //sleep 1 second and try again
-        sleep(1);
-        port_map_file = fopen(PORT_MAP_FILENAME, "r+");
-        if (!port_map_file){
-	// doesn't exist, start at min port and create file
-        	port_map_file = fopen(PORT_MAP_FILENAME, "w");
-        	next_port = MIN_PORT;
-        }
-    }
-    else{
-	    // go to last line to get last used port
-	    while ((read = getline(&line, &len, port_map_file)) != -1) {
-		last_line = line;
-	    }
-	    // otherwise incremenet the last used port
-		last_port = strtok(line, " ");
-		next_port = atoi(last_port) + PORT_INCREMENT;
-
-		//wrap around
-		if(next_port >= MAX_PORT)
-		    next_port = MIN_PORT;
-	    if(next_port < MIN_PORT){
-		log_print("ERROR getting port from port_map\n");
-		exit(1);
-	    }    
-    }
+    int next_port = portmap_alloc(id, payload, date_str);
+    if(next_port < 0)
+        return 0;
 
     /* Prepend new entry */
 	new = (struct value_t*) calloc( 1, sizeof(struct value_t) );
@@ -191,6 +192,11 @@ int values_add( const char query[], int port, time_t lifetime,
 	log_debug( "VAL: Add value id %s:%hu.",  str_id( id, hexbuf ), new->port );
     ap_debug_print("adding announcement for %s %d\n", 
             str_id(id, hexbuf), new->port);
+	if( idmap_set( id, IDMAP_VALUE, new ) < 0 ) {
+		free( new );
+		return 0;
+	}
+
 	/* Prepend to list */
 	new->next = g_values;
 	g_values = new;
@@ -198,15 +204,11 @@ int values_add( const char query[], int port, time_t lifetime,
 	/* Trigger immediate handling */
 	g_values_announce= 0;
 
-    // Add to the port map file
-    fprintf(port_map_file, "%d %s %s %s\n", 
-            new->port, str_id(id, hexbuf), payload, date_str);
-    fclose(port_map_file); 
-    
     return 1;
 }
 
 void value_free( struct value_t *value ) {
+	idmap_set( value->id, IDMAP_VALUE, NULL );
 #ifdef AUTH
 	/* Secure erase */
 	if( value->skey ) {
@@ -263,87 +265,77 @@ void values_expire( void ) {
 }
 
 #ifdef ANNOUNCEMENTS
+/* Set once the values of the whole window were added */
+static int g_announcements_added = 0;
+
 /* Hajime 
- * Read infohashes from file and send announce_peer messages to the 
- * DHT that we are a seeder for the infohash.
+ * Send announce_peer messages to the DHT that we are a seeder for
+ * each infohash of the current window (infohashes.c). This is done
+ * once, later changes of the window are applied by values_changed.
  */
 static int add_announcements(){
-    FILE *hash_file = fopen(HASH_FILENAME, "r");
-    if(!hash_file){
-        log_print("ERROR opening hash file %s\n", HASH_FILENAME);
-        exit(1);
-    }
-
-    char *line;
-    size_t len = 0;
-    ssize_t read;
+    struct infohash_t *ih;
+    size_t i, num;
     int rc = 0;
 
-    char *infohash, *payload, *date_str;
     int new_value_added = 0;
 
-    //send announcement for each info hash in file
-    //ports are incremented so each infohash has unique port starting at 6882
-    while ((read = getline(&line, &len, hash_file)) != -1) {
-        //remove trailing newline
-        line[strcspn(line, "\n")] = 0;
-        if(strlen(line) > 0){
-            infohash = strtok(line, " ");
-            payload = strtok(NULL, " ");
-            date_str = strtok(NULL, " ");
-    
-            //add infohash and starting port number to values
-            // multiple announcements taken care of in values_announce
-            // Only increase the running port number if we actually added a new 
-            //  value
-            new_value_added += values_add( infohash, 0, time_now_sec() + VALUE_LIFETIME, 
-                    payload, date_str);
-        }
-    }
-    free(line);
-    fclose(hash_file);
-
-    // if a new value was added, rewrite port_map file to delete old entries
-    char buf[1024];
-    int buf_len = 1024;
-    char *port;
-    time_t now, line_t;
-    struct tm line_tm;
-    time(&now);
-    int secs_in_3_days = 60 * 60 * 24 * 3;
-
-    if(new_value_added){
-        FILE *old_ports, *new_ports;
-        old_ports = fopen(PORT_MAP_FILENAME, "r");
-        new_ports = fopen(PORT_TMP_FILENAME, "w");
-        while(fgets(buf, buf_len, old_ports)){
-            buf[strcspn(buf, "\n")] = 0;
-            if(strlen(buf) > 0){
-                port = strtok(buf, " ");
-                infohash = strtok(NULL, " ");
-                payload = strtok(NULL, " ");
-                date_str = strtok(NULL, " ");
-
-                strptime(date_str, "%Y-%m-%d", &line_tm);
-                line_t = mktime(&line_tm);
-                //this is imprecise, but only copy over entries less than three days in the past
-                if(now - secs_in_3_days < line_t)
-                    fprintf(new_ports, "%s %s %s %s\n", port, infohash, payload, date_str);
-            }
-        }
-        fclose(old_ports);
-        fclose(new_ports);
-        rename(PORT_TMP_FILENAME, PORT_MAP_FILENAME);
+    if(g_announcements_added)
+        return rc;
+
+    //send announcement for each infohash of the window
+    ih = infohashes_get(&num);
+    for(i = 0; i < num; i++){
+        //add infohash and starting port number to values
+        // multiple announcements taken care of in values_announce
+        // Only increase the running port number if we actually added a new 
+        //  value
+        new_value_added += values_add( ih[i].hex, 0, LONG_MAX, 
+                ih[i].payload, ih[i].date);
     }
+    g_announcements_added = 1;
+
+    // if a new value was added, write out its port range
+    if(new_value_added)
+        portmap_save();
                 
     return rc;
 }
+
+/* Hajime
+ * The infohash window moved or the module list changed. Stop
+ * announcing removed infohashes and start announcing new ones;
+ * the others keep their port range and announce schedule.
+ */
+static void values_changed(struct infohash_t added[], size_t added_num,
+        struct infohash_t removed[], size_t removed_num){
+    struct value_t *value;
+    int new_value_added = 0;
+    size_t i;
+
+    // The whole window is added with the first announcements
+    if(!g_announcements_added)
+        return;
+
+    for(i = 0; i < removed_num; i++){
+        value = values_find(removed[i].id);
+        if(value)
+            values_remove(value);
+    }
+
+    for(i = 0; i < added_num; i++){
+        new_value_added += values_add( added[i].hex, 0, LONG_MAX,
+                added[i].payload, added[i].date);
+    }
+
+    if(new_value_added)
+        portmap_save();
+}
 #endif
 
 void values_announce( void ) {
 	struct value_t *value;
 	time_t now;
-    int i, port;
 
 	now = time_now_sec();
 	value = g_values;
@@ -355,13 +347,15 @@ void values_announce( void ) {
                     str_id( value->id, hexbuf ), value->port );
 #endif
             /*Hajime
-             * Send announce_peer for each port in port range
+             * Send announce_peer for each port in port range,
+             * all from one search
              */
-            port = value->port;
-            for(i = 0; i < PORTS_PER_ANNOUNCE; i++){
-    			kad_announce_once( value->id, port++);
-            }
+			kad_announce_ports( value->id, value->port, PORTS_PER_ANNOUNCE );
 			value->refresh = now + ANNOUNCE_INTERVAL;
+			value->token_refresh = value->refresh - TOKEN_REFRESH_TIME;
+		} else if( value->token_refresh && value->token_refresh < now ) {
+			kad_refresh_tokens( value->id );
+			value->token_refresh = 0;
 		}
 		value = value->next;
 	}
@@ -372,13 +366,17 @@ void values_handle( int _rc, int _sock ) {
 	if( g_values_expire <= time_now_sec() ) {
 		values_expire();
 
+		/* Free the port ranges of old dates */
+		portmap_expire();
+		portmap_save();
+
 		//Try again in ~1 minute 
 		g_values_expire = time_add_min( ANNOUNCE_MAINTENANCE_TIME );
 	}
 
 	if( g_values_announce <= time_now_sec() && kad_count_nodes( 0 ) != 0 ) {
         /*Hajime
-         * Check infohash file for new payloads to announce
+         * Add the infohashes of the window when the first nodes are known
          */
 #ifdef ANNOUNCEMENTS
         add_announcements();
@@ -393,6 +391,9 @@ void values_handle( int _rc, int _sock ) {
 void values_setup( void ) {
 	/* Cause the callback to be called in intervals */
 	net_add_handler( -1, &values_handle );
+#ifdef ANNOUNCEMENTS
+	infohashes_watch( &values_changed );
+#endif
 }
 
 void values_free( void ) {
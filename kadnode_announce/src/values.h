@@ -21,6 +21,12 @@ struct value_t {
 	int port;
 	time_t lifetime; /* Keep entry refreshed until the lifetime expires */
 	time_t refresh; /* Next time the entry need to be refreshed */
+	time_t token_refresh; /* Next time the tokens for the entry are refreshed, 0 if not */
+	/* Result of the last completed announcement */
+	int acked; /* (node, port) pairs that acked */
+	int sent; /* (node, port) pairs announced to */
+	int replicated; /* Seconds until the target nodes acked all ports, -1 if never */
+	int announcements; /* Completed announcements */
 };
 
 void values_setup( void );
@@ -35,6 +41,9 @@ void values_debug( int fd );
 /* Count all entries */
 int values_count( void );
 
+/* Record the result of a completed announcement */
+void values_announced( const UCHAR id[], int acked, int sent, int replicated );
+
 /* Add a value id / port that will be announced until lifetime is exceeded */
 int values_add( const char query[], int port, time_t lifetime,
        char *payload, char *date_str );
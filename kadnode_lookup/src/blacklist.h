@@ -0,0 +1,48 @@
+
+#ifndef _BLACKLIST_H_
+#define _BLACKLIST_H_
+
+#include <sys/socket.h>
+
+/*
+* Blacklist of DHT nodes, keyed on the compact address (IP and port).
+* Misbehaviour adds to the score of an address; when the score reaches
+* BLACKLIST_SCORE, the address is blacklisted for BLACKLIST_TIME seconds,
+* doubled for every time it was blacklisted before (up to 2^BLACKLIST_MAX_STRIKES).
+* Scores halve every BLACKLIST_DECAY seconds, so that rare timeouts of
+* good nodes do not add up.
+*
+* The entries are kept in a hash table of BLACKLIST_SETS sets with
+* BLACKLIST_WAYS entries each. When a set is full, the entry that is
+* least likely to be blacklisted is replaced.
+*/
+
+#define BLACKLIST_SETS 1024
+#define BLACKLIST_WAYS 8
+#define BLACKLIST_SIZE (BLACKLIST_SETS * BLACKLIST_WAYS)
+
+#define BLACKLIST_SCORE 100
+#define BLACKLIST_TIME (60 * 60)
+#define BLACKLIST_MAX_STRIKES 4
+#define BLACKLIST_DECAY (10 * 60)
+
+/* Scores of misbehaviour */
+#define BLACKLIST_TRUNCATED_TID 100 /* Breaks all searches through the node */
+#define BLACKLIST_BAD_NODES 50 /* Node info of unexpected length */
+#define BLACKLIST_TIMEOUT 20 /* No reply to three requests */
+
+/* Add to the score of an address. Returns 1 if it became blacklisted. */
+int blacklist_score( const struct sockaddr *sa, int score );
+
+/* Blacklist an address now */
+void blacklist_add( const struct sockaddr *sa );
+
+/* Check if an address is blacklisted. An entry with port 0 matches all ports. */
+int blacklist_contains( const struct sockaddr *sa );
+
+/* Number of blacklisted addresses */
+int blacklist_count( void );
+
+void blacklist_debug( int fd );
+
+#endif /* _BLACKLIST_H_ */
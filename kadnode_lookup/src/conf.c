@@ -83,6 +83,31 @@ const char *kadnode_usage_str = "KadNode - A P2P name resolution daemon.\n"
 "				Default: ipv4\n\n"
 " --query-tld <domain>		Top level domain to be handled by KadNode.\n"
 "				Default: "QUERY_TLD_DEFAULT"\n\n"
+" --log-fsync <seconds>		Interval to sync the measurement logs to disk, 0 to disable.\n"
+"				Default: 60\n\n"
+" --log-format <text|binary>	Write seeder and result node logs as text or in the\n"
+"				binary format read by kadnode-logcat.\n"
+"				Default: text\n\n"
+#ifdef ZLIB
+" --log-compress		Write seeder and result node logs gzip compressed.\n\n"
+#endif
+" --modules-file <file>		Hajime config file with the module names to compute\n"
+"				the infohashes from.\n"
+"				Default: "MODULES_FILENAME"\n\n"
+" --infohash-window <days>	Compute infohashes for this many days before and\n"
+"				after the current UTC day.\n"
+"				Default: 2\n\n"
+" --session-timeout <minutes>	Log seeder sessions instead of all seeders of each lookup.\n"
+"				A session is closed after the seeder was not seen for\n"
+"				this long. 0 logs all seeders.\n"
+"				Default: 0\n\n"
+#ifdef ANNOUNCEMENTS
+" --announce-replicas <num>	Number of closest nodes to store each announcement on.\n"
+"				Default: 8, at most 16\n\n"
+" --capture-ifname <interface>	Capture the uTP SYNs of leechers on this interface\n"
+"				(or any) and write them to the leecher log.\n\n"
+" --capture-file <file>		Replay a pcap file through the capture at startup.\n\n"
+#endif
 #ifdef LPD
 " --lpd-addr <addr>		Set multicast address for Local Peer Discovery.\n"
 "				Default: "DHT_ADDR4_MCAST" / "DHT_ADDR6_MCAST"\n\n"
@@ -221,6 +246,12 @@ void conf_init( void ) {
 	gconf = (struct gconf_t *) calloc( 1, sizeof(struct gconf_t) );
 
 	gconf->is_running = 1;
+	gconf->log_fsync = LOG_FSYNC_DEFAULT;
+	gconf->session_timeout = 60 * SESSION_TIMEOUT_DEFAULT;
+	gconf->infohash_window = INFOHASH_WINDOW_DEFAULT;
+#ifdef ANNOUNCEMENTS
+	gconf->announce_replicas = ANNOUNCE_REPLICAS_DEFAULT;
+#endif
 
 #ifdef DEBUG
 	gconf->verbosity = VERBOSITY_DEBUG;
@@ -252,6 +283,10 @@ void conf_check( void ) {
 		gconf->dht_port = strdup( DHT_PORT );
 	}
 
+	if( gconf->modules_file == NULL ) {
+		gconf->modules_file = strdup( MODULES_FILENAME );
+	}
+
 #ifdef CMD
 	if( gconf->cmd_port == NULL )  {
 		gconf->cmd_port = strdup( CMD_PORT );
@@ -372,7 +407,27 @@ void conf_info( void ) {
 	}
 
 	log_info( "Query TLD: %s", gconf->query_tld );
+	if( gconf->log_fsync > 0 ) {
+		log_info( "Log Sync: every %d seconds", gconf->log_fsync );
+	} else {
+		log_info( "Log Sync: disabled" );
+	}
+	log_info( "Log Format: %s", (gconf->log_format == LOG_FORMAT_BINARY) ? "binary" : "text" );
+#ifdef ZLIB
+	log_info( "Log Compression: %s", gconf->log_compress ? "gzip" : "disabled" );
+#endif
+	if( gconf->session_timeout > 0 ) {
+		log_info( "Seeder Sessions: %d minutes timeout", gconf->session_timeout / 60 );
+	} else {
+		log_info( "Seeder Sessions: disabled" );
+	}
 	log_info( "Peer File: %s", gconf->peerfile ? gconf->peerfile : "None" );
+	log_info( "Modules File: %s", gconf->modules_file );
+	log_info( "Infohash Window: +/- %d days", gconf->infohash_window );
+#ifdef ANNOUNCEMENTS
+	log_info( "Announce Replicas: %d", gconf->announce_replicas );
+	log_info( "Capture Interface: %s", gconf->capture_ifname ? gconf->capture_ifname : "None" );
+#endif
 #ifdef LPD
 	log_info( "LPD Address: %s", (gconf->lpd_disable == 0) ? gconf->lpd_addr : "Disabled" );
 #endif
@@ -385,6 +440,11 @@ void conf_free( void ) {
 	free( gconf->user );
 	free( gconf->pidfile );
 	free( gconf->peerfile );
+	free( gconf->modules_file );
+#ifdef ANNOUNCEMENTS
+	free( gconf->capture_ifname );
+	free( gconf->capture_file );
+#endif
 	free( gconf->dht_port );
 	free( gconf->dht_ifname );
 	free( gconf->configfile );
@@ -433,6 +493,23 @@ void conf_str( const char opt[], char *dst[], const char src[] ) {
 	*dst = strdup( src );
 }
 
+/* Parse a number within a range - error on invalid input */
+int conf_int( const char opt[], const char val[], int min, int max ) {
+	char *end;
+	long n;
+
+	if( val == NULL ) {
+		conf_arg_expected( opt );
+	}
+
+	n = strtol( val, &end, 10 );
+	if( end == val || *end != '\0' || n < min || n > max ) {
+		log_err( "CFG: Invalid argument for %s.", opt );
+	}
+
+	return n;
+}
+
 int conf_handle_option( char opt[], char val[] ) {
 
 	if( match( opt, "--node-id" ) ) {
@@ -449,6 +526,38 @@ int conf_handle_option( char opt[], char val[] ) {
 		conf_str( opt, &gconf->pidfile, val );
 	} else if( match( opt, "--peerfile" ) ) {
 		conf_str( opt, &gconf->peerfile, val );
+	} else if( match( opt, "--log-fsync" ) ) {
+		gconf->log_fsync = conf_int( opt, val, 0, 24 * 60 * 60 );
+	} else if( match( opt, "--log-format" ) ) {
+		if( val && match( val, "text" ) ) {
+			gconf->log_format = LOG_FORMAT_TEXT;
+		} else if( val && match( val, "binary" ) ) {
+			gconf->log_format = LOG_FORMAT_BINARY;
+		} else {
+			log_err( "CFG: Invalid argument for %s. Use 'text' or 'binary'.", opt );
+		}
+	} else if( match( opt, "--modules-file" ) ) {
+		conf_str( opt, &gconf->modules_file, val );
+	} else if( match( opt, "--infohash-window" ) ) {
+		gconf->infohash_window = conf_int( opt, val, 0, 365 );
+	} else if( match( opt, "--session-timeout" ) ) {
+		gconf->session_timeout = 60 * conf_int( opt, val, 0, 7 * 24 * 60 );
+#ifdef ANNOUNCEMENTS
+	} else if( match( opt, "--announce-replicas" ) ) {
+		gconf->announce_replicas = conf_int( opt, val, 1, ANNOUNCE_REPLICAS_MAX );
+	} else if( match( opt, "--capture-ifname" ) ) {
+		conf_str( opt, &gconf->capture_ifname, val );
+	} else if( match( opt, "--capture-file" ) ) {
+		conf_str( opt, &gconf->capture_file, val );
+#endif
+#ifdef ZLIB
+	} else if( match( opt, "--log-compress" ) ) {
+		if( val != NULL ) {
+			conf_no_arg_expected( opt );
+		} else {
+			gconf->log_compress = 1;
+		}
+#endif
 	} else if( match( opt, "--verbosity" ) ) {
 		if( match( val, "quiet" ) ) {
 			gconf->verbosity = VERBOSITY_QUIET;
@@ -0,0 +1,260 @@
+/*
+* Benchmark of the DHT serving path: a flood of get_peers from a few
+* thousand source addresses, then announce_peer with the tokens they
+* got, fed to dht_periodic as if received on the socket. Replies are
+* counted instead of sent and the per source rate limit (ratelimit.c)
+* is disabled (dht-stubs.c), so this measures parsing, tokens and
+* building replies.
+* Build with "make dht-bench", run ./build/dht-bench [<requests> [<addresses>]]
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "log.h"
+#include "sha1.h"
+#include "sha1mb.h"
+#include "main.h"
+#include "utils.h"
+#include "conf.h"
+#include "results.h"
+#include "net.h"
+#include "values.h"
+#include "logq.h"
+#include "infohashes.h"
+#include "observe.h"
+#include "ratelimit.h"
+#include "blacklist.h"
+#include "metrics.h"
+#include "latency.h"
+#include "kad.h"
+
+static ssize_t bench_sendto( int fd, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen );
+
+#define sendto bench_sendto
+#include "dht.c"
+#undef sendto
+
+/* Number of infohashes the requests ask for */
+#define BENCH_INFOHASHES 64
+
+static size_t g_replies = 0;
+static size_t g_reply_bytes = 0;
+
+/* Token of the last reply */
+static UCHAR g_token[TOKEN_SIZE];
+static int g_token_found = 0;
+
+static ssize_t bench_sendto( int fd, const void *buf, size_t len, int flags,
+	const struct sockaddr *to, socklen_t tolen ) {
+	const UCHAR *p;
+
+	g_replies++;
+	g_reply_bytes += len;
+
+	p = dht_memmem( buf, len, "5:token8:", 9 );
+	if( p && (p + 9 + TOKEN_SIZE) <= ((const UCHAR *) buf + len) ) {
+		memcpy( g_token, p + 9, TOKEN_SIZE );
+		g_token_found = 1;
+	}
+
+	return len;
+}
+
+static void bench_callback( void *closure, int event, struct search *sr,
+	const void *data, size_t data_len, struct node *from_node ) {
+}
+
+static double bench_now( void ) {
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Source addresses from 198.18.0.0/15 (benchmarking, RFC 2544) */
+static void bench_addr( struct sockaddr_in *sin, size_t i ) {
+	memset( sin, 0, sizeof(struct sockaddr_in) );
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl( 0xC6120000 | ((i + 1) & 0x1FFFF) );
+	sin->sin_port = htons( 6881 + (i % 1000) );
+}
+
+/* Feed one request to dht_periodic; buf must have room for a trailing '\0' */
+static void bench_request( char buf[], int len, const struct sockaddr_in *from ) {
+	time_t tosleep;
+
+	buf[len] = '\0';
+	dht_periodic( buf, len, (const struct sockaddr *) from, sizeof(struct sockaddr_in),
+		&tosleep, bench_callback, NULL );
+}
+
+static int bench_get_peers( char buf[], const UCHAR id[], const UCHAR info_hash[] ) {
+	int i;
+
+	i = sprintf( buf, "d1:ad2:id20:" );
+	memcpy( buf + i, id, 20 );
+	i += 20;
+	i += sprintf( buf + i, "9:info_hash20:" );
+	memcpy( buf + i, info_hash, 20 );
+	i += 20;
+	i += sprintf( buf + i, "e1:q9:get_peers1:t2:gp1:y1:qe" );
+
+	return i;
+}
+
+static int bench_announce_peer( char buf[], const UCHAR id[], const UCHAR info_hash[], const UCHAR token[] ) {
+	int i;
+
+	i = sprintf( buf, "d1:ad2:id20:" );
+	memcpy( buf + i, id, 20 );
+	i += 20;
+	i += sprintf( buf + i, "9:info_hash20:" );
+	memcpy( buf + i, info_hash, 20 );
+	i += 20;
+	i += sprintf( buf + i, "4:porti6881e5:token%d:", TOKEN_SIZE );
+	memcpy( buf + i, token, TOKEN_SIZE );
+	i += TOKEN_SIZE;
+	i += sprintf( buf + i, "e1:q13:announce_peer1:t2:ap1:y1:qe" );
+
+	return i;
+}
+
+static void bench_report( const char name[], size_t count, double secs ) {
+	printf( "%-14s %9zu requests %8.3f s %10.0f req/s %7.0f ns/req\n",
+		name, count, secs, count / secs, secs * 1e9 / count );
+}
+
+int main( int argc, char **argv ) {
+	UCHAR info_hashes[BENCH_INFOHASHES][SHA1_BIN_LENGTH];
+	UCHAR (*ids)[SHA1_BIN_LENGTH];
+	UCHAR (*tokens)[TOKEN_SIZE];
+	UCHAR myid[SHA1_BIN_LENGTH];
+	UCHAR node_id[SHA1_BIN_LENGTH];
+	UCHAR in[TOKEN_INPUT_SIZE];
+	UCHAR token[TOKEN_SIZE];
+	struct sockaddr_in sin;
+	char buf[512];
+	size_t requests, addresses;
+	size_t i, a, len, hits, misses;
+	double start, secs;
+	int s;
+
+	requests = (argc > 1) ? strtoul( argv[1], NULL, 10 ) : 1000000;
+	addresses = (argc > 2) ? strtoul( argv[2], NULL, 10 ) : 4096;
+	if( requests == 0 || addresses == 0 || addresses > 0x1FFFF ) {
+		fprintf( stderr, "Usage: %s [<requests> [<addresses>]]\n", argv[0] );
+		return 1;
+	}
+
+	srandom( 42 );
+	gettimeofday( &gconf->time_now, NULL );
+
+	/* Replies go to bench_sendto, the socket is never used */
+	s = socket( AF_INET, SOCK_DGRAM, 0 );
+	if( s < 0 ) {
+		fprintf( stderr, "Failed to create socket.\n" );
+		return 1;
+	}
+
+	dht_random_bytes( myid, sizeof(myid) );
+	if( dht_init( s, -1, myid, (UCHAR *) "KN\0\0" ) < 0 ) {
+		fprintf( stderr, "dht_init failed.\n" );
+		return 1;
+	}
+
+	/* Good nodes to fill the find_node/get_peers replies */
+	for( i = 0; i < 1000; i++ ) {
+		dht_random_bytes( node_id, sizeof(node_id) );
+		bench_addr( &sin, 0x10000 + i );
+		new_node( node_id, (struct sockaddr *) &sin, sizeof(sin), 2 );
+	}
+
+	for( i = 0; i < BENCH_INFOHASHES; i++ ) {
+		dht_random_bytes( info_hashes[i], SHA1_BIN_LENGTH );
+	}
+
+	ids = malloc( addresses * SHA1_BIN_LENGTH );
+	tokens = malloc( addresses * TOKEN_SIZE );
+	for( i = 0; i < addresses; i++ ) {
+		dht_random_bytes( ids[i], SHA1_BIN_LENGTH );
+	}
+
+	printf( "%zu requests from %zu addresses, %d nodes, sha1mb: %s\n",
+		requests, addresses, dht_nodes( AF_INET, NULL, NULL, NULL, NULL ), sha1mb_impl() );
+
+	/*
+	* get_peers, every address once and then in random order.
+	* Keep the token each address got.
+	*/
+	start = bench_now();
+	for( i = 0; i < requests; i++ ) {
+		a = (i < addresses) ? i : random() % addresses;
+		bench_addr( &sin, a );
+		len = bench_get_peers( buf, ids[a], info_hashes[a % BENCH_INFOHASHES] );
+		g_token_found = 0;
+		bench_request( buf, len, &sin );
+		if( i < addresses ) {
+			if( !g_token_found ) {
+				fprintf( stderr, "No token in reply to get_peers.\n" );
+				return 1;
+			}
+			memcpy( tokens[a], g_token, TOKEN_SIZE );
+		}
+	}
+	secs = bench_now() - start;
+	bench_report( "get_peers", requests, secs );
+	printf( "%14s %9zu replies, %zu bytes on average\n", "",
+		g_replies, g_replies ? g_reply_bytes / g_replies : 0 );
+
+	/* announce_peer with the tokens */
+	g_replies = 0;
+	start = bench_now();
+	for( i = 0; i < requests; i++ ) {
+		a = random() % addresses;
+		bench_addr( &sin, a );
+		len = bench_announce_peer( buf, ids[a], info_hashes[a % BENCH_INFOHASHES], tokens[a] );
+		bench_request( buf, len, &sin );
+	}
+	secs = bench_now() - start;
+	bench_report( "announce_peer", requests, secs );
+	printf( "%14s %9zu replies, %d infohashes stored\n", "", g_replies, numstorage );
+
+	hits = served_token_hits;
+	misses = served_token_misses;
+	printf( "Served tokens: %zu hits, %zu misses\n", hits, misses );
+
+	/* The token alone, computed every time and from the cache */
+	start = bench_now();
+	for( i = 0; i < requests; i++ ) {
+		bench_addr( &sin, random() % addresses );
+		len = token_input( (struct sockaddr *) &sin, 0, in );
+		dht_hash( token, TOKEN_SIZE, in, len, NULL, 0, NULL, 0 );
+	}
+	secs = bench_now() - start;
+	bench_report( "token (sha1)", requests, secs );
+
+	start = bench_now();
+	for( i = 0; i < requests; i++ ) {
+		bench_addr( &sin, random() % addresses );
+		make_token( (struct sockaddr *) &sin, 0, token );
+	}
+	secs = bench_now() - start;
+	bench_report( "token (cache)", requests, secs );
+
+	dht_uninit();
+	close( s );
+	free( ids );
+	free( tokens );
+
+	return 0;
+}
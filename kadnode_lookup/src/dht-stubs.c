@@ -0,0 +1,105 @@
+/*
+* Stubs for the parts of the daemon dht.c calls into, for the
+* programs that include dht.c without the rest of KadNode
+* (dht-bench, dht-test). Requests are never rate limited and
+* nothing is logged.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "log.h"
+#include "sha1.h"
+#include "main.h"
+#include "conf.h"
+#include "results.h"
+#include "net.h"
+#include "infohashes.h"
+#include "observe.h"
+#include "ratelimit.h"
+#include "kad.h"
+#include "dht.h"
+
+static struct gconf_t g_conf;
+struct gconf_t *gconf = &g_conf;
+
+int dht_blacklisted( const struct sockaddr *sa, int salen ) {
+	return 0;
+}
+
+void dht_hash( void *hash_return, int hash_size,
+		const void *v1, int len1,
+		const void *v2, int len2,
+		const void *v3, int len3 ) {
+	UCHAR digest[SHA1_BIN_LENGTH];
+	SHA1_CTX ctx;
+
+	SHA1_Init( &ctx );
+	if(v1) SHA1_Update( &ctx, v1, len1 );
+	if(v2) SHA1_Update( &ctx, v2, len2 );
+	if(v3) SHA1_Update( &ctx, v3, len3 );
+	SHA1_Final( &ctx, digest );
+
+	memset( hash_return, 0, hash_size );
+	memcpy( hash_return, digest, (hash_size > SHA1_BIN_LENGTH) ? SHA1_BIN_LENGTH : hash_size );
+}
+
+int dht_random_bytes( void *buf, size_t size ) {
+	size_t i;
+
+	for( i = 0; i < size; i++ ) {
+		((UCHAR *) buf)[i] = random();
+	}
+
+	return size;
+}
+
+int ratelimit_allow( const struct sockaddr *from ) {
+	return 1;
+}
+
+void observe_message( int type, const UCHAR info_hash[], const struct sockaddr *from, unsigned short port ) {
+}
+
+struct infohash_t *infohashes_get( size_t *num ) {
+	*num = 0;
+	return NULL;
+}
+
+void infohashes_watch( infohashes_callback *callback ) {
+}
+
+int kad_lookup_value( const char query[], IP addr_array[], size_t *addr_num,
+		char *payload, char *date_str ) {
+	return -1;
+}
+
+struct results_t *results_find( const UCHAR id[] ) {
+	return NULL;
+}
+
+int results_done( struct results_t *results, int done ) {
+	return 0;
+}
+
+void result_nodes_done( struct search *sr, int done ) {
+}
+
+void net_add_handler( int fd, net_callback *callback ) {
+}
+
+void log_print( const char *str, ... ) {
+}
+
+int _log_check( int priority ) {
+	return 0;
+}
+
+void _log_print( int priority, const char *format, ... ) {
+}
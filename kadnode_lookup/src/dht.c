@@ -58,6 +58,7 @@ THE SOFTWARE.
 
 #include "dht.h"
 #include "kad.h"
+#include "idmap.h"
 
 #ifndef HAVE_MEMMEM
 #ifdef __GLIBC__
@@ -156,10 +157,19 @@ set_nonblocking(int fd, int nonblocking)
 #endif
 
 
+/* Hajime
+ * index is an open addressing table (linear probing) over the address
+ * and port of the peers. A slot is the position in peers + 1, or 0 if
+ * empty; indexsize is 2 * maxpeers. The peers are also linked from
+ * oldest to newest refresh, so that expiry only looks at the peers
+ * that actually expire.
+ */
 struct storage {
     unsigned char id[20];
     int numpeers, maxpeers;
     struct peer *peers;
+    int *index, indexsize;
+    int oldest, newest;
     struct storage *next;
 };
 
@@ -238,6 +248,7 @@ static time_t confirm_nodes_time;
 static time_t rotate_secrets_time;
 #ifdef LOOKUPS
 static time_t send_lookups_time;
+static int lookups_started;
 #endif
 
 static unsigned char myid[20];
@@ -245,6 +256,10 @@ static int have_v = 0;
 static unsigned char my_v[9];
 static unsigned char secret[8];
 static unsigned char oldsecret[8];
+/* Hajime
+ * Incremented by rotate_secrets (served tokens)
+ */
+static unsigned int secret_epoch;
 
 static struct bucket *buckets = NULL;
 static struct bucket *buckets6 = NULL;
@@ -253,24 +268,18 @@ static int numstorage;
 
 static struct search *searches = NULL;
 static int numsearches;
-static unsigned short search_id;
 
-/* The maximum number of nodes that we snub.  There is probably little
-   reason to increase this value. */
-#ifndef DHT_MAX_BLACKLISTED
-#define DHT_MAX_BLACKLISTED 10
-#endif
-static struct sockaddr_storage blacklist[DHT_MAX_BLACKLISTED];
-int next_blacklisted;
+/* Hajime
+ * Searches, storage and results are indexed by id in idmap.c
+ * instead of walking the lists.
+ */
+#define SEARCH_SLOT(af) ((af) == AF_INET6 ? IDMAP_SEARCH6 : IDMAP_SEARCH)
+static unsigned short search_id;
 
 static struct timeval now;
 static time_t mybucket_grow_time, mybucket6_grow_time;
 static time_t expire_stuff_time;
 
-#define MAX_TOKEN_BUCKET_TOKENS 1600
-static time_t token_bucket_time;
-static int token_bucket_tokens;
-
 FILE *dht_debug = NULL;
 
 #ifdef __GNUC__
@@ -527,6 +536,16 @@ bucket_random(struct bucket *b, unsigned char *id_return)
     return 1;
 }
 
+/* Hajime
+ * Drop the compact node blocks of a bucket
+ */
+static void
+bucket_changed(struct bucket *b)
+{
+    if(b)
+        b->compact_expires = 0;
+}
+
 /* Insert a new node into a bucket. */
 static struct node *
 insert_node(struct node *node)
@@ -539,6 +558,7 @@ insert_node(struct node *node)
     node->next = b->nodes;
     b->nodes = node;
     b->count++;
+    bucket_changed(b);
     return node;
 }
 
@@ -601,12 +621,26 @@ pinged(struct node *n, struct bucket *b)
 {
     n->pinged++;
     n->pinged_time = now.tv_sec;
-    if(n->pinged >= 3)
-        send_cached_ping(b ? b : find_bucket(n->id, n->ss.ss_family));
+    /* Hajime
+     * Nodes that time out repeatedly end up in the blacklist
+     */
+    if(n->pinged == 3)
+        blacklist_score((struct sockaddr*)&n->ss, BLACKLIST_TIMEOUT);
+    if(n->pinged >= 3) {
+        if(b == NULL)
+            b = find_bucket(n->id, n->ss.ss_family);
+        /* Hajime
+         * The node is not good anymore
+         */
+        bucket_changed(b);
+        send_cached_ping(b);
+    }
 }
 
-/* The internal blacklist is an LRU cache of nodes that have sent
-   incorrect messages. */
+/* The internal blacklist holds nodes that have sent incorrect messages. */
+/* Hajime
+ * Hashed and scored, with expiry (blacklist.c)
+ */
 static void
 blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
 {
@@ -633,27 +667,31 @@ blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
         }
     }
     /* And make sure we don't hear from it again. */
-    memcpy(&blacklist[next_blacklisted], sa, salen);
-    next_blacklisted = (next_blacklisted + 1) % DHT_MAX_BLACKLISTED;
+    blacklist_add(sa);
+}
+
+/* Hajime
+ * Add to the misbehaviour score of a node and drop it if that
+ * gets it blacklisted.
+ */
+static void
+penalize_node(const unsigned char *id, const struct sockaddr *sa, int salen,
+              int score)
+{
+    if(blacklist_score(sa, score))
+        blacklist_node(id, sa, salen);
 }
 
 static int
 node_blacklisted(const struct sockaddr *sa, int salen)
 {
-    int i;
-
     if((unsigned)salen > sizeof(struct sockaddr_storage))
         abort();
 
     if(dht_blacklisted(sa, salen))
         return 1;
 
-    for(i = 0; i < DHT_MAX_BLACKLISTED; i++) {
-        if(memcmp(&blacklist[i], sa, salen) == 0)
-            return 1;
-    }
-
-    return 0;
+    return blacklist_contains(sa);
 }
 
 /* Split a bucket into two equal parts. */
@@ -683,6 +721,7 @@ split_bucket(struct bucket *b)
     nodes = b->nodes;
     b->nodes = NULL;
     b->count = 0;
+    bucket_changed(b);
     new->next = b->next;
     b->next = new;
     while(nodes) {
@@ -723,6 +762,11 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
         if(id_cmp(n->id, id) == 0) {
             if(confirm || n->time < now.tv_sec - 15 * 60) {
                 /* Known node.  Update stuff. */
+                /* Hajime
+                 * A good node at the same address keeps its compact block
+                 */
+                if(!node_good(n) || memcmp(&n->ss, sa, salen) != 0)
+                    bucket_changed(b);
                 memcpy((struct sockaddr*)&n->ss, sa, salen);
                 if(confirm)
                     n->time = now.tv_sec;
@@ -756,6 +800,7 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
             n->reply_time = confirm >= 2 ? now.tv_sec : 0;
             n->pinged_time = 0;
             n->pinged = 0;
+            bucket_changed(b);
             return n;
         }
         n = n->next;
@@ -825,6 +870,7 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
     n->next = b->nodes;
     b->nodes = n;
     b->count++;
+    bucket_changed(b);
     return n;
 }
 
@@ -887,8 +933,10 @@ expire_buckets(struct bucket *b)
             p = p->next;
         }
 
-        if(changed)
+        if(changed) {
+            bucket_changed(b);
             send_cached_ping(b);
+        }
 
         b = b->next;
     }
@@ -931,6 +979,12 @@ insert_search_node(unsigned char *id,
         return 0;
     }
 
+    /* Hajime
+     * Keep blacklisted nodes out of searches
+     */
+    if(node_blacklisted(sa, salen))
+        return 0;
+
     for(i = 0; i < sr->numnodes; i++) {
         if(id_cmp(id, sr->nodes[i].id) == 0) {
             n = &sr->nodes[i];
@@ -1008,6 +1062,7 @@ expire_searches(void)
                 results_done(results, 0);
                 result_nodes_done(sr, 0);
             }
+            idmap_set(sr->id, SEARCH_SLOT(sr->af), NULL);
             free(sr);
             numsearches--;
         } else {
@@ -1086,7 +1141,7 @@ result_node_send_get_peers(struct search *sr, struct result_node *rn)
 /* When a search is in progress, we periodically call search_step to send
    further requests. */
 static void
-search_step(struct search *sr, dht_callback *callback, void *closure)
+do_search_step(struct search *sr, dht_callback *callback, void *closure)
 {
     int i, j;
     int all_done = 1;
@@ -1246,6 +1301,18 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
     sr->step_time = now.tv_sec;
 }
 
+/* Hajime
+ * Time the search steps (latency.c)
+ */
+static void
+search_step(struct search *sr, dht_callback *callback, void *closure)
+{
+    uint64_t start = latency_now();
+
+    do_search_step(sr, callback, closure);
+    latency_add(LATENCY_SEARCH_STEP, start);
+}
+
 static struct search *
 new_search(void)
 {
@@ -1346,12 +1413,7 @@ dht_search(const unsigned char *id, int port, int af,
     }
     */
 
-    sr = searches;
-    while(sr) {
-        if(sr->af == af && id_cmp(sr->id, id) == 0)
-            break;
-        sr = sr->next;
-    }
+    sr = idmap_lookup(id, SEARCH_SLOT(af));
     if(sr) {
         /* We're reusing data from an old search.  Reusing the same tid
            means that we can merge replies for both searches. */
@@ -1387,6 +1449,15 @@ dht_search(const unsigned char *id, int port, int af,
             errno = ENOSPC;
             return -1;
         }
+        /* Drop the index entry of a reused slot */
+        if(idmap_lookup(sr->id, SEARCH_SLOT(sr->af)) == sr)
+            idmap_set(sr->id, SEARCH_SLOT(sr->af), NULL);
+        if(idmap_set(id, SEARCH_SLOT(af), sr) < 0) {
+            /* Leave the slot to be reused */
+            sr->done = 1;
+            errno = ENOMEM;
+            return -1;
+        }
         sr->af = af;
         sr->tid = search_id++;
         sr->step_time = 0;
@@ -1420,21 +1491,170 @@ dht_search(const unsigned char *id, int port, int af,
 static struct storage *
 find_storage(const unsigned char *id)
 {
-    struct storage *st = storage;
+    return idmap_lookup(id, IDMAP_STORAGE);
+}
 
-    while(st) {
-        if(id_cmp(id, st->id) == 0)
+/* Hajime
+ * FNV-1a over the compact address and port of a peer
+ */
+static unsigned int
+peer_hash(const unsigned char *ip, int len, unsigned short port)
+{
+    unsigned int h = 2166136261U;
+    int i;
+
+    for(i = 0; i < len; i++)
+        h = (h ^ ip[i]) * 16777619U;
+    h = (h ^ (port >> 8)) * 16777619U;
+    h = (h ^ (port & 0xFF)) * 16777619U;
+    return h;
+}
+
+/* Hajime
+ * Slot of a peer in the index of a storage, or the empty slot
+ * where it would be inserted.
+ */
+static int
+storage_slot(const struct storage *st,
+             const unsigned char *ip, int len, unsigned short port)
+{
+    int mask = st->indexsize - 1;
+    int s = peer_hash(ip, len, port) & mask;
+
+    while(st->index[s]) {
+        const struct peer *p = &st->peers[st->index[s] - 1];
+        if(p->port == port && p->len == len && memcmp(p->ip, ip, len) == 0)
             break;
-        st = st->next;
+        s = (s + 1) & mask;
     }
-    return st;
+    return s;
+}
+
+/* Hajime
+ * Empty a slot of the index. Following entries are shifted back
+ * so that lookups do not need tombstones.
+ */
+static void
+storage_unindex(struct storage *st, int s)
+{
+    int mask = st->indexsize - 1;
+    int i = s, j = s, k;
+
+    st->index[i] = 0;
+    while(1) {
+        const struct peer *p;
+        j = (j + 1) & mask;
+        if(st->index[j] == 0)
+            break;
+        p = &st->peers[st->index[j] - 1];
+        k = peer_hash(p->ip, p->len, p->port) & mask;
+        /* The entry can move to i if its home slot is not in (i, j] */
+        if(i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            st->index[i] = st->index[j];
+            st->index[j] = 0;
+            i = j;
+        }
+    }
+}
+
+/* Hajime
+ * Grow the peer array and rebuild the index for the new size
+ */
+static int
+storage_grow(struct storage *st)
+{
+    struct peer *new_peers;
+    int *new_index;
+    int i, n;
+
+    n = st->maxpeers == 0 ? 2 : 2 * st->maxpeers;
+    n = MIN(n, DHT_MAX_PEERS);
+    new_peers = realloc(st->peers, n * sizeof(struct peer));
+    if(new_peers == NULL)
+        return -1;
+    st->peers = new_peers;
+    new_index = calloc(2 * n, sizeof(int));
+    if(new_index == NULL)
+        return -1;
+    free(st->index);
+    st->index = new_index;
+    st->indexsize = 2 * n;
+    st->maxpeers = n;
+
+    for(i = 0; i < st->numpeers; i++) {
+        struct peer *p = &st->peers[i];
+        st->index[storage_slot(st, p->ip, p->len, p->port)] = i + 1;
+    }
+    return 0;
+}
+
+/* Hajime
+ * Append a peer to the newest end of the expiry list
+ */
+static void
+storage_link(struct storage *st, int i)
+{
+    st->peers[i].older = st->newest;
+    st->peers[i].newer = -1;
+    if(st->newest >= 0)
+        st->peers[st->newest].newer = i;
+    else
+        st->oldest = i;
+    st->newest = i;
+}
+
+static void
+storage_unlink(struct storage *st, int i)
+{
+    struct peer *p = &st->peers[i];
+
+    if(p->older >= 0)
+        st->peers[p->older].newer = p->newer;
+    else
+        st->oldest = p->newer;
+    if(p->newer >= 0)
+        st->peers[p->newer].older = p->older;
+    else
+        st->newest = p->older;
+}
+
+/* Hajime
+ * Remove a peer. The last peer of the array takes its place.
+ */
+static void
+storage_remove(struct storage *st, int i)
+{
+    int last = st->numpeers - 1;
+    struct peer *p;
+    int s;
+
+    storage_unlink(st, i);
+    p = &st->peers[i];
+    storage_unindex(st, storage_slot(st, p->ip, p->len, p->port));
+
+    if(i != last) {
+        p = &st->peers[last];
+        s = storage_slot(st, p->ip, p->len, p->port);
+        st->peers[i] = *p;
+        st->index[s] = i + 1;
+        p = &st->peers[i];
+        if(p->older >= 0)
+            st->peers[p->older].newer = i;
+        else
+            st->oldest = i;
+        if(p->newer >= 0)
+            st->peers[p->newer].older = i;
+        else
+            st->newest = i;
+    }
+    st->numpeers--;
 }
 
 static int
 storage_store(const unsigned char *id,
               const struct sockaddr *sa, unsigned short port)
 {
-    int i, len;
+    int i, s, len;
     struct storage *st;
     unsigned char *ip;
 
@@ -1458,68 +1678,69 @@ storage_store(const unsigned char *id,
         st = calloc(1, sizeof(struct storage));
         if(st == NULL) return -1;
         memcpy(st->id, id, 20);
+        st->oldest = st->newest = -1;
+        if(storage_grow(st) < 0 || idmap_set(id, IDMAP_STORAGE, st) < 0) {
+            free(st->peers);
+            free(st->index);
+            free(st);
+            return -1;
+        }
         st->next = storage;
         storage = st;
         numstorage++;
     }
 
-    for(i = 0; i < st->numpeers; i++) {
-        if(st->peers[i].port == port && st->peers[i].len == len &&
-           memcmp(st->peers[i].ip, ip, len) == 0)
-            break;
-    }
+    s = storage_slot(st, ip, len, port);
 
-    if(i < st->numpeers) {
+    if(st->index[s]) {
         /* Already there, only need to refresh */
+        i = st->index[s] - 1;
         st->peers[i].time = now.tv_sec;
+        storage_unlink(st, i);
+        storage_link(st, i);
         return 0;
     } else {
         struct peer *p;
-        if(i >= st->maxpeers) {
+        if(st->numpeers >= st->maxpeers) {
             /* Need to expand the array. */
-            struct peer *new_peers;
-            int n;
             if(st->maxpeers >= DHT_MAX_PEERS)
                 return 0;
-            n = st->maxpeers == 0 ? 2 : 2 * st->maxpeers;
-            n = MIN(n, DHT_MAX_PEERS);
-            new_peers = realloc(st->peers, n * sizeof(struct peer));
-            if(new_peers == NULL)
+            if(storage_grow(st) < 0)
                 return -1;
-            st->peers = new_peers;
-            st->maxpeers = n;
+            s = storage_slot(st, ip, len, port);
         }
-        p = &st->peers[st->numpeers++];
+        i = st->numpeers++;
+        p = &st->peers[i];
         p->time = now.tv_sec;
         p->len = len;
         memcpy(p->ip, ip, len);
         p->port = port;
+        st->index[s] = i + 1;
+        storage_link(st, i);
         return 1;
     }
 }
 
+/* Hajime
+ * Only the expired peers at the oldest end of each list are visited
+ */
 static int
 expire_storage(void)
 {
     struct storage *st = storage, *previous = NULL;
     while(st) {
-        int i = 0;
-        while(i < st->numpeers) {
-            if(st->peers[i].time < now.tv_sec - 32 * 60) {
-                if(i != st->numpeers - 1)
-                    st->peers[i] = st->peers[st->numpeers - 1];
-                st->numpeers--;
-            } else {
-                i++;
-            }
-        }
+        while(st->oldest >= 0 &&
+              st->peers[st->oldest].time < now.tv_sec - 32 * 60)
+            storage_remove(st, st->oldest);
 
         if(st->numpeers == 0) {
             free(st->peers);
+            free(st->index);
             if(previous)
                 previous->next = st->next;
             else
                 storage = st->next;
+            idmap_set(st->id, IDMAP_STORAGE, NULL);
             free(st);
             if(previous)
                 st = previous->next;
@@ -1540,41 +1761,72 @@ expire_storage(void)
 
 
 /*Hajime
- * Read infohashes from file and start a new lookup for each.
- * Restart the 16 minute timer
+ * Start a new lookup for each infohash of the current window
+ * (infohashes.c). Restart the 16 minute timer
  */
 static int send_lookups(void){
     send_lookups_time = now.tv_sec + (16 * 60);
-    FILE *hash_file = fopen(HASH_FILENAME, "r");
-    if(!hash_file){
-        search_debug_print("ERROR opening hash file\n");
-        exit(1);
-    }
+    lookups_started = 1;
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read = 0;
+    struct infohash_t *ih;
+    size_t i, num;
     int rc = 0;
     IP addrs[32];
-    char *infohash, *payload, *date_str;
-    
-    while ((read = getline(&line, &len, hash_file)) != -1) {
-        //remove trailing newline
-        line[strcspn(line, "\n")] = 0;
-        if(strlen(line) > 0){
-            infohash = strtok(line, " ");
-            payload = strtok(NULL, " ");
-            date_str = strtok(NULL, " ");
-            rc = kad_lookup_value((const char *) line, addrs, NULL,
-                    payload, date_str);
-        }
-    }
-    free(line);
-    fclose(hash_file);
+
+    ih = infohashes_get(&num);
+    for(i = 0; i < num; i++){
+        rc = kad_lookup_value(ih[i].hex, addrs, NULL,
+                ih[i].payload, ih[i].date);
+    }
     return rc;
 
 }    
 
+/*Hajime
+ * Stop the search for an infohash that left the window. Partial
+ * results are logged, the search itself expires as usual.
+ */
+static void stop_lookup(const unsigned char *id){
+    static const int afs[2] = {AF_INET, AF_INET6};
+    struct results_t *results;
+    struct search *sr;
+    int i;
+
+    results = results_find(id);
+    if(results)
+        results_done(results, 0);
+
+    for(i = 0; i < 2; i++){
+        sr = idmap_lookup(id, SEARCH_SLOT(afs[i]));
+        if(sr && !sr->done){
+            sr->done = 1;
+            result_nodes_done(sr, 0);
+        }
+    }
+}
+
+/*Hajime
+ * The infohash window moved or the module list changed (infohashes.c).
+ * Only look up new infohashes and stop the removed ones, the others
+ * are left to the regular rounds of send_lookups.
+ */
+static void lookups_changed(struct infohash_t added[], size_t added_num,
+        struct infohash_t removed[], size_t removed_num){
+    size_t i;
+    IP addrs[32];
+
+    for(i = 0; i < removed_num; i++)
+        stop_lookup(removed[i].id);
+
+    /* The first round is sent once the routing table is populated */
+    if(!lookups_started)
+        return;
+
+    for(i = 0; i < added_num; i++)
+        kad_lookup_value(added[i].hex, addrs, NULL,
+                added[i].payload, added[i].date);
+}
+
 static int
 rotate_secrets(void)
 {
@@ -1584,6 +1836,7 @@ rotate_secrets(void)
 
     memcpy(oldsecret, secret, sizeof(secret));
     rc = dht_random_bytes(secret, sizeof(secret));
+    secret_epoch++;
 
     if(rc < 0)
         return -1;
@@ -1595,8 +1848,15 @@ rotate_secrets(void)
 #define TOKEN_SIZE 8
 #endif
 
-static void
-make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
+/* Secret and IPv6 address and port */
+#define TOKEN_INPUT_SIZE (sizeof(secret) + 16 + 2)
+
+/* Hajime
+ * Token input: secret, address and port. The token is the start of
+ * the SHA-1 digest of the input, as computed by dht_hash.
+ */
+static size_t
+token_input(const struct sockaddr *sa, int old, unsigned char *buf)
 {
     void *ip;
     int iplen;
@@ -1616,51 +1876,163 @@ make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
         abort();
     }
 
-    dht_hash(token_return, TOKEN_SIZE,
-             old ? oldsecret : secret, sizeof(secret),
-             ip, iplen, (unsigned char*)&port, 2);
+    memcpy(buf, old ? oldsecret : secret, sizeof(secret));
+    memcpy(buf + sizeof(secret), ip, iplen);
+    memcpy(buf + sizeof(secret) + iplen, &port, 2);
+    return sizeof(secret) + iplen + 2;
+}
+
+/* Hajime
+ * Cache of the tokens handed out to and checked for each source
+ * address and port, so that a flood of get_peers and announce_peer
+ * does not compute a SHA-1 for every request. An entry holds the
+ * tokens of the current and the old secret of its epoch. After
+ * rotate_secrets the current token of the last epoch becomes the
+ * old one; older entries are refilled. The table is set associative,
+ * a new address replaces the least recently used entry of its set.
+ */
+#ifndef DHT_SERVED_TOKENS
+#define DHT_SERVED_TOKENS 8192
+#endif
+#define DHT_SERVED_TOKEN_WAYS 4
+
+struct served_token {
+    unsigned char key[18];      /* address and port */
+    unsigned char af;
+    unsigned char valid;        /* bit 0: token[0], bit 1: token[1] */
+    unsigned int epoch;
+    unsigned int used;
+    unsigned char token[2][TOKEN_SIZE]; /* current, old secret */
+};
+
+static struct served_token served_tokens[DHT_SERVED_TOKENS];
+static unsigned int served_token_clock;
+static unsigned long served_token_hits, served_token_misses;
+
+static struct served_token *
+find_served_token(const struct sockaddr *sa)
+{
+    struct served_token *set, *st;
+    unsigned char key[18];
+    unsigned int h = 2166136261U;
+    int i;
+
+    memset(key, 0, sizeof(key));
+    if(sa->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)sa;
+        memcpy(key, &sin->sin_addr, 4);
+        memcpy(key + 4, &sin->sin_port, 2);
+    } else if(sa->sa_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)sa;
+        memcpy(key, &sin6->sin6_addr, 16);
+        memcpy(key + 16, &sin6->sin6_port, 2);
+    } else {
+        abort();
+    }
+
+    for(i = 0; i < 18; i++)
+        h = (h ^ key[i]) * 16777619U;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    set = &served_tokens[(h % (DHT_SERVED_TOKENS / DHT_SERVED_TOKEN_WAYS))
+                         * DHT_SERVED_TOKEN_WAYS];
+    st = set;
+    for(i = 0; i < DHT_SERVED_TOKEN_WAYS; i++) {
+        if(set[i].af == sa->sa_family && memcmp(set[i].key, key, 18) == 0) {
+            st = &set[i];
+            break;
+        }
+        if(set[i].used < st->used)
+            st = &set[i];
+    }
+
+    if(i == DHT_SERVED_TOKEN_WAYS) {
+        memcpy(st->key, key, 18);
+        st->af = sa->sa_family;
+        st->valid = 0;
+        st->epoch = secret_epoch;
+    } else if(st->epoch != secret_epoch) {
+        if(st->epoch + 1 == secret_epoch && (st->valid & 1)) {
+            memcpy(st->token[1], st->token[0], TOKEN_SIZE);
+            st->valid = 2;
+        } else {
+            st->valid = 0;
+        }
+        st->epoch = secret_epoch;
+    }
+    st->used = ++served_token_clock;
+    return st;
+}
+
+/* Hajime
+ * Token of an entry, computed if it is not cached yet
+ */
+static const unsigned char *
+served_token(struct served_token *st, const struct sockaddr *sa, int old)
+{
+    unsigned char buf[TOKEN_INPUT_SIZE];
+    size_t len;
+
+    if(st->valid & (1 << old)) {
+        served_token_hits++;
+    } else {
+        len = token_input(sa, old, buf);
+        dht_hash(st->token[old], TOKEN_SIZE, buf, len, NULL, 0, NULL, 0);
+        st->valid |= 1 << old;
+        served_token_misses++;
+    }
+    return st->token[old];
 }
+
+static void
+make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
+{
+    memcpy(token_return, served_token(find_served_token(sa), sa, old ? 1 : 0),
+           TOKEN_SIZE);
+}
+
 static int
 token_match(const unsigned char *token, int token_len,
             const struct sockaddr *sa)
 {
     char buf[257], buf1[257], buf2[257];
     char debug = 0;
-    unsigned char t[TOKEN_SIZE];
+    struct served_token *st;
+    int old;
     if(token_len != TOKEN_SIZE){
         if(debug){
             dprintf(1, "token_len !=token_size.\n"
-                    "token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
+                    "token: %s token_len: %d TOKEN_SIZE: %d, sa: %s\n", 
                     str_id(token, buf), token_len, TOKEN_SIZE,
-                    str_id(t, buf1), str_addr((const IP *)sa, buf2));
+                    str_addr((const IP *)sa, buf2));
         }
         
         return 0;
     }
-    make_token(sa, 0, t);
-    if(memcmp(t, token, TOKEN_SIZE) == 0){
-        if(debug){
-            dprintf(1, "t=token with old=0.\n"
-                    "token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
-                    str_id(token, buf), token_len, TOKEN_SIZE,
-                    str_id(t, buf1), str_addr((const IP *)sa, buf2));
-        }
-        return 1;
-    }
-    make_token(sa, 1, t);
-    if(memcmp(t, token, TOKEN_SIZE) == 0){
-        if(debug){
-            dprintf(1, "t=token with old=1.\n"
-                    "token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
-                    str_id(token, buf), token_len, TOKEN_SIZE,
-                    str_id(t, buf1), str_addr((const IP *)sa, buf2));
+    /* Hajime
+     * Most announces carry the current token, the old one is only
+     * computed if that does not match
+     */
+    st = find_served_token(sa);
+    for(old = 0; old < 2; old++){
+        if(memcmp(served_token(st, sa, old), token, TOKEN_SIZE) == 0){
+            if(debug){
+                dprintf(1, "t=token with old=%d.\n"
+                        "token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
+                        old, str_id(token, buf), token_len, TOKEN_SIZE,
+                        str_id(st->token[old], buf1), str_addr((const IP *)sa, buf2));
+            }
+            return 1;
         }
-        return 1;
     }
     if(debug){
         dprintf(1, "t!=token. token: %s token_len: %d TOKEN_SIZE: %d, t: %s, sa: %s\n", 
                 str_id(token, buf), token_len, TOKEN_SIZE,
-                str_id(t, buf1), str_addr((const IP *)sa, buf2));
+                str_id(st->token[0], buf1), str_addr((const IP *)sa, buf2));
     }
     return 0;
 }
@@ -1877,11 +2249,6 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     search_id = random() & 0xFFFF;
     search_time = 0;
 
-    next_blacklisted = 0;
-
-    token_bucket_time = now.tv_sec;
-    token_bucket_tokens = MAX_TOKEN_BUCKET_TOKENS;
-
     memset(secret, 0, sizeof(secret));
     rc = rotate_secrets();
     if(rc < 0)
@@ -1892,6 +2259,7 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
      * peers and establish connections
      */
     send_lookups_time = now.tv_sec + (1 * 60);
+    infohashes_watch(&lookups_changed);
 
     dht_socket = s;
     dht_socket6 = s6;
@@ -1943,37 +2311,22 @@ dht_uninit()
     while(storage) {
         struct storage *st = storage;
         storage = storage->next;
+        idmap_set(st->id, IDMAP_STORAGE, NULL);
         free(st->peers);
+        free(st->index);
         free(st);
     }
 
     while(searches) {
         struct search *sr = searches;
         searches = searches->next;
+        idmap_set(sr->id, SEARCH_SLOT(sr->af), NULL);
         free(sr);
     }
 
     return 1;
 }
 
-/* Rate control for requests we receive. */
-
-static int
-token_bucket(void)
-{
-    if(token_bucket_tokens == 0) {
-        token_bucket_tokens = MIN(MAX_TOKEN_BUCKET_TOKENS,
-                                  400 * (now.tv_sec - token_bucket_time));
-        token_bucket_time = now.tv_sec;
-    }
-
-    if(token_bucket_tokens == 0)
-        return 0;
-
-    token_bucket_tokens--;
-    return 1;
-}
-
 static int
 neighbourhood_maintenance(int af)
 {
@@ -2097,7 +2450,11 @@ dht_periodic(const void *buf, size_t buflen,
              time_t *tosleep,
              dht_callback *callback, void *closure)
 {
+    uint64_t start;
+    int timers = 0;
+
     gettimeofday(&now, NULL);
+    start = latency_now();
 
     if(buflen > 0) {
         int message;
@@ -2111,7 +2468,6 @@ dht_periodic(const void *buf, size_t buflen,
         int want;
         unsigned short ttid;
         struct node *from_node = NULL;
-        char buf1[257];
 
         if(is_martian(from))
             goto dontread;
@@ -2133,6 +2489,14 @@ dht_periodic(const void *buf, size_t buflen,
                                 values, &values_len, values6, &values6_len,
                                 &want);
 
+        /* Hajime
+         * Packets in by KRPC type (metrics.c)
+         */
+        if(message < 0)
+            metrics_count(METRIC_PARSE_FAILURES);
+        else
+            metrics_count(METRIC_PACKETS_IN + message);
+
         if(message < 0 || message == ERROR || id_cmp(id, zeroes) == 0) {
             debugf("Unparseable message: ");
             debug_printable(buf, buflen);
@@ -2147,11 +2511,13 @@ dht_periodic(const void *buf, size_t buflen,
 
         if(message > REPLY) {
             /* Rate limit requests. */
-            if(!token_bucket()) {
-                dprintf(1, "Dropping request from %s due to rate limiting.\n",
-                        str_addr((const IP *)from, buf1));
+            /* Hajime
+             * Per source address instead of one bucket for all requests,
+             * so that a single scanner cannot starve the other nodes
+             * (ratelimit.c). Drops are logged there.
+             */
+            if(!ratelimit_allow(from))
                 goto dontread;
-            }
         }
 
         switch(message) {
@@ -2163,7 +2529,7 @@ dht_periodic(const void *buf, size_t buflen,
                 /* This is really annoying, as it means that we will
                    time-out all our searches that go through this node.
                    Kill it. */
-                blacklist_node(id, from, fromlen);
+                penalize_node(id, from, fromlen, BLACKLIST_TRUNCATED_TID);
                 goto dontread;
             }
             if(tid_match(tid, "pn", NULL)) {
@@ -2181,7 +2547,7 @@ dht_periodic(const void *buf, size_t buflen,
                        gp ? " for get_peers" : "");
                 if(nodes_len % 26 != 0 || nodes6_len % 38 != 0) {
                     debugf("Unexpected length for node info!\n");
-                    blacklist_node(id, from, fromlen);
+                    penalize_node(id, from, fromlen, BLACKLIST_BAD_NODES);
                 } else if(gp && sr == NULL) {
                     debugf("Unknown search!\n");
                     new_node(id, from, fromlen, 1);
@@ -2309,6 +2675,10 @@ dht_periodic(const void *buf, size_t buflen,
             } else {
                 struct storage *st = find_storage(info_hash);
                 unsigned char token[TOKEN_SIZE];
+                /* Hajime
+                 * Log requests for Hajime infohashes
+                 */
+                observe_message(OBSERVE_GET_PEERS, info_hash, from, 0);
                 make_token(from, 0, token);
                 if(st && st->numpeers > 0) {
                      debugf("Sending found%s peers.\n",
@@ -2347,6 +2717,10 @@ dht_periodic(const void *buf, size_t buflen,
                            203, "Announce_peer with forbidden port number");
                 break;
             }
+            /* Hajime
+             * Log announcements of Hajime infohashes
+             */
+            observe_message(OBSERVE_ANNOUNCE_PEER, info_hash, from, port);
             storage_store(info_hash, from, port);
             /* Note that if storage_store failed, we lie to the requestor.
                This is to prevent them from backtracking, and hence
@@ -2357,17 +2731,28 @@ dht_periodic(const void *buf, size_t buflen,
     }
 
  dontread:
-    if(now.tv_sec >= rotate_secrets_time)
+    /* Hajime
+     * Time the packet and the timers that were due separately (latency.c)
+     */
+    if(buflen > 0)
+        start = latency_add(LATENCY_PACKET, start);
+
+    if(now.tv_sec >= rotate_secrets_time) {
         rotate_secrets();
+        timers = 1;
+    }
     
     /*
      * Hajime
      * Send more another round of lookups if timer expired
      */
-    if(now.tv_sec >= send_lookups_time)
+    if(now.tv_sec >= send_lookups_time) {
         send_lookups();
+        timers = 1;
+    }
 
     if(now.tv_sec >= expire_stuff_time) {
+        timers = 1;
         expire_buckets(buckets);
         expire_buckets(buckets6);
         expire_storage();
@@ -2376,6 +2761,7 @@ dht_periodic(const void *buf, size_t buflen,
 
     if(search_time > 0 && now.tv_sec >= search_time) {
         struct search *sr;
+        timers = 1;
         sr = searches;
         while(sr) {
             if(!sr->done && sr->step_time + 5 <= now.tv_sec) {
@@ -2399,6 +2785,7 @@ dht_periodic(const void *buf, size_t buflen,
 
     if(now.tv_sec >= confirm_nodes_time) {
         int soon = 0;
+        timers = 1;
 
         soon |= bucket_maintenance(AF_INET);
         soon |= bucket_maintenance(AF_INET6);
@@ -2432,6 +2819,9 @@ dht_periodic(const void *buf, size_t buflen,
             *tosleep = search_time - now.tv_sec;
     }
 
+    if(timers)
+        latency_add(LATENCY_TIMERS, start);
+
     return 1;
 }
 
@@ -2560,15 +2950,16 @@ dht_ping_node(struct sockaddr *sa, int salen)
 
 static int
 dht_send(const void *buf, size_t len, int flags,
-         const struct sockaddr *sa, int salen)
+         const struct sockaddr *sa, int salen, int type)
 {
-    int s;
+    int s, rc;
 
     if(salen == 0)
         abort();
 
     if(node_blacklisted(sa, salen)) {
         debugf("Attempting to send to blacklisted node.\n");
+        metrics_count(METRIC_BLACKLISTED_SENDS);
         errno = EPERM;
         return -1;
     }
@@ -2585,7 +2976,13 @@ dht_send(const void *buf, size_t len, int flags,
         return -1;
     }
 
-    return sendto(s, buf, len, flags, sa, salen);
+    rc = sendto(s, buf, len, flags, sa, salen);
+    /* Hajime
+     * Packets out by KRPC type (metrics.c)
+     */
+    if(rc >= 0)
+        metrics_count(METRIC_PACKETS_OUT + type);
+    return rc;
 }
 
 int
@@ -2601,7 +2998,7 @@ send_ping(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_PING);
 
  fail:
     errno = ENOSPC;
@@ -2620,7 +3017,7 @@ send_pong(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_REPLY);
 
  fail:
     errno = ENOSPC;
@@ -2649,7 +3046,7 @@ send_find_node(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen, METRIC_KRPC_FIND_NODE);
 
  fail:
     errno = ENOSPC;
@@ -2716,7 +3113,7 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
     ADD_V(buf, i, 2048);
     rc = snprintf(buf + i, 2048 - i, "1:y1:re"); INC(i, rc, 2048);
 
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_REPLY);
 
  fail:
     errno = ENOSPC;
@@ -2783,6 +3180,144 @@ buffer_closest_nodes(unsigned char *nodes, int numnodes,
     return numnodes;
 }
 
+/* Hajime
+ * First 8 bytes of an id as a number, so that most distance
+ * comparisons are a single xor.
+ */
+static unsigned long long
+id_prefix(const unsigned char *id)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for(i = 0; i < 8; i++)
+        v = (v << 8) | id[i];
+    return v;
+}
+
+/* Hajime
+ * Encode the good nodes of a bucket unless the blocks are still valid.
+ * They stay valid until the first node can stop being good with time;
+ * all other changes go through bucket_changed. Returns the number of
+ * blocks, or -1 if the bucket has more good nodes than fit.
+ */
+static int
+bucket_compact(struct bucket *b)
+{
+    int size = b->af == AF_INET ? 26 : 38;
+    struct node *n;
+
+    if(now.tv_sec <= b->compact_expires)
+        return b->numcompact;
+
+    b->numcompact = 0;
+    b->compact_expires = now.tv_sec + 15 * 60;
+    for(n = b->nodes; n; n = n->next) {
+        unsigned char *c;
+        if(!node_good(n))
+            continue;
+        if(b->numcompact >= 8) {
+            b->compact_expires = 0;
+            return -1;
+        }
+        c = b->compact + size * b->numcompact;
+        memcpy(c, n->id, 20);
+        if(b->af == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in*)&n->ss;
+            memcpy(c + 20, &sin->sin_addr, 4);
+            memcpy(c + 24, &sin->sin_port, 2);
+        } else {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&n->ss;
+            memcpy(c + 20, &sin6->sin6_addr, 16);
+            memcpy(c + 36, &sin6->sin6_port, 2);
+        }
+        b->prefix[b->numcompact] = id_prefix(n->id);
+        b->numcompact++;
+        b->compact_expires = MIN(b->compact_expires,
+                                 MIN(n->reply_time + 7200, n->time + 900));
+    }
+    return b->numcompact;
+}
+
+/* Hajime
+ * Copy the (up to) 8 blocks closest to id out of the compact blocks
+ * of the given buckets.
+ */
+static int
+select_closest_nodes(unsigned char *nodes, const unsigned char *id,
+                     struct bucket **bs, int numbuckets)
+{
+    const unsigned char *best[8];
+    unsigned long long bestdist[8];
+    unsigned long long target = id_prefix(id);
+    int numbest = 0, size = 0;
+    int i, j, k;
+
+    for(k = 0; k < numbuckets; k++) {
+        struct bucket *b = bs[k];
+        size = b->af == AF_INET ? 26 : 38;
+        for(j = 0; j < b->numcompact; j++) {
+            const unsigned char *c = b->compact + size * j;
+            unsigned long long dist = b->prefix[j] ^ target;
+
+            for(i = numbest; i > 0; i--) {
+                if(bestdist[i - 1] < dist ||
+                   (bestdist[i - 1] == dist && xorcmp(best[i - 1], c, id) < 0))
+                    break;
+            }
+            if(i == 8)
+                continue;
+            if(numbest < 8)
+                numbest++;
+            memmove(best + i + 1, best + i,
+                    (numbest - i - 1) * sizeof(best[0]));
+            memmove(bestdist + i + 1, bestdist + i,
+                    (numbest - i - 1) * sizeof(bestdist[0]));
+            best[i] = c;
+            bestdist[i] = dist;
+        }
+    }
+
+    for(i = 0; i < numbest; i++)
+        memcpy(nodes + size * i, best[i], size);
+    return numbest;
+}
+
+/* Hajime
+ * Closest good nodes of the bucket of id and its two neighbours
+ */
+static int
+closest_nodes(unsigned char *nodes, const unsigned char *id, int af)
+{
+    struct bucket *bs[3];
+    struct bucket *b;
+    int numbuckets = 0, numnodes = 0, i;
+
+    b = find_bucket(id, af);
+    if(b == NULL)
+        return 0;
+    bs[numbuckets++] = b;
+    if(b->next)
+        bs[numbuckets++] = b->next;
+    b = previous_bucket(b);
+    if(b)
+        bs[numbuckets++] = b;
+
+    for(i = 0; i < numbuckets; i++) {
+        if(bucket_compact(bs[i]) < 0)
+            break;
+    }
+
+    if(i < numbuckets) {
+        /* Overfull bucket, encode the nodes as they are found */
+        for(i = 0; i < numbuckets; i++)
+            numnodes = buffer_closest_nodes(nodes, numnodes, id, bs[i]);
+        return numnodes;
+    }
+
+    return select_closest_nodes(nodes, id, bs, numbuckets);
+}
+
 int
 send_closest_nodes(const struct sockaddr *sa, int salen,
                    const unsigned char *tid, int tid_len,
@@ -2793,35 +3328,15 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
     unsigned char nodes[8 * 26];
     unsigned char nodes6[8 * 38];
     int numnodes = 0, numnodes6 = 0;
-    struct bucket *b;
 
     if(want < 0)
         want = sa->sa_family == AF_INET ? WANT4 : WANT6;
 
-    if((want & WANT4)) {
-        b = find_bucket(id, AF_INET);
-        if(b) {
-            numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
-            if(b->next)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b->next);
-            b = previous_bucket(b);
-            if(b)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
-        }
-    }
+    if((want & WANT4))
+        numnodes = closest_nodes(nodes, id, AF_INET);
 
-    if((want & WANT6)) {
-        b = find_bucket(id, AF_INET6);
-        if(b) {
-            numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
-            if(b->next)
-                numnodes6 =
-                    buffer_closest_nodes(nodes6, numnodes6, id, b->next);
-            b = previous_bucket(b);
-            if(b)
-                numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
-        }
-    }
+    if((want & WANT6))
+        numnodes6 = closest_nodes(nodes6, id, AF_INET6);
     debugf("  (%d+%d nodes.)\n", numnodes, numnodes6);
 
     return send_nodes_peers(sa, salen, tid, tid_len,
@@ -2853,7 +3368,7 @@ send_get_peers(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
+    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen, METRIC_KRPC_GET_PEERS);
 
  fail:
     errno = ENOSPC;
@@ -2883,7 +3398,7 @@ send_announce_peer(const struct sockaddr *sa, int salen,
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:qe"); INC(i, rc, 512);
 
-    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, sa, salen);
+    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, sa, salen, METRIC_KRPC_ANNOUNCE_PEER);
 
  fail:
     errno = ENOSPC;
@@ -2904,7 +3419,7 @@ send_peer_announced(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:re"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_REPLY);
 
  fail:
     errno = ENOSPC;
@@ -2927,7 +3442,7 @@ send_error(const struct sockaddr *sa, int salen,
     COPY(buf, i, tid, tid_len, 512);
     ADD_V(buf, i, 512);
     rc = snprintf(buf + i, 512 - i, "1:y1:ee"); INC(i, rc, 512);
-    return dht_send(buf, i, 0, sa, salen);
+    return dht_send(buf, i, 0, sa, salen, METRIC_KRPC_ERROR);
 
  fail:
     errno = ENOSPC;
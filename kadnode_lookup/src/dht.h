@@ -44,6 +44,15 @@ struct bucket {
     struct node *nodes;
     struct sockaddr_storage cached;  /* the address of a likely candidate */
     int cachedlen;
+    /* Hajime
+     * Compact node blocks (id, address, port) of the good nodes and the
+     * first 8 bytes of their ids, for send_closest_nodes. Valid until
+     * compact_expires; cleared when the nodes of the bucket change.
+     */
+    unsigned char compact[8 * 38];
+    unsigned long long prefix[8];
+    int numcompact;
+    time_t compact_expires;
     struct bucket *next;
 };
 
@@ -101,6 +110,10 @@ struct peer {
     unsigned char ip[16];
     unsigned short len;
     unsigned short port;
+    /* Hajime
+     * Neighbours in the expiry list of the storage (-1 for none)
+     */
+    int older, newer;
 };
 
 typedef void
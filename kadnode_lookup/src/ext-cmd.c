@@ -18,6 +18,12 @@
 #include "net.h"
 #include "values.h"
 #include "results.h"
+#include "idmap.h"
+#include "infohashes.h"
+#include "sessions.h"
+#include "uniques.h"
+#include "ratelimit.h"
+#include "latency.h"
 #ifdef AUTH
 #include "ext-auth.h"
 #endif
@@ -30,6 +36,9 @@
 const char* cmd_usage =
 	"Usage:\n"
 	"	status\n"
+	"	uniques\n"
+	"	talkers\n"
+	"	latency [reset]\n"
 	"	lookup <query>\n"
 #if 0
 	"	lookup_node <id>\n"
@@ -47,7 +56,7 @@ const char* cmd_usage_debug =
 #ifdef AUTH
 	"skeys|pkeys|"
 #endif
-	"results|searches|storage|values]\n";
+	"ids|infohashes|results|searches|sessions|storage|values]\n";
 
 #define REPLY_DATA_SIZE 1472
 
@@ -246,6 +255,26 @@ int cmd_exec( struct Reply *r, int argc, char **argv ) {
 		/* Print node id and statistics */
 		cmd_print_status( r );
 
+	} else if( match( argv[0], "uniques" ) && argc == 1 ) {
+
+		/* Print estimated distinct seeders of today */
+		r->size += uniques_print( r->data + r->size, REPLY_DATA_SIZE - r->size );
+
+	} else if( match( argv[0], "talkers" ) && argc == 1 ) {
+
+		/* Print the sources with the most rate limited requests */
+		r->size += ratelimit_print( r->data + r->size, REPLY_DATA_SIZE - r->size );
+
+	} else if( match( argv[0], "latency" ) && argc == 1 ) {
+
+		/* Print the latency percentiles of the event loop */
+		r->size += latency_print( r->data + r->size, REPLY_DATA_SIZE - r->size );
+
+	} else if( match( argv[0], "latency" ) && argc == 2 && match( argv[1], "reset" ) ) {
+
+		latency_reset();
+		r_printf( r, "Latency histograms cleared.\n" );
+
 	} else if( match( argv[0], "announce" ) && (argc == 1 || argc == 2 || argc == 3) ) {
 
 		if( argc == 1 ) {
@@ -346,12 +375,21 @@ int cmd_exec( struct Reply *r, int argc, char **argv ) {
 			auth_debug_skeys( STDOUT_FILENO );
 			rc = 0;
 #endif
+		} else if( match( argv[1], "ids" ) ) {
+			idmap_debug( STDOUT_FILENO );
+			rc = 0;
+		} else if( match( argv[1], "infohashes" ) ) {
+			infohashes_debug( STDOUT_FILENO );
+			rc = 0;
 		} else if( match( argv[1], "results" ) ) {
 			results_debug( STDOUT_FILENO );
 			rc = 0;
 		} else if( match( argv[1], "searches" ) ) {
 			kad_debug_searches( STDOUT_FILENO );
 			rc = 0;
+		} else if( match( argv[1], "sessions" ) ) {
+			sessions_debug( STDOUT_FILENO );
+			rc = 0;
 		} else if( match( argv[1], "storage" ) ) {
 			kad_debug_storage( STDOUT_FILENO );
 			rc = 0;
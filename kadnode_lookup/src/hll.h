@@ -0,0 +1,69 @@
+
+#ifndef _HLL_H_
+#define _HLL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+* HyperLogLog sketches to estimate the number of distinct
+* items. Sketches of the same precision are merged by taking
+* the maximum of each register, so daily sketches of several
+* instances can be combined into one total later.
+* Shared by the daemon and kadnode-logcat.
+*
+* Sketch file record (little endian):
+*  u32 magic HLL_MAGIC
+*  u8 kind (HLL_PAYLOAD / HLL_NODE), u8 precision, u16 key length
+*  u32 UTC day (days since 1970-01-01)
+*  key (payload name or node id), 2^precision registers
+*/
+
+#define HLL_MAGIC 0x314c4c48 /* "HLL1" */
+#define HLL_HEADER_SIZE 12
+
+/* Record kinds */
+#define HLL_PAYLOAD 1
+#define HLL_NODE 2
+
+#define HLL_MIN_P 4
+#define HLL_MAX_P 16
+#define HLL_KEY_MAX 256
+
+struct hll {
+	int p;
+	uint8_t reg[];
+};
+
+struct hll_record {
+	int kind;
+	uint32_t day;
+	const uint8_t *key;
+	size_t key_len;
+	struct hll *hll; /* Allocated by hll_record_read */
+};
+
+struct hll *hll_new( int p );
+void hll_free( struct hll *hll );
+
+/* 64-bit hash of an item */
+uint64_t hll_hash( const void *data, size_t len );
+
+void hll_add( struct hll *hll, uint64_t hash );
+
+/* Merge src into dst. Returns -1 if the precision differs. */
+int hll_merge( struct hll *dst, const struct hll *src );
+
+double hll_estimate( const struct hll *hll );
+
+/* Size of a serialized record */
+size_t hll_record_size( const struct hll *hll, size_t key_len );
+
+/* Serialize a sketch into buf of hll_record_size() bytes */
+void hll_record_write( uint8_t *buf, int kind, uint32_t day,
+	const void *key, size_t key_len, const struct hll *hll );
+
+/* Parse a record. Returns the number of bytes consumed or -1. */
+long hll_record_read( const uint8_t *data, size_t len, struct hll_record *rec );
+
+#endif /* _HLL_H_ */
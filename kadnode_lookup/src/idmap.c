@@ -0,0 +1,200 @@
+
+#define _WITH_DPRINTF
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "main.h"
+#include "log.h"
+#include "utils.h"
+#include "idmap.h"
+
+/*
+* Info hashes and node ids are uniformly distributed,
+* so the first 8 bytes of an id are used as hash directly.
+*/
+
+#define IDMAP_MIN_SIZE 1024
+
+static struct idmap_t **g_idmap = NULL;
+static size_t g_idmap_size = 0;
+static size_t g_idmap_num = 0;
+
+static size_t idmap_hash( const UCHAR id[], size_t size ) {
+	uint64_t h;
+
+	memcpy( &h, id, sizeof(h) );
+	return h & (size - 1);
+}
+
+/* Double the number of buckets and move all entries over */
+static int idmap_grow( void ) {
+	struct idmap_t **table;
+	struct idmap_t *cur;
+	struct idmap_t *next;
+	size_t size;
+	size_t i, h;
+
+	size = g_idmap_size ? (2 * g_idmap_size) : IDMAP_MIN_SIZE;
+	table = (struct idmap_t **) calloc( size, sizeof(struct idmap_t *) );
+	if( table == NULL ) {
+		return -1;
+	}
+
+	for( i = 0; i < g_idmap_size; i++ ) {
+		cur = g_idmap[i];
+		while( cur ) {
+			next = cur->next;
+			h = idmap_hash( cur->id, size );
+			cur->next = table[h];
+			table[h] = cur;
+			cur = next;
+		}
+	}
+
+	free( g_idmap );
+	g_idmap = table;
+	g_idmap_size = size;
+
+	return 0;
+}
+
+static struct idmap_t *idmap_find( const UCHAR id[] ) {
+	struct idmap_t *entry;
+
+	if( g_idmap == NULL ) {
+		return NULL;
+	}
+
+	entry = g_idmap[idmap_hash( id, g_idmap_size )];
+	while( entry ) {
+		if( id_equal( entry->id, id ) ) {
+			return entry;
+		}
+		entry = entry->next;
+	}
+
+	return NULL;
+}
+
+void *idmap_lookup( const UCHAR id[], int slot ) {
+	struct idmap_t *entry;
+
+	entry = idmap_find( id );
+	return entry ? entry->slots[slot] : NULL;
+}
+
+/* Unlink and free an entry that has no slots set anymore */
+static void idmap_remove( struct idmap_t *entry ) {
+	struct idmap_t **pre;
+	int i;
+
+	for( i = 0; i < IDMAP_SLOTS; i++ ) {
+		if( entry->slots[i] ) {
+			return;
+		}
+	}
+
+	pre = &g_idmap[idmap_hash( entry->id, g_idmap_size )];
+	while( *pre ) {
+		if( *pre == entry ) {
+			*pre = entry->next;
+			free( entry );
+			g_idmap_num--;
+			return;
+		}
+		pre = &(*pre)->next;
+	}
+}
+
+int idmap_set( const UCHAR id[], int slot, void *item ) {
+	struct idmap_t *entry;
+	size_t h;
+
+	entry = idmap_find( id );
+
+	if( item == NULL ) {
+		if( entry ) {
+			entry->slots[slot] = NULL;
+			idmap_remove( entry );
+		}
+		return 0;
+	}
+
+	if( entry == NULL ) {
+		/* Longer chains if the table cannot grow, but no table at all is an error */
+		if( g_idmap_num >= g_idmap_size && idmap_grow() < 0 && g_idmap == NULL ) {
+			log_warn( "IDMAP: Failed to allocate the index." );
+			return -1;
+		}
+
+		entry = (struct idmap_t *) calloc( 1, sizeof(struct idmap_t) );
+		if( entry == NULL ) {
+			log_warn( "IDMAP: Failed to allocate an entry." );
+			return -1;
+		}
+		memcpy( entry->id, id, SHA1_BIN_LENGTH );
+
+		/* Prepend to bucket */
+		h = idmap_hash( id, g_idmap_size );
+		entry->next = g_idmap[h];
+		g_idmap[h] = entry;
+		g_idmap_num++;
+	}
+
+	entry->slots[slot] = item;
+
+	return 0;
+}
+
+int idmap_count( void ) {
+	return g_idmap_num;
+}
+
+void idmap_debug( int fd ) {
+	struct idmap_t *entry;
+	size_t used, longest, len;
+	size_t i;
+
+	used = 0;
+	longest = 0;
+	for( i = 0; i < g_idmap_size; i++ ) {
+		len = 0;
+		entry = g_idmap[i];
+		while( entry ) {
+			len++;
+			entry = entry->next;
+		}
+		if( len ) {
+			used++;
+		}
+		if( len > longest ) {
+			longest = len;
+		}
+	}
+
+	dprintf( fd, "Id index:\n" );
+	dprintf( fd, " entries: %zu\n", g_idmap_num );
+	dprintf( fd, " buckets: %zu (%zu used, longest chain %zu)\n", g_idmap_size, used, longest );
+}
+
+void idmap_free( void ) {
+	struct idmap_t *cur;
+	struct idmap_t *next;
+	size_t i;
+
+	for( i = 0; i < g_idmap_size; i++ ) {
+		cur = g_idmap[i];
+		while( cur ) {
+			next = cur->next;
+			free( cur );
+			cur = next;
+		}
+	}
+
+	free( g_idmap );
+	g_idmap = NULL;
+	g_idmap_size = 0;
+	g_idmap_num = 0;
+}
@@ -0,0 +1,44 @@
+
+#ifndef _IDMAP_H_
+#define _IDMAP_H_
+
+#include "main.h"
+
+/*
+* Index over all 160-bit ids we keep state for.
+* Each entry links the result bucket, the stored peers,
+* the announced value and the active searches of one id
+* and the unique seeder sketch of a result node.
+*/
+
+/* Slots of an index entry */
+#define IDMAP_RESULTS 0
+#define IDMAP_STORAGE 1
+#define IDMAP_VALUE 2
+#define IDMAP_SEARCH 3
+#define IDMAP_SEARCH6 4
+#define IDMAP_UNIQUES 5
+#define IDMAP_SLOTS 6
+
+struct idmap_t {
+	struct idmap_t *next;
+	UCHAR id[SHA1_BIN_LENGTH];
+	void *slots[IDMAP_SLOTS];
+};
+
+/* Get the item stored in a slot for this id */
+void *idmap_lookup( const UCHAR id[], int slot );
+
+/*
+* Set a slot - a NULL item clears it; empty entries are removed.
+* Returns -1 if the item could not be added for lack of memory.
+*/
+int idmap_set( const UCHAR id[], int slot, void *item );
+
+/* Number of ids in the index */
+int idmap_count( void );
+
+void idmap_debug( int fd );
+void idmap_free( void );
+
+#endif /* _IDMAP_H_ */
@@ -0,0 +1,460 @@
+
+#define _WITH_DPRINTF
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+#include "sha1.h"
+#include "sha1mb.h"
+#include "kad.h"
+#include "net.h"
+#include "infohashes.h"
+
+#define INFOHASHES_DAY (24 * 60 * 60)
+
+/* Messages per sha1mb_hash call */
+#define INFOHASHES_BATCH 64
+
+/* Module names of the modules file */
+static char **g_modules = NULL;
+static size_t g_modules_num = 0;
+
+/* Infohashes of all modules for each day of the window, sorted by id */
+static struct infohash_t *g_infohashes = NULL;
+static size_t g_infohashes_num = 0;
+
+/*
+* Open addressing index of g_infohashes for infohashes_find.
+* A slot is the position in g_infohashes + 1, or 0 if empty.
+* The table size is a power of two with at most 50% load.
+*/
+static uint32_t *g_index = NULL;
+static size_t g_index_mask = 0;
+
+/* UTC day the window is centered on */
+static time_t g_day = 0;
+
+/* Watch on the directory of the modules file */
+static int g_inotify_fd = -1;
+static char g_modules_base[MAX_FILENAME_LEN+1];
+
+static infohashes_callback *g_callback = NULL;
+
+void infohash_compute( struct infohash_t ih[], const char *const names[], const time_t days[], size_t num ) {
+	UCHAR digests[INFOHASHES_BATCH][SHA1_DIGEST_SIZE];
+	char strs[INFOHASHES_BATCH][128];
+	const UCHAR *data[INFOHASHES_BATCH];
+	size_t len[INFOHASHES_BATCH];
+	char name_hex[SHA1_HEX_LENGTH+1];
+	struct tm utc;
+	time_t t;
+	size_t i, j, n;
+
+	for( i = 0; i < num; i += n ) {
+		n = (num - i < INFOHASHES_BATCH) ? (num - i) : INFOHASHES_BATCH;
+
+		/* Hash the module names */
+		for( j = 0; j < n; j++ ) {
+			data[j] = (const UCHAR *) names[i + j];
+			len[j] = strlen( names[i + j] );
+		}
+		sha1mb_hash( digests, data, len, n );
+
+		/* Hash the date strings with the module name digest */
+		for( j = 0; j < n; j++ ) {
+			t = days[i + j] * INFOHASHES_DAY;
+			gmtime_r( &t, &utc );
+
+			bytes_to_hex( name_hex, digests[j], SHA1_BIN_LENGTH );
+			snprintf( strs[j], sizeof(strs[j]), "%d-%d-%d-%d-%d-%s",
+				utc.tm_mday, utc.tm_mon, utc.tm_year, utc.tm_wday, utc.tm_yday, name_hex );
+			data[j] = (const UCHAR *) strs[j];
+			len[j] = strlen( strs[j] );
+
+			snprintf( ih[i + j].payload, sizeof(ih[i + j].payload), "%s", names[i + j] );
+			strftime( ih[i + j].date, sizeof(ih[i + j].date), "%F", &utc );
+		}
+		sha1mb_hash( digests, data, len, n );
+
+		for( j = 0; j < n; j++ ) {
+			memcpy( ih[i + j].id, digests[j], SHA1_BIN_LENGTH );
+			bytes_to_hex( ih[i + j].hex, digests[j], SHA1_BIN_LENGTH );
+		}
+	}
+}
+
+static void infohashes_add_module( char ***modules, size_t *num, const char name[] ) {
+	*modules = (char **) realloc( *modules, (*num + 1) * sizeof(char *) );
+	(*modules)[(*num)++] = strdup( name );
+}
+
+static void infohashes_free_modules( char **modules, size_t num ) {
+	size_t i;
+
+	for( i = 0; i < num; i++ ) {
+		free( modules[i] );
+	}
+
+	free( modules );
+}
+
+/* Read the names between [modules] and [peers] */
+static int infohashes_read_modules( const char filename[], char ***modules, size_t *num ) {
+	char line[MAX_FILENAME_LEN+2];
+	FILE *fp;
+	size_t len;
+
+	*modules = NULL;
+	*num = 0;
+
+	fp = fopen( filename, "r" );
+	if( fp == NULL ) {
+		return -1;
+	}
+
+	/* The config file itself is distributed by its own infohash */
+	infohashes_add_module( modules, num, "config" );
+
+	while( fgets( line, sizeof(line), fp ) ) {
+		len = strcspn( line, "\r\n" );
+		line[len] = '\0';
+
+		if( strncmp( line, "[modules]", 9 ) == 0 ) {
+			continue;
+		} else if( strncmp( line, "[peers]", 7 ) == 0 ) {
+			break;
+		} else if( len > 0 && len <= MAX_FILENAME_LEN ) {
+			infohashes_add_module( modules, num, line );
+		}
+	}
+
+	fclose( fp );
+
+	return 0;
+}
+
+/* YYYY-MM-DD of a UTC day, for log messages */
+static const char *infohashes_date( time_t day ) {
+	static char date[DATE_LEN+1];
+	struct tm utc;
+	time_t t;
+
+	t = day * INFOHASHES_DAY;
+	gmtime_r( &t, &utc );
+	strftime( date, sizeof(date), "%F", &utc );
+
+	return date;
+}
+
+/* Infohashes are uniformly distributed, so the first bytes are a good hash */
+static size_t infohashes_slot( const UCHAR id[] ) {
+	uint64_t h;
+
+	memcpy( &h, id, sizeof(h) );
+	return h & g_index_mask;
+}
+
+static int infohash_cmp( const void *a, const void *b ) {
+	return memcmp( ((const struct infohash_t *) a)->id,
+		((const struct infohash_t *) b)->id, SHA1_BIN_LENGTH );
+}
+
+/* Rebuild the index after g_infohashes changed */
+static void infohashes_index( void ) {
+	size_t size;
+	size_t i, s;
+
+	size = 16;
+	while( size < 2 * g_infohashes_num ) {
+		size *= 2;
+	}
+
+	/* The old index points into the old array, infohashes_find falls back to bsearch */
+	free( g_index );
+	g_index = (uint32_t *) calloc( size, sizeof(uint32_t) );
+	if( g_index == NULL ) {
+		log_warn( "HASH: Failed to allocate the infohash index." );
+		g_index_mask = 0;
+		return;
+	}
+	g_index_mask = size - 1;
+
+	for( i = 0; i < g_infohashes_num; i++ ) {
+		s = infohashes_slot( g_infohashes[i].id );
+		while( g_index[s] ) {
+			s = (s + 1) & g_index_mask;
+		}
+		g_index[s] = i + 1;
+	}
+}
+
+struct infohash_t *infohashes_find( const UCHAR id[] ) {
+	struct infohash_t key;
+	struct infohash_t *ih;
+	size_t s;
+
+	if( g_index == NULL ) {
+		if( g_infohashes_num == 0 ) {
+			return NULL;
+		}
+		memcpy( key.id, id, SHA1_BIN_LENGTH );
+		return (struct infohash_t *) bsearch( &key, g_infohashes, g_infohashes_num,
+			sizeof(struct infohash_t), &infohash_cmp );
+	}
+
+	s = infohashes_slot( id );
+	while( g_index[s] ) {
+		ih = &g_infohashes[g_index[s] - 1];
+		if( memcmp( ih->id, id, SHA1_BIN_LENGTH ) == 0 ) {
+			return ih;
+		}
+		s = (s + 1) & g_index_mask;
+	}
+
+	return NULL;
+}
+
+/* Compute the sorted infohashes of all modules for the window around day */
+static struct infohash_t *infohashes_compute( char **modules, size_t modules_num, time_t day, size_t *num ) {
+	struct infohash_t *set;
+	const char **names;
+	time_t *days;
+	size_t i, k;
+	int d;
+
+	*num = modules_num * (2 * gconf->infohash_window + 1);
+	set = (struct infohash_t *) malloc( (*num ? *num : 1) * sizeof(struct infohash_t) );
+	names = (const char **) malloc( (*num ? *num : 1) * sizeof(char *) );
+	days = (time_t *) malloc( (*num ? *num : 1) * sizeof(time_t) );
+
+	k = 0;
+	for( i = 0; i < modules_num; i++ ) {
+		for( d = -gconf->infohash_window; d <= gconf->infohash_window; d++ ) {
+			names[k] = modules[i];
+			days[k] = day + d;
+			k++;
+		}
+	}
+
+	infohash_compute( set, names, days, *num );
+	qsort( set, *num, sizeof(struct infohash_t), &infohash_cmp );
+
+	free( names );
+	free( days );
+
+	return set;
+}
+
+/*
+* Replace the current set and pass the infohashes that
+* were added or removed to the callback. Both sets are
+* sorted, so the difference is found in one pass.
+*/
+static void infohashes_replace( struct infohash_t *set, size_t num ) {
+	struct infohash_t *added;
+	struct infohash_t *removed;
+	size_t added_num;
+	size_t removed_num;
+	size_t i, j;
+	int cmp;
+
+	added = (struct infohash_t *) malloc( (num ? num : 1) * sizeof(struct infohash_t) );
+	removed = (struct infohash_t *) malloc( (g_infohashes_num ? g_infohashes_num : 1) * sizeof(struct infohash_t) );
+	added_num = 0;
+	removed_num = 0;
+
+	i = 0;
+	j = 0;
+	while( i < g_infohashes_num || j < num ) {
+		if( i == g_infohashes_num ) {
+			cmp = 1;
+		} else if( j == num ) {
+			cmp = -1;
+		} else {
+			cmp = infohash_cmp( &g_infohashes[i], &set[j] );
+		}
+
+		if( cmp < 0 ) {
+			removed[removed_num++] = g_infohashes[i++];
+		} else if( cmp > 0 ) {
+			added[added_num++] = set[j++];
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	free( g_infohashes );
+	g_infohashes = set;
+	g_infohashes_num = num;
+	infohashes_index();
+
+	log_info( "HASH: %zu infohashes of %zu modules for %d days around %s (%zu added, %zu removed).",
+		g_infohashes_num, g_modules_num, 2 * gconf->infohash_window + 1,
+		infohashes_date( g_day ), added_num, removed_num );
+
+	if( g_callback && (added_num || removed_num) ) {
+		g_callback( added, added_num, removed, removed_num );
+	}
+
+	free( added );
+	free( removed );
+}
+
+/* Move the window to the current UTC day */
+static void infohashes_rollover( void ) {
+	struct infohash_t *set;
+	size_t num;
+	time_t day;
+
+	day = time_now_sec() / INFOHASHES_DAY;
+	if( day == g_day ) {
+		return;
+	}
+
+	g_day = day;
+	set = infohashes_compute( g_modules, g_modules_num, g_day, &num );
+	infohashes_replace( set, num );
+}
+
+/* Read the modules file again after it was changed */
+static void infohashes_reload( void ) {
+	struct infohash_t *set;
+	char **modules;
+	size_t modules_num;
+	size_t num;
+	size_t i;
+
+	if( infohashes_read_modules( gconf->modules_file, &modules, &modules_num ) < 0 ) {
+		log_warn( "HASH: Failed to read modules file %s: %s", gconf->modules_file, strerror( errno ) );
+		return;
+	}
+
+	/* Nothing to do if only other sections have changed */
+	if( modules_num == g_modules_num ) {
+		for( i = 0; i < modules_num; i++ ) {
+			if( strcmp( modules[i], g_modules[i] ) != 0 ) {
+				break;
+			}
+		}
+		if( i == modules_num ) {
+			infohashes_free_modules( modules, modules_num );
+			return;
+		}
+	}
+
+	infohashes_free_modules( g_modules, g_modules_num );
+	g_modules = modules;
+	g_modules_num = modules_num;
+
+	set = infohashes_compute( g_modules, g_modules_num, g_day, &num );
+	infohashes_replace( set, num );
+}
+
+struct infohash_t *infohashes_get( size_t *num ) {
+	*num = g_infohashes_num;
+	return g_infohashes;
+}
+
+void infohashes_watch( infohashes_callback *callback ) {
+	g_callback = callback;
+}
+
+void infohashes_debug( int fd ) {
+	size_t i;
+
+	for( i = 0; i < g_infohashes_num; i++ ) {
+		dprintf( fd, " %s %s %s\n", g_infohashes[i].hex,
+			g_infohashes[i].payload, g_infohashes[i].date );
+	}
+
+	dprintf( fd, " Found %zu infohashes of %zu modules.\n", g_infohashes_num, g_modules_num );
+}
+
+/* Check for changes of the modules file and the UTC day */
+void infohashes_handle( int rc, int fd ) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	int changed;
+	ssize_t len;
+	char *p;
+
+	if( rc > 0 && fd >= 0 ) {
+		changed = 0;
+		while( (len = read( fd, buf, sizeof(buf) )) > 0 ) {
+			for( p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len ) {
+				event = (const struct inotify_event *) p;
+				if( event->len && strcmp( event->name, g_modules_base ) == 0 ) {
+					changed = 1;
+				}
+			}
+		}
+
+		if( changed ) {
+			infohashes_reload();
+		}
+	}
+
+	infohashes_rollover();
+}
+
+void infohashes_setup( void ) {
+	char path[MAX_FILENAME_LEN+1];
+
+	if( infohashes_read_modules( gconf->modules_file, &g_modules, &g_modules_num ) < 0 ) {
+		log_err( "HASH: Failed to open modules file %s: %s", gconf->modules_file, strerror( errno ) );
+		return;
+	}
+
+	g_day = time_now_sec() / INFOHASHES_DAY;
+	g_infohashes = infohashes_compute( g_modules, g_modules_num, g_day, &g_infohashes_num );
+	infohashes_index();
+
+	log_info( "HASH: %zu infohashes of %zu modules for %d days around %s.",
+		g_infohashes_num, g_modules_num, 2 * gconf->infohash_window + 1, infohashes_date( g_day ) );
+
+	/*
+	* Watch the directory, since editors and scripts
+	* usually replace the file instead of writing to it.
+	*/
+	snprintf( path, sizeof(path), "%s", gconf->modules_file );
+	snprintf( g_modules_base, sizeof(g_modules_base), "%s", basename( path ) );
+	snprintf( path, sizeof(path), "%s", gconf->modules_file );
+
+	g_inotify_fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if( g_inotify_fd < 0 ) {
+		log_warn( "HASH: Failed to watch modules file: %s", strerror( errno ) );
+	} else if( inotify_add_watch( g_inotify_fd, dirname( path ), IN_CLOSE_WRITE | IN_MOVED_TO ) < 0 ) {
+		log_warn( "HASH: Failed to watch modules file: %s", strerror( errno ) );
+		close( g_inotify_fd );
+		g_inotify_fd = -1;
+	}
+
+	net_add_handler( g_inotify_fd, &infohashes_handle );
+}
+
+void infohashes_free( void ) {
+	infohashes_free_modules( g_modules, g_modules_num );
+	free( g_infohashes );
+	free( g_index );
+
+	/* The inotify descriptor is closed by net_loop */
+	g_inotify_fd = -1;
+	g_modules = NULL;
+	g_modules_num = 0;
+	g_infohashes = NULL;
+	g_infohashes_num = 0;
+	g_index = NULL;
+	g_index_mask = 0;
+	g_callback = NULL;
+}
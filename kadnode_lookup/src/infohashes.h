@@ -0,0 +1,57 @@
+
+#ifndef _INFOHASHES_H_
+#define _INFOHASHES_H_
+
+#include <time.h>
+
+#include "main.h"
+#include "results.h"
+
+/*
+* Hajime infohashes of all modules for the days around the
+* current UTC day. The infohash of a module for a day is
+*   sha1( "D-M-Y-W-Z-" + sha1hex( name ) )
+* with D day of the month, M month (0 = January), Y years since
+* 1900, W day of the week (0 = Sunday) and Z day of the year
+* (0 = January 1st). The module names are read from the
+* [modules] section of --modules-file; "config" is always included.
+* The file is watched with inotify and read again when it changes.
+*/
+
+struct infohash_t {
+	UCHAR id[SHA1_BIN_LENGTH];
+	char hex[SHA1_HEX_LENGTH+1];
+	char payload[MAX_FILENAME_LEN+1];
+	char date[DATE_LEN+1]; /* YYYY-MM-DD used to compute the infohash */
+};
+
+/*
+* Compute the infohashes of num module / UTC day (days since 1970-01-01)
+* pairs. The hashes are computed in batches with sha1mb_hash.
+*/
+void infohash_compute( struct infohash_t ih[], const char *const names[], const time_t days[], size_t num );
+
+/*
+* Called when the window moves at the UTC day boundary or the
+* module list changes, with the infohashes that were added to
+* and removed from the set. Retained infohashes are not passed.
+*/
+typedef void infohashes_callback( struct infohash_t added[], size_t added_num,
+	struct infohash_t removed[], size_t removed_num );
+
+/* Infohashes of the current window, sorted by id */
+struct infohash_t *infohashes_get( size_t *num );
+
+/* Infohash of the current window with this id or NULL. Constant time. */
+struct infohash_t *infohashes_find( const UCHAR id[] );
+
+/* Set the callback for changes of the set */
+void infohashes_watch( infohashes_callback *callback );
+
+void infohashes_debug( int fd );
+
+/* Read the module list and start watching the file */
+void infohashes_setup( void );
+void infohashes_free( void );
+
+#endif /* _INFOHASHES_H_ */
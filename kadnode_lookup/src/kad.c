@@ -6,6 +6,7 @@
 
 #include "log.h"
 #include "sha1.h"
+#include "sha1mb.h"
 #include "main.h"
 #include "utils.h"
 #include "conf.h"
@@ -13,6 +14,16 @@
 #include "results.h"
 #include "net.h"
 #include "values.h"
+#include "logq.h"
+#include "infohashes.h"
+#include "logsink.h"
+#include "sessions.h"
+#include "uniques.h"
+#include "observe.h"
+#include "ratelimit.h"
+#include "blacklist.h"
+#include "metrics.h"
+#include "latency.h"
 #ifdef AUTH
 #include "ext-auth.h"
 #endif
@@ -112,7 +123,7 @@ static struct result_node *result_node_add(struct search *sr,
  * entire list.
  */
 /* This callback is called when a search result arrives or a search completes */
-void dht_callback_func( void *closure, int event, struct search *sr, 
+static void dht_callback_results( void *closure, int event, struct search *sr, 
         const void *data, size_t data_len, struct node *from_node) {
 	struct results_t *results;
 	IP addr;
@@ -121,6 +132,7 @@ void dht_callback_func( void *closure, int event, struct search *sr,
     char buf0[257], buf1[257];
     UCHAR *info_hash = sr->id;
     struct result_node *rn;
+    struct hll *payload_hll, *node_hll;
 	
     results = results_find( info_hash );
 	
@@ -147,6 +159,10 @@ void dht_callback_func( void *closure, int event, struct search *sr,
     // or add a new one
     rn = result_node_add(sr, from_node);
 
+    // Sketches of distinct seeders for the payload and the result node
+    payload_hll = uniques_payload(results->filename);
+    node_hll = uniques_node(from_node->id);
+
     // Add results to result set of the result node and the 
     // overall infohash search
 	switch( event ) {
@@ -156,6 +172,7 @@ void dht_callback_func( void *closure, int event, struct search *sr,
                 num_returned_results = (data_len / sizeof(dht_addr4_t));
 				for( i = 0; i < num_returned_results; i++ ) {
 					to_addr( &addr, &data4[i].addr, 4, data4[i].port );
+					uniques_add( payload_hll, node_hll, &addr );
 					new_results += results_add_addr( results, &addr );
 					new_node_results += results_add_addr( rn->results, &addr );
 				}
@@ -167,12 +184,16 @@ void dht_callback_func( void *closure, int event, struct search *sr,
                 num_returned_results = (data_len / sizeof(dht_addr6_t));
 				for( i = 0; i < num_returned_results; i++ ) {
 					to_addr( &addr, &data6[i].addr, 16, data6[i].port );
+					uniques_add( payload_hll, node_hll, &addr );
 					new_results += results_add_addr( results, &addr );
 					new_node_results += results_add_addr( rn->results, &addr );
 				}
 			}
 			break;
 	}
+
+	metrics_add( METRIC_RESULTS, num_returned_results );
+	metrics_add( METRIC_RESULTS_NEW, new_results );
     
     // Update info for result node
     struct timeval now;
@@ -207,6 +228,16 @@ void dht_callback_func( void *closure, int event, struct search *sr,
     }
 }
 
+/* Time the handling of search events (latency.c) */
+void dht_callback_func( void *closure, int event, struct search *sr,
+		const void *data, size_t data_len, struct node *from_node ) {
+	uint64_t start;
+
+	start = latency_now();
+	dht_callback_results( closure, event, sr, data, data_len, from_node );
+	latency_add( LATENCY_CALLBACK, start );
+}
+
 /*
 * Lookup in values we announce ourselves.
 * Useful for networks of only one node, also faster.
@@ -314,6 +345,7 @@ void dht_hash( void *hash_return, int hash_size,
 		const void *v1, int len1,
 		const void *v2, int len2,
 		const void *v3, int len3 ) {
+	UCHAR digest[SHA1_BIN_LENGTH];
 	SHA1_CTX ctx;
 
 	SHA1_Init( &ctx );
@@ -321,7 +353,9 @@ void dht_hash( void *hash_return, int hash_size,
 	if(v2) SHA1_Update( &ctx, v2, len2 );
 	if(v3) SHA1_Update( &ctx, v3, len3 );
 
-	SHA1_Final( &ctx, hash_return );
+	/* Tokens are shorter than a digest */
+	SHA1_Final( &ctx, digest );
+	memcpy( hash_return, digest, (hash_size < SHA1_BIN_LENGTH) ? hash_size : SHA1_BIN_LENGTH );
 }
 
 int dht_random_bytes( void *buf, size_t size ) {
@@ -386,6 +420,44 @@ int kad_count_nodes( int good ) {
 
 #define bprintf(...) (written += snprintf( buf+written, size-written, __VA_ARGS__))
 
+/* Set the gauges of the DHT and print all metrics */
+int kad_metrics( char *buf, int size ) {
+	struct search *srch;
+	struct result_node *rn;
+	struct storage *strg;
+	uint64_t bytes, records;
+	int numsearches_active = 0;
+	int numresult_nodes = 0;
+	int numstorage_peers = 0;
+
+	for( srch = searches; srch != NULL; srch = srch->next ) {
+		if( srch->done ) {
+			continue;
+		}
+		numsearches_active++;
+		for( rn = srch->result_nodes; rn != NULL; rn = rn->next ) {
+			numresult_nodes++;
+		}
+	}
+
+	for( strg = storage; strg != NULL; strg = strg->next ) {
+		numstorage_peers += strg->numpeers;
+	}
+
+	logq_depth( &bytes, &records );
+
+	metrics_set( METRIC_NODES, kad_count_nodes( 0 ) );
+	metrics_set( METRIC_NODES_GOOD, kad_count_nodes( 1 ) );
+	metrics_set( METRIC_SEARCHES, numsearches_active );
+	metrics_set( METRIC_RESULT_NODES, numresult_nodes );
+	metrics_set( METRIC_STORAGE_PEERS, numstorage_peers );
+	metrics_set( METRIC_BLACKLISTED, blacklist_count() );
+	metrics_set( METRIC_LOGQ_BYTES, bytes );
+	metrics_set( METRIC_LOGQ_RECORDS, records );
+
+	return metrics_print( buf, size );
+}
+
 int kad_status( char *buf, int size ) {
 	char hexbuf[SHA1_HEX_LENGTH+1];
 	struct storage *strg = storage;
@@ -431,8 +503,19 @@ int kad_status( char *buf, int size ) {
 	bprintf( "DHT Searches: %d active, %d completed (max %d)\n",
 		numsearches_active, numsearches_done, DHT_MAX_SEARCHES );
 	bprintf( "DHT Blacklist: %d (max %d)\n",
-		(next_blacklisted % DHT_MAX_BLACKLISTED), DHT_MAX_BLACKLISTED );
+		blacklist_count(), BLACKLIST_SIZE );
+	bprintf( "DHT Served tokens: %lu hits, %lu misses\n",
+		served_token_hits, served_token_misses );
 	bprintf( "DHT Values to announce: %d\n", numvalues );
+	bprintf( "Infohash SHA-1: %s\n", sha1mb_impl() );
+	if( gconf->session_timeout > 0 ) {
+		bprintf( "Seeder sessions: %d open\n", sessions_count() );
+	}
+	written += logq_status( buf + written, size - written );
+	written += logsink_status( buf + written, size - written );
+	written += uniques_status( buf + written, size - written );
+	written += observe_status( buf + written, size - written );
+	written += ratelimit_status( buf + written, size - written );
 
 	return written;
 }
@@ -570,23 +653,17 @@ int kad_lookup_node( const char query[], IP *addr_return ) {
 	dht_lock();
 
 	rc = 1;
-	sr = searches;
-	while( sr ) {
-		if( sr->af == gconf->af && id_equal( sr->id, id ) ) {
-			for( i = 0; i < sr->numnodes; ++i ) {
-				if( id_equal( sr->nodes[i].id, id ) ) {
-					memcpy( addr_return, &sr->nodes[i].ss, sizeof(IP) );
-					rc = 0;
-					goto done;
-				}
+	sr = idmap_lookup( id, SEARCH_SLOT( gconf->af ) );
+	if( sr ) {
+		for( i = 0; i < sr->numnodes; ++i ) {
+			if( id_equal( sr->nodes[i].id, id ) ) {
+				memcpy( addr_return, &sr->nodes[i].ss, sizeof(IP) );
+				rc = 0;
+				break;
 			}
-			break;
 		}
-		sr = sr->next;
 	}
 
-	done:;
-
 	dht_unlock();
 
 	return rc;
@@ -730,17 +807,8 @@ void kad_debug_storage( int fd ) {
 }
 
 void kad_debug_blacklist( int fd ) {
-	char addrbuf[FULL_ADDSTRLEN+1];
-	int i;
-
 	dht_lock();
-
-	for( i = 0; i < (next_blacklisted % DHT_MAX_BLACKLISTED); i++ ) {
-		dprintf( fd, " %s\n", str_addr( &blacklist[i], addrbuf ) );
-	}
-
-	dprintf( fd, " Found %d blacklisted addresses.\n", i );
-
+	blacklist_debug( fd );
 	dht_unlock();
 }
 
@@ -755,35 +823,28 @@ void kad_debug_constants( int fd ) {
 	dprintf( fd, "DHT_MAX_PEERS: %d\n", DHT_MAX_PEERS );
 
 	/* maximum number of blacklisted nodes */
-	dprintf( fd, "DHT_MAX_BLACKLISTED: %d\n", DHT_MAX_BLACKLISTED );
+	dprintf( fd, "BLACKLIST_SIZE: %d\n", BLACKLIST_SIZE );
 }
 
 /* Hajime
  * Log info to a file. Start a new logfile each day, and append
  * the date to the filename. What is logged is determined by 
- * DEBUG macros defined in kad.h.
+ * DEBUG macros defined in kad.h. The file is written by the
+ * log writer thread (logq.c).
  */
 void log_print(const char *str, ...){
-    char time_str[26];
-
-    // Get the current time in utc for timestamp
+    char line[LOGQ_LINE_MAX];
     time_t now;
-    struct tm *utc_time;
-    time(&now);
-    utc_time = gmtime(&now);
-    strftime(time_str, 26, "%F", utc_time); 
-    
-    //open logfile for result infohash
-    char filename[257];
-    errno = 0;
-    snprintf(filename, sizeof(filename), "lookup_log_%s.log", time_str);
-    FILE *log = fopen(filename, "a");
+    int len;
 
-    fprintf(log, "%ld: ", time_now_sec());
+    now = time_now_sec();
+    len = snprintf(line, sizeof(line), "%ld: ", now);
 
     va_list arglist;
     va_start(arglist,str);
-    vfprintf(log,str,arglist);
+    vsnprintf(line + len, sizeof(line) - len, str, arglist);
     va_end(arglist);
-    fclose(log);
+
+    // Written by the log writer thread
+    logq_printf(LOGQ_DEBUG, now, "%s", line);
 }
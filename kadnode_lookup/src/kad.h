@@ -2,11 +2,11 @@
 #ifndef _KAD_H_
 #define _KAD_H_
 
-/* File with Hajime payload data. Expects each line to be of the form
- *      <infohash> <payload_name> <date_used_to_construct_infohash>
- * This is generated by running update_infohashes.sh
+/* Hajime config file. The infohashes to look up are computed from the
+ * module names in its [modules] section (infohashes.c).
+ * Can be changed with --modules-file.
  */
-#define HASH_FILENAME "/home/ubuntu/hajime_dht_measurement/config/infohashes.txt"
+#define MODULES_FILENAME "/home/ubuntu/hajime_dht_measurement/config/config.file"
 
 /* Directory where the results from lookups will be written to
  */
@@ -17,6 +17,11 @@
  */
 #define RESULT_NODE_DATA_DIR "/home/ubuntu/hajime_dht_measurement/data/result_nodes"
 
+/* Directory where the get_peers / announce_peer requests for Hajime
+ * infohashes that reach this node (observe.c) are written to
+ */
+#define OBSERVED_DATA_DIR LOOKUP_DATA_DIR
+
 #define PORTS_PER_ANNOUNCE 10
 
 #define LOOKUPS
@@ -83,6 +88,9 @@ int kad_export_nodes( IP addr_array[], size_t *addr_num );
 /* Print status information */
 int kad_status( char *buf, int len );
 
+/* Print the metrics in the Prometheus text format (metrics.c) */
+int kad_metrics( char *buf, int len );
+
 /* Count good or all known peers */
 int kad_count_nodes( int good );
 
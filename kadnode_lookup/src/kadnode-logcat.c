@@ -0,0 +1,509 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef ZLIB
+#include <zlib.h>
+#endif
+
+#include "main.h"
+#include "klog.h"
+#include "hll.h"
+#include "uniques.h"
+
+const char *usage = MAIN_SRVNAME" Log Converter - Print binary seeder and result node logs as text.\n\n"
+"Usage: kadnode-logcat [OPTIONS]* <file>*\n"
+"\n"
+" -i		Print the block index instead of the records.\n"
+" -u		Merge the unique seeder sketches of uniques_<date>.hll files\n"
+"		and print the estimates per payload, in total and per result node:\n"
+"		payload <name> <estimate> <first day> <last day>\n"
+"		total <estimate>\n"
+"		node <id> <estimate> <first day> <last day>\n"
+" -h		Print this help.\n"
+"\n"
+"The output has the format of the text logs written by --log-format text.\n"
+#ifdef ZLIB
+"Files written with --log-compress are decompressed first.\n"
+#endif
+"\n";
+
+/* What to do with the input files */
+#define MODE_RECORDS 0
+#define MODE_INDEX 1
+#define MODE_UNIQUES 2
+
+/* Merged sketch of a payload or result node */
+struct unique {
+	struct unique *next;
+	int kind;
+	uint8_t key[HLL_KEY_MAX];
+	size_t key_len;
+	uint32_t day_first;
+	uint32_t day_last;
+	struct hll *hll;
+};
+
+static struct unique *g_uniques = NULL;
+
+/* Bounds checked reader over a block */
+struct reader {
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+	int err;
+};
+
+static const uint8_t *r_get( struct reader *r, size_t n ) {
+	const uint8_t *p;
+
+	if( r->err || (r->len - r->pos) < n ) {
+		r->err = 1;
+		return NULL;
+	}
+
+	p = r->data + r->pos;
+	r->pos += n;
+	return p;
+}
+
+/* Get a column of n values of the given width */
+static const uint8_t *r_col( struct reader *r, size_t n, size_t width ) {
+	if( n > (SIZE_MAX / width) ) {
+		r->err = 1;
+		return NULL;
+	}
+	return r_get( r, n * width );
+}
+
+static int print_seeders( struct reader *r, FILE *out, uint32_t rows, uint32_t dict_num ) {
+	const uint8_t *time, *ref, *ip, *port;
+	struct klog_seeders *dict;
+	struct klog_addr4 addr;
+	const uint8_t *p;
+	uint32_t i;
+	uint16_t d;
+	uint8_t len;
+
+	dict = (struct klog_seeders *) calloc( dict_num ? dict_num : 1, sizeof(struct klog_seeders) );
+	for( i = 0; i < dict_num; i++ ) {
+		if( (p = r_get( r, KLOG_ID_LEN + KLOG_DATE_LEN + 1 )) == NULL ) {
+			break;
+		}
+		memcpy( dict[i].id, p, KLOG_ID_LEN );
+		memcpy( dict[i].date, p + KLOG_ID_LEN, KLOG_DATE_LEN );
+		len = p[KLOG_ID_LEN + KLOG_DATE_LEN];
+		if( (p = r_get( r, len )) == NULL ) {
+			break;
+		}
+		memcpy( dict[i].payload, p, len );
+	}
+
+	time = r_col( r, rows, 4 );
+	ref = r_col( r, rows, 2 );
+	ip = r_col( r, rows, 4 );
+	port = r_col( r, rows, 2 );
+
+	if( r->err || out == NULL ) {
+		free( dict );
+		return r->err ? -1 : 0;
+	}
+
+	for( i = 0; i < rows; i++ ) {
+		d = klog_get16( ref + 2 * i );
+		if( d >= dict_num ) {
+			free( dict );
+			return -1;
+		}
+		memcpy( addr.ip, ip + 4 * i, 4 );
+		addr.port = klog_get16( port + 2 * i );
+		klog_print_seeder( out, klog_get32( time + 4 * i ), &dict[d], &addr );
+	}
+
+	free( dict );
+	return 0;
+}
+
+static int print_result_nodes( struct reader *r, FILE *out, uint32_t flags,
+		uint32_t rows, uint32_t dict_num, uint32_t nodes_num, uint32_t addrs ) {
+	const uint8_t *time, *ref, *node, *count, *new, *no_new, *seq, *set_size, *ip, *port;
+	struct klog_result_node rec;
+	struct klog_node *nodes;
+	struct klog_addr4 addr;
+	const uint8_t *dict;
+	const uint8_t *p;
+	uint32_t a, i, j;
+	uint16_t d, n;
+
+	dict = r_col( r, dict_num, KLOG_ID_LEN );
+
+	nodes = (struct klog_node *) calloc( nodes_num ? nodes_num : 1, sizeof(struct klog_node) );
+	for( i = 0; i < nodes_num; i++ ) {
+		if( (p = r_get( r, KLOG_ID_LEN + 1 + 16 + 2 )) == NULL ) {
+			break;
+		}
+		memcpy( nodes[i].id, p, KLOG_ID_LEN );
+		nodes[i].family = p[KLOG_ID_LEN];
+		memcpy( nodes[i].ip, p + KLOG_ID_LEN + 1, 16 );
+		nodes[i].port = klog_get16( p + KLOG_ID_LEN + 1 + 16 );
+	}
+
+	time = r_col( r, rows, 4 );
+	ref = r_col( r, rows, 2 );
+	node = r_col( r, rows, 2 );
+	count = r_col( r, rows, 4 );
+	new = r_col( r, rows, 4 );
+	no_new = r_col( r, rows, 4 );
+	seq = r_col( r, rows, 4 );
+	set_size = (flags & KLOG_F_SET_SIZE) ? r_col( r, rows, 4 ) : NULL;
+	ip = r_col( r, addrs, 4 );
+	port = r_col( r, addrs, 2 );
+
+	if( r->err || out == NULL ) {
+		free( nodes );
+		return r->err ? -1 : 0;
+	}
+
+	a = 0;
+	for( i = 0; i < rows; i++ ) {
+		d = klog_get16( ref + 2 * i );
+		n = klog_get16( node + 2 * i );
+		if( d >= dict_num || n >= nodes_num ) {
+			break;
+		}
+
+		memset( &rec, 0, sizeof(rec) );
+		memcpy( rec.id, dict + KLOG_ID_LEN * d, KLOG_ID_LEN );
+		rec.node = nodes[n];
+		rec.count = klog_get32( count + 4 * i );
+		rec.new_responses = klog_get32( new + 4 * i );
+		rec.no_new_responses = klog_get32( no_new + 4 * i );
+		rec.sequential = klog_get32( seq + 4 * i );
+		if( set_size ) {
+			rec.set_size = klog_get32( set_size + 4 * i );
+			rec.flags = KLOG_F_SET_SIZE;
+		}
+
+		if( rec.count > (addrs - a) ) {
+			break;
+		}
+
+		for( j = 0; j < rec.count; j++, a++ ) {
+			memcpy( addr.ip, ip + 4 * a, 4 );
+			addr.port = klog_get16( port + 2 * a );
+			klog_print_result( out, klog_get32( time + 4 * i ), rec.id, &rec.node, &addr );
+		}
+		klog_print_summary( out, klog_get32( time + 4 * i ), &rec );
+	}
+
+	free( nodes );
+	return (i == rows) ? 0 : -1;
+}
+
+/* Print one block or footer. Returns the number of bytes consumed or -1. */
+static long print_block( const uint8_t *data, size_t len, FILE *out, int index_only ) {
+	struct reader r = { data, len, 0, 0 };
+	const uint8_t *p;
+	uint32_t magic, kind, flags, rows, dict_num, nodes_num, addrs;
+	uint32_t num, i;
+	int rc;
+
+	if( (p = r_get( &r, 4 )) == NULL ) {
+		return -1;
+	}
+	magic = klog_get32( p );
+
+	if( magic == KLOG_FOOTER_MAGIC ) {
+		if( (p = r_get( &r, 4 )) == NULL ) {
+			return -1;
+		}
+		num = klog_get32( p );
+		if( (p = r_col( &r, num, KLOG_INDEX_SIZE )) == NULL || r_get( &r, 8 ) == NULL ) {
+			return -1;
+		}
+		if( index_only ) {
+			for( i = 0; i < num; i++, p += KLOG_INDEX_SIZE ) {
+				fprintf( out, "block at %llu: %u rows, time %u - %u\n",
+					(unsigned long long) klog_get64( p ), klog_get32( p + 8 ),
+					klog_get32( p + 12 ), klog_get32( p + 16 ) );
+			}
+		}
+		return r.pos;
+	}
+
+	if( magic != KLOG_BLOCK_MAGIC || (p = r_get( &r, KLOG_HEADER_SIZE - 4 )) == NULL ) {
+		return -1;
+	}
+
+	kind = klog_get16( p );
+	flags = klog_get16( p + 2 );
+	rows = klog_get32( p + 4 );
+	dict_num = klog_get32( p + 8 );
+	nodes_num = klog_get32( p + 12 );
+	addrs = klog_get32( p + 16 );
+
+	/* Without output the block is only skipped */
+	if( index_only ) {
+		out = NULL;
+	}
+
+	if( kind == KLOG_SEEDERS ) {
+		rc = print_seeders( &r, out, rows, dict_num );
+	} else if( kind == KLOG_RESULT_NODES ) {
+		rc = print_result_nodes( &r, out, flags, rows, dict_num, nodes_num, addrs );
+	} else {
+		rc = -1;
+	}
+
+	return (rc < 0) ? -1 : (long) r.pos;
+}
+
+/* Add the sketches of a file to the totals */
+static int read_uniques( const char *path, const uint8_t *data, size_t len ) {
+	struct hll_record rec;
+	struct unique *u;
+	size_t pos;
+	long rc;
+
+	pos = 0;
+	while( pos < len ) {
+		rc = hll_record_read( data + pos, len - pos, &rec );
+		if( rc < 0 ) {
+			fprintf( stderr, "%s: Invalid sketch at offset %zu.\n", path, pos );
+			return 1;
+		}
+		pos += rc;
+
+		for( u = g_uniques; u; u = u->next ) {
+			if( u->kind == rec.kind && u->key_len == rec.key_len
+					&& memcmp( u->key, rec.key, rec.key_len ) == 0 ) {
+				break;
+			}
+		}
+
+		if( u == NULL ) {
+			u = (struct unique *) calloc( 1, sizeof(struct unique) );
+			u->kind = rec.kind;
+			u->key_len = rec.key_len;
+			memcpy( u->key, rec.key, rec.key_len );
+			u->day_first = rec.day;
+			u->day_last = rec.day;
+			u->next = g_uniques;
+			g_uniques = u;
+		} else if( u->hll ) {
+			/* Same key from another day or instance */
+			if( hll_merge( u->hll, rec.hll ) < 0 ) {
+				fprintf( stderr, "%s: Sketch precision mismatch.\n", path );
+			}
+			hll_free( rec.hll );
+			rec.hll = NULL;
+		}
+
+		if( rec.hll ) {
+			u->hll = rec.hll;
+		}
+		if( rec.day < u->day_first ) {
+			u->day_first = rec.day;
+		}
+		if( rec.day > u->day_last ) {
+			u->day_last = rec.day;
+		}
+	}
+
+	return 0;
+}
+
+static const char *day_str( uint32_t day, char *buf ) {
+	struct tm utc;
+	time_t t;
+
+	t = (time_t) day * 24 * 60 * 60;
+	gmtime_r( &t, &utc );
+	strftime( buf, 16, "%F", &utc );
+	return buf;
+}
+
+/* Print the estimates of all sketches read */
+static void print_uniques( FILE *out ) {
+	char first[16], last[16];
+	char hexbuf[2 * KLOG_ID_LEN + 1];
+	struct hll *total;
+	struct unique *u;
+	struct unique *next;
+	int kind;
+	int i;
+
+	total = hll_new( UNIQUES_PAYLOAD_P );
+
+	/* Payloads first, then result nodes */
+	for( kind = HLL_PAYLOAD; kind <= HLL_NODE; kind++ ) {
+		for( u = g_uniques; u; u = u->next ) {
+			if( u->kind != kind ) {
+				continue;
+			}
+
+			day_str( u->day_first, first );
+			day_str( u->day_last, last );
+			if( kind == HLL_PAYLOAD ) {
+				fprintf( out, "payload %.*s %.0f %s %s\n",
+					(int) u->key_len, u->key, hll_estimate( u->hll ), first, last );
+				hll_merge( total, u->hll );
+			} else {
+				for( i = 0; i < KLOG_ID_LEN && i < u->key_len; i++ ) {
+					sprintf( hexbuf + 2 * i, "%02x", u->key[i] );
+				}
+				fprintf( out, "node %s %.0f %s %s\n",
+					hexbuf, hll_estimate( u->hll ), first, last );
+			}
+		}
+
+		if( kind == HLL_PAYLOAD ) {
+			fprintf( out, "total %.0f\n", hll_estimate( total ) );
+		}
+	}
+
+	hll_free( total );
+
+	for( u = g_uniques; u; u = next ) {
+		next = u->next;
+		hll_free( u->hll );
+		free( u );
+	}
+	g_uniques = NULL;
+}
+
+/* Print all blocks of the data of a file */
+static int print_data( const char *path, const uint8_t *data, size_t len, FILE *out, int mode ) {
+	size_t pos;
+	long rc;
+
+	if( mode == MODE_UNIQUES ) {
+		return read_uniques( path, data, len );
+	}
+
+	pos = 0;
+	while( pos < len ) {
+		rc = print_block( data + pos, len - pos, out, (mode == MODE_INDEX) );
+		if( rc < 0 ) {
+			/* E.g. a block cut short when the daemon was killed */
+			fprintf( stderr, "%s: Invalid data at offset %zu.\n", path, pos );
+			return 1;
+		}
+		pos += rc;
+	}
+
+	return 0;
+}
+
+#ifdef ZLIB
+/* Decompress all gzip members of a file and print the blocks */
+static int print_gzip( const char *path, FILE *out, int mode ) {
+	uint8_t *data;
+	size_t size;
+	size_t len;
+	gzFile gz;
+	int err;
+	int rc;
+
+	if( (gz = gzopen( path, "rb" )) == NULL ) {
+		fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+		return 1;
+	}
+
+	size = 1024 * 1024;
+	len = 0;
+	data = (uint8_t *) malloc( size );
+	err = 0;
+
+	while( (rc = gzread( gz, data + len, size - len )) > 0 ) {
+		len += rc;
+		if( len == size ) {
+			size *= 2;
+			data = (uint8_t *) realloc( data, size );
+		}
+	}
+
+	if( rc < 0 ) {
+		/* The last member is incomplete - print the data before */
+		fprintf( stderr, "%s: %s\n", path, gzerror( gz, &rc ) );
+		err = 1;
+	}
+	gzclose( gz );
+
+	err |= print_data( path, data, len, out, mode );
+	free( data );
+
+	return err;
+}
+#endif
+
+static int print_file( const char *path, FILE *out, int mode ) {
+	struct stat st;
+	const uint8_t *data;
+	int rc;
+	int fd;
+
+	if( (fd = open( path, O_RDONLY )) < 0 || fstat( fd, &st ) < 0 ) {
+		fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+		return 1;
+	}
+
+	if( st.st_size == 0 ) {
+		close( fd );
+		return 0;
+	}
+
+	data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( data == MAP_FAILED ) {
+		fprintf( stderr, "%s: %s\n", path, strerror( errno ) );
+		return 1;
+	}
+
+#ifdef ZLIB
+	if( st.st_size >= 2 && data[0] == 0x1f && data[1] == 0x8b ) {
+		munmap( (void *) data, st.st_size );
+		return print_gzip( path, out, mode );
+	}
+#endif
+
+	rc = print_data( path, data, st.st_size, out, mode );
+
+	munmap( (void *) data, st.st_size );
+	return rc;
+}
+
+int main( int argc, char **argv ) {
+	int mode;
+	int rc;
+	int i;
+
+	mode = MODE_RECORDS;
+	rc = 0;
+
+	for( i = 1; i < argc; i++ ) {
+		if( strcmp( argv[i], "-h" ) == 0 ) {
+			fprintf( stdout, "%s", usage );
+			return 0;
+		} else if( strcmp( argv[i], "-i" ) == 0 ) {
+			mode = MODE_INDEX;
+		} else if( strcmp( argv[i], "-u" ) == 0 ) {
+			mode = MODE_UNIQUES;
+		} else {
+			rc |= print_file( argv[i], stdout, mode );
+		}
+	}
+
+	if( mode == MODE_UNIQUES ) {
+		print_uniques( stdout );
+	}
+
+	return rc;
+}
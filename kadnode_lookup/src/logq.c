@@ -0,0 +1,259 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "main.h"
+#include "log.h"
+#include "logq.h"
+#include "logsink.h"
+#include "metrics.h"
+
+/*
+* Single producer / single consumer ring. The DHT thread
+* advances g_head, the writer thread advances g_tail.
+* Both positions only grow; the offset into the buffer is
+* the position modulo LOGQ_SIZE. Records never wrap around
+* the end of the buffer, a padding record fills the gap.
+*/
+
+/* Fills the space up to the end of the buffer */
+#define LOGQ_PAD 0xffff
+
+/* Poll interval of the writer thread when the ring is empty */
+#define LOGQ_IDLE_NS (10 * 1000 * 1000)
+
+struct logq_rec {
+	uint32_t len; /* Payload length in bytes */
+	uint16_t stream;
+	uint16_t type;
+	int64_t time;
+};
+
+/* Records start at a multiple of the header size */
+#define LOGQ_ALIGN(n) (((n) + sizeof(struct logq_rec) - 1) & ~(sizeof(struct logq_rec) - 1))
+
+static UCHAR *g_ring = NULL;
+static uint64_t g_head = 0;
+static uint64_t g_tail = 0;
+static int g_stop = 0;
+static pthread_t g_thread;
+
+/* Statistics - counted by the DHT thread */
+static uint64_t g_enqueued = 0;
+static uint64_t g_dropped = 0;
+static uint64_t g_max_depth = 0;
+
+/* Statistics - counted by the writer thread */
+static uint64_t g_written = 0;
+
+/* Write all records currently in the ring. Returns the number of records written. */
+static int logq_drain( void ) {
+	const struct logq_rec *rec;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t off;
+	int count;
+
+	count = 0;
+	head = __atomic_load_n( &g_head, __ATOMIC_ACQUIRE );
+	tail = g_tail;
+
+	while( tail != head ) {
+		off = tail & (LOGQ_SIZE - 1);
+		rec = (const struct logq_rec *) &g_ring[off];
+		if( rec->type == LOGQ_PAD ) {
+			tail += LOGQ_SIZE - off;
+		} else {
+			logsink_write( rec->stream, rec->type, rec->time, rec + 1, rec->len );
+			tail += LOGQ_ALIGN( sizeof(struct logq_rec) + rec->len );
+			count++;
+		}
+		/* Hand the space back to the producer */
+		__atomic_store_n( &g_tail, tail, __ATOMIC_RELEASE );
+	}
+
+	if( count ) {
+		__atomic_add_fetch( &g_written, count, __ATOMIC_RELAXED );
+	}
+
+	return count;
+}
+
+static void *logq_loop( void *arg ) {
+	struct timespec idle = { 0, LOGQ_IDLE_NS };
+	time_t flush_time = 0;
+	time_t now;
+
+	while( 1 ) {
+		if( logq_drain() > 0 ) {
+			/* Keep the files flushed under constant load */
+			now = time( NULL );
+			if( now != flush_time ) {
+				logsink_flush();
+				flush_time = now;
+			}
+			continue;
+		}
+
+		/* Ring is empty */
+		logsink_flush();
+
+		if( __atomic_load_n( &g_stop, __ATOMIC_ACQUIRE ) ) {
+			/* Records queued right before the stop flag was set */
+			if( logq_drain() > 0 ) {
+				continue;
+			}
+			break;
+		}
+
+		nanosleep( &idle, NULL );
+	}
+
+	return NULL;
+}
+
+int logq_write( int stream, int type, time_t time, const void *data, size_t len ) {
+	struct logq_rec *rec;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t off;
+	size_t need;
+	size_t pad;
+
+	if( g_ring == NULL ) {
+		g_dropped++;
+		metrics_count( METRIC_LOG_DROPPED );
+		return -1;
+	}
+
+	need = LOGQ_ALIGN( sizeof(struct logq_rec) + len );
+	head = g_head;
+	tail = __atomic_load_n( &g_tail, __ATOMIC_ACQUIRE );
+
+	/* A record that does not fit before the end starts at the beginning again */
+	off = head & (LOGQ_SIZE - 1);
+	pad = (LOGQ_SIZE - off < need) ? (LOGQ_SIZE - off) : 0;
+
+	if( (head + pad + need - tail) > LOGQ_SIZE ) {
+		/* Writer is behind - do not block the DHT */
+		g_dropped++;
+		metrics_count( METRIC_LOG_DROPPED );
+		return -1;
+	}
+
+	if( pad ) {
+		rec = (struct logq_rec *) &g_ring[off];
+		rec->len = 0;
+		rec->stream = 0;
+		rec->type = LOGQ_PAD;
+		rec->time = 0;
+		head += pad;
+	}
+
+	rec = (struct logq_rec *) &g_ring[head & (LOGQ_SIZE - 1)];
+	rec->len = len;
+	rec->stream = stream;
+	rec->type = type;
+	rec->time = time;
+	memcpy( rec + 1, data, len );
+	head += need;
+
+	__atomic_store_n( &g_head, head, __ATOMIC_RELEASE );
+
+	g_enqueued++;
+	if( (head - tail) > g_max_depth ) {
+		g_max_depth = head - tail;
+	}
+
+	return 0;
+}
+
+void logq_drop( void ) {
+	g_dropped++;
+	metrics_count( METRIC_LOG_DROPPED );
+}
+
+int logq_vprintf( int stream, time_t time, const char *format, va_list vlist ) {
+	char line[LOGQ_LINE_MAX];
+	int len;
+
+	len = vsnprintf( line, sizeof(line), format, vlist );
+	if( len < 0 ) {
+		return -1;
+	}
+
+	if( len >= sizeof(line) ) {
+		len = sizeof(line) - 1;
+	}
+
+	return logq_write( stream, LOGQ_TEXT, time, line, len );
+}
+
+int logq_printf( int stream, time_t time, const char *format, ... ) {
+	va_list vlist;
+	int rc;
+
+	va_start( vlist, format );
+	rc = logq_vprintf( stream, time, format, vlist );
+	va_end( vlist );
+
+	return rc;
+}
+
+int logq_status( char *buf, int size ) {
+	uint64_t depth;
+
+	depth = g_head - __atomic_load_n( &g_tail, __ATOMIC_ACQUIRE );
+
+	return snprintf( buf, size,
+		"Log queue: %llu queued, %llu written, %llu dropped, %llu/%d bytes used (max %llu)\n",
+		(unsigned long long) g_enqueued,
+		(unsigned long long) __atomic_load_n( &g_written, __ATOMIC_RELAXED ),
+		(unsigned long long) g_dropped,
+		(unsigned long long) depth, LOGQ_SIZE,
+		(unsigned long long) g_max_depth
+	);
+}
+
+void logq_depth( uint64_t *bytes, uint64_t *records ) {
+	*bytes = g_head - __atomic_load_n( &g_tail, __ATOMIC_ACQUIRE );
+	*records = g_enqueued - __atomic_load_n( &g_written, __ATOMIC_RELAXED );
+}
+
+void logq_setup( void ) {
+	g_ring = (UCHAR *) malloc( LOGQ_SIZE );
+	if( g_ring == NULL ) {
+		log_err( "LOG: Failed to allocate log queue." );
+		return;
+	}
+
+	if( pthread_create( &g_thread, NULL, &logq_loop, NULL ) != 0 ) {
+		log_err( "LOG: Failed to start log writer thread." );
+	}
+}
+
+void logq_free( void ) {
+	UCHAR *ring;
+
+	if( g_ring == NULL ) {
+		return;
+	}
+
+	/* The writer empties the ring before it exits */
+	__atomic_store_n( &g_stop, 1, __ATOMIC_RELEASE );
+	pthread_join( g_thread, NULL );
+	logsink_free();
+
+	ring = g_ring;
+	g_ring = NULL;
+	free( ring );
+
+	if( g_dropped ) {
+		log_warn( "LOG: %llu records were dropped.", (unsigned long long) g_dropped );
+	}
+}
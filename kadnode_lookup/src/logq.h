@@ -0,0 +1,63 @@
+
+#ifndef _LOGQ_H_
+#define _LOGQ_H_
+
+#include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+/*
+* Measurement log output is handed to a writer thread
+* through a bounded lock-free ring buffer, so that the
+* DHT thread never blocks on file I/O. When the ring is
+* full, records are dropped and counted.
+*/
+
+/* Output streams - one daily file each */
+#define LOGQ_DEBUG 0 /* lookup_log_<date>.log */
+#define LOGQ_LOOKUP 1 /* LOOKUP_DATA_DIR/<date>.log */
+#define LOGQ_RESULT_NODES 2 /* RESULT_NODE_DATA_DIR/result_node_responses_<date>.log */
+#define LOGQ_SESSIONS 3 /* LOOKUP_DATA_DIR/sessions_<date>.log */
+#define LOGQ_UNIQUES 4 /* LOOKUP_DATA_DIR/uniques_<date>.hll */
+#ifdef ANNOUNCEMENTS
+#define LOGQ_LEECHERS 5 /* ANNOUNCE_DATA_DIR/<date>.log */
+#endif
+#define LOGQ_OBSERVED 6 /* OBSERVED_DATA_DIR/observed_<date>.log */
+#define LOGQ_STREAMS 7
+
+/* Record type of data written as is (formatted text or sketches), other types are KLOG_* kinds (klog.h) */
+#define LOGQ_TEXT 0
+
+/* Size of the ring buffer in bytes (power of two) */
+#define LOGQ_SIZE (16 * 1024 * 1024)
+
+/* Maximum length of a formatted line */
+#define LOGQ_LINE_MAX 1024
+
+/*
+* Queue a formatted line for a stream. The record time
+* selects the daily file. Must only be called from the
+* DHT thread. Returns -1 if the record was dropped.
+*/
+int logq_printf( int stream, time_t time, const char *format, ... );
+int logq_vprintf( int stream, time_t time, const char *format, va_list vlist );
+
+/* Queue a binary record. The data is copied. */
+int logq_write( int stream, int type, time_t time, const void *data, size_t len );
+
+/* Count a record that was dropped before it was queued, e.g. for lack of memory */
+void logq_drop( void );
+
+/* Print queue statistics */
+int logq_status( char *buf, int size );
+
+/* Bytes and records in the queue */
+void logq_depth( uint64_t *bytes, uint64_t *records );
+
+/* Start the writer thread */
+void logq_setup( void );
+
+/* Write all queued records and stop the writer thread */
+void logq_free( void );
+
+#endif /* _LOGQ_H_ */
@@ -0,0 +1,500 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef ZLIB
+#include <zlib.h>
+#endif
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "kad.h"
+#include "logq.h"
+#include "klog.h"
+#include "logsink.h"
+#include "metrics.h"
+
+/* Size of the stdio buffer of each file */
+#define LOGSINK_BUFSIZE (64 * 1024)
+
+/* Wait before trying to open a file again */
+#define LOGSINK_RETRY 10
+
+#ifdef ZLIB
+/* Uncompressed size at which a block is compressed */
+#define LOGSINK_ZBLOCK (1024 * 1024)
+
+/* Oldest data kept uncompressed if --log-fsync is 0 */
+#define LOGSINK_ZBLOCK_AGE 60
+
+/* Output buffer of the deflate encoder */
+#define LOGSINK_ZCHUNK (64 * 1024)
+#endif
+
+struct logsink_t {
+	FILE *fp;
+	time_t day; /* UTC day the file belongs to */
+	time_t retry; /* Do not try to open a file before */
+	int dirty; /* Data written since the last fsync */
+	char filename[256];
+	/* Binary format */
+	struct klog_block *block;
+	struct klog_index *index; /* Blocks written to the current file */
+	uint32_t index_num;
+	uint32_t index_size;
+	int index_failed; /* Out of memory, the file gets no footer */
+#ifdef ZLIB
+	/*
+	* Compressed files are a sequence of gzip members. The data
+	* is collected in memory and each block becomes a member,
+	* so a crash loses at most the block not yet written.
+	*/
+	int compress;
+	FILE *mem;
+	char *mem_data;
+	size_t mem_size;
+	time_t mem_time; /* Time of the first record in the block */
+	uint64_t mem_base; /* Uncompressed bytes of the previous blocks */
+#endif
+};
+
+static struct logsink_t g_sinks[LOGQ_STREAMS];
+static time_t g_sync_time = 0;
+
+#ifdef ZLIB
+static z_stream g_zstream;
+static int g_zstream_init = 0;
+static UCHAR g_zout[LOGSINK_ZCHUNK];
+
+/* Statistics - counted by the writer thread, read by logsink_status */
+static uint64_t g_zbytes_in = 0;
+static uint64_t g_zbytes_out = 0;
+static uint64_t g_zcpu_ns = 0;
+
+static int logsink_compressed( int stream ) {
+	/* Sketch files are small and do not compress well */
+	return gconf->log_compress && (stream != LOGQ_DEBUG) && (stream != LOGQ_UNIQUES);
+}
+
+static uint64_t logsink_cpu_ns( void ) {
+	struct timespec ts;
+
+	if( clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts ) != 0 ) {
+		return 0;
+	}
+	return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* Compress the collected data as one gzip member */
+static void logsink_compress( struct logsink_t *sink ) {
+	uint64_t start;
+	size_t len;
+	size_t out;
+	int rc;
+
+	if( sink->mem == NULL ) {
+		return;
+	}
+
+	fflush( sink->mem );
+	if( sink->mem_size == 0 ) {
+		return;
+	}
+
+	if( !g_zstream_init ) {
+		/* windowBits + 16 selects the gzip wrapper */
+		if( deflateInit2( &g_zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+			log_err( "LOG: Failed to initialize zlib." );
+		}
+		g_zstream_init = 1;
+	} else {
+		deflateReset( &g_zstream );
+	}
+
+	start = logsink_cpu_ns();
+	len = sink->mem_size;
+	out = 0;
+
+	g_zstream.next_in = (Bytef *) sink->mem_data;
+	g_zstream.avail_in = len;
+	do {
+		g_zstream.next_out = g_zout;
+		g_zstream.avail_out = sizeof(g_zout);
+		rc = deflate( &g_zstream, Z_FINISH );
+		fwrite( g_zout, 1, sizeof(g_zout) - g_zstream.avail_out, sink->fp );
+		out += sizeof(g_zout) - g_zstream.avail_out;
+	} while( rc == Z_OK );
+
+	__atomic_add_fetch( &g_zcpu_ns, logsink_cpu_ns() - start, __ATOMIC_RELAXED );
+	__atomic_add_fetch( &g_zbytes_in, len, __ATOMIC_RELAXED );
+	__atomic_add_fetch( &g_zbytes_out, out, __ATOMIC_RELAXED );
+
+	/* Reuse the buffer for the next block */
+	fseek( sink->mem, 0, SEEK_SET );
+	sink->mem_size = 0;
+	sink->mem_base += len;
+	sink->mem_time = 0;
+}
+
+/*
+* Uncompressed size of a compressed file we append to, so that
+* the offsets of the new blocks count the data already in it
+*/
+static uint64_t logsink_zsize( const char filename[] ) {
+	uint64_t size;
+	gzFile gz;
+	int n;
+
+	gz = gzopen( filename, "rb" );
+	if( gz == NULL ) {
+		return 0;
+	}
+
+	size = 0;
+	while( (n = gzread( gz, g_zout, sizeof(g_zout) )) > 0 ) {
+		size += n;
+	}
+	gzclose( gz );
+
+	return size;
+}
+#endif
+
+/* Stream that records are written to */
+static FILE *logsink_out( struct logsink_t *sink ) {
+#ifdef ZLIB
+	if( sink->compress ) {
+		return sink->mem;
+	}
+#endif
+	return sink->fp;
+}
+
+/* Seeder and result node records are written in the binary format if enabled */
+static int logsink_binary( int stream ) {
+	return (gconf->log_format == LOG_FORMAT_BINARY)
+		&& (stream == LOGQ_LOOKUP || stream == LOGQ_RESULT_NODES);
+}
+
+/* Binary records and sketches are dropped rather than written to stdout */
+static int logsink_stdout( int stream ) {
+	return !logsink_binary( stream ) && (stream != LOGQ_UNIQUES);
+}
+
+static void logsink_filename( char *buf, size_t size, int stream, time_t time ) {
+	const char *ext;
+	char date[16];
+	struct tm utc;
+
+	gmtime_r( &time, &utc );
+	strftime( date, sizeof(date), "%F", &utc );
+	ext = logsink_binary( stream ) ? "klog" : "log";
+#ifdef ZLIB
+	if( logsink_compressed( stream ) ) {
+		ext = logsink_binary( stream ) ? "klog.gz" : "log.gz";
+	}
+#endif
+
+	switch( stream ) {
+		case LOGQ_LOOKUP:
+			snprintf( buf, size, "%s/%s.%s", LOOKUP_DATA_DIR, date, ext );
+			break;
+		case LOGQ_RESULT_NODES:
+			snprintf( buf, size, "%s/result_node_responses_%s.%s", RESULT_NODE_DATA_DIR, date, ext );
+			break;
+		case LOGQ_SESSIONS:
+			snprintf( buf, size, "%s/sessions_%s.%s", LOOKUP_DATA_DIR, date, ext );
+			break;
+		case LOGQ_UNIQUES:
+			snprintf( buf, size, "%s/uniques_%s.hll", LOOKUP_DATA_DIR, date );
+			break;
+#ifdef ANNOUNCEMENTS
+		case LOGQ_LEECHERS:
+			snprintf( buf, size, "%s/%s.%s", ANNOUNCE_DATA_DIR, date, ext );
+			break;
+#endif
+		case LOGQ_OBSERVED:
+			snprintf( buf, size, "%s/observed_%s.%s", OBSERVED_DATA_DIR, date, ext );
+			break;
+		default:
+			snprintf( buf, size, "lookup_log_%s.log", date );
+	}
+}
+
+/* Write the collected binary records as a block */
+static void logsink_block( struct logsink_t *sink ) {
+	struct klog_index *index;
+	struct klog_index entry;
+	uint32_t size;
+
+	if( sink->block == NULL || klog_block_rows( sink->block ) == 0 ) {
+		return;
+	}
+
+	if( sink->index_num == sink->index_size && !sink->index_failed ) {
+		size = sink->index_size ? (2 * sink->index_size) : 64;
+		index = realloc( sink->index, size * sizeof(struct klog_index) );
+		if( index ) {
+			sink->index = index;
+			sink->index_size = size;
+		} else {
+			log_warn( "LOG: Out of memory, %s gets no block index", sink->filename );
+			sink->index_failed = 1;
+		}
+	}
+
+	/* The blocks are still written, an incomplete index would be wrong */
+	if( sink->index_failed ) {
+		klog_block_write( sink->block, logsink_out( sink ), &entry );
+		return;
+	}
+
+	if( klog_block_write( sink->block, logsink_out( sink ), &sink->index[sink->index_num] ) > 0 ) {
+#ifdef ZLIB
+		/* Offset in the uncompressed data of the file */
+		sink->index[sink->index_num].offset += sink->mem_base;
+#endif
+		sink->index_num++;
+	}
+}
+
+static void logsink_close( struct logsink_t *sink ) {
+	FILE *fp;
+
+	fp = sink->fp;
+	if( fp == NULL ) {
+		return;
+	}
+
+	/* Finish a binary file with the block index */
+	logsink_block( sink );
+	if( sink->index_num && !sink->index_failed && fp != stdout ) {
+		klog_footer_write( logsink_out( sink ), sink->index, sink->index_num );
+	}
+	sink->index_num = 0;
+	sink->index_failed = 0;
+
+#ifdef ZLIB
+	logsink_compress( sink );
+	sink->mem_base = 0;
+#endif
+
+	if( fp != stdout ) {
+		fflush( fp );
+		if( gconf->log_fsync > 0 ) {
+			fsync( fileno( fp ) );
+		}
+		fclose( fp );
+	}
+	sink->fp = NULL;
+}
+
+/*
+* Open the file for the day of the record. The new file is
+* opened before the old one is closed, so that there is
+* always a file to write to. Returns NULL if there is none.
+*/
+static FILE *logsink_file( int stream, time_t rec_time ) {
+	struct logsink_t *sink;
+	char filename[256];
+	time_t day;
+	time_t now;
+	FILE *fp;
+
+	sink = &g_sinks[stream];
+	day = rec_time / (24 * 60 * 60);
+
+	/* Late records of the previous day go to the current file */
+	if( sink->fp && day <= sink->day ) {
+		return logsink_out( sink );
+	}
+
+	now = time( NULL );
+	if( sink->retry > now ) {
+		return sink->fp ? logsink_out( sink ) : NULL;
+	}
+
+	logsink_filename( filename, sizeof(filename), stream, rec_time );
+
+	fp = fopen( filename, "a" );
+	if( fp == NULL ) {
+		log_warn( "LOG: Failed to open log file %s: %s", filename, strerror( errno ) );
+		sink->retry = now + LOGSINK_RETRY;
+		if( sink->fp == NULL && logsink_stdout( stream ) ) {
+			/* Nothing to fall back to, the day is left for the retry */
+			sink->fp = stdout;
+#ifdef ZLIB
+			sink->compress = 0;
+#endif
+		}
+		return sink->fp ? logsink_out( sink ) : NULL;
+	}
+
+	setvbuf( fp, NULL, _IOFBF, LOGSINK_BUFSIZE );
+
+	/* Block offsets for the footer index */
+	fseek( fp, 0, SEEK_END );
+
+	logsink_close( sink );
+	sink->fp = fp;
+	sink->day = day;
+	sink->retry = 0;
+	sink->dirty = 0;
+	strcpy( sink->filename, filename );
+
+#ifdef ZLIB
+	sink->compress = logsink_compressed( stream );
+	if( sink->compress && sink->mem == NULL ) {
+		sink->mem = open_memstream( &sink->mem_data, &sink->mem_size );
+		if( sink->mem == NULL ) {
+			log_warn( "LOG: Failed to create compression buffer, writing %s uncompressed: %s",
+				filename, strerror( errno ) );
+			sink->compress = 0;
+		}
+	}
+
+	/* Appending after a restart */
+	if( sink->compress && ftell( fp ) > 0 ) {
+		sink->mem_base = logsink_zsize( filename );
+	}
+#endif
+
+	return logsink_out( sink );
+}
+
+void logsink_write( int stream, int type, time_t time, const void *data, size_t len ) {
+	struct logsink_t *sink;
+	FILE *fp;
+
+	if( stream < 0 || stream >= LOGQ_STREAMS ) {
+		return;
+	}
+
+	sink = &g_sinks[stream];
+	fp = logsink_file( stream, time );
+	if( fp == NULL ) {
+		return;
+	}
+	metrics_add( METRIC_LOG_BYTES, len );
+
+#ifdef ZLIB
+	if( sink->compress && sink->mem_time == 0 ) {
+		sink->mem_time = time;
+	}
+#endif
+
+	if( type == LOGQ_TEXT ) {
+		fwrite( data, 1, len, fp );
+	} else if( logsink_binary( stream ) ) {
+		/* Each stream carries only one kind of record */
+		if( sink->block == NULL ) {
+			sink->block = klog_block_new( type );
+		}
+		klog_block_add( sink->block, time, data );
+		if( klog_block_rows( sink->block ) >= KLOG_BLOCK_ROWS ) {
+			logsink_block( sink );
+		}
+	} else {
+		klog_print_record( fp, type, time, data );
+	}
+
+	sink->dirty = 1;
+}
+
+void logsink_flush( void ) {
+	struct logsink_t *sink;
+	int do_sync;
+	time_t now;
+	int i;
+#ifdef ZLIB
+	time_t max_age;
+
+	max_age = (gconf->log_fsync > 0) ? gconf->log_fsync : LOGSINK_ZBLOCK_AGE;
+#endif
+
+	now = time( NULL );
+	do_sync = (gconf->log_fsync > 0) && (now - g_sync_time) >= gconf->log_fsync;
+
+	for( i = 0; i < LOGQ_STREAMS; i++ ) {
+		sink = &g_sinks[i];
+		if( sink->fp == NULL ) {
+			continue;
+		}
+
+		logsink_block( sink );
+#ifdef ZLIB
+		if( sink->compress && (ftell( sink->mem ) >= LOGSINK_ZBLOCK
+				|| (sink->mem_time && (now - sink->mem_time) >= max_age)) ) {
+			logsink_compress( sink );
+		}
+#endif
+		fflush( sink->fp );
+
+		if( do_sync && sink->dirty && sink->fp != stdout ) {
+			fsync( fileno( sink->fp ) );
+			sink->dirty = 0;
+		}
+	}
+
+	if( do_sync ) {
+		g_sync_time = now;
+	}
+}
+
+void logsink_free( void ) {
+	int i;
+
+	for( i = 0; i < LOGQ_STREAMS; i++ ) {
+		logsink_close( &g_sinks[i] );
+		klog_block_free( g_sinks[i].block );
+		free( g_sinks[i].index );
+		g_sinks[i].block = NULL;
+		g_sinks[i].index = NULL;
+		g_sinks[i].index_size = 0;
+#ifdef ZLIB
+		if( g_sinks[i].mem ) {
+			fclose( g_sinks[i].mem );
+			free( g_sinks[i].mem_data );
+			g_sinks[i].mem = NULL;
+			g_sinks[i].mem_data = NULL;
+		}
+#endif
+	}
+
+#ifdef ZLIB
+	if( g_zstream_init ) {
+		deflateEnd( &g_zstream );
+		g_zstream_init = 0;
+	}
+#endif
+}
+
+int logsink_status( char *buf, int size ) {
+#ifdef ZLIB
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t cpu_ns;
+
+	if( !gconf->log_compress ) {
+		return 0;
+	}
+
+	bytes_in = __atomic_load_n( &g_zbytes_in, __ATOMIC_RELAXED );
+	bytes_out = __atomic_load_n( &g_zbytes_out, __ATOMIC_RELAXED );
+	cpu_ns = __atomic_load_n( &g_zcpu_ns, __ATOMIC_RELAXED );
+
+	return snprintf( buf, size,
+		"Log compression: %llu KB -> %llu KB (ratio %.2f), %.3f s CPU\n",
+		(unsigned long long) (bytes_in / 1024),
+		(unsigned long long) (bytes_out / 1024),
+		bytes_out ? ((double) bytes_in / bytes_out) : 0.0,
+		cpu_ns / 1e9
+	);
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,25 @@
+
+#ifndef _LOGSINK_H_
+#define _LOGSINK_H_
+
+#include <time.h>
+
+/*
+* Output side of the measurement logs. Each stream keeps
+* one buffered file handle open that is replaced at the
+* UTC day boundary. Only used by the log writer thread.
+*/
+
+/* Append a record (LOGQ_TEXT or a KLOG_* kind) to the daily file of a stream */
+void logsink_write( int stream, int type, time_t time, const void *data, size_t len );
+
+/* Flush buffered data and fsync when the interval has passed */
+void logsink_flush( void );
+
+/* Flush, sync and close all files */
+void logsink_free( void );
+
+/* Compression statistics, may be called from any thread */
+int logsink_status( char *buf, int size );
+
+#endif /* _LOGSINK_H_ */
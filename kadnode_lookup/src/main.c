@@ -17,6 +17,12 @@
 #include "net.h"
 #include "values.h"
 #include "results.h"
+#include "metrics.h"
+#include "idmap.h"
+#include "infohashes.h"
+#include "sessions.h"
+#include "uniques.h"
+#include "logq.h"
 #include "peerfile.h"
 #ifdef __CYGWIN__
 #include "windows.h"
@@ -46,11 +52,17 @@
 
 
 int main_start( void ) {
+	/* Start the log writer thread */
+	logq_setup();
+
 	/* Setup port-forwarding */
 #ifdef FWD
 	fwd_setup();
 #endif
 
+	/* Read the Hajime modules to look up */
+	infohashes_setup();
+
 	/* Setup the Kademlia DHT */
 	kad_setup();
 
@@ -60,6 +72,15 @@ int main_start( void ) {
 	/* Setup handler to expire results */
 	results_setup();
 
+	/* Setup handler to update the metric rates */
+	metrics_setup();
+
+	/* Setup handler to close seeder sessions */
+	sessions_setup();
+
+	/* Setup handler to write out unique seeder estimates */
+	uniques_setup();
+
 	/* Setup import of peerfile  */
 	peerfile_setup();
 
@@ -110,10 +131,23 @@ int main_start( void ) {
 
 	results_free();
 
+	metrics_free();
+
+	sessions_free();
+
+	uniques_free();
+
 	values_free();
 
 	kad_free();
 
+	idmap_free();
+
+	infohashes_free();
+
+	/* Write out all queued log records */
+	logq_free();
+
 #ifdef FWD
 	fwd_free();
 #endif
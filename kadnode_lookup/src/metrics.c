@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "main.h"
+#include "utils.h"
+#include "net.h"
+#include "metrics.h"
+
+struct metric_desc_t {
+	const char *name;
+	const char *labels; /* NULL or 'name="value"' */
+	const char *help;
+};
+
+#define PACKETS_IN_HELP "DHT packets received by KRPC type."
+#define PACKETS_OUT_HELP "DHT packets sent by KRPC type."
+
+static const struct metric_desc_t g_counter_descs[METRIC_COUNTERS] = {
+	{ "kadnode_dht_packets_in_total", "type=\"error\"", PACKETS_IN_HELP },
+	{ "kadnode_dht_packets_in_total", "type=\"reply\"", PACKETS_IN_HELP },
+	{ "kadnode_dht_packets_in_total", "type=\"ping\"", PACKETS_IN_HELP },
+	{ "kadnode_dht_packets_in_total", "type=\"find_node\"", PACKETS_IN_HELP },
+	{ "kadnode_dht_packets_in_total", "type=\"get_peers\"", PACKETS_IN_HELP },
+	{ "kadnode_dht_packets_in_total", "type=\"announce_peer\"", PACKETS_IN_HELP },
+	{ "kadnode_dht_packets_out_total", "type=\"error\"", PACKETS_OUT_HELP },
+	{ "kadnode_dht_packets_out_total", "type=\"reply\"", PACKETS_OUT_HELP },
+	{ "kadnode_dht_packets_out_total", "type=\"ping\"", PACKETS_OUT_HELP },
+	{ "kadnode_dht_packets_out_total", "type=\"find_node\"", PACKETS_OUT_HELP },
+	{ "kadnode_dht_packets_out_total", "type=\"get_peers\"", PACKETS_OUT_HELP },
+	{ "kadnode_dht_packets_out_total", "type=\"announce_peer\"", PACKETS_OUT_HELP },
+	{ "kadnode_dht_parse_failures_total", NULL, "DHT packets that could not be parsed." },
+	{ "kadnode_dht_ratelimit_drops_total", NULL, "DHT requests dropped by the per source rate limit." },
+	{ "kadnode_dht_blacklisted_sends_total", NULL, "DHT packets not sent because the node is blacklisted." },
+	{ "kadnode_results_total", NULL, "Peer addresses received for the lookups." },
+	{ "kadnode_results_new_total", NULL, "Peer addresses not received before for the same lookup." },
+	{ "kadnode_log_bytes_total", NULL, "Bytes of log records handed to the log files." },
+	{ "kadnode_log_dropped_total", NULL, "Log records dropped because the log queue was full." }
+};
+
+static const struct metric_desc_t g_gauge_descs[METRIC_GAUGES] = {
+	{ "kadnode_dht_nodes", NULL, "Nodes in the routing table." },
+	{ "kadnode_dht_nodes_good", NULL, "Good nodes in the routing table." },
+	{ "kadnode_dht_searches", NULL, "Active DHT searches." },
+	{ "kadnode_result_nodes", NULL, "Nodes that returned results to the active searches." },
+	{ "kadnode_dht_storage_peers", NULL, "Peers stored for announce_peer requests." },
+	{ "kadnode_dht_blacklisted", NULL, "Blacklisted addresses." },
+	{ "kadnode_results_per_second", NULL, "Peer addresses received per second over the last full minute." },
+	{ "kadnode_logq_bytes", NULL, "Bytes in the log queue." },
+	{ "kadnode_logq_records", NULL, "Records in the log queue." }
+};
+
+static struct metrics_block_t g_blocks[METRICS_THREADS];
+static int g_blocks_num = 0;
+
+static double g_gauges[METRIC_GAUGES];
+
+__thread struct metrics_block_t *metrics_block = NULL;
+
+/* Start of the current rate interval and METRIC_RESULTS at that time */
+static time_t g_interval = 0;
+static uint64_t g_interval_results = 0;
+
+struct metrics_block_t *metrics_register( void ) {
+	int i;
+
+	i = __atomic_fetch_add( &g_blocks_num, 1, __ATOMIC_RELAXED );
+	if( i >= METRICS_THREADS ) {
+		i = METRICS_THREADS - 1;
+	}
+
+	metrics_block = &g_blocks[i];
+
+	return metrics_block;
+}
+
+uint64_t metrics_get( int id ) {
+	uint64_t sum;
+	int num;
+	int i;
+
+	num = __atomic_load_n( &g_blocks_num, __ATOMIC_RELAXED );
+	if( num > METRICS_THREADS ) {
+		num = METRICS_THREADS;
+	}
+
+	sum = 0;
+	for( i = 0; i < num; i++ ) {
+		sum += __atomic_load_n( &g_blocks[i].counters[id], __ATOMIC_RELAXED );
+	}
+
+	return sum;
+}
+
+void metrics_set( int id, double value ) {
+	__atomic_store( &g_gauges[id], &value, __ATOMIC_RELAXED );
+}
+
+int metrics_print( char *buf, int size ) {
+	const struct metric_desc_t *desc;
+	const char *last;
+	double value;
+	int written;
+	int i;
+
+	written = 0;
+
+#define mprintf(...) \
+	if( written < size ) { written += snprintf( buf + written, size - written, __VA_ARGS__ ); }
+
+	/* HELP and TYPE once per metric family */
+	last = NULL;
+	for( i = 0; i < METRIC_COUNTERS; i++ ) {
+		desc = &g_counter_descs[i];
+		if( last == NULL || strcmp( last, desc->name ) != 0 ) {
+			mprintf( "# HELP %s %s\n# TYPE %s counter\n", desc->name, desc->help, desc->name );
+			last = desc->name;
+		}
+
+		if( desc->labels ) {
+			mprintf( "%s{%s} %llu\n", desc->name, desc->labels, (unsigned long long) metrics_get( i ) );
+		} else {
+			mprintf( "%s %llu\n", desc->name, (unsigned long long) metrics_get( i ) );
+		}
+	}
+
+	for( i = 0; i < METRIC_GAUGES; i++ ) {
+		desc = &g_gauge_descs[i];
+		__atomic_load( &g_gauges[i], &value, __ATOMIC_RELAXED );
+		mprintf( "# HELP %s %s\n# TYPE %s gauge\n%s %.15g\n", desc->name, desc->help, desc->name,
+			desc->name, value );
+	}
+
+#undef mprintf
+
+	return (written < size) ? written : (size - 1);
+}
+
+void metrics_handle( int _rc, int _sock ) {
+	uint64_t results;
+	time_t now;
+
+	now = time_now_sec();
+	if( now < g_interval + METRICS_INTERVAL ) {
+		return;
+	}
+
+	results = metrics_get( METRIC_RESULTS );
+
+	/* Only a rate if the interval just ended */
+	if( g_interval && now < g_interval + 2 * METRICS_INTERVAL ) {
+		metrics_set( METRIC_RESULTS_RATE, (double) (results - g_interval_results) / METRICS_INTERVAL );
+	} else {
+		metrics_set( METRIC_RESULTS_RATE, 0 );
+	}
+
+	g_interval = now - (now % METRICS_INTERVAL);
+	g_interval_results = results;
+}
+
+void metrics_setup( void ) {
+	net_add_handler( -1, &metrics_handle );
+}
+
+void metrics_free( void ) {
+	/* Nothing to do */
+}
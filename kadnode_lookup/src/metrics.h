@@ -0,0 +1,93 @@
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+/*
+* Counters and gauges of the daemon in the Prometheus text
+* exposition format (GET /metrics of ext-web.c).
+*
+* Every thread counts into a block of its own, so a count on
+* the hot path is a plain add without locked instructions or
+* cache lines shared with other threads. The blocks are added
+* up when printed. Gauges are set by the thread that owns the
+* value, mostly by kad_metrics right before printing.
+*/
+
+/* KRPC message types, in the order of the message types of dht.c */
+#define METRIC_KRPC_ERROR 0
+#define METRIC_KRPC_REPLY 1
+#define METRIC_KRPC_PING 2
+#define METRIC_KRPC_FIND_NODE 3
+#define METRIC_KRPC_GET_PEERS 4
+#define METRIC_KRPC_ANNOUNCE_PEER 5
+#define METRIC_KRPC_TYPES 6
+
+/* Counters */
+#define METRIC_PACKETS_IN 0 /* + METRIC_KRPC_* */
+#define METRIC_PACKETS_OUT (METRIC_PACKETS_IN + METRIC_KRPC_TYPES) /* + METRIC_KRPC_* */
+#define METRIC_PARSE_FAILURES (METRIC_PACKETS_OUT + METRIC_KRPC_TYPES)
+#define METRIC_RATELIMIT_DROPS (METRIC_PARSE_FAILURES + 1)
+#define METRIC_BLACKLISTED_SENDS (METRIC_PARSE_FAILURES + 2)
+#define METRIC_RESULTS (METRIC_PARSE_FAILURES + 3)
+#define METRIC_RESULTS_NEW (METRIC_PARSE_FAILURES + 4)
+#define METRIC_LOG_BYTES (METRIC_PARSE_FAILURES + 5)
+#define METRIC_LOG_DROPPED (METRIC_PARSE_FAILURES + 6)
+#define METRIC_COUNTERS (METRIC_PARSE_FAILURES + 7)
+
+/* Gauges */
+#define METRIC_NODES 0
+#define METRIC_NODES_GOOD 1
+#define METRIC_SEARCHES 2
+#define METRIC_RESULT_NODES 3
+#define METRIC_STORAGE_PEERS 4
+#define METRIC_BLACKLISTED 5
+#define METRIC_RESULTS_RATE 6 /* Set from METRIC_RESULTS once per METRICS_INTERVAL */
+#define METRIC_LOGQ_BYTES 7
+#define METRIC_LOGQ_RECORDS 8
+#define METRIC_GAUGES 9
+
+/* Interval of the per second rates */
+#define METRICS_INTERVAL 60
+
+/* Threads with a block of their own; more threads share the last block */
+#define METRICS_THREADS 8
+
+struct metrics_block_t {
+	uint64_t counters[METRIC_COUNTERS];
+} __attribute__((aligned(64)));
+
+extern __thread struct metrics_block_t *metrics_block;
+
+/* Assign a block to the calling thread */
+struct metrics_block_t *metrics_register( void );
+
+/* Add to a counter of the calling thread */
+static inline void metrics_add( int id, uint64_t n ) {
+	struct metrics_block_t *block;
+
+	block = metrics_block;
+	if( block == NULL ) {
+		block = metrics_register();
+	}
+
+	/* Only this thread writes, the relaxed store keeps the reader from seeing torn values */
+	__atomic_store_n( &block->counters[id], block->counters[id] + n, __ATOMIC_RELAXED );
+}
+
+#define metrics_count(id) metrics_add( id, 1 )
+
+/* Sum of a counter over all threads */
+uint64_t metrics_get( int id );
+
+void metrics_set( int id, double value );
+
+/* Print all metrics in the text exposition format */
+int metrics_print( char *buf, int size );
+
+/* Register a handler to update the rates */
+void metrics_setup( void );
+void metrics_free( void );
+
+#endif /* _METRICS_H_ */
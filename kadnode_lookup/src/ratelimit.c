@@ -0,0 +1,215 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "main.h"
+#include "utils.h"
+#include "logq.h"
+#include "ratelimit.h"
+#include "metrics.h"
+
+struct ratelimit_slot_t {
+	UCHAR key[8]; /* IPv4 address or IPv6 /64 */
+	UCHAR af; /* 0 if unused */
+	int tokens;
+	time_t time; /* Last refill */
+	time_t last_seen;
+	uint64_t requests;
+	uint64_t dropped;
+};
+
+static struct ratelimit_slot_t g_slots[RATELIMIT_SLOTS];
+static uint32_t g_seed = 0;
+
+static uint64_t g_requests = 0;
+static uint64_t g_dropped = 0;
+static uint64_t g_evicted = 0;
+
+/* Drops since the last debug log line */
+static uint64_t g_log_dropped = 0;
+static time_t g_log_time = 0;
+
+/* Seeded FNV-1a, so that sources cannot pick colliding addresses */
+static uint32_t ratelimit_hash( const UCHAR key[], int af, uint32_t seed ) {
+	uint32_t h;
+	int i;
+
+	h = (2166136261U ^ seed) + af;
+	for( i = 0; i < 8; i++ ) {
+		h = (h ^ key[i]) * 16777619U;
+	}
+
+	return h;
+}
+
+static int ratelimit_key( const struct sockaddr *from, UCHAR key[] ) {
+	memset( key, 0, 8 );
+	if( from->sa_family == AF_INET ) {
+		memcpy( key, &((const IP4 *) from)->sin_addr, 4 );
+		return AF_INET;
+	} else if( from->sa_family == AF_INET6 ) {
+		memcpy( key, &((const IP6 *) from)->sin6_addr, 8 );
+		return AF_INET6;
+	} else {
+		return 0;
+	}
+}
+
+static const char *ratelimit_str( const struct ratelimit_slot_t *slot, char buf[] ) {
+	UCHAR addr[16];
+
+	if( slot->af == AF_INET ) {
+		inet_ntop( AF_INET, slot->key, buf, INET6_ADDRSTRLEN+1 );
+	} else {
+		memset( addr, 0, sizeof(addr) );
+		memcpy( addr, slot->key, 8 );
+		inet_ntop( AF_INET6, addr, buf, INET6_ADDRSTRLEN+1 );
+		strcat( buf, "/64" );
+	}
+
+	return buf;
+}
+
+/* Slot of a source; a new source replaces the less recently seen of its two slots */
+static struct ratelimit_slot_t *ratelimit_slot( const UCHAR key[], int af, time_t now ) {
+	struct ratelimit_slot_t *a;
+	struct ratelimit_slot_t *b;
+
+	a = &g_slots[ratelimit_hash( key, af, g_seed ) % RATELIMIT_SLOTS];
+	if( a->af == af && memcmp( a->key, key, 8 ) == 0 ) {
+		return a;
+	}
+
+	b = &g_slots[ratelimit_hash( key, af, ~g_seed ) % RATELIMIT_SLOTS];
+	if( b->af == af && memcmp( b->key, key, 8 ) == 0 ) {
+		return b;
+	}
+
+	if( b->last_seen < a->last_seen ) {
+		a = b;
+	}
+
+	if( a->af ) {
+		g_evicted++;
+	}
+
+	memcpy( a->key, key, 8 );
+	a->af = af;
+	a->tokens = RATELIMIT_BURST;
+	a->time = now;
+	a->requests = 0;
+	a->dropped = 0;
+
+	return a;
+}
+
+int ratelimit_allow( const struct sockaddr *from ) {
+	char addrbuf[INET6_ADDRSTRLEN+4];
+	struct ratelimit_slot_t *slot;
+	UCHAR key[8];
+	time_t now;
+	int af;
+
+	af = ratelimit_key( from, key );
+	if( af == 0 ) {
+		return 0;
+	}
+
+	while( g_seed == 0 ) {
+		g_seed = random();
+	}
+
+	now = time_now_sec();
+	slot = ratelimit_slot( key, af, now );
+	slot->last_seen = now;
+	slot->requests++;
+	g_requests++;
+
+	if( slot->tokens < RATELIMIT_BURST && now > slot->time ) {
+		if( now - slot->time >= RATELIMIT_BURST / RATELIMIT_RATE ) {
+			slot->tokens = RATELIMIT_BURST;
+		} else {
+			slot->tokens += RATELIMIT_RATE * (now - slot->time);
+			if( slot->tokens > RATELIMIT_BURST ) {
+				slot->tokens = RATELIMIT_BURST;
+			}
+		}
+	}
+	slot->time = now;
+
+	if( slot->tokens > 0 ) {
+		slot->tokens--;
+		return 1;
+	}
+
+	slot->dropped++;
+	g_dropped++;
+	g_log_dropped++;
+	metrics_count( METRIC_RATELIMIT_DROPS );
+
+	/* The debug log is queued, but a flood would still fill the queue */
+	if( now >= g_log_time + RATELIMIT_LOG_INTERVAL ) {
+		logq_printf( LOGQ_DEBUG, now, "%ld: Dropping requests from %s due to rate limiting (%llu dropped since the last message).\n",
+			(long) now, ratelimit_str( slot, addrbuf ), (unsigned long long) g_log_dropped );
+		g_log_dropped = 0;
+		g_log_time = now;
+	}
+
+	return 0;
+}
+
+int ratelimit_status( char *buf, int size ) {
+	return snprintf( buf, size, "Rate limit: %llu requests, %llu dropped, %llu sources evicted\n",
+		(unsigned long long) g_requests, (unsigned long long) g_dropped, (unsigned long long) g_evicted );
+}
+
+int ratelimit_print( char *buf, int size ) {
+	char addrbuf[INET6_ADDRSTRLEN+4];
+	struct ratelimit_slot_t *top[RATELIMIT_TOP];
+	struct ratelimit_slot_t *slot;
+	int written;
+	int i, j, k;
+
+	written = 0;
+
+#define rprintf(...) \
+	if( written < size ) { written += snprintf( buf + written, size - written, __VA_ARGS__ ); }
+
+	for( j = 0; j < RATELIMIT_TOP; j++ ) {
+		top[j] = NULL;
+	}
+
+	/* Most dropped first, then most requests */
+	for( i = 0; i < RATELIMIT_SLOTS; i++ ) {
+		slot = &g_slots[i];
+		if( slot->af == 0 ) {
+			continue;
+		}
+
+		for( j = 0; j < RATELIMIT_TOP; j++ ) {
+			if( top[j] == NULL || slot->dropped > top[j]->dropped
+					|| (slot->dropped == top[j]->dropped && slot->requests > top[j]->requests) ) {
+				for( k = RATELIMIT_TOP - 1; k > j; k-- ) {
+					top[k] = top[k - 1];
+				}
+				top[j] = slot;
+				break;
+			}
+		}
+	}
+
+	rprintf( "Top talkers (requests, dropped, seconds since last request):\n" );
+	for( j = 0; j < RATELIMIT_TOP && top[j]; j++ ) {
+		rprintf( " %s: %llu %llu %ld\n", ratelimit_str( top[j], addrbuf ),
+			(unsigned long long) top[j]->requests, (unsigned long long) top[j]->dropped,
+			(long) (time_now_sec() - top[j]->last_seen) );
+	}
+
+#undef rprintf
+
+	return (written < size) ? written : (size - 1);
+}
@@ -20,6 +20,11 @@
 #include "ext-auth.h"
 #endif
 #include "results.h"
+#include "idmap.h"
+#include "logq.h"
+#include "klog.h"
+#include "sessions.h"
+#include "latency.h"
 #include "dht.h"
 #include "kad.h"
 
@@ -42,17 +47,7 @@ struct results_t* results_get( void ) {
 
 /* Find a value search result */
 struct results_t *results_find( const UCHAR id[] ) {
-	struct results_t *results;
-
-	results = g_results;
-	while( results != NULL ) {
-		if( id_equal( results->id, id ) ) {
-			return results;
-		}
-		results = results->next;
-	}
-
-	return NULL;
+	return (struct results_t *) idmap_lookup( id, IDMAP_RESULTS );
 }
 
 int results_count( struct results_t *results ) {
@@ -167,6 +162,7 @@ void results_remove( struct results_t *target ) {
 			} else {
 				g_results = cur->next;
 			}
+			idmap_set( target->id, IDMAP_RESULTS, NULL );
 			results_item_free( target );
 			break;
 		}
@@ -247,6 +243,11 @@ struct results_t* results_add( const char query[], int *is_new,
     if(date_str)
         memcpy(new->file_hash_date_str, date_str, DATE_LEN);
 
+	if( idmap_set( id, IDMAP_RESULTS, new ) < 0 ) {
+		free( new );
+		return NULL;
+	}
+
 	/* Prepend to list */
 	new->next = g_results;
 	g_results = new;
@@ -339,72 +340,77 @@ int ip_ignore(char *ip, char *ignore_addrs, int num_ignore_addrs){
 */
 
 /* Hajime
- * Log results to file.
- * Open a new file for each day, appending the date to the log filename
+ * Copy the addresses of a results bucket behind a log record
+ * header of the given size. The record is freed by the caller.
  */
-void log_lookup_results(struct results_t *results, int done){
-    char buf[256+1];
+static void *log_record_new(struct results_t *results, size_t header_len,
+        uint32_t *count, size_t *len){
     struct result_t *result;
-    int count = 0;
-    //int num_ignore_addrs = 0;
-    char time_str[26];
-	char ipbuf[INET6_ADDRSTRLEN+1];
-	unsigned short port;
-    //char ignore_addrs[MAX_IGNORE_ADDRS][IP_STR_LEN + 1];
-    //memset(ignore_addrs, 0, MAX_IGNORE_ADDRS * (IP_STR_LEN + 1));
-
-    //Get IPs we're announcing on to filter out
-    //num_ignore_addrs = get_ignore_addrs(ignore_addrs[0]);
-    
-    // Get the current time in utc for timestamp
-    time_t now;
-    struct tm *utc_time;
-    time(&now);
-    utc_time = gmtime(&now);
-    strftime(time_str, 26, "%F", utc_time); 
-    
-    //open logfile for result infohash
-    char filename[257];
-    errno = 0;
-    snprintf(filename, sizeof(filename), "%s/%s.log", LOOKUP_DATA_DIR, time_str);
-    FILE *log = fopen(filename, "a");
-    
+    struct klog_addr4 *addr;
+    UCHAR *record;
 
-    if(!log) {
-        log_print("Error %d \n", errno);
-        //sleep 1 second and try again
-        sleep(1);
-        errno = 0;
-        log = fopen(filename, "a");
-        if (!log){
-            log_print("ERROR: Failed to open log file %s. printing to stdout\n", filename);
-            log_print("Error %d \n", errno);
-            log = stdout;
-        }
+    *count = 0;
+    result = results->entries;
+    while( result ) {
+        (*count)++;
+        result = result->next;
+    }
+
+    *len = header_len + *count * sizeof(struct klog_addr4);
+    record = calloc(1, *len);
+    if(record == NULL) {
+        logq_drop();
+        return NULL;
     }
+    addr = (struct klog_addr4 *) (record + header_len);
 
     result = results->entries;
     while( result ) {
-		inet_ntop( AF_INET, &((IP4 *)&result->addr)->sin_addr, ipbuf, sizeof(ipbuf) );
-        //if(!ip_ignore(ipbuf, ignore_addrs[0], num_ignore_addrs)){
-            port = ntohs( ((IP4 *)&result->addr)->sin_port );
-            // timestamp payload_filename payload_hash_date infohash [seeder|leecher] ip port
-            fprintf(log, "%ld %s %s %s seeder %s %hu\n", 
-                    now, results->filename, results->file_hash_date_str,
-                    str_id( results->id, buf), ipbuf, port);
-            count++;
-        //}
-      if( result->next == NULL ) {
-        break;
-      }
-
-      result = result->next;
+        memcpy(addr->ip, &((IP4 *)&result->addr)->sin_addr, 4);
+        addr->port = ntohs( ((IP4 *)&result->addr)->sin_port );
+        addr++;
+        result = result->next;
     }
-    
-    fflush(log);
-    if (log != stdout) 
-        fclose(log);
 
+    return record;
+}
+
+/* Hajime
+ * Log results to file.
+ * A new file is used for each day, appending the date to the log filename.
+ * The seeders are queued as one record for the log writer thread (logq.c),
+ * which formats them as lines of
+ *   timestamp payload_filename payload_hash_date infohash seeder ip port
+ * With --session-timeout only the opening and closing of seeder
+ * sessions is logged (sessions.c).
+ */
+void log_lookup_results(struct results_t *results, int done){
+    struct klog_seeders *rec;
+    size_t len;
+    uint32_t count;
+    uint64_t start = latency_now();
+
+    // Get the current time for timestamp
+    time_t now;
+    time(&now);
+
+    rec = log_record_new(results, sizeof(struct klog_seeders), &count, &len);
+    if(rec == NULL) {
+        latency_add(LATENCY_LOG_RESULTS, start);
+        return;
+    }
+    memcpy(rec->id, results->id, SHA1_BIN_LENGTH);
+    snprintf(rec->date, sizeof(rec->date), "%s", results->file_hash_date_str);
+    snprintf(rec->payload, sizeof(rec->payload), "%.*s", KLOG_PAYLOAD_LEN, results->filename);
+    rec->count = count;
+
+    if(gconf->session_timeout > 0)
+        sessions_update(rec->payload, (struct klog_addr4 *)(rec + 1), count, now);
+    else if(count > 0)
+        logq_write(LOGQ_LOOKUP, KLOG_SEEDERS, now, rec, len);
+    free(rec);
+
+    latency_add(LATENCY_LOG_RESULTS, start);
 }
 
 static void result_node_free(struct result_node *rn){
@@ -416,79 +422,55 @@ static void result_node_free(struct result_node *rn){
 /* Hajime
  * Log result node data to file then free the result node structs
  * All results from all result nodes, plus a summary line, are written
- * to file (these files get huge)
+ * to file (these files get huge). Each result node is queued as one
+ * record for the log writer thread.
  */
 void result_nodes_done(struct search *sr, int done){
-    char buf0[257], buf1[256+1], buf2[256+1];
-    struct result_t *result;
-    int count = 0;
-    //int num_ignore_addrs;
-    //char ignore_addrs[MAX_IGNORE_ADDRS][IP_STR_LEN + 1];
-    //memset(ignore_addrs, 0, MAX_IGNORE_ADDRS * (IP_STR_LEN + 1));
-    char time_str[26];
+    struct klog_result_node *rec;
+    struct node *n;
+    size_t len;
+    uint32_t count;
+    uint64_t start = latency_now();
 
-    // Get the current time in utc for timestamp
+    // Get the current time for timestamp
     time_t now;
-    struct tm *utc_time;
     time(&now);
-    utc_time = gmtime(&now);
-    strftime(time_str, 26, "%F", utc_time); 
-
-    //Get IPs we're announcing on to filter out
-    //num_ignore_addrs = get_ignore_addrs(ignore_addrs[0]);
-
-    //open logfile for result infohash
-    char filename[256];
-    snprintf(filename, sizeof(filename), "%s/result_node_responses_%s.log", 
-            RESULT_NODE_DATA_DIR, time_str);
-    errno = 0;
-    FILE *log = fopen(filename, "a");
-	char ipbuf[INET6_ADDRSTRLEN+1];
-	unsigned short port;
-
-
-    if(!log) {
-        log_print("Error %d \n", errno);
-        //sleep 1 second and try again
-        sleep(1);
-        log = fopen(filename, "a");
-        if (!log){
-            log_print("ERROR: Failed to open log file %s. printing to stdout\n", filename);
-        log_print("Error %d \n", errno);
-            log = stdout;
-        }
-    }
 
     struct result_node *rn, *next;
     rn = sr->result_nodes;
 
     while(rn){
-        result = rn->results->entries;
-        count = 0;
-        while( result ) {
-		    inet_ntop( AF_INET, &((IP4 *)&result->addr)->sin_addr, ipbuf, sizeof(ipbuf) );
-            //if(!ip_ignore(ipbuf, ignore_addrs[0], num_ignore_addrs)){
-                // %seeder_addr timestamp infohash from_node_id from_node_addr complete new_result_responses no_new_result_responses
-                port = ntohs( ((IP4 *)&result->addr)->sin_port );
-                fprintf(log, "%ld %s %s %s %s %hu\n", 
-                        now,
-                        str_id(sr->id, buf0),
-                        str_addr(&rn->from_node->ss, buf1),
-                        str_id(rn->from_node->id, buf2),
-                        ipbuf, port);
-                count++;
-            //}
-            result = result->next;
+        rec = log_record_new(rn->results, sizeof(struct klog_result_node), &count, &len);
+        if(rec == NULL) {
+            next = rn->next;
+            result_node_free(rn);
+            rn = next;
+            continue;
+        }
+        memcpy(rec->id, sr->id, SHA1_BIN_LENGTH);
+
+        n = rn->from_node;
+        memcpy(rec->node.id, n->id, SHA1_BIN_LENGTH);
+        if(n->ss.ss_family == AF_INET) {
+            rec->node.family = 4;
+            memcpy(rec->node.ip, &((IP4 *)&n->ss)->sin_addr, 4);
+            rec->node.port = ntohs(((IP4 *)&n->ss)->sin_port);
+        } else if(n->ss.ss_family == AF_INET6) {
+            rec->node.family = 6;
+            memcpy(rec->node.ip, &((IP6 *)&n->ss)->sin6_addr, 16);
+            rec->node.port = ntohs(((IP6 *)&n->ss)->sin6_port);
         }
-        fprintf(log, "#%ld %s %s %s Total seeders: %d new_results_responses: %d "
-                "no_new_results_responses: %d (%d sequential) result_set_size: %d\n", 
-                now, str_id(sr->id, buf2), str_id(rn->from_node->id, buf0), 
-                str_addr(&rn->from_node->ss, buf1),
-                count,
-                rn->num_new_results_responses, rn->num_no_new_results_responses,
-                rn->sequential_no_new_results_responses,
-                rn->result_set_size);
-        
+
+        rec->new_responses = rn->num_new_results_responses;
+        rec->no_new_responses = rn->num_no_new_results_responses;
+        rec->sequential = rn->sequential_no_new_results_responses;
+        rec->set_size = rn->result_set_size;
+        rec->flags = KLOG_F_SET_SIZE;
+        rec->count = count;
+
+        logq_write(LOGQ_RESULT_NODES, KLOG_RESULT_NODES, now, rec, len);
+        free(rec);
+
         //free the result_node
         next = rn->next;
         result_node_free(rn);
@@ -497,9 +479,8 @@ void result_nodes_done(struct search *sr, int done){
     
     //clean up search
     sr->result_nodes = NULL;
-    fflush(log); 
-    if(log != stdout) 
-        fclose(log);
+
+    latency_add(LATENCY_RESULT_NODES, start);
 
 }
 
@@ -575,6 +556,7 @@ void results_free( void ) {
 	cur = g_results;
 	while( cur ) {
 		next = cur->next;
+		idmap_set( cur->id, IDMAP_RESULTS, NULL );
 		results_item_free( cur );
 		cur = next;
 	}
@@ -0,0 +1,293 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "main.h"
+#include "conf.h"
+#include "log.h"
+#include "utils.h"
+#include "net.h"
+#include "idmap.h"
+#include "logq.h"
+#include "hll.h"
+#include "uniques.h"
+
+/* Number of result nodes printed by uniques_print */
+#define UNIQUES_TOP_NODES 5
+
+#define UNIQUES_DAY (24 * 60 * 60)
+
+struct uniques_payload_t {
+	char *name;
+	struct hll *hll;
+};
+
+struct uniques_node_t {
+	UCHAR id[SHA1_BIN_LENGTH];
+	struct hll *hll;
+};
+
+static struct uniques_payload_t *g_payloads = NULL;
+static size_t g_payloads_num = 0;
+
+/* Result nodes are found through the id index (IDMAP_UNIQUES) */
+static struct uniques_node_t *g_nodes = NULL;
+static size_t g_nodes_num = 0;
+static uint64_t g_nodes_dropped = 0;
+
+/* UTC day of the sketches */
+static time_t g_day = 0;
+
+/* Queue a sketch for the log writer thread */
+static void uniques_write( int kind, const void *key, size_t key_len, const struct hll *hll ) {
+	uint8_t *buf;
+	size_t len;
+
+	len = hll_record_size( hll, key_len );
+	buf = (uint8_t *) malloc( len );
+	if( buf == NULL ) {
+		logq_drop();
+		return;
+	}
+
+	hll_record_write( buf, kind, g_day, key, key_len, hll );
+
+	/* The last second of the day selects the daily file */
+	logq_write( LOGQ_UNIQUES, LOGQ_TEXT, (g_day + 1) * UNIQUES_DAY - 1, buf, len );
+	free( buf );
+}
+
+/* Write out and free all sketches */
+static void uniques_flush( void ) {
+	size_t i;
+
+	for( i = 0; i < g_payloads_num; i++ ) {
+		uniques_write( HLL_PAYLOAD, g_payloads[i].name, strlen( g_payloads[i].name ), g_payloads[i].hll );
+		hll_free( g_payloads[i].hll );
+		free( g_payloads[i].name );
+	}
+
+	for( i = 0; i < g_nodes_num; i++ ) {
+		uniques_write( HLL_NODE, g_nodes[i].id, SHA1_BIN_LENGTH, g_nodes[i].hll );
+		idmap_set( g_nodes[i].id, IDMAP_UNIQUES, NULL );
+		hll_free( g_nodes[i].hll );
+	}
+
+	free( g_payloads );
+	g_payloads = NULL;
+	g_payloads_num = 0;
+	g_nodes_num = 0;
+	g_nodes_dropped = 0;
+}
+
+/* Start new sketches at the UTC day boundary */
+static void uniques_rollover( void ) {
+	time_t day;
+
+	day = time_now_sec() / UNIQUES_DAY;
+	if( day != g_day ) {
+		uniques_flush();
+		g_day = day;
+	}
+}
+
+struct hll *uniques_payload( const char payload[] ) {
+	struct uniques_payload_t *payloads;
+	struct uniques_payload_t *entry;
+	struct hll *hll;
+	char *name;
+	size_t i;
+
+	uniques_rollover();
+
+	for( i = 0; i < g_payloads_num; i++ ) {
+		if( strcmp( g_payloads[i].name, payload ) == 0 ) {
+			return g_payloads[i].hll;
+		}
+	}
+
+	if( strlen( payload ) > HLL_KEY_MAX || (hll = hll_new( UNIQUES_PAYLOAD_P )) == NULL ) {
+		return NULL;
+	}
+
+	name = strdup( payload );
+	if( name == NULL ) {
+		hll_free( hll );
+		return NULL;
+	}
+
+	payloads = (struct uniques_payload_t *) realloc( g_payloads,
+		(g_payloads_num + 1) * sizeof(struct uniques_payload_t) );
+	if( payloads == NULL ) {
+		free( name );
+		hll_free( hll );
+		return NULL;
+	}
+
+	g_payloads = payloads;
+	entry = &g_payloads[g_payloads_num++];
+	entry->name = name;
+	entry->hll = hll;
+
+	return hll;
+}
+
+struct hll *uniques_node( const UCHAR id[] ) {
+	struct uniques_node_t *entry;
+	struct hll *hll;
+
+	uniques_rollover();
+
+	entry = (struct uniques_node_t *) idmap_lookup( id, IDMAP_UNIQUES );
+	if( entry ) {
+		return entry->hll;
+	}
+
+	if( g_nodes == NULL ) {
+		g_nodes = (struct uniques_node_t *) calloc( UNIQUES_MAX_NODES, sizeof(struct uniques_node_t) );
+	}
+
+	if( g_nodes == NULL || g_nodes_num >= UNIQUES_MAX_NODES || (hll = hll_new( UNIQUES_NODE_P )) == NULL ) {
+		g_nodes_dropped++;
+		return NULL;
+	}
+
+	entry = &g_nodes[g_nodes_num];
+	if( idmap_set( id, IDMAP_UNIQUES, entry ) < 0 ) {
+		hll_free( hll );
+		g_nodes_dropped++;
+		return NULL;
+	}
+
+	g_nodes_num++;
+	memcpy( entry->id, id, SHA1_BIN_LENGTH );
+	entry->hll = hll;
+
+	return hll;
+}
+
+void uniques_add( struct hll *payload, struct hll *node, const IP *addr ) {
+	UCHAR key[18];
+	uint64_t hash;
+	size_t len;
+
+	/* A seeder is identified by address and port */
+	if( addr->ss_family == AF_INET ) {
+		memcpy( key, &((IP4 *)addr)->sin_addr, 4 );
+		memcpy( key + 4, &((IP4 *)addr)->sin_port, 2 );
+		len = 6;
+	} else {
+		memcpy( key, &((IP6 *)addr)->sin6_addr, 16 );
+		memcpy( key + 16, &((IP6 *)addr)->sin6_port, 2 );
+		len = 18;
+	}
+
+	hash = hll_hash( key, len );
+
+	if( payload ) {
+		hll_add( payload, hash );
+	}
+
+	if( node ) {
+		hll_add( node, hash );
+	}
+}
+
+int uniques_status( char *buf, int size ) {
+	struct hll *total;
+	double estimate;
+	size_t i;
+
+	/* All payloads together */
+	estimate = 0.0;
+	if( g_payloads_num && (total = hll_new( UNIQUES_PAYLOAD_P )) != NULL ) {
+		for( i = 0; i < g_payloads_num; i++ ) {
+			hll_merge( total, g_payloads[i].hll );
+		}
+		estimate = hll_estimate( total );
+		hll_free( total );
+	}
+
+	return snprintf( buf, size,
+		"Unique seeders today: ~%.0f (%zu payloads, %zu result nodes)\n",
+		estimate, g_payloads_num, g_nodes_num
+	);
+}
+
+int uniques_print( char *buf, int size ) {
+	char hexbuf[SHA1_HEX_LENGTH+1];
+	char date[16];
+	struct uniques_node_t *top[UNIQUES_TOP_NODES];
+	double top_est[UNIQUES_TOP_NODES];
+	double estimate;
+	struct tm utc;
+	time_t day_start;
+	int written;
+	size_t i;
+	int j, k;
+
+	written = 0;
+	day_start = g_day * UNIQUES_DAY;
+	gmtime_r( &day_start, &utc );
+	strftime( date, sizeof(date), "%F", &utc );
+
+#define uprintf(...) \
+	if( written < size ) { written += snprintf( buf + written, size - written, __VA_ARGS__ ); }
+
+	uprintf( "Unique seeders on %s (UTC):\n", date );
+	for( i = 0; i < g_payloads_num; i++ ) {
+		uprintf( " %s: ~%.0f\n", g_payloads[i].name, hll_estimate( g_payloads[i].hll ) );
+	}
+
+	/* Result nodes that returned the most seeders */
+	for( j = 0; j < UNIQUES_TOP_NODES; j++ ) {
+		top[j] = NULL;
+		top_est[j] = 0.0;
+	}
+
+	for( i = 0; i < g_nodes_num; i++ ) {
+		estimate = hll_estimate( g_nodes[i].hll );
+		for( j = 0; j < UNIQUES_TOP_NODES; j++ ) {
+			if( top[j] == NULL || estimate > top_est[j] ) {
+				for( k = UNIQUES_TOP_NODES - 1; k > j; k-- ) {
+					top[k] = top[k - 1];
+					top_est[k] = top_est[k - 1];
+				}
+				top[j] = &g_nodes[i];
+				top_est[j] = estimate;
+				break;
+			}
+		}
+	}
+
+	uprintf( "Result nodes: %zu (%llu not counted)\n",
+		g_nodes_num, (unsigned long long) g_nodes_dropped );
+	for( j = 0; j < UNIQUES_TOP_NODES && top[j]; j++ ) {
+		uprintf( " %s: ~%.0f\n", str_id( top[j]->id, hexbuf ), top_est[j] );
+	}
+
+#undef uprintf
+
+	return (written < size) ? written : (size - 1);
+}
+
+void uniques_handle( int _rc, int _sock ) {
+	/* Write out the sketches even if there are no lookups */
+	uniques_rollover();
+}
+
+void uniques_setup( void ) {
+	g_day = time_now_sec() / UNIQUES_DAY;
+	net_add_handler( -1, &uniques_handle );
+}
+
+void uniques_free( void ) {
+	/* Merged with the sketches of a later run of the same day */
+	uniques_flush();
+
+	free( g_nodes );
+	g_nodes = NULL;
+}
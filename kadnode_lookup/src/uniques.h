@@ -0,0 +1,40 @@
+
+#ifndef _UNIQUES_H_
+#define _UNIQUES_H_
+
+#include "main.h"
+#include "hll.h"
+
+/*
+* Estimated number of distinct seeder addresses of the current
+* UTC day, per payload and per result node that returned them.
+* At the end of the day the sketches are written to
+* LOOKUP_DATA_DIR/uniques_<date>.hll and reset.
+* kadnode-logcat -u merges and prints these files.
+*/
+
+/* Precision of the sketches - 2^p registers of one byte */
+#define UNIQUES_PAYLOAD_P 14
+#define UNIQUES_NODE_P 8
+
+/* Result nodes with a sketch per day */
+#define UNIQUES_MAX_NODES 8192
+
+/* Sketches of the current day; NULL if there is no room */
+struct hll *uniques_payload( const char payload[] );
+struct hll *uniques_node( const UCHAR id[] );
+
+/* Count a seeder address in both sketches (each may be NULL) */
+void uniques_add( struct hll *payload, struct hll *node, const IP *addr );
+
+int uniques_status( char *buf, int size );
+
+/* Print the estimates of all payloads and the top result nodes */
+int uniques_print( char *buf, int size );
+
+void uniques_setup( void );
+
+/* Write out the sketches of the current day */
+void uniques_free( void );
+
+#endif /* _UNIQUES_H_ */
@@ -15,6 +15,8 @@
 #include "ext-auth.h"
 #endif
 #include "values.h"
+#include "idmap.h"
+#include "infohashes.h"
 
 /* Announce values every 10 minutes */
 #define ANNOUNCE_INTERVAL (10*60)
@@ -31,16 +33,7 @@ struct value_t* values_get( void ) {
 }
 
 struct value_t* values_find( UCHAR id[] ) {
-	struct value_t *value;
-
-	value = g_values;
-	while( value ) {
-		if( id_equal( id, value->id ) ) {
-			return value;
-		}
-		value = value->next;
-	}
-	return NULL;
+	return (struct value_t *) idmap_lookup( id, IDMAP_VALUE );
 }
 
 int values_count( void ) {
@@ -160,6 +153,11 @@ struct value_t *values_add( const char query[], int port, time_t lifetime,
     ap_debug_print("%ld adding announcement for %s %d\n", 
             time_now_sec(), str_id(id, hexbuf), port);
 
+	if( idmap_set( id, IDMAP_VALUE, new ) < 0 ) {
+		free( new );
+		return NULL;
+	}
+
 	/* Prepend to list */
 	new->next = g_values;
 	g_values = new;
@@ -186,6 +184,7 @@ struct value_t *values_add( const char query[], int port, time_t lifetime,
 }
 
 void value_free( struct value_t *value ) {
+	idmap_set( value->id, IDMAP_VALUE, NULL );
 #ifdef AUTH
 	/* Secure erase */
 	if( value->skey ) {
@@ -243,39 +242,20 @@ void values_expire( void ) {
 
 #ifdef ANNOUNCEMENTS
 static int add_announcements(){
-    FILE *hash_file = fopen(HASH_FILENAME, "r");
-    if(!hash_file){
-        printf("ERROR opening hash file %s\n", HASH_FILENAME);
-        exit(1);
-    }
-
-    char *line;
-    size_t len = 0;
-    ssize_t read;
+    struct infohash_t *ih;
+    size_t i, num;
     int rc = 0;
 
-    char *infohash, *payload, *date_str;
-    
-    //send announcement for each info hash in file
+    //send announcement for each infohash of the current window
     //ports are incremented so each infohash has unique port starting at 6882
-    while ((read = getline(&line, &len, hash_file)) != -1) {
-        //remove trailing newline
-        line[strcspn(line, "\n")] = 0;
-        if(strlen(line) > 0){
-            infohash = strtok(line, " ");
-            payload = strtok(NULL, " ");
-            date_str = strtok(NULL, " ");
-    
-            //add infohash and starting port number to values
-            // multiple announcements taken care of in values_announce
-            values_add( infohash, running_port_num, LONG_MAX,
-                    payload, date_str);
-            running_port_num += 100;
-            
-        }
+    ih = infohashes_get(&num);
+    for(i = 0; i < num; i++){
+        //add infohash and starting port number to values
+        // multiple announcements taken care of in values_announce
+        values_add( ih[i].hex, running_port_num, LONG_MAX,
+                ih[i].payload, ih[i].date);
+        running_port_num += 100;
     }
-    free(line);
-    fclose(hash_file);
     return rc;
 }
 #endif
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Compare pcap_to_log_tuples.py and pcap2log on a directory of captures.
+# Both must write the same lines.
+# Usage: bench_pcap2log.sh <capture directory> [<pcap2log binary>]
+# A synthetic multi-GB capture can be made with:
+#   python make_bench_pcap.py <capture directory> 8 256
+
+CAPTURE_DIR="$1"
+PCAP2LOG="${2:-../../kadnode_announce/build/pcap2log}"
+OUT_DIR=$(mktemp -d)
+
+if [ -z "$CAPTURE_DIR" ]; then
+    echo "Usage: $0 <capture directory> [<pcap2log binary>]"
+    exit 1
+fi
+
+BYTES=$(cat "$CAPTURE_DIR"/* | wc -c)
+echo "Captures: $(ls "$CAPTURE_DIR" | wc -l) files, $((BYTES / 1024 / 1024)) MB"
+
+rate() {
+    # MB/s from bytes and nanoseconds
+    echo "$1 $2" | awk '{ printf "%.1f s, %.1f MB/s\n", $2 / 1e9, ($1 / 1048576) / ($2 / 1e9) }'
+}
+
+mkdir "$OUT_DIR/c" "$OUT_DIR/py"
+
+for JOBS in $(printf "1\n%s\n" $(nproc) | sort -un); do
+    rm -f "$OUT_DIR"/c/*
+    START=$(date +%s%N)
+    "$PCAP2LOG" -j $JOBS -d "$CAPTURE_DIR" "$OUT_DIR/c"
+    END=$(date +%s%N)
+    echo "pcap2log -j $JOBS: $(rate $BYTES $((END - START)))"
+done
+
+START=$(date +%s%N)
+if ! python pcap_to_log_tuples.py -d "$CAPTURE_DIR" "$OUT_DIR/py"; then
+    echo "pcap_to_log_tuples.py failed"
+    exit 1
+fi
+END=$(date +%s%N)
+echo "pcap_to_log_tuples.py: $(rate $BYTES $((END - START)))"
+
+if cmp -s "$OUT_DIR"/c/*.log "$OUT_DIR"/py/*.log; then
+    echo "Output is identical ($(cat "$OUT_DIR"/c/*.log | wc -l) lines)."
+else
+    echo "Output differs, see $OUT_DIR"
+    exit 1
+fi
+
+rm -rf "$OUT_DIR"
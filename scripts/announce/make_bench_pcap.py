@@ -0,0 +1,41 @@
+import sys
+import random
+import struct
+
+# Write synthetic tcpdump captures for bench_pcap2log.sh: mostly DHT-sized
+# UDP traffic to the announced port range, with some uTP SYNs in between.
+# Usage: make_bench_pcap.py <output directory> <number of files> <MB per file>
+
+MIN_PORT = 20000
+MAX_PORT = 60000
+
+def packet(t, rng):
+  syn = rng.random() < 0.2
+  dport = rng.randint(MIN_PORT, MAX_PORT)
+  if syn:
+    payload = b'\x41' + bytes(rng.getrandbits(8) for _ in range(19))
+  else:
+    payload = bytes(rng.getrandbits(8) for _ in range(rng.choice([40, 120, 300, 1200])))
+  src = bytes(rng.randint(1, 254) for _ in range(4))
+  udp = struct.pack('!HHHH', rng.randint(1024, 65535), dport, 8 + len(payload), 0) + payload
+  ip = struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(udp), 0, 0, 64, 17, 0,
+      src, b'\x0a\x00\x00\x01') + udp
+  eth = b'\x00' * 12 + b'\x08\x00' + ip
+  return struct.pack('<IIII', t, 0, len(eth), len(eth)) + eth
+
+def main(argv):
+  if len(argv) != 4:
+    print("Usage: make_bench_pcap.py <output directory> <number of files> <MB per file>")
+    exit()
+  rng = random.Random(1)
+  # A block of packets is repeated to fill the files quickly
+  block = b''.join(packet(1700000000 + i, rng) for i in range(20000))
+  for n in range(int(argv[2])):
+    out = open('%s/announce_cap_%d' % (argv[1], n), 'wb')
+    out.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1))
+    for i in range(max(1, int(argv[3]) * 1024 * 1024 // len(block))):
+      out.write(block)
+    out.close()
+
+if __name__ == '__main__':
+  main(sys.argv)
@@ -4,6 +4,9 @@ import os
 import re
 from datetime import datetime
 import time
+import mmap
+import binascii
+import struct
 
 PORT_MAP_FILE = "/home/ubuntu/hajime_dht_measurement/config/port_map.txt"
 LOG_FILE = 'pcap_parse.log'
@@ -11,6 +14,15 @@ MIN_PORT = 20000
 MAX_PORT = 60000
 port_map = {}
 
+# Memory-mapped port map published by kadnode_announce (see portshm.h)
+PORT_MAP_SHM = "/dev/shm/kadnode_port_map"
+SHM_MAGIC = 0x4d50484b
+SHM_VERSION = 1
+SHM_HEADER = struct.Struct('=IIIHHHH')
+SHM_SLOT = struct.Struct('=H')
+SHM_RANGE = struct.Struct('=20sH11s257s')
+shm = None
+
 log_file=open(LOG_FILE, 'a')
 
 def load_port_map():
@@ -26,6 +38,49 @@ def load_port_map():
       log_file.write('Error parsing line %s\n'%line)
   port_map_file.close()
 
+def open_port_map_shm():
+  global shm
+  try:
+    f = open(PORT_MAP_SHM, 'rb')
+    shm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    f.close()
+  except (IOError, OSError, ValueError):
+    shm = None
+    return False
+  magic, version = struct.unpack_from('=II', shm, 0)
+  if magic != SHM_MAGIC or version != SHM_VERSION:
+    shm = None
+    return False
+  return True
+
+def lookup_port_shm(port):
+  _, _, _, min_port, slots_num, _, _ = SHM_HEADER.unpack_from(shm, 0)
+  if port < min_port or port >= min_port + slots_num:
+    return None
+  ranges_offset = SHM_HEADER.size + slots_num * SHM_SLOT.size
+  # Retry while the announce node changes the map
+  while True:
+    seq1 = struct.unpack_from('=I', shm, 8)[0]
+    if seq1 & 1:
+      continue
+    slot = SHM_SLOT.unpack_from(shm, SHM_HEADER.size + (port - min_port) * SHM_SLOT.size)[0]
+    if slot:
+      entry = SHM_RANGE.unpack_from(shm, ranges_offset + (slot - 1) * SHM_RANGE.size)
+    seq2 = struct.unpack_from('=I', shm, 8)[0]
+    if seq1 == seq2:
+      break
+  if not slot:
+    return None
+  id, _, date, filename = entry
+  return {'infohash': binascii.hexlify(id).decode(),
+      'filename': filename.split(b'\0')[0].decode(),
+      'date': date.split(b'\0')[0].decode()}
+
+def lookup_port(port):
+  if shm is not None:
+    return lookup_port_shm(port)
+  return port_map.get((port/50) * 50)
+
 def convert_pcap(pcap_filename, output_dir=None):
     time_str = datetime.utcnow().strftime('%Y-%m-%d')
     if output_dir:
@@ -34,7 +89,9 @@ def convert_pcap(pcap_filename, output_dir=None):
         output_file = '%s.log'%time_str
     output = open(output_file, 'a') 
 
-    load_port_map()
+    # Prefer the live map of a kadnode_announce running on this host
+    if not open_port_map_shm():
+      load_port_map()
 
     log_file.write('%d Parsing pcacp %s.\n'%(time.time(), pcap_filename))
     packets = rdpcap(pcap_filename)
@@ -77,12 +134,11 @@ def convert_pcap(pcap_filename, output_dir=None):
           continue
 
         # Get the payload info
-        payload_start_port = (dport/50) * 50
-        if payload_start_port not in port_map:
+        payload_dict = lookup_port(dport)
+        if payload_dict is None:
           log_file.write('Error: could not find port %d in port map. Skipping:\n'%dport)
           log_file.write('%s\n'%packet.summary())
           continue
-        payload_dict = port_map[payload_start_port]
         output.write("%d %s %s %s leecher %s %d %d %s\n" % 
             (packet_time, payload_dict['filename'], payload_dict['date'], 
               payload_dict['infohash'], src_ip, sport, udp_len, 